@@ -1080,6 +1080,8 @@ int rewriteAppendOnlyFileBackground(void) {
     long long start;
 
     if (server.aof_child_pid != -1) return REDIS_ERR;
+    /* A lazy leveldb load has only part of the key space in memory. */
+    if (leveldbLazyLoading()) return REDIS_ERR;
     start = ustime();
     if ((childpid = fork()) == 0) {
         char tmpfile[256];
@@ -64,6 +64,7 @@
 static pthread_t bio_threads[REDIS_BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[REDIS_BIO_NUM_OPS];
 static pthread_cond_t bio_condvar[REDIS_BIO_NUM_OPS];
+static pthread_cond_t bio_step_cond[REDIS_BIO_NUM_OPS];
 static list *bio_jobs[REDIS_BIO_NUM_OPS];
 /* The following array is used to hold the number of pending jobs for every
  * OP type. This allows us to export the bioPendingJobsOfType() API that is
@@ -84,10 +85,6 @@ struct bio_job {
 
 void *bioProcessBackgroundJobs(void *arg);
 
-/* Make sure we have enough stack to perform all the things we do in the
- * main thread. */
-#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
-
 /* Initialize the background system, spawning the thread. */
 void bioInit(void) {
     pthread_attr_t attr;
@@ -99,6 +96,7 @@ void bioInit(void) {
     for (j = 0; j < REDIS_BIO_NUM_OPS; j++) {
         pthread_mutex_init(&bio_mutex[j],NULL);
         pthread_cond_init(&bio_condvar[j],NULL);
+        pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
     }
@@ -174,6 +172,17 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Process the job accordingly to its type. */
         if (type == REDIS_BIO_LEVELDB_BACKUP) {
             backupleveldb(job->arg1);
+        } else if (type == REDIS_BIO_LEVELDB_WRITE ||
+                   type >= REDIS_BIO_LEVELDB_SHARD_WRITE) {
+            leveldbAsyncWriteJob(job->arg1);
+        } else if (type == REDIS_BIO_LEVELDB_SWEEP) {
+            leveldbSweep(job->arg1);
+        } else if (type == REDIS_BIO_LEVELDB_MELT) {
+            leveldbMeltRun(job->arg1);
+        } else if (type == REDIS_BIO_LEVELDB_FSYNC) {
+            leveldbFsyncJob(job->arg1);
+        } else if (type == REDIS_BIO_LEVELDB_SNAPSHOT) {
+            leveldbSnapshotSave(job->arg1);
         } else if (type == REDIS_BIO_CLOSE_FILE) {
             close((long)job->arg1);
         } else if (type == REDIS_BIO_AOF_FSYNC) {
@@ -188,6 +197,9 @@ void *bioProcessBackgroundJobs(void *arg) {
         pthread_mutex_lock(&bio_mutex[type]);
         listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
+
+        /* Unblock threads blocked on bioWaitPendingJobsLE() if any. */
+        pthread_cond_broadcast(&bio_step_cond[type]);
     }
 }
 
@@ -200,6 +212,15 @@ unsigned long long bioPendingJobsOfType(int type) {
     return val;
 }
 
+/* Wait until the number of pending jobs of the specified type is less or
+ * equal to the specified number. */
+void bioWaitPendingJobsLE(int type, unsigned long long num) {
+    pthread_mutex_lock(&bio_mutex[type]);
+    while (bio_pending[type] > num)
+        pthread_cond_wait(&bio_step_cond[type],&bio_mutex[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
 /* Kill the running bio threads in an unclean way. This function should be
  * used only when it's critical to stop the threads for some reason.
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
@@ -39,4 +39,15 @@ void bioKillThreads(void);
 #define REDIS_BIO_CLOSE_FILE          0 /* Deferred close(2) syscall. */
 #define REDIS_BIO_AOF_FSYNC           1 /* Deferred AOF fsync. */
 #define REDIS_BIO_LEVELDB_BACKUP      2 /* Deferred LEVELDB backup. */
-#define REDIS_BIO_NUM_OPS             3
+#define REDIS_BIO_LEVELDB_WRITE       3 /* Deferred LEVELDB write batch, first shard. */
+#define REDIS_BIO_LEVELDB_SWEEP       4 /* Deferred LEVELDB range deletion. */
+#define REDIS_BIO_LEVELDB_MELT        5 /* Deferred LEVELDB key melt. */
+#define REDIS_BIO_LEVELDB_FSYNC       6 /* Deferred LEVELDB log sync. */
+#define REDIS_BIO_LEVELDB_SNAPSHOT    7 /* Deferred LEVELDB snapshot save. */
+#define REDIS_BIO_LEVELDB_SHARD_WRITE 8 /* Deferred LEVELDB write batch of the
+                                           other shards, one type per shard. */
+#define REDIS_BIO_NUM_OPS             15
+
+/* Make sure we have enough stack to perform all the things we do in the
+ * main thread. */
+#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
@@ -200,7 +200,7 @@ long redisBitpos(void *s, unsigned long count, int bit) {
 void setbitCommand(redisClient *c) {
     robj *o;
     char *err = "bit is not an integer or out of range";
-    size_t bitoffset;
+    size_t bitoffset, oldlen;
     int byte, bit;
     int byteval, bitval;
     long on;
@@ -233,6 +233,7 @@ void setbitCommand(redisClient *c) {
 
     /* Grow sds value to the right length if necessary */
     byte = bitoffset >> 3;
+    oldlen = sdslen(o->ptr);
     o->ptr = sdsgrowzero(o->ptr,byte+1);
 
     /* Get current values */
@@ -248,7 +249,7 @@ void setbitCommand(redisClient *c) {
     notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
     addReply(c, bitval ? shared.cone : shared.czero);
-    leveldbSetDirect(c->db->id, &server.ldb, c->argv[1], o);
+    leveldbSetStringRange(c->db->id, &server.ldb, c->argv[1], o, oldlen, byte, 1);
 }
 
 /* GETBIT key offset */
@@ -463,8 +464,9 @@ void bitopCommand(redisClient *c) {
         leveldbSetDirect(c->db->id, &server.ldb, targetkey, o);
         notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
-    } else if (dbDelete(c->db,targetkey)) {
-        leveldbDelString(c->db->id, &server.ldb, targetkey);
+    } else if ((o = lookupKeyWrite(c->db,targetkey)) != NULL) {
+        leveldbDelKey(c->db->id, &server.ldb, targetkey, o);
+        dbDelete(c->db,targetkey);
         signalModifiedKey(c->db,targetkey);
         notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",targetkey,c->db->id);
     }
@@ -237,6 +237,8 @@ void loadServerConfigFromString(char *config) {
                 server.maxmemory_policy = REDIS_MAXMEMORY_ALLKEYS_RANDOM;
             } else if (!strcasecmp(argv[1],"noeviction")) {
                 server.maxmemory_policy = REDIS_MAXMEMORY_NO_EVICTION;
+            } else if (!strcasecmp(argv[1],"freeze-lru")) {
+                server.maxmemory_policy = REDIS_MAXMEMORY_FREEZE_LRU;
             } else {
                 err = "Invalid maxmemory policy";
                 goto loaderr;
@@ -344,6 +346,71 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"leveldb-path") && argc == 2) {
             zfree(server.leveldb_path);
             server.leveldb_path = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"leveldb-group-commit") && argc == 2) {
+            if ((server.leveldb_group_commit = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-lazy-load") && argc == 2) {
+            if ((server.leveldb_lazy_load = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-repl-snapshot") && argc == 2) {
+            if ((server.leveldb_repl_snapshot = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-async-write") && argc == 2) {
+            if ((server.leveldb_async = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-fsync") && argc == 2) {
+            if (!strcasecmp(argv[1],"no")) {
+                server.leveldb_fsync = REDIS_LEVELDB_FSYNC_NO;
+            } else if (!strcasecmp(argv[1],"always")) {
+                server.leveldb_fsync = REDIS_LEVELDB_FSYNC_ALWAYS;
+            } else if (!strcasecmp(argv[1],"everysec")) {
+                server.leveldb_fsync = REDIS_LEVELDB_FSYNC_EVERYSEC;
+            } else {
+                err = "argument must be 'no', 'always' or 'everysec'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-async-max-bytes") && argc == 2) {
+            server.leveldb_async_max_bytes = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"leveldb-load-max-memory") && argc == 2) {
+            server.leveldb_load_max_memory = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"leveldb-hotness-period") && argc == 2) {
+            server.leveldb_hotness_period = strtoll(argv[1],NULL,10);
+            if (server.leveldb_hotness_period < 0) {
+                err = "leveldb-hotness-period can't be negative"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-cache-size") && argc == 2) {
+            server.leveldb_cache_size = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"leveldb-freezed-index") && argc == 2) {
+            if (!strcasecmp(argv[1],"dict")) {
+                server.leveldb_freezed_index = REDIS_LEVELDB_FREEZED_DICT;
+            } else if (!strcasecmp(argv[1],"filter")) {
+                server.leveldb_freezed_index = REDIS_LEVELDB_FREEZED_FILTER;
+            } else {
+                err = "Invalid leveldb frozen key index"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-coalesce-ms") && argc == 2) {
+            server.leveldb_coalesce_ms = strtoll(argv[1],NULL,10);
+            if (server.leveldb_coalesce_ms < 0) {
+                err = "leveldb-coalesce-ms can't be negative"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-load-threads") && argc == 2) {
+            server.leveldb_load_threads = atoi(argv[1]);
+            if (server.leveldb_load_threads < 1 ||
+                server.leveldb_load_threads > REDIS_MAX_LEVELDB_LOAD_THREADS)
+            {
+                err = "Invalid number of leveldb load threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"leveldb-shards") && argc == 2) {
+            server.leveldb_shards = atoi(argv[1]);
+            if (server.leveldb_shards < 1 ||
+                server.leveldb_shards > REDIS_MAX_LEVELDB_SHARDS)
+            {
+                err = "Invalid number of leveldb shards"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"no-appendfsync-on-rewrite")
                    && argc == 2) {
             if ((server.aof_no_fsync_on_rewrite= yesnotoi(argv[1])) == -1) {
@@ -644,6 +711,8 @@ void configSetCommand(redisClient *c) {
             server.maxmemory_policy = REDIS_MAXMEMORY_ALLKEYS_RANDOM;
         } else if (!strcasecmp(o->ptr,"noeviction")) {
             server.maxmemory_policy = REDIS_MAXMEMORY_NO_EVICTION;
+        } else if (!strcasecmp(o->ptr,"freeze-lru")) {
+            server.maxmemory_policy = REDIS_MAXMEMORY_FREEZE_LRU;
         } else {
             goto badfmt;
         }
@@ -912,6 +981,57 @@ void configSetCommand(redisClient *c) {
 
       if (yn == -1) goto badfmt;
       server.leveldb_state = yn ? REDIS_LEVELDB_ON : REDIS_LEVELDB_OFF;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-group-commit")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.leveldb_group_commit = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-repl-snapshot")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.leveldb_repl_snapshot = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-async-write")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        /* Apply what is still queued before writing from the main thread. */
+        if (!yn && server.leveldb_state != REDIS_LEVELDB_OFF)
+            leveldbDrain(&server.ldb);
+        server.leveldb_async = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-fsync")) {
+        if (!strcasecmp(o->ptr,"no")) {
+            server.leveldb_fsync = REDIS_LEVELDB_FSYNC_NO;
+        } else if (!strcasecmp(o->ptr,"everysec")) {
+            server.leveldb_fsync = REDIS_LEVELDB_FSYNC_EVERYSEC;
+        } else if (!strcasecmp(o->ptr,"always")) {
+            server.leveldb_fsync = REDIS_LEVELDB_FSYNC_ALWAYS;
+        } else {
+            goto badfmt;
+        }
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-async-max-bytes")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll <= 0) goto badfmt;
+        server.leveldb_async_max_bytes = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-load-max-memory")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0) goto badfmt;
+        server.leveldb_load_max_memory = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-hotness-period")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0) goto badfmt;
+        server.leveldb_hotness_period = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-coalesce-ms")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0) goto badfmt;
+        /* Write what is pending when coalescing is turned off. */
+        if (ll == 0 && server.leveldb_state != REDIS_LEVELDB_OFF)
+            leveldbCoalesceFlush(&server.ldb);
+        server.leveldb_coalesce_ms = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"leveldb-load-threads")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > REDIS_MAX_LEVELDB_LOAD_THREADS) goto badfmt;
+        server.leveldb_load_threads = ll;
     } else {
         addReplyErrorFormat(c,"Unsupported CONFIG parameter: %s",
             (char*)c->argv[2]->ptr);
@@ -1018,6 +1138,13 @@ void configGetCommand(redisClient *c) {
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.hz);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
+    config_get_numerical_field("leveldb-async-max-bytes",server.leveldb_async_max_bytes);
+    config_get_numerical_field("leveldb-load-threads",server.leveldb_load_threads);
+    config_get_numerical_field("leveldb-shards",server.leveldb_shards);
+    config_get_numerical_field("leveldb-coalesce-ms",server.leveldb_coalesce_ms);
+    config_get_numerical_field("leveldb-cache-size",server.leveldb_cache_size);
+    config_get_numerical_field("leveldb-load-max-memory",server.leveldb_load_max_memory);
+    config_get_numerical_field("leveldb-hotness-period",server.leveldb_hotness_period);
 
     /* Bool (yes/no) values */
     config_get_bool_field("no-appendfsync-on-rewrite",
@@ -1040,6 +1167,14 @@ void configGetCommand(redisClient *c) {
             server.aof_rewrite_incremental_fsync);
     config_get_bool_field("aof-load-truncated",
             server.aof_load_truncated);
+    config_get_bool_field("leveldb-group-commit",
+            server.leveldb_group_commit);
+    config_get_bool_field("leveldb-async-write",
+            server.leveldb_async);
+    config_get_bool_field("leveldb-repl-snapshot",
+            server.leveldb_repl_snapshot);
+    config_get_bool_field("leveldb-lazy-load",
+            server.leveldb_lazy_load);
 
     /* Everything we can't handle with macros follows. */
 
@@ -1073,12 +1208,33 @@ void configGetCommand(redisClient *c) {
         case REDIS_MAXMEMORY_ALLKEYS_LRU: s = "allkeys-lru"; break;
         case REDIS_MAXMEMORY_ALLKEYS_RANDOM: s = "allkeys-random"; break;
         case REDIS_MAXMEMORY_NO_EVICTION: s = "noeviction"; break;
+        case REDIS_MAXMEMORY_FREEZE_LRU: s = "freeze-lru"; break;
         default: s = "unknown"; break; /* too harmless to panic */
         }
         addReplyBulkCString(c,"maxmemory-policy");
         addReplyBulkCString(c,s);
         matches++;
     }
+    if (stringmatch(pattern,"leveldb-freezed-index",0)) {
+        addReplyBulkCString(c,"leveldb-freezed-index");
+        addReplyBulkCString(c,
+            server.leveldb_freezed_index == REDIS_LEVELDB_FREEZED_FILTER ?
+            "filter" : "dict");
+        matches++;
+    }
+    if (stringmatch(pattern,"leveldb-fsync",0)) {
+        char *policy;
+
+        switch(server.leveldb_fsync) {
+        case REDIS_LEVELDB_FSYNC_NO: policy = "no"; break;
+        case REDIS_LEVELDB_FSYNC_EVERYSEC: policy = "everysec"; break;
+        case REDIS_LEVELDB_FSYNC_ALWAYS: policy = "always"; break;
+        default: policy = "unknown"; break;
+        }
+        addReplyBulkCString(c,"leveldb-fsync");
+        addReplyBulkCString(c,policy);
+        matches++;
+    }
     if (stringmatch(pattern,"appendfsync",0)) {
         char *policy;
 
@@ -1780,6 +1936,7 @@ int rewriteConfig(char *path) {
         "allkeys-random", REDIS_MAXMEMORY_ALLKEYS_RANDOM,
         "volatile-ttl", REDIS_MAXMEMORY_VOLATILE_TTL,
         "noeviction", REDIS_MAXMEMORY_NO_EVICTION,
+        "freeze-lru", REDIS_MAXMEMORY_FREEZE_LRU,
         NULL, REDIS_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,REDIS_DEFAULT_MAXMEMORY_SAMPLES);
     rewriteConfigYesNoOption(state,"appendonly",server.aof_state != REDIS_AOF_OFF,0);
@@ -1810,6 +1967,26 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hz",server.hz,REDIS_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,REDIS_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,REDIS_DEFAULT_AOF_LOAD_TRUNCATED);
+    rewriteConfigYesNoOption(state,"leveldb-group-commit",server.leveldb_group_commit,REDIS_DEFAULT_LEVELDB_GROUP_COMMIT);
+    rewriteConfigYesNoOption(state,"leveldb-async-write",server.leveldb_async,REDIS_DEFAULT_LEVELDB_ASYNC);
+    rewriteConfigYesNoOption(state,"leveldb-repl-snapshot",server.leveldb_repl_snapshot,REDIS_DEFAULT_LEVELDB_REPL_SNAPSHOT);
+    rewriteConfigYesNoOption(state,"leveldb-lazy-load",server.leveldb_lazy_load,REDIS_DEFAULT_LEVELDB_LAZY_LOAD);
+    rewriteConfigEnumOption(state,"leveldb-fsync",server.leveldb_fsync,
+        "everysec", REDIS_LEVELDB_FSYNC_EVERYSEC,
+        "always", REDIS_LEVELDB_FSYNC_ALWAYS,
+        "no", REDIS_LEVELDB_FSYNC_NO,
+        NULL, REDIS_DEFAULT_LEVELDB_FSYNC);
+    rewriteConfigBytesOption(state,"leveldb-async-max-bytes",server.leveldb_async_max_bytes,REDIS_DEFAULT_LEVELDB_ASYNC_MAX_BYTES);
+    rewriteConfigNumericalOption(state,"leveldb-load-threads",server.leveldb_load_threads,REDIS_DEFAULT_LEVELDB_LOAD_THREADS);
+    rewriteConfigNumericalOption(state,"leveldb-shards",server.leveldb_shards,REDIS_DEFAULT_LEVELDB_SHARDS);
+    rewriteConfigNumericalOption(state,"leveldb-coalesce-ms",server.leveldb_coalesce_ms,REDIS_DEFAULT_LEVELDB_COALESCE_MS);
+    rewriteConfigBytesOption(state,"leveldb-cache-size",server.leveldb_cache_size,REDIS_DEFAULT_LEVELDB_CACHE_SIZE);
+    rewriteConfigBytesOption(state,"leveldb-load-max-memory",server.leveldb_load_max_memory,REDIS_DEFAULT_LEVELDB_LOAD_MAX_MEMORY);
+    rewriteConfigNumericalOption(state,"leveldb-hotness-period",server.leveldb_hotness_period,REDIS_DEFAULT_LEVELDB_HOTNESS_PERIOD);
+    rewriteConfigEnumOption(state,"leveldb-freezed-index",server.leveldb_freezed_index,
+        "dict", REDIS_LEVELDB_FREEZED_DICT,
+        "filter", REDIS_LEVELDB_FREEZED_FILTER,
+        NULL, REDIS_DEFAULT_LEVELDB_FREEZED_INDEX);
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
 
     /* Step 3: remove all the orphaned lines in the old file, that is, lines
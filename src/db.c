@@ -105,6 +105,7 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     struct dictEntry *de = dictFind(db->dict,key->ptr);
 
     redisAssertWithInfo(NULL,key,de != NULL);
+    leveldbOverwriteString(db->id, &server.ldb, key, dictGetVal(de), val);
     dictReplace(db->dict, key->ptr, val);
 }
 
@@ -159,7 +160,10 @@ robj *dbRandomKey(redisDb *db) {
 int dbDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (dictSize(db->expires) > 0) {
+        leveldbDelExpire(db->id,&server.ldb,key,getExpire(db,key));
+        dictDelete(db->expires,key->ptr);
+    }
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         return 1;
     } else {
@@ -213,7 +217,9 @@ long long emptyDb(void(callback)(void*)) {
         removed += dictSize(server.db[j].dict);
         dictEmpty(server.db[j].dict,callback);
         dictEmpty(server.db[j].expires,callback);
-        dictEmpty(server.db[j].freezed,NULL);
+        leveldbCancelMelts(j,NULL);
+        leveldbLazyLoadFlushed(j);
+        emptyFreezedKeys(j);
     }
     return removed;
 }
@@ -251,7 +257,9 @@ void flushdbCommand(redisClient *c) {
     signalFlushedDb(c->db->id);
     dictEmpty(c->db->dict,NULL);
     dictEmpty(c->db->expires,NULL);
-    dictEmpty(c->db->freezed,NULL);
+    leveldbCancelMelts(c->db->id,NULL);
+    leveldbLazyLoadFlushed(c->db->id);
+    emptyFreezedKeys(c->db->id);
     addReply(c,shared.ok);
     leveldbFlushdb(c->db->id, &server.ldb);
 }
@@ -282,28 +290,12 @@ void delCommand(redisClient *c) {
     for (j = 1; j < c->argc; j++) {
 
         o = lookupKeyRead(c->db,c->argv[j]);
-        if (o != NULL) {
-          switch(o->type) {
-            case REDIS_SET: 
-              //leveldbSclear(c->db->id,&server.ldb, c->argv[j]);
-              leveldbDelSet(c->db->id, &server.ldb, c->argv[j], o);
-              break;
-            case REDIS_ZSET: 
-              //leveldbZclear(c->db->id,&server.ldb, c->argv[j]);
-              leveldbDelZset(c->db->id, &server.ldb, c->argv[j], o);
-              break;
-            case REDIS_HASH: 
-              //leveldbHclear(c->db->id,&server.ldb, c->argv[j]);
-              leveldbDelHash(c->db->id, &server.ldb, c->argv[j], o);
-              break;
-            case REDIS_STRING:
-              leveldbDelString(c->db->id, &server.ldb, c->argv[j]);
-              break;
-          }
-        }
+        leveldbDelKey(c->db->id, &server.ldb, c->argv[j], o);
 
         expireIfNeeded(c->db,c->argv[j]);
-        if (dbDelete(c->db,c->argv[j])) {
+        if (dbDelete(c->db,c->argv[j]) ||
+            leveldbDelFreezedKey(c,c->argv[j]))
+        {
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,
                 "del",c->argv[j],c->db->id);
@@ -678,7 +670,7 @@ void shutdownCommand(redisClient *c) {
 }
 
 void renameGenericCommand(redisClient *c, int nx) {
-    robj *o;
+    robj *o, *old;
     long long expire;
 
     /* To use the same key as src and dst is probably an error */
@@ -692,12 +684,16 @@ void renameGenericCommand(redisClient *c, int nx) {
 
     incrRefCount(o);
     expire = getExpire(c->db,c->argv[1]);
-    if (lookupKeyWrite(c->db,c->argv[2]) != NULL) {
-        if (nx) {
-            decrRefCount(o);
-            addReply(c,shared.czero);
-            return;
-        }
+    if ((old = lookupKeyWrite(c->db,c->argv[2])) != NULL && nx) {
+        decrRefCount(o);
+        addReply(c,shared.czero);
+        return;
+    }
+    /* The records move to the new name in a single LevelDB write. */
+    leveldbBeginBatch(&server.ldb);
+    leveldbReplaceKey(c->db->id,&server.ldb,c->argv[2],old,o);
+    leveldbDelKey(c->db->id,&server.ldb,c->argv[1],o);
+    if (old != NULL) {
         /* Overwrite: delete the old key before creating the new one
          * with the same name. */
         dbDelete(c->db,c->argv[2]);
@@ -705,6 +701,7 @@ void renameGenericCommand(redisClient *c, int nx) {
     dbAdd(c->db,c->argv[2],o);
     if (expire != -1) setExpire(c->db,c->argv[2],expire);
     dbDelete(c->db,c->argv[1]);
+    leveldbEndBatch(&server.ldb);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
     notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"rename_from",
@@ -765,8 +762,14 @@ void moveCommand(redisClient *c) {
     dbAdd(dst,c->argv[1],o);
     incrRefCount(o);
 
+    /* Move the records too, in a single LevelDB write. */
+    leveldbBeginBatch(&server.ldb);
+    leveldbPutKey(dst->id,&server.ldb,c->argv[1],o);
+    leveldbDelKey(src->id,&server.ldb,c->argv[1],o);
+
     /* OK! key moved, free the entry in the source DB */
     dbDelete(src,c->argv[1]);
+    leveldbEndBatch(&server.ldb);
     server.dirty++;
     addReply(c,shared.cone);
 }
@@ -779,6 +782,7 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
+    leveldbDelExpire(db->id,&server.ldb,key,getExpire(db,key));
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
 
@@ -788,6 +792,7 @@ void setExpire(redisDb *db, robj *key, long long when) {
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     redisAssertWithInfo(NULL,key,kde != NULL);
+    leveldbSetExpire(db->id,&server.ldb,key,dictGetVal(kde),getExpire(db,key),when);
     de = dictReplaceRaw(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
 }
@@ -864,6 +869,7 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key);
     notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
         "expired",key,db->id);
+    leveldbDelKey(db->id,&server.ldb,key,dictFetchValue(db->dict,key->ptr));
     return dbDelete(db,key);
 }
 
@@ -903,6 +909,7 @@ void expireGenericCommand(redisClient *c, long long basetime, int unit) {
     if (when <= mstime() && !server.loading && !server.masterhost) {
         robj *aux;
 
+        leveldbDelKey(c->db->id,&server.ldb,key,dictFetchValue(c->db->dict,key->ptr));
         redisAssertWithInfo(c,key,dbDelete(c->db,key));
         server.dirty++;
 
@@ -1,11 +1,24 @@
 #include "redis.h"
 #include "bio.h"
+#include "endianconv.h"
+#include <math.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define LEVELDB_KEY_FLAG_DATABASE_ID 0
 #define LEVELDB_KEY_FLAG_TYPE 1 
 #define LEVELDB_KEY_FLAG_SET_KEY_LEN 2
 #define LEVELDB_KEY_FLAG_SET_KEY 3
 
+/* Range deletions flush every LEVELDB_CLEAR_BATCH_OPS records, so that
+ * clearing a big key space does not stage an unbounded batch in memory. */
+#define LEVELDB_CLEAR_BATCH_OPS 1000
+
+/* A group commit batch is flushed early once it stages that many bytes. */
+#define LEVELDB_GROUP_COMMIT_MAX_BYTES (16*1024*1024)
+
 void procLeveldbError(char* err, const char* fmt) {
   if (err != NULL) {
     redisLog(REDIS_WARNING, fmt, err);
@@ -14,341 +27,4794 @@ void procLeveldbError(char* err, const char* fmt) {
   }
 }
 
-void initleveldb(struct leveldb* ldb, char *path) {
-  ldb->options = leveldb_options_create();
-  leveldb_options_set_create_if_missing(ldb->options, 1);
-  leveldb_options_set_compression(ldb->options, 1);
-  leveldb_options_set_write_buffer_size(ldb->options, 64 * 1024 * 1024);
-  leveldb_options_set_max_open_files(ldb->options, 500);
+void initleveldb(struct leveldb* ldb, char *path) {
+  ldb->options = leveldb_options_create();
+  leveldb_options_set_create_if_missing(ldb->options, 1);
+  leveldb_options_set_compression(ldb->options, 1);
+  leveldb_options_set_write_buffer_size(ldb->options, 64 * 1024 * 1024);
+  leveldb_options_set_max_open_files(ldb->options, 500);
+  ldb->cache = leveldb_cache_create_lru(server.leveldb_cache_size);
+  leveldb_options_set_cache(ldb->options, ldb->cache);
+
+  int j;
+  ldb->numshards = server.leveldb_shards;
+  ldb->shards = zcalloc(sizeof(leveldbShard)*ldb->numshards);
+  for (j = 0; j < ldb->numshards; j++) {
+    char *err = NULL;
+    sds dir = leveldbShardPath(path, j);
+
+    ldb->shards[j].db = leveldb_open(ldb->options, dir, &err);
+    procLeveldbError(err, "open leveldb err: %s");
+    ldb->shards[j].wb = leveldb_writebatch_create();
+    sdsfree(dir);
+  }
+  ldb->db = ldb->shards[0].db;
+
+  ldb->roptions = leveldb_readoptions_create();
+  leveldb_readoptions_set_fill_cache(ldb->roptions, 0);
+  ldb->proptions = leveldb_readoptions_create();
+
+  ldb->woptions = leveldb_writeoptions_create();
+  leveldb_writeoptions_set_sync(ldb->woptions, 0);
+  ldb->swoptions = leveldb_writeoptions_create();
+  leveldb_writeoptions_set_sync(ldb->swoptions, 1);
+
+  ldb->wbbytes = 0;
+  ldb->wbops = 0;
+  ldb->batchdepth = 0;
+  ldb->batchfreezed = 0;
+  ldb->batchatomic = 0;
+  ldb->batchsweeps = listCreate();
+
+  ldb->dbslot = zmalloc(sizeof(int)*server.dbnum);
+  for (j = 0; j < 256; j++) ldb->slotdb[j] = -1;
+  for (j = 0; j < server.dbnum; j++) {
+    ldb->dbslot[j] = j;
+    ldb->slotdb[j] = j;
+  }
+}
+
+/* -----------------------------------------------------------------------------
+ * Write pipeline
+ *
+ * Mutations are not written to LevelDB directly: they are staged into the
+ * batch of their shard with leveldbBatchPut() / leveldbBatchDelete(), and
+ * leveldbCommit() closes the mutation of a command.
+ *
+ * With leveldb-group-commit enabled leveldbCommit() leaves the batch staged,
+ * and beforeSleep() writes everything produced by an event loop iteration
+ * with a single leveldbFlush(), before the replies are sent to the clients.
+ * Otherwise every leveldbCommit() flushes the batch of its own command.
+ *
+ * When leveldb-async-write is off a flushed batch is written right away, one
+ * shard after the other. When it is on, the batch of every shard is handed
+ * to the writer thread of the shard (REDIS_BIO_LEVELDB_WRITE for the first
+ * one), so that a LevelDB stall (L0 slowdown, compaction) does not block the
+ * event loop and the shards are written in parallel. The queue is bounded by
+ * leveldb-async-max-bytes: once full, the main thread waits for the writers.
+ *
+ * Code reading LevelDB from the main thread must call leveldbDrain() first,
+ * otherwise it may miss mutations that are still queued.
+ *
+ * leveldbBeginBatch() / leveldbEndBatch() stage all the mutations in between
+ * as a single write, used for MULTI/EXEC and scripts so that a crash never
+ * persists half of them. When such a write spans several shards it goes
+ * through leveldbWriteShardsAtomic() instead of the writer threads. Inside a
+ * batch leveldbDrain() only waits for the
+ * writer: the staged mutations are written early only when the batch froze
+ * or melted keys and the caller reads the frozen keys back from LevelDB.
+ *
+ * leveldb-fsync controls when the LevelDB log reaches the disk, much like
+ * appendfsync does for the AOF: "always" writes every flushed batch with
+ * sync enabled (so with group commit there is one fsync per event loop
+ * iteration), "everysec" lets leveldbFsyncCron() queue a synced empty write
+ * to the REDIS_BIO_LEVELDB_FSYNC thread once per second, and "no" leaves it
+ * to the OS. The time spent syncing is reported to the latency monitor.
+ * -------------------------------------------------------------------------- */
+
+typedef struct leveldbAsyncJob {
+    leveldb_t *db;
+    leveldb_writeoptions_t *woptions;
+    leveldb_writebatch_t *wb;
+    size_t bytes;
+    long long ctime;    /* mstime() of the enqueue, used to compute the lag. */
+    int sync;           /* Written with swoptions (leveldb-fsync always). */
+} leveldbAsyncJob;
+
+static pthread_mutex_t leveldb_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t leveldb_async_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long leveldb_async_batches = 0; /* Queued batches. */
+static unsigned long long leveldb_async_bytes = 0;   /* Queued bytes. */
+static long long leveldb_async_lag = 0; /* Queue time of the last batch, ms. */
+
+/* Changes to the frozen keys staged by the open batch, in ldb->batchfreezed. */
+#define LEVELDB_BATCH_FREEZE 1  /* Records and F record of a frozen key. */
+#define LEVELDB_BATCH_MELT 2    /* Deleted F record of a melted key. */
+
+static void leveldbFreezedWritten(struct leveldb *ldb);
+static void leveldbWriteShardsAtomic(struct leveldb *ldb, leveldb_writeoptions_t *woptions);
+
+/* Slowest synced write performed by a background thread since the last
+ * leveldbFsyncCron(), that reports it to the latency monitor. */
+static pthread_mutex_t leveldb_fsync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long long leveldb_fsync_always_ms = 0;
+static long long leveldb_fsync_everysec_ms = 0;
+
+/* Queue the staged batch of a shard for its writer thread, waiting while
+ * the queue is over leveldb-async-max-bytes. A batch larger than the limit
+ * is still accepted once the queue is empty. */
+static void leveldbAsyncEnqueueShard(struct leveldb *ldb, int shard, int sync) {
+    leveldbShard *sh = ldb->shards+shard;
+    leveldbAsyncJob *job = zmalloc(sizeof(*job));
+    long long start = 0, stall;
+
+    job->db = sh->db;
+    job->woptions = sync ? ldb->swoptions : ldb->woptions;
+    job->wb = sh->wb;
+    job->bytes = sh->wbbytes;
+    job->ctime = mstime();
+    job->sync = sync;
+
+    pthread_mutex_lock(&leveldb_async_mutex);
+    if (leveldb_async_batches &&
+        leveldb_async_bytes + job->bytes > server.leveldb_async_max_bytes)
+    {
+        server.leveldb_async_stalls++;
+        start = mstime();
+        while (leveldb_async_batches &&
+               leveldb_async_bytes + job->bytes > server.leveldb_async_max_bytes)
+            pthread_cond_wait(&leveldb_async_cond,&leveldb_async_mutex);
+    }
+    leveldb_async_batches++;
+    leveldb_async_bytes += job->bytes;
+    pthread_mutex_unlock(&leveldb_async_mutex);
+    if (start) {
+        stall = mstime() - start;
+        latencyAddSampleIfNeeded("leveldb-async-stall",stall);
+    }
+
+    bioCreateBackgroundJob(shard ? REDIS_BIO_LEVELDB_SHARD_WRITE+shard-1 :
+                           REDIS_BIO_LEVELDB_WRITE,job,NULL,NULL);
+    sh->wb = leveldb_writebatch_create();
+    sh->wbbytes = 0;
+    sh->wbops = 0;
+}
+
+/* Queue the staged batch of every shard. */
+static void leveldbAsyncEnqueue(struct leveldb *ldb, int sync) {
+    int j;
+
+    for (j = 0; j < ldb->numshards; j++)
+        if (ldb->shards[j].wbops) leveldbAsyncEnqueueShard(ldb, j, sync);
+}
+
+/* Executed by the writer thread of the shard. */
+void leveldbAsyncWriteJob(void *arg) {
+    leveldbAsyncJob *job = arg;
+    char *err = NULL;
+    long long start = job->sync ? mstime() : 0, elapsed;
+
+    leveldb_write(job->db, job->woptions, job->wb, &err);
+    procLeveldbError(err, "async write leveldb err: %s");
+    leveldb_writebatch_destroy(job->wb);
+    if (job->sync) {
+        elapsed = mstime() - start;
+        pthread_mutex_lock(&leveldb_fsync_mutex);
+        if (elapsed > leveldb_fsync_always_ms) leveldb_fsync_always_ms = elapsed;
+        pthread_mutex_unlock(&leveldb_fsync_mutex);
+    }
+
+    pthread_mutex_lock(&leveldb_async_mutex);
+    leveldb_async_batches--;
+    leveldb_async_bytes -= job->bytes;
+    leveldb_async_lag = mstime() - job->ctime;
+    pthread_cond_broadcast(&leveldb_async_cond);
+    pthread_mutex_unlock(&leveldb_async_mutex);
+    zfree(job);
+}
+
+void leveldbAsyncStats(unsigned long long *batches, unsigned long long *bytes, long long *lag) {
+    pthread_mutex_lock(&leveldb_async_mutex);
+    *batches = leveldb_async_batches;
+    *bytes = leveldb_async_bytes;
+    *lag = leveldb_async_lag;
+    pthread_mutex_unlock(&leveldb_async_mutex);
+}
+
+/* Write the staged batch of every shard. */
+static void leveldbWriteShards(struct leveldb *ldb, leveldb_writeoptions_t *woptions) {
+    int j;
+
+    for (j = 0; j < ldb->numshards; j++) {
+        leveldbShard *sh = ldb->shards+j;
+        char *err = NULL;
+
+        if (sh->wbops == 0) continue;
+        leveldb_write(sh->db, woptions, sh->wb, &err);
+        procLeveldbError(err, "write leveldb err: %s");
+        leveldb_writebatch_clear(sh->wb);
+        sh->wbbytes = 0;
+        sh->wbops = 0;
+    }
+}
+
+/* Write (or queue) everything staged in the shards. */
+void leveldbFlush(struct leveldb *ldb) {
+    int atomic = 0, shards = 0, j;
+
+    if (ldb->wbops == 0) return;
+    if (ldb->batchatomic) {
+        for (j = 0; j < ldb->numshards; j++)
+            if (ldb->shards[j].wbops) shards++;
+        atomic = shards > 1;
+    }
+    if (server.leveldb_async && !atomic) {
+        leveldbAsyncEnqueue(ldb, server.leveldb_fsync == REDIS_LEVELDB_FSYNC_ALWAYS);
+    } else if (server.leveldb_fsync == REDIS_LEVELDB_FSYNC_ALWAYS) {
+        long long latency;
+
+        latencyStartMonitor(latency);
+        if (atomic)
+            leveldbWriteShardsAtomic(ldb, ldb->swoptions);
+        else
+            leveldbWriteShards(ldb, ldb->swoptions);
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("leveldb-fsync-always",latency);
+    } else if (atomic) {
+        leveldbWriteShardsAtomic(ldb, ldb->woptions);
+    } else {
+        leveldbWriteShards(ldb, ldb->woptions);
+    }
+    ldb->wbbytes = 0;
+    ldb->wbops = 0;
+    ldb->batchfreezed = 0;
+    ldb->batchatomic = ldb->batchdepth > 0;
+    server.leveldb_op_num++;
+    if (!server.leveldb_async || atomic) leveldbFreezedWritten(ldb);
+}
+
+/* Write an empty batch with sync enabled to every shard: LevelDB syncs its
+ * log, and with it every write performed before. */
+static void leveldbSyncLog(struct leveldb *ldb) {
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    int j;
+
+    for (j = 0; j < ldb->numshards; j++) {
+        char *err = NULL;
+
+        leveldb_write(ldb->shards[j].db, ldb->swoptions, wb, &err);
+        procLeveldbError(err, "fsync leveldb err: %s");
+    }
+    leveldb_writebatch_destroy(wb);
+}
+
+/* Executed by the REDIS_BIO_LEVELDB_FSYNC thread. */
+void leveldbFsyncJob(void *arg) {
+    long long start = mstime(), elapsed;
+
+    leveldbSyncLog(arg);
+    elapsed = mstime() - start;
+    pthread_mutex_lock(&leveldb_fsync_mutex);
+    if (elapsed > leveldb_fsync_everysec_ms) leveldb_fsync_everysec_ms = elapsed;
+    pthread_mutex_unlock(&leveldb_fsync_mutex);
+}
+
+/* Called every second by serverCron(): reports the sync latency measured by
+ * the background threads, and with leveldb-fsync everysec queues a sync if
+ * something was written since the previous one. */
+void leveldbFsyncCron(void) {
+    long long always, everysec;
+
+    pthread_mutex_lock(&leveldb_fsync_mutex);
+    always = leveldb_fsync_always_ms;
+    everysec = leveldb_fsync_everysec_ms;
+    leveldb_fsync_always_ms = leveldb_fsync_everysec_ms = 0;
+    pthread_mutex_unlock(&leveldb_fsync_mutex);
+    latencyAddSampleIfNeeded("leveldb-fsync-always",always);
+    latencyAddSampleIfNeeded("leveldb-fsync-everysec",everysec);
+
+    if (server.leveldb_fsync != REDIS_LEVELDB_FSYNC_EVERYSEC) return;
+    if (server.leveldb_op_num == server.leveldb_fsync_op_num) return;
+    if (bioPendingJobsOfType(REDIS_BIO_LEVELDB_FSYNC)) return;
+    server.leveldb_fsync_op_num = server.leveldb_op_num;
+    bioCreateBackgroundJob(REDIS_BIO_LEVELDB_FSYNC,&server.ldb,NULL,NULL);
+}
+
+/* Called once the mutation of a command is fully staged. With group commit
+ * the batch is left to beforeSleep(), unless it grew past
+ * LEVELDB_GROUP_COMMIT_MAX_BYTES. */
+void leveldbCommit(struct leveldb *ldb) {
+    if (ldb->batchdepth) return;
+    if (server.leveldb_group_commit &&
+        ldb->wbbytes < LEVELDB_GROUP_COMMIT_MAX_BYTES) return;
+    leveldbFlush(ldb);
+}
+
+/* Wait for the writer threads to apply every queued batch. */
+static void leveldbWaitWriter(void) {
+    pthread_mutex_lock(&leveldb_async_mutex);
+    while (leveldb_async_batches)
+        pthread_cond_wait(&leveldb_async_cond,&leveldb_async_mutex);
+    pthread_mutex_unlock(&leveldb_async_mutex);
+}
+
+/* Commit the staged batch and wait for the writer thread to apply every
+ * queued batch, so that LevelDB reflects all the mutations performed so far.
+ * Inside a batch the staged mutations are kept, unless they change the
+ * frozen keys. */
+void leveldbDrain(struct leveldb *ldb) {
+    if (ldb->batchdepth == 0 || ldb->batchfreezed) leveldbFlush(ldb);
+    leveldbWaitWriter();
+    leveldbFreezedWritten(ldb);
+}
+
+/* Stage everything up to the matching leveldbEndBatch() as one write, even
+ * without group commit. Batches nest. */
+void leveldbBeginBatch(struct leveldb *ldb) {
+    ldb->batchdepth++;
+    ldb->batchatomic = 1;
+}
+
+/* Start the sweeps deferred by the batch, once its metadata is written. */
+static void leveldbStartBatchSweeps(struct leveldb *ldb) {
+    listNode *ln;
+
+    if (ldb->batchsweeps == NULL || listLength(ldb->batchsweeps) == 0) return;
+    leveldbFlush(ldb);
+    leveldbWaitWriter();
+    while ((ln = listFirst(ldb->batchsweeps)) != NULL) {
+        bioCreateBackgroundJob(REDIS_BIO_LEVELDB_SWEEP, ln->value, NULL, NULL);
+        listDelNode(ldb->batchsweeps, ln);
+    }
+}
+
+void leveldbEndBatch(struct leveldb *ldb) {
+    if (--ldb->batchdepth) return;
+    leveldbCommit(ldb);
+    leveldbStartBatchSweeps(ldb);
+}
+
+/* -----------------------------------------------------------------------------
+ * Record encoding
+ *
+ * Records are stored in the format LEVELDB_FORMAT_VERSION:
+ *
+ * [slot][TYPE][keylen][key] strings and frozen keys
+ * [slot][TYPE][keylen][key][page] pages of the strings stored in pages
+ * [slot][TYPE][keylen][key][generation][field] hashes, sets, sorted sets
+ * [slot][TYPE][keylen][key][generation][sequence] lists
+ *
+ * The key length and the generation are varints. TYPE is the upper case
+ * letter of the record type ('C', 'F', 'H', 'L', 'S', 'Z'): the format 1
+ * used the lower case letters and a single byte key length, so the records
+ * of the two formats never mix, see leveldbMigrate(). The values are:
+ *
+ * C, H, L: [0][bytes], or [1][zigzag varint] when the value is an integer
+ * C of a string longer than LEVELDB_STRING_PAGE_SIZE: [2][varint length],
+ *    the bytes are in the pages: page n, a number as in leveldbCatInt64(),
+ *    holds LEVELDB_STRING_PAGE_SIZE bytes from n*LEVELDB_STRING_PAGE_SIZE
+ *    (the last one may be shorter), so that SETBIT, SETRANGE and APPEND only
+ *    write the pages they touched.
+ * S: empty
+ * Z: the score as a big endian IEEE 754 double
+ * F: the record type of the frozen key
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_FORMAT_VERSION 3
+#define LEVELDB_VARINT_MAX_LEN 10
+#define LEVELDB_VALUE_RAW 0
+#define LEVELDB_VALUE_INT 1
+#define LEVELDB_VALUE_PAGED 2
+#define LEVELDB_STRING_PAGE_SIZE 4096
+#define LEVELDB_SCORE_LEN 8
+#define LEVELDB_INT64_LEN 8
+
+static int leveldbEncodeVarint(unsigned char *buf, uint64_t v) {
+    int len = 0;
+
+    while (v >= 128) {
+        buf[len++] = (v & 127) | 128;
+        v >>= 7;
+    }
+    buf[len++] = v;
+    return len;
+}
+
+static int leveldbDecodeVarint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift <= 63 && *p < end; shift += 7) {
+        unsigned char byte = *(*p)++;
+
+        *v |= (uint64_t)(byte & 127) << shift;
+        if (!(byte & 128)) return REDIS_OK;
+    }
+    return REDIS_ERR;
+}
+
+static sds leveldbCatVarint(sds s, uint64_t v) {
+    unsigned char buf[LEVELDB_VARINT_MAX_LEN];
+
+    return sdscatlen(s, buf, leveldbEncodeVarint(buf, v));
+}
+
+static sds leveldbEncodeInteger(long long value) {
+    unsigned char buf[LEVELDB_VARINT_MAX_LEN+1];
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+    buf[0] = LEVELDB_VALUE_INT;
+    return sdsnewlen(buf, 1+leveldbEncodeVarint(buf+1, zigzag));
+}
+
+/* Value of a string or hash record. Integers are stored as varints only
+ * when the conversion back gives the very same string. */
+static sds leveldbEncodeValue(const char *s, size_t len) {
+    long long value;
+    char tag = LEVELDB_VALUE_RAW;
+
+    if (len <= 20 && string2ll(s, len, &value)) return leveldbEncodeInteger(value);
+    return sdscatlen(sdsnewlen(&tag, 1), s, len);
+}
+
+static sds leveldbEncodeObjectValue(robj *o) {
+    if (o->encoding == REDIS_ENCODING_INT) return leveldbEncodeInteger((long)o->ptr);
+    return leveldbEncodeValue(o->ptr, sdslen(o->ptr));
+}
+
+static int leveldbDecodeValue(const char *s, size_t len, sds *value) {
+    const unsigned char *p = (const unsigned char*)s + 1, *end = (const unsigned char*)s + len;
+    uint64_t zigzag;
+    char buf[32];
+
+    if (len == 0) return REDIS_ERR;
+    if (s[0] == LEVELDB_VALUE_RAW) {
+        *value = sdsnewlen(s+1, len-1);
+        return REDIS_OK;
+    }
+    if (s[0] != LEVELDB_VALUE_INT ||
+        leveldbDecodeVarint(&p, end, &zigzag) == REDIS_ERR || p != end)
+        return REDIS_ERR;
+    *value = sdsnewlen(buf, ll2string(buf, sizeof(buf),
+                                      (long long)((zigzag >> 1) ^ -(zigzag & 1))));
+    return REDIS_OK;
+}
+
+static void leveldbEncodeScore(char *buf, double score) {
+    uint64_t bits;
+    int j;
+
+    memcpy(&bits, &score, sizeof(bits));
+    for (j = LEVELDB_SCORE_LEN-1; j >= 0; j--) {
+        buf[j] = bits & 0xff;
+        bits >>= 8;
+    }
+}
+
+static double leveldbDecodeScore(const char *buf) {
+    uint64_t bits = 0;
+    double score;
+    int j;
+
+    for (j = 0; j < LEVELDB_SCORE_LEN; j++) bits = (bits << 8) | (unsigned char)buf[j];
+    memcpy(&score, &bits, sizeof(score));
+    return score;
+}
+
+/* Signed 64 bit integers that sort as numbers: list sequences, expire times. */
+static sds leveldbCatInt64(sds key, long long n) {
+    char buf[LEVELDB_INT64_LEN];
+    uint64_t v = (uint64_t)n ^ ((uint64_t)1 << 63);
+    int j;
+
+    for (j = LEVELDB_INT64_LEN-1; j >= 0; j--) {
+        buf[j] = v & 0xff;
+        v >>= 8;
+    }
+    return sdscatlen(key, buf, sizeof(buf));
+}
+
+static long long leveldbDecodeInt64(const char *buf) {
+    uint64_t v = 0;
+    int j;
+
+    for (j = 0; j < LEVELDB_INT64_LEN; j++) v = (v << 8) | (unsigned char)buf[j];
+    return (long long)(v ^ ((uint64_t)1 << 63));
+}
+
+/* Number of pages of a string of 'len' bytes, 0 if it fits a single record. */
+static size_t leveldbStringPages(size_t len) {
+    if (len <= LEVELDB_STRING_PAGE_SIZE) return 0;
+    return (len+LEVELDB_STRING_PAGE_SIZE-1)/LEVELDB_STRING_PAGE_SIZE;
+}
+
+static size_t leveldbObjectPages(robj *o) {
+    if (o->type != REDIS_STRING || o->encoding == REDIS_ENCODING_INT) return 0;
+    return leveldbStringPages(sdslen(o->ptr));
+}
+
+static sds leveldbEncodePagedValue(size_t len) {
+    unsigned char buf[1+LEVELDB_VARINT_MAX_LEN];
+
+    buf[0] = LEVELDB_VALUE_PAGED;
+    return sdsnewlen(buf, 1+leveldbEncodeVarint(buf+1, len));
+}
+
+/* Length of the string of a paged string record, REDIS_ERR if the record is
+ * not one. */
+static int leveldbDecodePagedValue(const char *s, size_t len, size_t *length) {
+    const unsigned char *p = (const unsigned char*)s + 1, *end = (const unsigned char*)s + len;
+    uint64_t v;
+
+    if (len == 0 || s[0] != LEVELDB_VALUE_PAGED ||
+        leveldbDecodeVarint(&p, end, &v) == REDIS_ERR || p != end) return REDIS_ERR;
+    *length = v;
+    return REDIS_OK;
+}
+
+/* -----------------------------------------------------------------------------
+ * Slots and generations
+ *
+ * The first byte of a record is not the db id but the slot the db is mapped
+ * to, by default the db id itself. FLUSHDB maps the db to a free slot with a
+ * single metadata write, and a background job sweeps the old slot.
+ *
+ * In the same way the records of hashes, sets and sorted sets carry the
+ * generation of their key. Deleting a big collection only bumps the generation of its key, and the
+ * records of the old generation are swept in background. The generation of
+ * a key is dropped once it is deleted and its old records are swept.
+ *
+ * Metadata records live in the slot LEVELDB_META_SLOT:
+ *
+ * [0xff]['A'][slot][key] -> record type and last access time of the key
+ * [0xff]['d'][dbid] -> slot of the db
+ * [0xff]['E'][slot][time][key] -> record type of a volatile key
+ * [0xff]['G'][slot][keylen][key] -> generation of the key
+ * [0xff]['K'][slot][type][keylen][key][generation] -> records to sweep
+ * [0xff]['n'] -> number of shards
+ * [0xff]['R'] -> batch spanning several shards, while they are written
+ * [0xff]['v'] -> format version of the records
+ * [0xff]['x'][slot] -> slot to sweep
+ *
+ * Key lengths and generations are varints, as in the data records.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_META_SLOT 0xff
+#define LEVELDB_MAX_SLOTS 255
+#define LEVELDB_SLOT_FREE -1
+#define LEVELDB_SLOT_SWEEPING -2
+#define LEVELDB_META_ACCESS 'A'
+#define LEVELDB_META_DBSLOT 'd'
+#define LEVELDB_META_EXPIRE 'E'
+#define LEVELDB_META_KEYGEN 'G'
+#define LEVELDB_META_KEYSWEEP 'K'
+#define LEVELDB_META_SHARDS 'n'
+#define LEVELDB_META_REDO 'R'
+#define LEVELDB_META_VERSION 'v'
+#define LEVELDB_META_SLOTSWEEP 'x'
+
+/* Collections bigger than that are deleted by bumping their generation. */
+#define LEVELDB_SWEEP_MIN_ELEMENTS 128
+
+typedef struct leveldbKeyGen {
+    uint64_t gen;
+    int sweeps;                 /* Sweeps of older generations in progress. */
+} leveldbKeyGen;
+
+typedef struct leveldbSweepJob {
+    int slot;
+    int dbid;                   /* Db of the key, -1 for slot sweeps. */
+    sds key;                    /* NULL for slot sweeps. */
+    sds prefixes[5];            /* The records to delete. */
+    int numprefixes;
+    sds meta;                   /* Metadata record deleted once done. */
+    int done;
+} leveldbSweepJob;
+
+static pthread_mutex_t leveldb_sweep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list *leveldb_sweep_done = NULL; /* Jobs to release in leveldbSweepCron() */
+static volatile int leveldb_sweep_stop = 0;
+
+static int leveldbTypeHasFields(char type) {
+    return type == 'h' || type == 's' || type == 'z' || type == 'l';
+}
+
+uint64_t leveldbKeyGeneration(int dbid, sds key) {
+    dictEntry *de = dictFind(server.db[dbid].generations, key);
+
+    return de ? ((leveldbKeyGen*)dictGetVal(de))->gen : 0;
+}
+
+static sds leveldbKeyPrefixGen(int slot, char type, sds name, uint64_t gen) {
+    char tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN];
+    sds key;
+
+    tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = slot;
+    tmp[LEVELDB_KEY_FLAG_TYPE] = toupper(type);
+    key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY_LEN);
+    key = leveldbCatVarint(key, sdslen(name));
+    key = sdscatsds(key, name);
+    if (leveldbTypeHasFields(type)) key = leveldbCatVarint(key, gen);
+    return key;
+}
+
+/* Key of a record, or the prefix of the records of a collection. */
+sds leveldbKeyPrefix(int dbid, char type, sds name) {
+    uint64_t gen = leveldbTypeHasFields(type) ? leveldbKeyGeneration(dbid, name) : 0;
+
+    return leveldbKeyPrefixGen(server.ldb.dbslot[dbid], type, name, gen);
+}
+
+static sds leveldbStringPageKey(int slot, sds name, size_t page) {
+    return leveldbCatInt64(leveldbKeyPrefixGen(slot, 'c', name, 0), page);
+}
+
+/* Stage the pages 'first' to 'last' included of the string 's'. */
+static void leveldbPutStringPages(struct leveldb *ldb, int slot, sds name, const char *s,
+                                  size_t len, size_t first, size_t last)
+{
+    size_t j;
+
+    for (j = first; j <= last; j++) {
+        size_t start = j*LEVELDB_STRING_PAGE_SIZE;
+        size_t count = len-start < LEVELDB_STRING_PAGE_SIZE ? len-start : LEVELDB_STRING_PAGE_SIZE;
+        sds key = leveldbStringPageKey(slot, name, j);
+
+        leveldbBatchPut(ldb, key, sdslen(key), s+start, count);
+        sdsfree(key);
+    }
+}
+
+/* Stage the deletion of the pages from 'first' on of a string that had
+ * 'count' pages. */
+static void leveldbDelStringPages(struct leveldb *ldb, int slot, sds name, size_t first, size_t count) {
+    size_t j;
+
+    for (j = first; j < count; j++) {
+        sds key = leveldbStringPageKey(slot, name, j);
+
+        leveldbBatchDelete(ldb, key, sdslen(key));
+        sdsfree(key);
+    }
+}
+
+/* Stage the records of the string 's', in pages when it is long enough. */
+static void leveldbPutString(struct leveldb *ldb, int slot, sds name, const char *s, size_t len) {
+    size_t pages = leveldbStringPages(len);
+    sds key = leveldbKeyPrefixGen(slot, 'c', name, 0);
+    sds val = pages ? leveldbEncodePagedValue(len) : leveldbEncodeValue(s, len);
+
+    leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
+    if (pages) leveldbPutStringPages(ldb, slot, name, s, len, 0, pages-1);
+    sdsfree(key);
+    sdsfree(val);
+}
+
+/* Stage the deletion of the records of a string that is not in memory, the
+ * stored record tells if it has pages. */
+static void leveldbDelStoredString(struct leveldb *ldb, int dbid, sds name) {
+    sds key = leveldbKeyPrefix(dbid, 'c', name);
+    size_t valueLen, len;
+    char *value, *err = NULL;
+
+    value = leveldb_get(leveldbKeyDb(ldb, name), ldb->roptions, key, sdslen(key), &valueLen, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "drop leveldb key:%s err: %s", name, err);
+        leveldb_free(err);
+    } else if (value != NULL) {
+        if (leveldbDecodePagedValue(value, valueLen, &len) == REDIS_OK)
+            leveldbDelStringPages(ldb, ldb->dbslot[dbid], name, 0, leveldbStringPages(len));
+        leveldb_free(value);
+    }
+    leveldbBatchDelete(ldb, key, sdslen(key));
+    sdsfree(key);
+}
+
+static sds leveldbMetaKey(char type, int slot) {
+    char tmp[3];
+
+    tmp[0] = (char)LEVELDB_META_SLOT;
+    tmp[1] = type;
+    tmp[2] = slot;
+    return sdsnewlen(tmp, sizeof(tmp));
+}
+
+static sds leveldbKeyGenMetaKey(int slot, sds name) {
+    sds key = leveldbMetaKey(LEVELDB_META_KEYGEN, slot);
+
+    key = leveldbCatVarint(key, sdslen(name));
+    return sdscatsds(key, name);
+}
+
+static sds leveldbKeySweepMetaKey(int slot, char type, sds name, uint64_t gen) {
+    sds key = leveldbMetaKey(LEVELDB_META_KEYSWEEP, slot);
+
+    key = sdscatlen(key, &type, 1);
+    key = leveldbCatVarint(key, sdslen(name));
+    key = sdscatsds(key, name);
+    return leveldbCatVarint(key, gen);
+}
+
+static int leveldbFreeSlot(struct leveldb *ldb) {
+    int slot;
+
+    for (slot = 0; slot < LEVELDB_MAX_SLOTS; slot++)
+        if (ldb->slotdb[slot] == LEVELDB_SLOT_FREE) return slot;
+    return -1;
+}
+
+static void leveldbFreeSweepJob(leveldbSweepJob *job) {
+    int j;
+
+    for (j = 0; j < job->numprefixes; j++) sdsfree(job->prefixes[j]);
+    sdsfree(job->key);
+    sdsfree(job->meta);
+    zfree(job);
+}
+
+static leveldbSweepJob *leveldbCreateSlotSweep(int slot) {
+    leveldbSweepJob *job = zcalloc(sizeof(*job));
+    char c = slot;
+
+    job->slot = slot;
+    job->dbid = -1;
+    job->prefixes[0] = sdsnewlen(&c, 1);
+    job->prefixes[1] = leveldbMetaKey(LEVELDB_META_KEYGEN, slot);
+    job->prefixes[2] = leveldbMetaKey(LEVELDB_META_KEYSWEEP, slot);
+    job->prefixes[3] = leveldbMetaKey(LEVELDB_META_EXPIRE, slot);
+    job->prefixes[4] = leveldbMetaKey(LEVELDB_META_ACCESS, slot);
+    job->numprefixes = 5;
+    job->meta = leveldbMetaKey(LEVELDB_META_SLOTSWEEP, slot);
+    return job;
+}
+
+static leveldbSweepJob *leveldbCreateKeySweep(int dbid, char type, sds name, uint64_t gen) {
+    leveldbSweepJob *job = zcalloc(sizeof(*job));
+
+    job->slot = server.ldb.dbslot[dbid];
+    job->dbid = dbid;
+    job->key = sdsdup(name);
+    job->prefixes[0] = leveldbKeyPrefixGen(job->slot, type, name, gen);
+    job->numprefixes = 1;
+    job->meta = leveldbKeySweepMetaKey(job->slot, type, name, gen);
+    return job;
+}
+
+/* Delete the records of a sweep job from a shard. */
+static void leveldbSweepShard(leveldbSweepJob *job, leveldb_t *db) {
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    char *err = NULL;
+    int j, ops = 0;
+
+    for (j = 0; j < job->numprefixes && !leveldb_sweep_stop; j++) {
+        sds prefix = job->prefixes[j];
+        leveldb_iterator_t *iterator = leveldb_create_iterator(db, server.ldb.roptions);
+
+        for (leveldb_iter_seek(iterator, prefix, sdslen(prefix));
+             leveldb_iter_valid(iterator) && !leveldb_sweep_stop;
+             leveldb_iter_next(iterator))
+        {
+            size_t dataLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+
+            if (dataLen < sdslen(prefix) || memcmp(data, prefix, sdslen(prefix))) break;
+            leveldb_writebatch_delete(wb, data, dataLen);
+            if (++ops == LEVELDB_CLEAR_BATCH_OPS) {
+                leveldb_write(db, server.ldb.woptions, wb, &err);
+                procLeveldbError(err, "sweep leveldb write err: %s");
+                leveldb_writebatch_clear(wb);
+                ops = 0;
+            }
+        }
+        leveldb_iter_get_error(iterator, &err);
+        procLeveldbError(err, "sweep leveldb iterator err: %s");
+        leveldb_iter_destroy(iterator);
+    }
+
+    if (ops) {
+        leveldb_write(db, server.ldb.woptions, wb, &err);
+        procLeveldbError(err, "sweep leveldb write err: %s");
+    }
+    leveldb_writebatch_destroy(wb);
+}
+
+/* Delete the records of a sweep job, from the shard of its key or from all
+ * the shards for a slot. Runs in a bio thread. */
+void leveldbSweep(void *arg) {
+    leveldbSweepJob *job = arg;
+    int first = 0, last = server.ldb.numshards-1, j;
+
+    if (job->key) first = last = leveldbKeyShard(&server.ldb, job->key, sdslen(job->key));
+    for (j = first; j <= last; j++) leveldbSweepShard(job, server.ldb.shards[j].db);
+
+    /* On shutdown the job is left to the next start. The metadata record is
+     * deleted once every shard is swept, from the first shard last as that
+     * is the copy read at startup. */
+    if (!leveldb_sweep_stop) {
+        for (j = last; j >= first; j--) {
+            leveldb_t *db = server.ldb.shards[j].db;
+            char *err = NULL;
+
+            leveldb_delete(db, server.ldb.woptions, job->meta, sdslen(job->meta), &err);
+            procLeveldbError(err, "sweep leveldb write err: %s");
+            if (job->key == NULL) {
+                char start = job->slot, limit = job->slot+1;
+
+                leveldb_compact_range(db, &start, 1, &limit, 1);
+            }
+        }
+        job->done = 1;
+    }
+
+    pthread_mutex_lock(&leveldb_sweep_mutex);
+    if (leveldb_sweep_done == NULL) leveldb_sweep_done = listCreate();
+    listAddNodeTail(leveldb_sweep_done, job);
+    pthread_mutex_unlock(&leveldb_sweep_mutex);
+}
+
+/* Release the slots and the generations of the completed sweeps. */
+void leveldbSweepCron(void) {
+    list *done;
+    listIter li;
+    listNode *ln;
+
+    pthread_mutex_lock(&leveldb_sweep_mutex);
+    done = leveldb_sweep_done;
+    leveldb_sweep_done = NULL;
+    pthread_mutex_unlock(&leveldb_sweep_mutex);
+    if (done == NULL) return;
+
+    listRewind(done, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        leveldbSweepJob *job = listNodeValue(ln);
+
+        if (job->key == NULL) {
+            if (job->done) server.ldb.slotdb[job->slot] = LEVELDB_SLOT_FREE;
+        } else if (server.ldb.dbslot[job->dbid] == job->slot) {
+            redisDb *db = server.db+job->dbid;
+            dictEntry *de = dictFind(db->generations, job->key);
+            leveldbKeyGen *kg = de ? dictGetVal(de) : NULL;
+            robj keyobj;
+
+            /* Without records, a deleted key can restart from generation 0. */
+            initStaticStringObject(keyobj, job->key);
+            if (kg && --kg->sweeps == 0 &&
+                dictFind(db->dict, job->key) == NULL &&
+                !isKeyFreezed(job->dbid, &keyobj))
+            {
+                sds metakey = leveldbKeyGenMetaKey(job->slot, job->key);
+
+                leveldbBatchDelete(&server.ldb, metakey, sdslen(metakey));
+                leveldbCommit(&server.ldb);
+                sdsfree(metakey);
+                dictDelete(db->generations, job->key);
+            }
+        }
+        leveldbFreeSweepJob(job);
+    }
+    listRelease(done);
+}
+
+/* Write the metadata first: the sweep must not start before the records
+ * it deletes are unreachable. Inside a batch the sweeps wait for its end. */
+static void leveldbStartSweeps(struct leveldb *ldb, leveldbSweepJob **jobs, int numjobs) {
+    int j;
+
+    if (ldb->batchdepth) {
+        for (j = 0; j < numjobs; j++) listAddNodeTail(ldb->batchsweeps, jobs[j]);
+        return;
+    }
+    leveldbDrain(ldb);
+    for (j = 0; j < numjobs; j++)
+        bioCreateBackgroundJob(REDIS_BIO_LEVELDB_SWEEP, jobs[j], NULL, NULL);
+}
+
+/* Move a key to a new generation, staging the metadata. The returned sweep
+ * job must be started with leveldbStartSweeps(). */
+static leveldbSweepJob *leveldbRetireKeyJob(int dbid, struct leveldb *ldb, char type, sds name) {
+    dict *gens = server.db[dbid].generations;
+    dictEntry *de = dictFind(gens, name);
+    leveldbKeyGen *kg;
+    leveldbSweepJob *job;
+    unsigned char buf[LEVELDB_VARINT_MAX_LEN];
+    sds metakey;
+
+    if (de == NULL) {
+        kg = zmalloc(sizeof(*kg));
+        kg->gen = 0;
+        kg->sweeps = 0;
+        dictAdd(gens, sdsdup(name), kg);
+    } else {
+        kg = dictGetVal(de);
+    }
+    job = leveldbCreateKeySweep(dbid, type, name, kg->gen);
+    kg->gen++;
+    kg->sweeps++;
+
+    metakey = leveldbKeyGenMetaKey(job->slot, name);
+    leveldbBatchPut(ldb, metakey, sdslen(metakey), (char*)buf,
+                    leveldbEncodeVarint(buf, kg->gen));
+    leveldbBatchPut(ldb, job->meta, sdslen(job->meta), "", 0);
+    sdsfree(metakey);
+    return job;
+}
+
+/* Delete a big collection moving its key to a new generation. */
+static void leveldbRetireKey(int dbid, struct leveldb *ldb, char type, sds name) {
+    leveldbSweepJob *job = leveldbRetireKeyJob(dbid, ldb, type, name);
+
+    leveldbCommit(ldb);
+    leveldbStartSweeps(ldb, &job, 1);
+}
+
+/* Map the db to a free slot, returning the sweep job of the old one. */
+static leveldbSweepJob *leveldbRetireSlot(int dbid, struct leveldb *ldb) {
+    int old = ldb->dbslot[dbid];
+    int slot = leveldbFreeSlot(ldb);
+    leveldbSweepJob *job;
+    char c;
+    sds metakey;
+
+    if (slot == -1) {
+        leveldbStartBatchSweeps(ldb);
+        bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_SWEEP, 0);
+        leveldbSweepCron();
+        slot = leveldbFreeSlot(ldb);
+        redisAssert(slot != -1);
+    }
+
+    job = leveldbCreateSlotSweep(old);
+    metakey = leveldbMetaKey(LEVELDB_META_DBSLOT, dbid);
+    c = slot;
+    leveldbBatchPut(ldb, metakey, sdslen(metakey), &c, 1);
+    leveldbBatchPut(ldb, job->meta, sdslen(job->meta), "", 0);
+    sdsfree(metakey);
+
+    ldb->dbslot[dbid] = slot;
+    ldb->slotdb[slot] = dbid;
+    ldb->slotdb[old] = LEVELDB_SLOT_SWEEPING;
+    dictEmpty(server.db[dbid].generations, NULL);
+    dictEmpty(server.db[dbid].listheads, NULL);
+    return job;
+}
+
+/* Load the slots of the dbs and the generations of the keys, and restart
+ * the sweeps interrupted by a shutdown. */
+static int leveldbLoadMeta(struct leveldb *ldb) {
+    int explicit[LEVELDB_MAX_SLOTS];
+    int j, shard, success = REDIS_OK, numjobs = 0;
+    leveldbSweepJob **jobs = NULL;
+    leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+    char *err = NULL;
+    sds prefix;
+
+    for (j = 0; j < LEVELDB_MAX_SLOTS; j++) {
+        ldb->slotdb[j] = LEVELDB_SLOT_FREE;
+        explicit[j] = 0;
+    }
+    ldb->slotdb[LEVELDB_META_SLOT] = LEVELDB_SLOT_FREE;
+
+    /* Slots of the dbs and slots to sweep. */
+    prefix = leveldbMetaKey(LEVELDB_META_DBSLOT, 0);
+    for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value = leveldb_iter_value(iterator, &valueLen);
+        int id;
+
+        if ((unsigned char)data[0] != LEVELDB_META_SLOT) break;
+        if (dataLen != 3) continue;
+        id = (unsigned char)data[2];
+        if (data[1] == LEVELDB_META_DBSLOT && valueLen == 1) {
+            if (id >= server.dbnum) {
+                redisLog(REDIS_WARNING, "load leveldb select db error: %d", id);
+                success = REDIS_ERR;
+                goto cleanup;
+            }
+            ldb->dbslot[id] = (unsigned char)value[0];
+            explicit[id] = 1;
+        } else if (data[1] == LEVELDB_META_SLOTSWEEP && id < LEVELDB_MAX_SLOTS) {
+            ldb->slotdb[id] = LEVELDB_SLOT_SWEEPING;
+            jobs = zrealloc(jobs, sizeof(leveldbSweepJob*)*(numjobs+1));
+            jobs[numjobs++] = leveldbCreateSlotSweep(id);
+        }
+    }
+    for (j = 0; j < server.dbnum; j++) {
+        if (!explicit[j]) continue;
+        if (ldb->slotdb[ldb->dbslot[j]] != LEVELDB_SLOT_FREE) {
+            redisLog(REDIS_WARNING, "load leveldb slot %d of db %d already in use", ldb->dbslot[j], j);
+            success = REDIS_ERR;
+            goto cleanup;
+        }
+        ldb->slotdb[ldb->dbslot[j]] = j;
+    }
+    /* A db without a slot record uses the slot of its id, unless the slot
+     * was assigned to another db when there were less dbs configured. */
+    for (j = 0; j < server.dbnum; j++) {
+        sds metakey;
+        char c;
+
+        if (explicit[j]) continue;
+        if (ldb->slotdb[j] == LEVELDB_SLOT_FREE) {
+            ldb->dbslot[j] = j;
+            ldb->slotdb[j] = j;
+            continue;
+        }
+        ldb->dbslot[j] = leveldbFreeSlot(ldb);
+        ldb->slotdb[ldb->dbslot[j]] = j;
+        metakey = leveldbMetaKey(LEVELDB_META_DBSLOT, j);
+        c = ldb->dbslot[j];
+        leveldbBatchPut(ldb, metakey, sdslen(metakey), &c, 1);
+        sdsfree(metakey);
+    }
+    leveldbFlush(ldb);
+
+    /* Generations of the keys and the sweeps of their old records. */
+    sdsfree(prefix);
+    prefix = leveldbMetaKey(LEVELDB_META_KEYGEN, 0);
+    for (shard = 0; shard < ldb->numshards; shard++) {
+        if (shard) {
+            leveldb_iter_get_error(iterator, &err);
+            if (err != NULL) goto cleanup;
+            leveldb_iter_destroy(iterator);
+            iterator = leveldb_create_iterator(ldb->shards[shard].db, ldb->roptions);
+        }
+        for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+            size_t dataLen, valueLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            const char *value = leveldb_iter_value(iterator, &valueLen);
+            const unsigned char *p = (const unsigned char*)data + 3;
+            const unsigned char *end = (const unsigned char*)data + dataLen;
+            const unsigned char *vp = (const unsigned char*)value;
+            uint64_t keylen, gen;
+            char type = 0;
+            int dbid;
+            sds name;
+
+            if (dataLen < 4 || (unsigned char)data[0] != LEVELDB_META_SLOT) break;
+            if (data[1] != LEVELDB_META_KEYGEN && data[1] != LEVELDB_META_KEYSWEEP) break;
+            dbid = ldb->slotdb[(unsigned char)data[2]];
+            if (dbid < 0) continue; /* Swept with the slot. */
+
+            if (data[1] == LEVELDB_META_KEYSWEEP) type = *p++;
+            if (leveldbDecodeVarint(&p, end, &keylen) == REDIS_ERR ||
+                keylen > (size_t)(end - p)) continue;
+            name = sdsnewlen(p, keylen);
+            p += keylen;
+
+            if (data[1] == LEVELDB_META_KEYGEN) {
+                leveldbKeyGen *kg;
+
+                if (p != end || leveldbDecodeVarint(&vp, vp + valueLen, &gen) == REDIS_ERR) {
+                    sdsfree(name);
+                    continue;
+                }
+                kg = zmalloc(sizeof(*kg));
+                kg->gen = gen;
+                kg->sweeps = 0;
+                dictAdd(server.db[dbid].generations, name, kg);
+            } else {
+                dictEntry *de;
+
+                if (leveldbDecodeVarint(&p, end, &gen) == REDIS_ERR || p != end) {
+                    sdsfree(name);
+                    continue;
+                }
+                jobs = zrealloc(jobs, sizeof(leveldbSweepJob*)*(numjobs+1));
+                jobs[numjobs++] = leveldbCreateKeySweep(dbid, type, name, gen);
+                if ((de = dictFind(server.db[dbid].generations, name)) != NULL)
+                    ((leveldbKeyGen*)dictGetVal(de))->sweeps++;
+                sdsfree(name);
+            }
+        }
+    }
+
+cleanup:
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb meta iterator err: %s", err);
+        leveldb_free(err);
+        success = REDIS_ERR;
+    }
+    leveldb_iter_destroy(iterator);
+    sdsfree(prefix);
+    if (success == REDIS_OK) {
+        for (j = 0; j < numjobs; j++)
+            bioCreateBackgroundJob(REDIS_BIO_LEVELDB_SWEEP, jobs[j], NULL, NULL);
+    } else {
+        for (j = 0; j < numjobs; j++) leveldbFreeSweepJob(jobs[j]);
+    }
+    zfree(jobs);
+    return success;
+}
+
+/* -----------------------------------------------------------------------------
+ * Shards
+ *
+ * With leveldb-shards N the key space is split in N LevelDB instances: the
+ * first one is leveldb-path itself, shard n lives in leveldb-path/shard-n.
+ * Every shard has its own memtable, write ahead log and writer thread, so
+ * the writes of the different shards proceed in parallel.
+ *
+ * All the records of a key, the data records as well as its E, G and K
+ * metadata, go to the shard selected by the hash of its name, so a key is
+ * always written atomically. The other metadata records (slots of the dbs,
+ * slots to sweep, format version, number of shards) are written to every
+ * shard, the copy in the first shard being the one read at startup.
+ *
+ * A batch opened by leveldbBeginBatch() that touches keys of several shards,
+ * like MULTI/EXEC, is written by leveldbWriteShardsAtomic(): the records of
+ * every shard are first written to the first shard as a redo record, in the
+ * same write as its own records, then the other shards are written and the
+ * redo record is deleted. A redo record found at startup was left by a crash
+ * between the shard writes, leveldbRecoverShards() writes it again.
+ *
+ * The number of shards is recorded in the first shard and can't change on an
+ * existing database: to reshard, start a new server and resync it from this
+ * one as a slave.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_SHARD_PREFIX "shard-"
+#define LEVELDB_SHARD_HASH_SEED 0x5f4a3c29
+
+sds leveldbShardPath(const char *path, int shard) {
+    if (shard == 0) return sdsnew(path);
+    return sdscatprintf(sdsempty(),"%s/" LEVELDB_SHARD_PREFIX "%d",path,shard);
+}
+
+int leveldbKeyShard(struct leveldb *ldb, const char *name, size_t len) {
+    if (ldb->numshards == 1) return 0;
+    return MurmurHash64A(name, len, LEVELDB_SHARD_HASH_SEED) % ldb->numshards;
+}
+
+/* The shard holding the records of a key. */
+leveldb_t *leveldbKeyDb(struct leveldb *ldb, sds name) {
+    return ldb->shards[leveldbKeyShard(ldb, name, sdslen(name))].db;
+}
+
+/* Shard of a record, -1 for the metadata records written to every shard. */
+static int leveldbRecordShard(struct leveldb *ldb, const char *key, size_t keylen) {
+    const unsigned char *p, *end = (const unsigned char*)key + keylen;
+    uint64_t namelen;
+
+    if (ldb->numshards == 1) return 0;
+    if ((unsigned char)key[0] != LEVELDB_META_SLOT) {
+        p = (const unsigned char*)key + LEVELDB_KEY_FLAG_SET_KEY_LEN;
+    } else if (keylen < 3) {
+        return -1;
+    } else if (key[1] == LEVELDB_META_EXPIRE) {
+        size_t hdrlen = 3 + LEVELDB_INT64_LEN;
+
+        if (keylen < hdrlen) return 0;
+        return leveldbKeyShard(ldb, key + hdrlen, keylen - hdrlen);
+    } else if (key[1] == LEVELDB_META_ACCESS) {
+        return leveldbKeyShard(ldb, key + 3, keylen - 3);
+    } else if (key[1] == LEVELDB_META_KEYGEN) {
+        p = (const unsigned char*)key + 3;
+    } else if (key[1] == LEVELDB_META_KEYSWEEP) {
+        p = (const unsigned char*)key + 4;
+    } else {
+        return -1;
+    }
+    if (p > end || leveldbDecodeVarint(&p, end, &namelen) == REDIS_ERR ||
+        namelen > (uint64_t)(end - p)) return 0;
+    return leveldbKeyShard(ldb, (const char*)p, namelen);
+}
+
+/* Serialization of the staged batches in a redo record: for every put or
+ * delete [shard]['p' or 'd'][keylen][key], then for a put [vallen][val]. */
+typedef struct leveldbRedo {
+    sds buf;
+    int shard;
+} leveldbRedo;
+
+static void leveldbRedoPut(void *state, const char *key, size_t keylen, const char *val, size_t vallen) {
+    leveldbRedo *r = state;
+
+    r->buf = leveldbCatVarint(r->buf, r->shard);
+    r->buf = sdscatlen(r->buf, "p", 1);
+    r->buf = leveldbCatVarint(r->buf, keylen);
+    r->buf = sdscatlen(r->buf, key, keylen);
+    r->buf = leveldbCatVarint(r->buf, vallen);
+    r->buf = sdscatlen(r->buf, val, vallen);
+}
+
+static void leveldbRedoDelete(void *state, const char *key, size_t keylen) {
+    leveldbRedo *r = state;
+
+    r->buf = leveldbCatVarint(r->buf, r->shard);
+    r->buf = sdscatlen(r->buf, "d", 1);
+    r->buf = leveldbCatVarint(r->buf, keylen);
+    r->buf = sdscatlen(r->buf, key, keylen);
+}
+
+/* Write the staged batches of several shards, so that a crash never leaves
+ * some of them written and not the others. The queued batches are applied
+ * first, and the shards are written by the calling thread. */
+static void leveldbWriteShardsAtomic(struct leveldb *ldb, leveldb_writeoptions_t *woptions) {
+    char rkey[2] = { (char)LEVELDB_META_SLOT, LEVELDB_META_REDO };
+    leveldb_writebatch_t *wb;
+    leveldbRedo redo;
+    char *err = NULL;
+    int j, written = 0;
+
+    leveldbWaitWriter();
+    redo.buf = sdsempty();
+    for (j = 0; j < ldb->numshards; j++) {
+        if (ldb->shards[j].wbops == 0) continue;
+        redo.shard = j;
+        leveldb_writebatch_iterate(ldb->shards[j].wb, &redo, leveldbRedoPut, leveldbRedoDelete);
+    }
+    leveldb_writebatch_put(ldb->shards[0].wb, rkey, sizeof(rkey), redo.buf, sdslen(redo.buf));
+    ldb->shards[0].wbops++;
+    sdsfree(redo.buf);
+
+    for (j = 0; j < ldb->numshards; j++) {
+        leveldbShard *sh = ldb->shards+j;
+
+        if (sh->wbops == 0) continue;
+        leveldb_write(sh->db, woptions, sh->wb, &err);
+        procLeveldbError(err, "write leveldb err: %s");
+        leveldb_writebatch_clear(sh->wb);
+        sh->wbbytes = 0;
+        sh->wbops = 0;
+        if (++written == server.leveldb_debug_crash_shards) {
+            redisLog(REDIS_WARNING, "DEBUG leveldb-crash-after-shards: exiting after %d shards", written);
+            _exit(1);
+        }
+    }
+
+    wb = leveldb_writebatch_create();
+    leveldb_writebatch_delete(wb, rkey, sizeof(rkey));
+    leveldb_write(ldb->db, woptions, wb, &err);
+    procLeveldbError(err, "write leveldb err: %s");
+    leveldb_writebatch_destroy(wb);
+}
+
+/* Write again the batch of a redo record left by a crash. Nothing was
+ * written after it, so the shards it reached already are unaffected. */
+static int leveldbRecoverShards(struct leveldb *ldb) {
+    char rkey[2] = { (char)LEVELDB_META_SLOT, LEVELDB_META_REDO };
+    leveldb_writebatch_t **wbs;
+    const unsigned char *p, *end;
+    size_t valueLen;
+    char *value, *err = NULL;
+    long long records = 0;
+    int j, corrupted = 1, success = REDIS_OK;
+
+    value = leveldb_get(ldb->db, ldb->roptions, rkey, sizeof(rkey), &valueLen, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb redo err: %s", err);
+        leveldb_free(err);
+        return REDIS_ERR;
+    }
+    if (value == NULL) return REDIS_OK;
+
+    wbs = zmalloc(sizeof(leveldb_writebatch_t*)*ldb->numshards);
+    for (j = 0; j < ldb->numshards; j++) wbs[j] = leveldb_writebatch_create();
+    p = (const unsigned char*)value;
+    end = p + valueLen;
+    while (1) {
+        uint64_t shard, keylen, vallen = 0;
+        const unsigned char *key;
+        char op;
+
+        if (p == end) {
+            corrupted = 0;
+            break;
+        }
+        if (leveldbDecodeVarint(&p, end, &shard) == REDIS_ERR ||
+            shard >= (uint64_t)ldb->numshards || p == end) break;
+        op = *p++;
+        if (leveldbDecodeVarint(&p, end, &keylen) == REDIS_ERR ||
+            keylen > (uint64_t)(end-p)) break;
+        key = p;
+        p += keylen;
+        if (op == 'p') {
+            if (leveldbDecodeVarint(&p, end, &vallen) == REDIS_ERR ||
+                vallen > (uint64_t)(end-p)) break;
+            leveldb_writebatch_put(wbs[shard], (const char*)key, keylen, (const char*)p, vallen);
+            p += vallen;
+        } else if (op == 'd') {
+            leveldb_writebatch_delete(wbs[shard], (const char*)key, keylen);
+        } else {
+            break;
+        }
+        records++;
+    }
+    leveldb_free(value);
+
+    if (corrupted) {
+        redisLog(REDIS_WARNING, "load leveldb redo err: corrupted record");
+        success = REDIS_ERR;
+    } else {
+        for (j = 0; j < ldb->numshards && err == NULL; j++)
+            leveldb_write(ldb->shards[j].db, ldb->swoptions, wbs[j], &err);
+        if (err == NULL) {
+            leveldb_writebatch_clear(wbs[0]);
+            leveldb_writebatch_delete(wbs[0], rkey, sizeof(rkey));
+            leveldb_write(ldb->db, ldb->swoptions, wbs[0], &err);
+        }
+        if (err != NULL) {
+            redisLog(REDIS_WARNING, "write leveldb redo err: %s", err);
+            leveldb_free(err);
+            success = REDIS_ERR;
+        } else {
+            redisLog(REDIS_NOTICE, "leveldb completed a batch interrupted by a crash: %lld records", records);
+        }
+    }
+    for (j = 0; j < ldb->numshards; j++) leveldb_writebatch_destroy(wbs[j]);
+    zfree(wbs);
+    return success;
+}
+
+void leveldbBatchPut(struct leveldb *ldb, const char *key, size_t keylen, const char *val, size_t vallen) {
+    int shard = leveldbRecordShard(ldb, key, keylen), j;
+
+    for (j = 0; j < ldb->numshards; j++) {
+        leveldbShard *sh = ldb->shards+j;
+
+        if (shard != -1 && j != shard) continue;
+        leveldb_writebatch_put(sh->wb, key, keylen, val, vallen);
+        sh->wbbytes += keylen + vallen;
+        sh->wbops++;
+        ldb->wbbytes += keylen + vallen;
+        ldb->wbops++;
+    }
+}
+
+void leveldbBatchDelete(struct leveldb *ldb, const char *key, size_t keylen) {
+    int shard = leveldbRecordShard(ldb, key, keylen), j;
+
+    for (j = 0; j < ldb->numshards; j++) {
+        leveldbShard *sh = ldb->shards+j;
+
+        if (shard != -1 && j != shard) continue;
+        leveldb_writebatch_delete(sh->wb, key, keylen);
+        sh->wbbytes += keylen;
+        sh->wbops++;
+        ldb->wbbytes += keylen;
+        ldb->wbops++;
+    }
+}
+
+/* Check leveldb-shards against the number of shards of the database, that
+ * is recorded when it is created. A database without the record predates
+ * the shards and has a single one. */
+static int leveldbCheckShards(struct leveldb *ldb) {
+    char nkey[2] = { (char)LEVELDB_META_SLOT, LEVELDB_META_SHARDS };
+    unsigned char buf[LEVELDB_VARINT_MAX_LEN];
+    leveldb_iterator_t *iterator;
+    uint64_t numshards = 1;
+    size_t valueLen;
+    char *value, *err = NULL;
+    int empty;
+
+    value = leveldb_get(ldb->db, ldb->roptions, nkey, sizeof(nkey), &valueLen, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb shards err: %s", err);
+        leveldb_free(err);
+        return REDIS_ERR;
+    }
+    if (value != NULL) {
+        const unsigned char *p = (unsigned char*)value;
+
+        if (leveldbDecodeVarint(&p, p + valueLen, &numshards) == REDIS_ERR)
+            numshards = 0;
+        leveldb_free(value);
+    } else {
+        iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+        leveldb_iter_seek_to_first(iterator);
+        empty = !leveldb_iter_valid(iterator);
+        leveldb_iter_destroy(iterator);
+        if (empty) {
+            leveldbBatchPut(ldb, nkey, sizeof(nkey), (char*)buf,
+                            leveldbEncodeVarint(buf, ldb->numshards));
+            leveldbFlush(ldb);
+            return REDIS_OK;
+        }
+    }
+    if (numshards != (uint64_t)ldb->numshards) {
+        redisLog(REDIS_WARNING, "leveldb was created with %llu shards, leveldb-shards is %d: "
+            "resync a new server from this one to change the number of shards",
+            (unsigned long long)numshards, ldb->numshards);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* The shards section of INFO leveldb: the queue of the writer and the size
+ * of every shard, then the LevelDB stats and tables of every shard. */
+sds leveldbCatShardsInfo(sds info) {
+    struct leveldb *ldb = &server.ldb;
+    int j;
+
+    info = sdscatprintf(info, "leveldb_shards:%d\r\n", ldb->numshards);
+    for (j = 0; j < ldb->numshards; j++) {
+        static const char maxkey[] = "\xff\xff\xff\xff\xff\xff\xff\xff";
+        const char *start = "", *limit = maxkey;
+        size_t startlen = 0, limitlen = sizeof(maxkey)-1;
+        uint64_t size;
+
+        leveldb_approximate_sizes(ldb->shards[j].db, 1, &start, &startlen,
+                                  &limit, &limitlen, &size);
+        info = sdscatprintf(info, "leveldb_shard%d:queued_batches=%llu,approx_bytes=%llu\r\n",
+            j, bioPendingJobsOfType(j ? REDIS_BIO_LEVELDB_SHARD_WRITE+j-1 :
+                                    REDIS_BIO_LEVELDB_WRITE),
+            (unsigned long long)size);
+    }
+    for (j = 0; j < ldb->numshards; j++) {
+        char *ss;
+
+        if (ldb->numshards > 1) info = sdscatprintf(info, "# shard %d\r\n", j);
+        ss = leveldb_property_value(ldb->shards[j].db, "leveldb.stats");
+        info = sdscat(info, ss);
+        leveldb_free(ss);
+        info = sdscat(info, "\r\n");
+        ss = leveldb_property_value(ldb->shards[j].db, "leveldb.sstables");
+        info = sdscat(info, ss);
+        leveldb_free(ss);
+    }
+    return info;
+}
+
+/* -----------------------------------------------------------------------------
+ * Lazy free
+ *
+ * The records of a big collection are retired with its generation, but the
+ * object itself would still be released element by element on DEL. Instead
+ * leveldbDelKey() hands the collections of more than
+ * LEVELDB_LAZYFREE_MIN_ELEMENTS elements to leveldbLazyFree() before they
+ * leave the key space, and leveldbLazyFreeCron() releases them a
+ * slice at a time, using at most LEVELDB_LAZYFREE_CYCLE_PERC percent of the
+ * time between two serverCron() calls. Frozen and evicted keys are still
+ * freed at once, as the maxmemory loop measures the memory they release.
+ *
+ * The elements are robj that may be shared with other objects or with the
+ * shared integers, so they can't be released by a background thread: the
+ * freeing runs in the main thread, but never in a single long pause.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_LAZYFREE_MIN_ELEMENTS 1024
+#define LEVELDB_LAZYFREE_CYCLE_PERC 25
+#define LEVELDB_LAZYFREE_STEP 256   /* Elements freed between time checks. */
+
+typedef struct leveldbLazyFreeJob {
+    robj *val;
+    unsigned long elements;     /* Elements still to free. */
+    size_t elesize;             /* Estimated bytes per element. */
+    int table;                  /* Dict table and bucket to free next. */
+    unsigned long bucket;
+} leveldbLazyFreeJob;
+
+static list *leveldb_lazyfree_jobs = NULL;
+static unsigned long long leveldb_lazyfree_elements = 0; /* Pending elements. */
+static unsigned long long leveldb_lazyfree_bytes = 0;    /* Pending bytes. */
+
+/* Elements of the collections that are not a single allocation, 0 for the
+ * others. */
+static unsigned long leveldbLazyFreeElements(robj *val) {
+    switch(val->type) {
+    case REDIS_LIST:
+        return val->encoding == REDIS_ENCODING_LINKEDLIST ? listTypeLength(val) : 0;
+    case REDIS_SET:
+        return val->encoding == REDIS_ENCODING_HT ? setTypeSize(val) : 0;
+    case REDIS_ZSET:
+        return val->encoding == REDIS_ENCODING_SKIPLIST ? zsetLength(val) : 0;
+    case REDIS_HASH:
+        return val->encoding == REDIS_ENCODING_HT ? hashTypeLength(val) : 0;
+    }
+    return 0;
+}
+
+/* Bytes of a string object, shared objects included. */
+static size_t leveldbLazyFreeObjectSize(robj *o) {
+    size_t size = sizeof(robj);
+
+    if (o->encoding == REDIS_ENCODING_RAW)
+        size += sizeof(struct sdshdr)+sdslen(o->ptr)+sdsavail(o->ptr)+1;
+    return size;
+}
+
+/* Estimated bytes per element of a collection returned by
+ * leveldbLazyFreeElements(): the node, its slot in the hash table and the
+ * size of an element picked at random. */
+static size_t leveldbLazyFreeElementSize(robj *val) {
+    dictEntry *de;
+
+    switch(val->type) {
+    case REDIS_LIST:
+        return sizeof(listNode) +
+            leveldbLazyFreeObjectSize(listNodeValue(listFirst((list*)val->ptr)));
+    case REDIS_SET:
+        de = dictGetRandomKey(val->ptr);
+        return sizeof(dictEntry) + sizeof(dictEntry*) +
+            leveldbLazyFreeObjectSize(dictGetKey(de));
+    case REDIS_HASH:
+        de = dictGetRandomKey(val->ptr);
+        return sizeof(dictEntry) + sizeof(dictEntry*) +
+            leveldbLazyFreeObjectSize(dictGetKey(de)) +
+            leveldbLazyFreeObjectSize(dictGetVal(de));
+    case REDIS_ZSET:
+        /* A skiplist node has 1.33 levels on average. */
+        de = dictGetRandomKey(((zset*)val->ptr)->dict);
+        return sizeof(dictEntry) + sizeof(dictEntry*) + sizeof(zskiplistNode) +
+            sizeof(struct zskiplistLevel)*4/3 +
+            leveldbLazyFreeObjectSize(dictGetKey(de));
+    }
+    return 0;
+}
+
+/* Take a reference to a value about to leave the key space, if it is worth
+ * freeing it incrementally. Returns 1 if the value was queued. */
+int leveldbLazyFree(robj *val) {
+    unsigned long elements = leveldbLazyFreeElements(val);
+    leveldbLazyFreeJob *job;
+
+    if (val->refcount != 1 || elements < LEVELDB_LAZYFREE_MIN_ELEMENTS) return 0;
+    if (leveldb_lazyfree_jobs == NULL) leveldb_lazyfree_jobs = listCreate();
+    job = zmalloc(sizeof(*job));
+    incrRefCount(val);
+    job->val = val;
+    job->elements = elements;
+    job->elesize = leveldbLazyFreeElementSize(val);
+    job->table = 0;
+    job->bucket = 0;
+    listAddNodeTail(leveldb_lazyfree_jobs, job);
+    leveldb_lazyfree_elements += elements;
+    leveldb_lazyfree_bytes += (unsigned long long)elements*job->elesize;
+    return 1;
+}
+
+/* Release the entries of the dict bucket after bucket. */
+static unsigned long leveldbLazyFreeDict(leveldbLazyFreeJob *job, dict *d, unsigned long count) {
+    unsigned long freed = 0;
+
+    while (freed < count && dictSize(d)) {
+        dictht *ht = &d->ht[job->table];
+        dictEntry *he, *next;
+
+        if (job->bucket >= ht->size) {
+            job->table = 1;
+            job->bucket = 0;
+            continue;
+        }
+        for (he = ht->table[job->bucket]; he; he = next) {
+            next = he->next;
+            dictFreeKey(d, he);
+            dictFreeVal(d, he);
+            zfree(he);
+            ht->used--;
+            freed++;
+        }
+        ht->table[job->bucket++] = NULL;
+    }
+    return freed;
+}
+
+/* Free about 'count' elements of the value, returns 1 once it is empty. The
+ * emptied structures are released with the value itself. */
+static int leveldbLazyFreeStep(leveldbLazyFreeJob *job, unsigned long count) {
+    robj *val = job->val;
+    unsigned long freed = 0;
+
+    switch(val->type) {
+    case REDIS_LIST: {
+        list *l = val->ptr;
+
+        while (freed < count && listLength(l)) {
+            listDelNode(l, listFirst(l));
+            freed++;
+        }
+        job->elements -= freed;
+        return listLength(l) == 0;
+    }
+    case REDIS_SET:
+    case REDIS_HASH:
+        job->elements -= leveldbLazyFreeDict(job, val->ptr, count);
+        return dictSize((dict*)val->ptr) == 0;
+    case REDIS_ZSET: {
+        zset *zs = val->ptr;
+        zskiplist *zsl = zs->zsl;
+        zskiplistNode *x;
+
+        /* The members are shared by the dict and the skiplist nodes: only
+         * the nodes count as elements. */
+        freed = leveldbLazyFreeDict(job, zs->dict, count);
+        while (freed < count && (x = zsl->header->level[0].forward) != NULL) {
+            zsl->header->level[0].forward = x->level[0].forward;
+            zsl->length--;
+            zslFreeNode(x);
+            job->elements--;
+            freed++;
+        }
+        return zsl->header->level[0].forward == NULL;
+    }
+    }
+    return 1;
+}
+
+/* Called by serverCron(). */
+void leveldbLazyFreeCron(void) {
+    long long start, timelimit;
+    listNode *ln;
+
+    if (leveldb_lazyfree_jobs == NULL || listLength(leveldb_lazyfree_jobs) == 0) return;
+    start = ustime();
+    timelimit = 1000000*LEVELDB_LAZYFREE_CYCLE_PERC/server.hz/100;
+    while ((ln = listFirst(leveldb_lazyfree_jobs)) != NULL) {
+        leveldbLazyFreeJob *job = ln->value;
+        unsigned long left = job->elements;
+        int done = leveldbLazyFreeStep(job, LEVELDB_LAZYFREE_STEP);
+
+        if (done) job->elements = 0;
+        leveldb_lazyfree_elements -= left - job->elements;
+        leveldb_lazyfree_bytes -= (unsigned long long)(left - job->elements)*job->elesize;
+        if (done) {
+            decrRefCount(job->val);
+            zfree(job);
+            listDelNode(leveldb_lazyfree_jobs, ln);
+        }
+        if (ustime()-start > timelimit) break;
+    }
+}
+
+/* The pending bytes are estimated when the values are queued, see
+ * leveldbLazyFreeElementSize(). */
+void leveldbLazyFreeStats(unsigned long *objects, unsigned long long *elements, unsigned long long *bytes) {
+    *objects = leveldb_lazyfree_jobs ? listLength(leveldb_lazyfree_jobs) : 0;
+    *elements = leveldb_lazyfree_elements;
+    *bytes = leveldb_lazyfree_bytes;
+}
+
+/* -----------------------------------------------------------------------------
+ * Write coalescing
+ *
+ * With leveldb-coalesce-ms set, the counters updated by INCR, DECR, INCRBY,
+ * DECRBY, INCRBYFLOAT, HINCRBY, HINCRBYFLOAT and ZINCRBY are not written
+ * at every update: the (db, key, field) is added to a set of dirty records,
+ * and leveldbCoalesceFlush() writes their current value from memory once per
+ * interval, so that a hot counter costs a single put per interval.
+ *
+ * As the values are read at flush time, the records of keys and fields
+ * deleted meanwhile are skipped (their deletion was already written), and
+ * the generation of a collection is the current one. The set is flushed
+ * before a key is frozen, before a BACKUP and at shutdown; the writes of the
+ * last interval are lost if the server crashes, like appendfsync everysec.
+ *
+ * A dirty record is [dbid][type][keylen][key], followed by [fieldlen][field]
+ * for the 'h' and 'z' types (the field may be empty), lengths and dbid as
+ * varints.
+ * -------------------------------------------------------------------------- */
+
+static dict *leveldb_coalesce_dirty = NULL;
+static int leveldb_coalesce_flushing = 0; /* Write through while flushing. */
+
+/* Returns 1 if the write of 'field' (NULL for strings) of the key is left to
+ * the next leveldbCoalesceFlush(), 0 if it must be written now. */
+static int leveldbCoalesce(int dbid, char type, robj *key, robj *field) {
+    robj *r1;
+    sds dirty;
+
+    /* The counters of a transaction are written with the transaction. */
+    if (server.leveldb_coalesce_ms == 0 || leveldb_coalesce_flushing ||
+        server.ldb.batchdepth) return 0;
+    if (leveldb_coalesce_dirty == NULL)
+        leveldb_coalesce_dirty = dictCreate(&freezedDictType, NULL);
+
+    dirty = leveldbCatVarint(sdsempty(), dbid);
+    dirty = sdscatlen(dirty, &type, 1);
+    r1 = getDecodedObject(key);
+    dirty = leveldbCatVarint(dirty, sdslen(r1->ptr));
+    dirty = sdscatsds(dirty, r1->ptr);
+    decrRefCount(r1);
+    if (field) {
+        robj *r2 = getDecodedObject(field);
+
+        dirty = leveldbCatVarint(dirty, sdslen(r2->ptr));
+        dirty = sdscatsds(dirty, r2->ptr);
+        decrRefCount(r2);
+    }
+    if (dictAdd(leveldb_coalesce_dirty, dirty, NULL) != DICT_OK) {
+        sdsfree(dirty);
+        server.leveldb_coalesced++;
+    }
+    return 1;
+}
+
+/* Stage the current value of a dirty record. */
+static void leveldbCoalesceWrite(struct leveldb *ldb, sds dirty) {
+    const unsigned char *p = (unsigned char*)dirty, *end = (unsigned char*)dirty + sdslen(dirty);
+    robj *key, *field = NULL, *o, *val;
+    uint64_t dbid, keylen, fieldlen;
+    char type;
+    double score;
+
+    if (leveldbDecodeVarint(&p, end, &dbid) == REDIS_ERR || dbid >= (uint64_t)server.dbnum ||
+        p == end) return;
+    type = *p++;
+    if (leveldbDecodeVarint(&p, end, &keylen) == REDIS_ERR || keylen > (size_t)(end-p)) return;
+    key = createStringObject((char*)p, keylen);
+    p += keylen;
+    if (type == 'h' || type == 'z') {
+        if (leveldbDecodeVarint(&p, end, &fieldlen) == REDIS_ERR || fieldlen != (size_t)(end-p)) {
+            decrRefCount(key);
+            return;
+        }
+        field = createStringObject((char*)p, fieldlen);
+    }
+    o = dictFetchValue(server.db[dbid].dict, key->ptr);
+
+    switch(type) {
+    case 'c':
+        if (o && o->type == REDIS_STRING) leveldbSetDirect(dbid, ldb, key, o);
+        break;
+    case 'h':
+        if (o && o->type == REDIS_HASH && (val = hashTypeGetObject(o, field)) != NULL) {
+            leveldbHsetDirect(dbid, ldb, key, field, val);
+            decrRefCount(val);
+        }
+        break;
+    case 'z':
+        if (o && o->type == REDIS_ZSET) {
+            if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+                if (zzlFind(o->ptr, field, &score) == NULL) break;
+            } else {
+                dictEntry *de = dictFind(((zset*)o->ptr)->dict, field);
+
+                if (de == NULL) break;
+                score = *(double*)dictGetVal(de);
+            }
+            leveldbZaddDirect(dbid, ldb, key, field, score);
+        }
+        break;
+    }
+    decrRefCount(key);
+    if (field) decrRefCount(field);
+}
+
+/* Write the current value of all the dirty records in a single batch. */
+void leveldbCoalesceFlush(struct leveldb *ldb) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (leveldb_coalesce_dirty == NULL || dictSize(leveldb_coalesce_dirty) == 0) return;
+    leveldb_coalesce_flushing = 1;
+    leveldbBeginBatch(ldb);
+    di = dictGetIterator(leveldb_coalesce_dirty);
+    while ((de = dictNext(di)) != NULL) leveldbCoalesceWrite(ldb, dictGetKey(de));
+    dictReleaseIterator(di);
+    leveldbEndBatch(ldb);
+    leveldb_coalesce_flushing = 0;
+    dictEmpty(leveldb_coalesce_dirty, NULL);
+}
+
+unsigned long leveldbCoalescePending(void) {
+    return leveldb_coalesce_dirty ? dictSize(leveldb_coalesce_dirty) : 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Frozen key index
+ *
+ * A frozen key has an F record holding its record type. By default the frozen
+ * keys are also indexed in db->freezed. With leveldb-freezed-index filter
+ * only a counting bloom filter of the names is kept in memory, 5 to 10 bytes
+ * per key instead of a dict entry and a copy of the name: the filter answers
+ * most lookups of the keys that are not frozen, the others read the F record.
+ *
+ * The counters are 4 bits and stick once saturated, so removing a key never
+ * hides another one. A full filter is rebuilt from the F records with twice
+ * the capacity.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_FILTER_MIN_KEYS 1024
+#define LEVELDB_FILTER_COUNTERS_PER_KEY 10
+#define LEVELDB_FILTER_HASHES 7
+#define LEVELDB_FILTER_MAX_COUNT 15
+
+typedef struct leveldbFreezedFilter {
+    unsigned char *counters;    /* Two 4 bits counters per byte. */
+    uint64_t size;              /* Number of counters. */
+    unsigned long capacity;     /* Keys before the filter is rebuilt. */
+    unsigned long count;        /* Frozen keys. */
+} leveldbFreezedFilter;
+
+/* One filter per db with leveldb-freezed-index filter, NULL otherwise. */
+static leveldbFreezedFilter *leveldb_freezed_filters = NULL;
+
+/* With the filter, the F records put (name -> record type) or deleted
+ * (name -> 0) that the writer threads may not have applied yet, one dict per
+ * db: a lookup finds there what LevelDB can't return yet, without waiting for
+ * the writer threads. Emptied once they applied every staged write, or by a
+ * drain when it reaches LEVELDB_FILTER_MAX_STAGED names. */
+static dict **leveldb_freezed_staged = NULL;
+
+#define LEVELDB_FILTER_MAX_STAGED 65536
+
+sds createleveldbFreezedKeyHead(int dbid, sds name) {
+  return leveldbKeyPrefix(dbid, 'f', name);
+}
+
+static void leveldbFilterInit(leveldbFreezedFilter *f, unsigned long capacity) {
+    f->capacity = capacity;
+    f->size = (uint64_t)capacity*LEVELDB_FILTER_COUNTERS_PER_KEY;
+    f->counters = zcalloc((f->size+1)/2);
+    f->count = 0;
+}
+
+/* Add (incr 1) or remove (incr -1) a name, or return 1 if it may be in the
+ * filter (incr 0). */
+static int leveldbFilterUpdate(leveldbFreezedFilter *f, const char *name, size_t len, int incr) {
+    uint64_t h1 = MurmurHash64A(name, len, 0xadc83b19);
+    uint64_t h2 = MurmurHash64A(name, len, 0x9747b28c) | 1;
+    int j;
+
+    for (j = 0; j < LEVELDB_FILTER_HASHES; j++) {
+        uint64_t idx = (h1 + j*h2) % f->size;
+        unsigned char *p = f->counters + idx/2;
+        int shift = (idx & 1) * 4;
+        int counter = (*p >> shift) & 0xf;
+
+        if (incr == 0) {
+            if (counter == 0) return 0;
+            continue;
+        }
+        if (counter == LEVELDB_FILTER_MAX_COUNT) continue;
+        counter += incr;
+        *p = (*p & ~(0xf << shift)) | (counter << shift);
+    }
+    return 1;
+}
+
+/* Call proc for every F record of the db, one shard after the other. */
+static int leveldbForEachFreezed(int dbid, void (*proc)(int dbid, const char *name, size_t len, char keytype, void *privdata), void *privdata) {
+    char prefix[LEVELDB_KEY_FLAG_SET_KEY_LEN];
+    leveldbRecordKey rk;
+    int shard;
+
+    prefix[LEVELDB_KEY_FLAG_DATABASE_ID] = server.ldb.dbslot[dbid];
+    prefix[LEVELDB_KEY_FLAG_TYPE] = 'F';
+    for (shard = 0; shard < server.ldb.numshards; shard++) {
+        leveldb_iterator_t *iterator = leveldb_create_iterator(server.ldb.shards[shard].db, server.ldb.roptions);
+        char *err = NULL;
+
+        for (leveldb_iter_seek(iterator, prefix, sizeof(prefix));
+             leveldb_iter_valid(iterator);
+             leveldb_iter_next(iterator))
+        {
+            size_t dataLen, valueLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            const char *value;
+
+            if (dataLen < sizeof(prefix) || memcmp(data, prefix, sizeof(prefix))) break;
+            value = leveldb_iter_value(iterator, &valueLen);
+            if (valueLen != 1 || leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR) continue;
+            proc(dbid, rk.key, rk.keylen, value[0], privdata);
+        }
+        leveldb_iter_get_error(iterator, &err);
+        leveldb_iter_destroy(iterator);
+        if (err != NULL) {
+            redisLog(REDIS_WARNING, "frozen keys leveldb iterator err: %s", err);
+            leveldb_free(err);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+static void leveldbFilterAddProc(int dbid, const char *name, size_t len, char keytype, void *privdata) {
+    leveldbFreezedFilter *f = privdata;
+    REDIS_NOTUSED(dbid);
+    REDIS_NOTUSED(keytype);
+
+    leveldbFilterUpdate(f, name, len, 1);
+    f->count++;
+}
+
+/* Rebuild the filter of a db from its F records, sized for twice its keys. */
+static int leveldbFilterRebuild(int dbid) {
+    leveldbFreezedFilter *f = leveldb_freezed_filters+dbid, nf;
+    unsigned long capacity = f->count*2;
+
+    leveldbDrain(&server.ldb);
+    while (1) {
+        if (capacity < LEVELDB_FILTER_MIN_KEYS) capacity = LEVELDB_FILTER_MIN_KEYS;
+        leveldbFilterInit(&nf, capacity);
+        if (leveldbForEachFreezed(dbid, leveldbFilterAddProc, &nf) == REDIS_ERR) {
+            zfree(nf.counters);
+            return REDIS_ERR;
+        }
+        if (nf.count <= nf.capacity) break;
+        capacity = nf.count*2;
+        zfree(nf.counters);
+    }
+    zfree(f->counters);
+    *f = nf;
+    return REDIS_OK;
+}
+
+/* Record the change of the F record of a key in the staged F records. */
+static void leveldbStageFreezed(int dbid, sds name, char keytype) {
+    dict *staged = leveldb_freezed_staged[dbid];
+    dictEntry *de = dictFind(staged, name);
+
+    if (de == NULL) de = dictAddRaw(staged, sdsdup(name));
+    dictSetSignedIntegerVal(de, keytype);
+    if (dictSize(staged) >= LEVELDB_FILTER_MAX_STAGED) leveldbDrain(&server.ldb);
+}
+
+/* Forget the staged F records once nothing is left to write: called after
+ * the writes were performed or the writer threads were waited for. */
+static void leveldbFreezedWritten(struct leveldb *ldb) {
+    int j;
+
+    if (leveldb_freezed_staged == NULL || ldb->wbops) return;
+    for (j = 0; j < server.dbnum; j++)
+        if (dictSize(leveldb_freezed_staged[j]))
+            dictEmpty(leveldb_freezed_staged[j], NULL);
+}
+
+/* Called by serverCron(): forget the staged F records applied by the
+ * writer threads. */
+void leveldbFreezedCron(void) {
+    unsigned long long batches, bytes;
+    long long lag;
+
+    if (leveldb_freezed_staged == NULL) return;
+    leveldbAsyncStats(&batches, &bytes, &lag);
+    if (batches == 0) leveldbFreezedWritten(&server.ldb);
+}
+
+/* Record type of a frozen key, 0 if not frozen. With the filter, a name that
+ * may be frozen is looked up in the staged F records, then its F record is
+ * read. The loader threads run while no F record is staged. */
+static char leveldbFreezedKeyType(int dbid, sds name) {
+    leveldbFreezedFilter *f;
+    dict *staged;
+    char *value, *err = NULL, keytype = 0;
+    size_t valueLen;
+    sds key;
+
+    if (leveldb_freezed_filters == NULL) {
+        dictEntry *de = dictFind(server.db[dbid].freezed, name);
+
+        return de ? (char)dictGetSignedIntegerVal(de) : 0;
+    }
+    f = leveldb_freezed_filters+dbid;
+    if (f->count == 0 || !leveldbFilterUpdate(f, name, sdslen(name), 0)) return 0;
+
+    staged = leveldb_freezed_staged[dbid];
+    if (dictSize(staged)) {
+        dictEntry *de = dictFind(staged, name);
+
+        if (de) return (char)dictGetSignedIntegerVal(de);
+    }
+    key = createleveldbFreezedKeyHead(dbid, name);
+    value = leveldb_get(leveldbKeyDb(&server.ldb, name), server.ldb.proptions, key, sdslen(key), &valueLen, &err);
+    sdsfree(key);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "frozen key leveldb get err: %s", err);
+        leveldb_free(err);
+    } else if (value != NULL && valueLen == 1) {
+        keytype = value[0];
+    }
+    leveldb_free(value);
+    return keytype;
+}
+
+/* Index a frozen key whose F record is staged. The name is released. */
+int addFreezedKey(int dbid, sds key, char keytype) {
+    leveldbFreezedFilter *f;
+    dictEntry *entry;
+
+    if (leveldb_freezed_filters == NULL) {
+        if ((entry = dictAddRaw(server.db[dbid].freezed,key)) == NULL) return REDIS_ERR;
+        dictSetSignedIntegerVal(entry, keytype);
+        return REDIS_OK;
+    }
+    leveldbStageFreezed(dbid, key, keytype);
+    f = leveldb_freezed_filters+dbid;
+    leveldbFilterUpdate(f, key, sdslen(key), 1);
+    sdsfree(key);
+    if (++f->count > f->capacity) leveldbFilterRebuild(dbid);
+    return REDIS_OK;
+}
+
+/* Unindex a frozen key. Nothing is done if the key is not indexed: its
+ * counters in the filter must not be decremented below zero. */
+void delFreezedKey(int dbid, sds key) {
+    leveldbFreezedFilter *f;
+
+    if (leveldb_freezed_filters == NULL) {
+        dictDelete(server.db[dbid].freezed, key);
+        return;
+    }
+    f = leveldb_freezed_filters+dbid;
+    if (f->count == 0 || !leveldbFilterUpdate(f, key, sdslen(key), 0)) return;
+    leveldbStageFreezed(dbid, key, 0);
+    leveldbFilterUpdate(f, key, sdslen(key), -1);
+    f->count--;
+}
+
+void emptyFreezedKeys(int dbid) {
+    leveldbFreezedFilter *f;
+
+    dictEmpty(server.db[dbid].freezed,NULL);
+    if (leveldb_freezed_filters == NULL) return;
+    dictEmpty(leveldb_freezed_staged[dbid],NULL);
+    f = leveldb_freezed_filters+dbid;
+    zfree(f->counters);
+    leveldbFilterInit(f, LEVELDB_FILTER_MIN_KEYS);
+}
+
+unsigned long freezedKeysCount(int dbid) {
+    if (leveldb_freezed_filters == NULL) return dictSize(server.db[dbid].freezed);
+    return leveldb_freezed_filters[dbid].count;
+}
+
+/* Memory used by the filters, 0 without them. */
+size_t leveldbFreezedFilterBytes(void) {
+    size_t bytes = 0;
+    int j;
+
+    if (leveldb_freezed_filters == NULL) return 0;
+    for (j = 0; j < server.dbnum; j++)
+        bytes += (leveldb_freezed_filters[j].size+1)/2;
+    return bytes;
+}
+
+static void leveldbLoadFreezedProc(int dbid, const char *name, size_t len, char keytype, void *privdata) {
+    int retval = addFreezedKey(dbid, sdsnewlen(name, len), keytype);
+    REDIS_NOTUSED(privdata);
+
+    redisAssertWithInfo(NULL,NULL,retval == REDIS_OK);
+}
+
+int loadFreezedKey(struct leveldb* ldb) {
+    int dbid;
+    REDIS_NOTUSED(ldb);
+
+    if (server.leveldb_freezed_index == REDIS_LEVELDB_FREEZED_FILTER) {
+        leveldb_freezed_filters = zcalloc(sizeof(leveldbFreezedFilter)*server.dbnum);
+        leveldb_freezed_staged = zmalloc(sizeof(dict*)*server.dbnum);
+        for (dbid = 0; dbid < server.dbnum; dbid++)
+            leveldb_freezed_staged[dbid] = dictCreate(&freezedDictType, NULL);
+        for (dbid = 0; dbid < server.dbnum; dbid++) {
+            if (leveldbFilterRebuild(dbid) == REDIS_ERR) return REDIS_ERR;
+        }
+        return REDIS_OK;
+    }
+    for (dbid = 0; dbid < server.dbnum; dbid++) {
+        if (leveldbForEachFreezed(dbid, leveldbLoadFreezedProc, NULL) == REDIS_ERR)
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+int isKeyFreezed(int dbid, robj *key) {
+    return leveldbFreezedKeyType(dbid, key->ptr) != 0;
+}
+
+char getFreezedKeyType(int dbid, robj *key) {
+    return leveldbFreezedKeyType(dbid, key->ptr);
+}
+
+int freezeKey(redisDb *db, struct leveldb *ldb, robj *key, char keytype) {
+    sds strkey;
+    sds leveldbkey;
+    int retval;
+    
+    /* The records must be up to date once the value leaves memory. */
+    leveldbCoalesceFlush(ldb);
+    if (!dbDelete(db, key)) {
+	    return REDIS_ERR;
+    }
+
+    leveldbkey = createleveldbFreezedKeyHead(db->id, key->ptr);
+    leveldbBatchPut(ldb, leveldbkey, sdslen(leveldbkey), &keytype, 1);
+    ldb->batchfreezed |= LEVELDB_BATCH_FREEZE;
+    leveldbCommit(ldb);
+    sdsfree(leveldbkey);
+    
+    strkey = sdsdup(key->ptr);
+    retval = addFreezedKey(db->id, strkey, keytype);
+    redisAssertWithInfo(NULL,key,retval == REDIS_OK);
+    if(retval != REDIS_OK)
+    {
+        sdsfree(strkey);
+        return REDIS_ERR;
+    }
+    
+    return REDIS_OK;
+}
+
+/* -----------------------------------------------------------------------------
+ * Expires
+ *
+ * The expire time of a volatile key is indexed in the meta slot, ordered by
+ * time inside the slot of its db:
+ *
+ * [0xff]['E'][slot][unix time in ms][key] -> record type of the key
+ *
+ * The time sorts as a signed number, see leveldbCatInt64(), and the key takes
+ * the rest of the record key. setExpire(), removeExpire() and dbDelete()
+ * keep the index in sync with db->expires; the records of an expired key
+ * are deleted as DEL does.
+ *
+ * The index is read before the key space: the loaders skip the keys that
+ * expired while the server was down, and their records are deleted once the
+ * load is done, without building the objects.
+ * -------------------------------------------------------------------------- */
+
+typedef struct leveldbLoadExpire {
+    long long when;
+    char type;
+} leveldbLoadExpire;
+
+static dict **leveldb_load_expires = NULL; /* Index of every db while loading. */
+static long long leveldb_load_mstime;      /* Keys expired before are dropped. */
+
+char leveldbObjectType(robj *o) {
+    switch(o->type) {
+    case REDIS_STRING: return 'c';
+    case REDIS_LIST: return 'l';
+    case REDIS_SET: return 's';
+    case REDIS_ZSET: return 'z';
+    case REDIS_HASH: return 'h';
+    }
+    return 0;
+}
+
+static sds leveldbExpireMetaKey(int slot, long long when, sds name) {
+    sds key = leveldbMetaKey(LEVELDB_META_EXPIRE, slot);
+
+    key = leveldbCatInt64(key, when);
+    return sdscatsds(key, name);
+}
+
+/* Move the key in the index from the 'old' expire time (-1 if none) to
+ * 'when'. */
+void leveldbSetExpire(int dbid, struct leveldb *ldb, robj *key, robj *val, long long old, long long when) {
+    char type = leveldbObjectType(val);
+    sds metakey;
+
+    if (server.leveldb_state == REDIS_LEVELDB_OFF || old == when) return;
+    if (old != -1) {
+        metakey = leveldbExpireMetaKey(ldb->dbslot[dbid], old, key->ptr);
+        leveldbBatchDelete(ldb, metakey, sdslen(metakey));
+        sdsfree(metakey);
+    }
+    metakey = leveldbExpireMetaKey(ldb->dbslot[dbid], when, key->ptr);
+    leveldbBatchPut(ldb, metakey, sdslen(metakey), &type, 1);
+    leveldbCommit(ldb);
+    sdsfree(metakey);
+}
+
+/* Remove the key from the index, 'when' is its expire time or -1. */
+void leveldbDelExpire(int dbid, struct leveldb *ldb, robj *key, long long when) {
+    sds metakey;
+
+    if (server.leveldb_state == REDIS_LEVELDB_OFF || when == -1) return;
+    metakey = leveldbExpireMetaKey(ldb->dbslot[dbid], when, key->ptr);
+    leveldbBatchDelete(ldb, metakey, sdslen(metakey));
+    leveldbCommit(ldb);
+    sdsfree(metakey);
+}
+
+/* Delete the records of a key that is leaving the key space. The caller
+ * removes the key right after: a big collection is then freed by
+ * leveldbLazyFreeCron(). */
+void leveldbDelKey(int dbid, struct leveldb *ldb, robj *key, robj *val) {
+    if (val == NULL) return;
+    switch(val->type) {
+    case REDIS_STRING: leveldbDelString(dbid, ldb, key, val); break;
+    case REDIS_LIST: leveldbDelList(dbid, ldb, key, val); break;
+    case REDIS_SET: leveldbDelSet(dbid, ldb, key, val); break;
+    case REDIS_ZSET: leveldbDelZset(dbid, ldb, key, val); break;
+    case REDIS_HASH: leveldbDelHash(dbid, ldb, key, val); break;
+    }
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbLazyFree(val);
+}
+
+/* Read the index of every shard in leveldb_load_expires. */
+static int leveldbLoadExpires(struct leveldb *ldb) {
+    sds prefix = leveldbMetaKey(LEVELDB_META_EXPIRE, 0);
+    int j, shard, success = REDIS_OK;
+
+    leveldb_load_mstime = mstime();
+    leveldb_load_expires = zmalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++)
+        leveldb_load_expires[j] = dictCreate(&generationsDictType, NULL);
+
+    for (shard = 0; shard < ldb->numshards && success == REDIS_OK; shard++) {
+        leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->shards[shard].db, ldb->roptions);
+        char *err = NULL;
+
+        for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+            size_t dataLen, valueLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            const char *value = leveldb_iter_value(iterator, &valueLen);
+            size_t hdrlen = 3 + LEVELDB_INT64_LEN;
+            leveldbLoadExpire *e;
+            dictEntry *de;
+            sds name;
+            int dbid;
+
+            if (dataLen < 2 || (unsigned char)data[0] != LEVELDB_META_SLOT ||
+                data[1] != LEVELDB_META_EXPIRE) break;
+            if (dataLen < hdrlen || valueLen != 1) continue;
+            dbid = ldb->slotdb[(unsigned char)data[2]];
+            if (dbid < 0) continue; /* Swept with the slot. */
+
+            name = sdsnewlen(data + hdrlen, dataLen - hdrlen);
+            if ((de = dictFind(leveldb_load_expires[dbid], name)) != NULL) {
+                /* The index is sorted by time: the older entry is stale. */
+                sds metakey;
+
+                e = dictGetVal(de);
+                metakey = leveldbExpireMetaKey((unsigned char)data[2], e->when, name);
+                leveldbBatchDelete(ldb, metakey, sdslen(metakey));
+                sdsfree(metakey);
+                sdsfree(name);
+            } else {
+                e = zmalloc(sizeof(*e));
+                dictAdd(leveldb_load_expires[dbid], name, e);
+            }
+            e->when = leveldbDecodeInt64(data + 3);
+            e->type = value[0];
+        }
+        leveldbFlush(ldb);
+
+        leveldb_iter_get_error(iterator, &err);
+        leveldb_iter_destroy(iterator);
+        if (err != NULL) {
+            redisLog(REDIS_WARNING, "load leveldb expires iterator err: %s", err);
+            leveldb_free(err);
+            success = REDIS_ERR;
+        }
+    }
+    sdsfree(prefix);
+    return success;
+}
+
+/* Called by the loaders for every key. */
+static int leveldbLoadKeyExpired(int dbid, sds name) {
+    dictEntry *de = dictFind(leveldb_load_expires[dbid], name);
+
+    return de && ((leveldbLoadExpire*)dictGetVal(de))->when < leveldb_load_mstime;
+}
+
+/* Once the key space is loaded, restore the expires of the loaded keys and
+ * delete the records of the keys skipped because expired. */
+static void leveldbApplyLoadExpires(struct leveldb *ldb) {
+    leveldbSweepJob **jobs = NULL;
+    int j, numjobs = 0;
+    long long dropped = 0;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dictIterator *di = dictGetIterator(leveldb_load_expires[j]);
+        dictEntry *de;
+
+        while ((de = dictNext(di)) != NULL) {
+            sds name = dictGetKey(de);
+            leveldbLoadExpire *e = dictGetVal(de);
+            robj keyobj;
+            sds key;
+
+            initStaticStringObject(keyobj, name);
+            if (dictFind(server.db[j].dict, name) != NULL) {
+                setExpire(server.db+j, &keyobj, e->when);
+                continue;
+            }
+
+            /* Not loaded: either expired or a stale index entry. */
+            if (e->when < leveldb_load_mstime &&
+                leveldbFreezedKeyType(j, name) == 0)
+            {
+                if (leveldbTypeHasFields(e->type)) {
+                    jobs = zrealloc(jobs, sizeof(leveldbSweepJob*)*(numjobs+1));
+                    jobs[numjobs++] = leveldbRetireKeyJob(j, ldb, e->type, name);
+                } else {
+                    leveldbDelStoredString(ldb, j, name);
+                }
+                dropped++;
+            }
+            key = leveldbExpireMetaKey(ldb->dbslot[j], e->when, name);
+            leveldbBatchDelete(ldb, key, sdslen(key));
+            sdsfree(key);
+            if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
+        }
+        dictReleaseIterator(di);
+    }
+    leveldbStartSweeps(ldb, jobs, numjobs);
+    zfree(jobs);
+    if (dropped)
+        redisLog(REDIS_NOTICE, "load leveldb dropped %lld expired keys", dropped);
+}
+
+static void leveldbFreeLoadExpires(void) {
+    int j;
+
+    if (leveldb_load_expires == NULL) return;
+    for (j = 0; j < server.dbnum; j++) dictRelease(leveldb_load_expires[j]);
+    zfree(leveldb_load_expires);
+    leveldb_load_expires = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * Hotness index
+ *
+ * With leveldb-hotness-period set, leveldbHotnessCron() walks the key space
+ * once per period, a few keys per cron call, and indexes the last access time
+ * of the keys accessed since the previous walk started:
+ *
+ * [0xff]['A'][slot][key] -> [record type][unix time in seconds]
+ *
+ * The time is a varint. The entries of the deleted keys are left in place:
+ * the budgeted startup load drops the ones that no longer match a key, and a
+ * flushed db drops them all with its slot.
+ * -------------------------------------------------------------------------- */
+
+typedef struct leveldbHotnessScan {
+    int dbid;
+    long long visited;
+} leveldbHotnessScan;
+
+static int leveldb_hotness_db = 0;              /* Db being walked. */
+static unsigned long leveldb_hotness_cursor = 0;
+static time_t leveldb_hotness_start = 0;        /* Start of the walk, 0 if idle. */
+static time_t leveldb_hotness_since = 0;        /* Older accesses are indexed. */
+static time_t leveldb_hotness_next = 0;         /* Start of the next walk. */
+
+static sds leveldbAccessMetaKey(int slot, sds name) {
+    return sdscatsds(leveldbMetaKey(LEVELDB_META_ACCESS, slot), name);
+}
+
+/* Called once the key space is loaded: the access time of the loaded keys
+ * is the load time, don't index it. */
+static void leveldbHotnessLoaded(void) {
+    leveldb_hotness_since = time(NULL)+1;
+}
+
+static void leveldbHotnessScanCallback(void *privdata, const dictEntry *de) {
+    leveldbHotnessScan *hs = privdata;
+    robj *o = dictGetVal(de);
+    time_t atime = server.unixtime - estimateObjectIdleTime(o);
+    char type = leveldbObjectType(o);
+    sds key, val;
+
+    hs->visited++;
+    if (atime < leveldb_hotness_since) return;
+    key = leveldbAccessMetaKey(server.ldb.dbslot[hs->dbid], dictGetKey(de));
+    val = leveldbCatVarint(sdsnewlen(&type, 1), atime);
+    leveldbBatchPut(&server.ldb, key, sdslen(key), val, sdslen(val));
+    sdsfree(key);
+    sdsfree(val);
+    server.leveldb_hotness_writes++;
+}
+
+void leveldbHotnessCron(void) {
+    leveldbHotnessScan hs;
+    long long total = 0, count;
+    int j;
+
+    if (server.leveldb_hotness_period == 0 || leveldbLazyLoading()) return;
+    if (leveldb_hotness_start == 0) {
+        if (server.unixtime < leveldb_hotness_next) return;
+        leveldb_hotness_start = server.unixtime;
+    }
+
+    /* Spread the walk over the period. */
+    for (j = 0; j < server.dbnum; j++) total += dictSize(server.db[j].dict);
+    count = total/(server.leveldb_hotness_period*server.hz) + 1;
+
+    hs.visited = 0;
+    while (hs.visited < count) {
+        dict *d = server.db[leveldb_hotness_db].dict;
+
+        hs.dbid = leveldb_hotness_db;
+        leveldb_hotness_cursor = dictSize(d) ?
+            dictScan(d, leveldb_hotness_cursor, leveldbHotnessScanCallback, &hs) : 0;
+        if (leveldb_hotness_cursor != 0) continue;
+        if (++leveldb_hotness_db < server.dbnum) continue;
+
+        leveldb_hotness_db = 0;
+        leveldb_hotness_since = leveldb_hotness_start;
+        leveldb_hotness_next = leveldb_hotness_start + server.leveldb_hotness_period;
+        leveldb_hotness_start = 0;
+        break;
+    }
+    leveldbCommit(&server.ldb);
+}
+
+/* -----------------------------------------------------------------------------
+ * Object loader
+ *
+ * The records of a key are consecutive in LevelDB, so instead of replaying
+ * one command per record the loader collects all the records of a key and
+ * builds its final encoding at once: ziplists are appended in order, dicts
+ * are created with their final size and sorted sets are sorted only once.
+ *
+ * The builder only allocates private objects (no shared integers) and does
+ * not touch the key space, so it is safe to run outside the main thread.
+ * -------------------------------------------------------------------------- */
+
+/* Split a data record key, mapping its slot with 'slotdb'. */
+static int leveldbParseRecordKeySlots(const char *data, size_t len, leveldbRecordKey *rk, const int *slotdb) {
+    const unsigned char *p = (const unsigned char*)data + LEVELDB_KEY_FLAG_SET_KEY_LEN;
+    const unsigned char *end = (const unsigned char*)data + len;
+    uint64_t keylen;
+
+    rk->slot = len ? (unsigned char)data[LEVELDB_KEY_FLAG_DATABASE_ID] : 0;
+    rk->dbid = slotdb[rk->slot];
+    if (len <= LEVELDB_KEY_FLAG_SET_KEY_LEN || !isupper(data[LEVELDB_KEY_FLAG_TYPE]))
+        return REDIS_ERR;
+    rk->type = tolower(data[LEVELDB_KEY_FLAG_TYPE]);
+    if (leveldbDecodeVarint(&p, end, &keylen) == REDIS_ERR ||
+        keylen > (size_t)(end - p)) return REDIS_ERR;
+    rk->key = (const char*)p;
+    rk->keylen = keylen;
+    p += keylen;
+
+    rk->field = NULL;
+    rk->fieldlen = 0;
+    rk->gen = 0;
+    if (leveldbTypeHasFields(rk->type)) {
+        if (leveldbDecodeVarint(&p, end, &rk->gen) == REDIS_ERR) return REDIS_ERR;
+        rk->field = (const char*)p;
+        rk->fieldlen = end - p;
+    } else if (rk->type == 'c' && p != end) {
+        rk->field = (const char*)p; /* A page of the string. */
+        rk->fieldlen = end - p;
+    } else if (p != end) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Split a data record key, see the record encoding above. The type is
+ * returned in lower case. */
+int leveldbParseRecordKey(const char *data, size_t len, leveldbRecordKey *rk) {
+    return leveldbParseRecordKeySlots(data, len, rk, server.ldb.slotdb);
+}
+
+/* Like createStringObject() but integers are encoded without using the
+ * shared objects, that are not thread safe. */
+static robj *leveldbCreateStringObject(const char *s, size_t len) {
+    long value;
+    robj *o;
+
+    if (len <= 21 && string2l(s,len,&value)) {
+        o = createObject(REDIS_STRING,NULL);
+        o->encoding = REDIS_ENCODING_INT;
+        o->ptr = (void*)value;
+        return o;
+    }
+    return createStringObject((char*)s,len);
+}
+
+void leveldbLoaderInit(leveldbKeyLoader *l) {
+    l->dbid = -1;
+    l->type = 0;
+    l->key = sdsempty();
+    l->gen = 0;
+    l->entries = NULL;
+    l->count = 0;
+    l->size = 0;
+    l->corrupted = 0;
+    l->pagedlen = 0;
+}
+
+/* Drop the collected records, keeping the allocated entries. */
+void leveldbLoaderReset(leveldbKeyLoader *l) {
+    long j;
+
+    for (j = 0; j < l->count; j++) {
+        sdsfree(l->entries[j].field);
+        sdsfree(l->entries[j].value);
+    }
+    l->count = 0;
+    l->type = 0;
+    l->dbid = -1;
+    l->corrupted = 0;
+    l->pagedlen = 0;
+    sdsclear(l->key);
+}
+
+void leveldbLoaderFree(leveldbKeyLoader *l) {
+    leveldbLoaderReset(l);
+    zfree(l->entries);
+    sdsfree(l->key);
+}
+
+/* Return 1 if the record belongs to the key being collected. */
+int leveldbLoaderIsKey(leveldbKeyLoader *l, leveldbRecordKey *rk) {
+    return l->type == rk->type && l->dbid == rk->dbid &&
+           sdslen(l->key) == rk->keylen &&
+           memcmp(l->key, rk->key, rk->keylen) == 0;
+}
+
+void leveldbLoaderStart(leveldbKeyLoader *l, leveldbRecordKey *rk) {
+    leveldbLoaderReset(l);
+    l->dbid = rk->dbid;
+    l->type = rk->type;
+    l->key = sdscpylen(l->key, rk->key, rk->keylen);
+    l->gen = leveldbTypeHasFields(rk->type) ? leveldbKeyGeneration(rk->dbid, l->key) : 0;
+}
+
+void leveldbLoaderAdd(leveldbKeyLoader *l, leveldbRecordKey *rk, const char *value, size_t valuelen) {
+    leveldbLoaderEntry *e;
+
+    if (rk->gen != l->gen) return; /* Old generation not swept yet. */
+    if (l->count == l->size) {
+        l->size = l->size ? l->size*2 : 16;
+        l->entries = zrealloc(l->entries, sizeof(leveldbLoaderEntry)*l->size);
+    }
+    e = l->entries + l->count++;
+    e->field = rk->field ? sdsnewlen(rk->field, rk->fieldlen) : NULL;
+    e->value = NULL;
+    e->score = 0;
+    if (l->type == 'l' && rk->fieldlen != LEVELDB_INT64_LEN) l->corrupted = 1;
+    if (l->type == 'c' && rk->field) {
+        if (rk->fieldlen != LEVELDB_INT64_LEN) l->corrupted = 1;
+        e->value = sdsnewlen(value, valuelen);
+    } else if (l->type == 'c' && valuelen && value[0] == LEVELDB_VALUE_PAGED) {
+        if (leveldbDecodePagedValue(value, valuelen, &l->pagedlen) == REDIS_ERR)
+            l->corrupted = 1;
+        e->value = sdsempty();
+    } else if (l->type == 'c' || l->type == 'h' || l->type == 'l') {
+        if (leveldbDecodeValue(value, valuelen, &e->value) == REDIS_ERR) {
+            e->value = sdsempty();
+            l->corrupted = 1;
+        }
+    } else if (l->type == 'z') {
+        if (valuelen != LEVELDB_SCORE_LEN) {
+            l->corrupted = 1;
+            return;
+        }
+        e->score = leveldbDecodeScore(value);
+        if (isnan(e->score)) l->corrupted = 1;
+    }
+}
+
+static int leveldbCompareZsetEntries(const void *a, const void *b) {
+    const leveldbLoaderEntry *ea = a, *eb = b;
+    size_t la, lb;
+    int cmp;
+
+    if (ea->score < eb->score) return -1;
+    if (ea->score > eb->score) return 1;
+    la = sdslen(ea->field);
+    lb = sdslen(eb->field);
+    cmp = memcmp(ea->field, eb->field, la < lb ? la : lb);
+    if (cmp == 0) return la < lb ? -1 : (la > lb);
+    return cmp;
+}
+
+static robj *leveldbBuildHash(leveldbKeyLoader *l) {
+    robj *o;
+    long j;
+    int ziplist = l->count <= (long)server.hash_max_ziplist_entries;
+
+    for (j = 0; ziplist && j < l->count; j++) {
+        if (sdslen(l->entries[j].field) > server.hash_max_ziplist_value ||
+            sdslen(l->entries[j].value) > server.hash_max_ziplist_value)
+            ziplist = 0;
+    }
+
+    if (ziplist) {
+        unsigned char *zl = ziplistNew();
+
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+
+            zl = ziplistPush(zl, (unsigned char*)e->field, sdslen(e->field), ZIPLIST_TAIL);
+            zl = ziplistPush(zl, (unsigned char*)e->value, sdslen(e->value), ZIPLIST_TAIL);
+        }
+        o = createObject(REDIS_HASH, zl);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+    } else {
+        dict *d = dictCreate(&hashDictType, NULL);
+
+        dictExpand(d, l->count);
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+
+            dictAdd(d, leveldbCreateStringObject(e->field, sdslen(e->field)),
+                       leveldbCreateStringObject(e->value, sdslen(e->value)));
+        }
+        o = createObject(REDIS_HASH, d);
+        o->encoding = REDIS_ENCODING_HT;
+    }
+    return o;
+}
+
+static int leveldbCompareLongLong(const void *a, const void *b) {
+    long long la = *(const long long*)a, lb = *(const long long*)b;
+
+    return la < lb ? -1 : (la > lb);
+}
+
+static robj *leveldbBuildSet(leveldbKeyLoader *l) {
+    robj *o;
+    long j;
+    long long *ints = NULL;
+
+    if (l->count <= (long)server.set_max_intset_entries) {
+        ints = zmalloc(sizeof(long long)*(l->count ? l->count : 1));
+        for (j = 0; j < l->count; j++) {
+            if (!string2ll(l->entries[j].field, sdslen(l->entries[j].field), ints+j)) {
+                zfree(ints);
+                ints = NULL;
+                break;
+            }
+        }
+    }
+
+    if (ints) {
+        intset *is = intsetNew();
+
+        /* Adding in ascending order always appends at the tail. */
+        qsort(ints, l->count, sizeof(long long), leveldbCompareLongLong);
+        for (j = 0; j < l->count; j++) is = intsetAdd(is, ints[j], NULL);
+        zfree(ints);
+        o = createObject(REDIS_SET, is);
+        o->encoding = REDIS_ENCODING_INTSET;
+    } else {
+        dict *d = dictCreate(&setDictType, NULL);
+
+        dictExpand(d, l->count);
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+
+            dictAdd(d, leveldbCreateStringObject(e->field, sdslen(e->field)), NULL);
+        }
+        o = createObject(REDIS_SET, d);
+        o->encoding = REDIS_ENCODING_HT;
+    }
+    return o;
+}
+
+static robj *leveldbBuildZset(leveldbKeyLoader *l) {
+    robj *o;
+    long j;
+    int ziplist = l->count <= (long)server.zset_max_ziplist_entries;
+    char buf[128];
+
+    for (j = 0; ziplist && j < l->count; j++) {
+        if (sdslen(l->entries[j].field) > server.zset_max_ziplist_value)
+            ziplist = 0;
+    }
+
+    if (ziplist) {
+        unsigned char *zl = ziplistNew();
+
+        qsort(l->entries, l->count, sizeof(leveldbLoaderEntry), leveldbCompareZsetEntries);
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+            int scorelen = d2string(buf, sizeof(buf), e->score);
+
+            zl = ziplistPush(zl, (unsigned char*)e->field, sdslen(e->field), ZIPLIST_TAIL);
+            zl = ziplistPush(zl, (unsigned char*)buf, scorelen, ZIPLIST_TAIL);
+        }
+        o = createObject(REDIS_ZSET, zl);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+    } else {
+        zset *zs = zmalloc(sizeof(*zs));
+
+        zs->dict = dictCreate(&zsetDictType, NULL);
+        zs->zsl = zslCreate();
+        dictExpand(zs->dict, l->count);
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+            robj *ele = leveldbCreateStringObject(e->field, sdslen(e->field));
+            zskiplistNode *node = zslInsert(zs->zsl, e->score, ele);
+
+            dictAdd(zs->dict, ele, &node->score);
+            incrRefCount(ele); /* Added to dictionary. */
+        }
+        o = createObject(REDIS_ZSET, zs);
+        o->encoding = REDIS_ENCODING_SKIPLIST;
+    }
+    return o;
+}
+
+/* The records are in sequence order, that is the order of the list. */
+static robj *leveldbBuildList(leveldbKeyLoader *l) {
+    robj *o;
+    long j;
+    int ziplist = l->count <= (long)server.list_max_ziplist_entries;
+
+    for (j = 0; ziplist && j < l->count; j++) {
+        if (sdslen(l->entries[j].value) > server.list_max_ziplist_value)
+            ziplist = 0;
+    }
+
+    if (ziplist) {
+        unsigned char *zl = ziplistNew();
+
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+
+            zl = ziplistPush(zl, (unsigned char*)e->value, sdslen(e->value), ZIPLIST_TAIL);
+        }
+        o = createObject(REDIS_LIST, zl);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+    } else {
+        o = createListObject();
+        for (j = 0; j < l->count; j++) {
+            leveldbLoaderEntry *e = l->entries + j;
+
+            listAddNodeTail(o->ptr, leveldbCreateStringObject(e->value, sdslen(e->value)));
+        }
+    }
+    return o;
+}
+
+/* A string stored in pages: the paged record comes first, then the pages in
+ * order. */
+static robj *leveldbBuildPagedString(leveldbKeyLoader *l) {
+    size_t len = l->pagedlen, pages = leveldbStringPages(len), j;
+    sds s;
+
+    if (pages == 0 || l->entries[0].field != NULL || (size_t)l->count != pages+1)
+        return NULL;
+    s = sdsnewlen(NULL, len);
+    for (j = 0; j < pages; j++) {
+        leveldbLoaderEntry *e = l->entries+j+1;
+        size_t start = j*LEVELDB_STRING_PAGE_SIZE;
+        size_t count = len-start < LEVELDB_STRING_PAGE_SIZE ? len-start : LEVELDB_STRING_PAGE_SIZE;
+
+        if (leveldbDecodeInt64(e->field) != (long long)j || sdslen(e->value) != count) {
+            sdsfree(s);
+            return NULL;
+        }
+        memcpy(s+start, e->value, count);
+    }
+    return createObject(REDIS_STRING, s);
+}
+
+/* Sequence of the first element of a collected list. */
+static long long leveldbLoaderListHead(leveldbKeyLoader *l) {
+    return l->type == 'l' && l->count ? leveldbDecodeInt64(l->entries[0].field) : 0;
+}
+
+/* Build the object of the collected key. Returns NULL if the records are
+ * corrupted. The collected records are left in place. */
+robj *leveldbLoaderBuild(leveldbKeyLoader *l) {
+    if (l->corrupted) return NULL;
+    switch(l->type) {
+    case 'c':
+        if (l->pagedlen) return leveldbBuildPagedString(l);
+        if (l->count != 1) return NULL;
+        return leveldbCreateStringObject(l->entries[0].value, sdslen(l->entries[0].value));
+    case 'h': return leveldbBuildHash(l);
+    case 's': return leveldbBuildSet(l);
+    case 'z': return leveldbBuildZset(l);
+    case 'l': return leveldbBuildList(l);
+    default: return NULL;
+    }
+}
+
+/* Build the collected key and add it to its db. Keys that are already in the
+ * key space (stale records of a key that changed type) are skipped. */
+static int leveldbLoaderInsert(leveldbKeyLoader *l) {
+    robj keyobj, *val;
+
+    if (l->type == 0 || l->count == 0) return REDIS_OK;
+    val = leveldbLoaderBuild(l);
+    if (val == NULL) {
+        redisLog(REDIS_WARNING, "load leveldb corrupted records of key: %s type: %c", l->key, l->type);
+        return REDIS_ERR;
+    }
+
+    initStaticStringObject(keyobj, l->key);
+    if (dictFind(server.db[l->dbid].dict, l->key) != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb skip duplicated key: %s type: %c", l->key, l->type);
+        decrRefCount(val);
+        return REDIS_OK;
+    }
+    dbAdd(server.db+l->dbid, &keyobj, val);
+    if (l->type == 'l') leveldbSetListHead(l->dbid, l->key, leveldbLoaderListHead(l));
+    return REDIS_OK;
+}
+
+/* Collect in 'l' the records of type 'keytype' of the key 'name'. */
+static int leveldbReadKeyRecords(struct leveldb *ldb, int dbid, sds name, char keytype, leveldbKeyLoader *l) {
+    sds prefix = leveldbKeyPrefix(dbid, keytype, name);
+    leveldb_iterator_t *iterator = leveldb_create_iterator(leveldbKeyDb(ldb, name), ldb->roptions);
+    size_t keylen = sdslen(name);
+    leveldbRecordKey rk;
+    char *err = NULL;
+
+    for (leveldb_iter_seek(iterator, prefix, sdslen(prefix)); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value;
+
+        if (leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR) break;
+        if (rk.dbid != dbid || rk.type != keytype) break;
+        if (rk.keylen != keylen || memcmp(name, rk.key, keylen) != 0) break;
+
+        if (l->type == 0) leveldbLoaderStart(l, &rk);
+        value = leveldb_iter_value(iterator, &valueLen);
+        leveldbLoaderAdd(l, &rk, value, valueLen);
+    }
+    sdsfree(prefix);
+
+    leveldb_iter_get_error(iterator, &err);
+    leveldb_iter_destroy(iterator);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "read leveldb key:%s iterator err: %s", name, err);
+        leveldb_free(err);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+int meltKey(int dbid, struct leveldb *ldb, robj *key, char keytype) {
+    int success = 1;
+    sds leveldbkey;
+    leveldbKeyLoader loader;
+    
+    leveldbCancelMelts(dbid, key);
+    /* The records of the key are read back below: inside a batch they are
+     * staged only if the batch froze keys. */
+    if (ldb->batchfreezed & LEVELDB_BATCH_FREEZE) leveldbFlush(ldb);
+    leveldbDrain(ldb);
+    leveldbkey = createleveldbFreezedKeyHead(dbid, key->ptr);
+    leveldbBatchDelete(ldb, leveldbkey, sdslen(leveldbkey));
+    ldb->batchfreezed |= LEVELDB_BATCH_MELT;
+    leveldbCommit(ldb);
+    sdsfree(leveldbkey);
+    
+    delFreezedKey(dbid, key->ptr);
+
+    leveldbLoaderInit(&loader);
+    if (leveldbReadKeyRecords(ldb, dbid, key->ptr, keytype, &loader) == REDIS_ERR)
+        success = 0;
+
+    if(success == 1 && leveldbLoaderInsert(&loader) == REDIS_OK) {
+        server.dirty += loader.count;
+    } else {
+        success = 0;
+    }
+    leveldbLoaderFree(&loader);
+    if(success == 1) {
+        return REDIS_OK;
+    }
+    return REDIS_ERR;
+}
+
+/* Delete a frozen key without reading it back, for the commands that replace
+ * or delete it: its F record and its records are deleted in one write. */
+static void leveldbDropFreezedKey(int dbid, struct leveldb *ldb, robj *key, char keytype) {
+    sds leveldbkey = createleveldbFreezedKeyHead(dbid, key->ptr);
+    leveldbSweepJob *job;
+
+    leveldbCancelMelts(dbid, key);
+    /* The pages of a string are found reading its stored record. */
+    if (!leveldbTypeHasFields(keytype)) {
+        if (ldb->batchfreezed & LEVELDB_BATCH_FREEZE) leveldbFlush(ldb);
+        leveldbDrain(ldb);
+    }
+    leveldbBeginBatch(ldb);
+    leveldbBatchDelete(ldb, leveldbkey, sdslen(leveldbkey));
+    ldb->batchfreezed |= LEVELDB_BATCH_MELT;
+    sdsfree(leveldbkey);
+    if (leveldbTypeHasFields(keytype)) {
+        if (keytype == 'l') leveldbSetListHead(dbid, key->ptr, 0);
+        job = leveldbRetireKeyJob(dbid, ldb, keytype, key->ptr);
+        leveldbStartSweeps(ldb, &job, 1);
+    } else {
+        leveldbDelStoredString(ldb, dbid, key->ptr);
+    }
+    leveldbEndBatch(ldb);
+    delFreezedKey(dbid, key->ptr);
+}
+
+/* -----------------------------------------------------------------------------
+ * Parallel startup load
+ *
+ * The key space is split in leveldb_load_threads ranges of about the same
+ * size on disk, at least one per shard. Every loader thread walks its own
+ * range and builds the objects, passing them to the main thread in batches:
+ * the main thread only adds the finished objects to the key space.
+ *
+ * Ranges are cut at prefixes of at most LEVELDB_LOAD_SPLIT_DEPTH bytes, that
+ * never go past [slot][type][keylen][key][generation], so the records of a
+ * key always belong to the same range.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_LOAD_BATCH_KEYS 1024
+#define LEVELDB_LOAD_MAX_QUEUED 16  /* Queued batches per loader thread. */
+#define LEVELDB_LOAD_SPLIT_DEPTH 4
+
+typedef struct leveldbLoadBatch {
+    long count;
+    long long records;
+    int dbid[LEVELDB_LOAD_BATCH_KEYS];
+    sds key[LEVELDB_LOAD_BATCH_KEYS];
+    robj *val[LEVELDB_LOAD_BATCH_KEYS];
+    long long listhead[LEVELDB_LOAD_BATCH_KEYS];
+} leveldbLoadBatch;
+
+typedef struct leveldbLoadRange {
+    leveldb_t *db;              /* Shard of the range. */
+    sds start;                  /* NULL to start from the first record. */
+    sds limit;                  /* NULL to read up to the last record. */
+    int threaded;               /* Pass batches to the main thread. */
+    int err;
+    long long records;
+    long long keys;
+    leveldbLoadBatch *batch;
+} leveldbLoadRange;
+
+static pthread_mutex_t leveldb_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t leveldb_load_cond = PTHREAD_COND_INITIALIZER;
+static list *leveldb_load_queue;    /* Batches ready to be inserted. */
+static int leveldb_load_running;    /* Loader threads still running. */
+static int leveldb_load_abort;      /* Set on error to stop the loaders. */
+
+static void leveldbLoadInsertBatch(leveldbLoadBatch *b) {
+    long j;
+
+    for (j = 0; j < b->count; j++) {
+        robj keyobj;
+
+        initStaticStringObject(keyobj, b->key[j]);
+        if (dictFind(server.db[b->dbid[j]].dict, b->key[j]) != NULL) {
+            redisLog(REDIS_WARNING, "load leveldb skip duplicated key: %s", b->key[j]);
+            decrRefCount(b->val[j]);
+        } else {
+            dbAdd(server.db+b->dbid[j], &keyobj, b->val[j]);
+            if (b->val[j]->type == REDIS_LIST)
+                leveldbSetListHead(b->dbid[j], b->key[j], b->listhead[j]);
+        }
+        sdsfree(b->key[j]);
+    }
+    b->count = 0;
+    b->records = 0;
+}
+
+/* Hand the current batch to the main thread, waiting if too many batches
+ * are queued already. Inline loads just insert it. */
+static void leveldbLoadEmitBatch(leveldbLoadRange *r) {
+    if (!r->threaded) {
+        leveldbLoadInsertBatch(r->batch);
+        return;
+    }
+    pthread_mutex_lock(&leveldb_load_mutex);
+    while (listLength(leveldb_load_queue) >=
+           (unsigned long)LEVELDB_LOAD_MAX_QUEUED*leveldb_load_running &&
+           !leveldb_load_abort)
+        pthread_cond_wait(&leveldb_load_cond, &leveldb_load_mutex);
+    listAddNodeTail(leveldb_load_queue, r->batch);
+    pthread_cond_broadcast(&leveldb_load_cond);
+    pthread_mutex_unlock(&leveldb_load_mutex);
+    r->batch = zcalloc(sizeof(leveldbLoadBatch));
+}
+
+static int leveldbLoadEmitKey(leveldbLoadRange *r, leveldbKeyLoader *l) {
+    leveldbLoadBatch *b = r->batch;
+    robj *val;
+
+    if (l->type == 0 || l->count == 0) return REDIS_OK;
+    val = leveldbLoaderBuild(l);
+    if (val == NULL) {
+        redisLog(REDIS_WARNING, "load leveldb corrupted records of key: %s type: %c", l->key, l->type);
+        return REDIS_ERR;
+    }
+    b->dbid[b->count] = l->dbid;
+    b->key[b->count] = sdsdup(l->key);
+    b->val[b->count] = val;
+    b->listhead[b->count] = leveldbLoaderListHead(l);
+    b->records += l->count;
+    if (++b->count == LEVELDB_LOAD_BATCH_KEYS) leveldbLoadEmitBatch(r);
+    return REDIS_OK;
+}
+
+/* Load the records in [r->start, r->limit). The frozen keys are skipped,
+ * they are loaded on demand by MELT, and so are the expired keys. */
+static void leveldbLoadRangeRecords(leveldbLoadRange *r) {
+    int skip = 0;
+    char *data, *value;
+    size_t dataLen, valueLen;
+    char *err = NULL;
+    leveldbRecordKey rk;
+    leveldbKeyLoader loader;
+    leveldb_readoptions_t *roptions = leveldb_readoptions_create();
+    leveldb_iterator_t *iterator;
+
+    /* A full scan would only evict the useful blocks from the cache. */
+    leveldb_readoptions_set_fill_cache(roptions, 0);
+    iterator = leveldb_create_iterator(r->db, roptions);
+    leveldbLoaderInit(&loader);
+    if (r->start)
+        leveldb_iter_seek(iterator, r->start, sdslen(r->start));
+    else
+        leveldb_iter_seek_to_first(iterator);
+
+    for (; leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        data = (char*) leveldb_iter_key(iterator, &dataLen);
+        if (r->limit && leveldbCompareKeys(data, dataLen, r->limit, sdslen(r->limit)) >= 0) break;
+        if (r->threaded && !(r->records % 65536) && leveldb_load_abort) break;
+        if (!r->threaded && !(r->records % 1000000)) {
+            processEventsWhileBlocked();
+            redisLog(REDIS_NOTICE, "load leveldb: %lld records, %lld keys", r->records, r->keys);
+        }
+        if (leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR &&
+            rk.dbid >= 0)
+        {
+            redisLog(REDIS_WARNING, "load leveldb bad record key, len: %zu", dataLen);
+            r->err = 1;
+            break;
+        }
+        if (rk.dbid == LEVELDB_SLOT_SWEEPING) {
+            /* Skip the whole flushed slot: seek past it and step back, so
+             * that the loop moves to the first record of the next slot. */
+            char next = rk.slot + 1;
+
+            leveldb_iter_seek(iterator, &next, 1);
+            if (!leveldb_iter_valid(iterator)) break;
+            leveldb_iter_prev(iterator);
+            continue;
+        }
+        if (rk.slot == LEVELDB_META_SLOT) break;
+        if (rk.dbid < 0) {
+            redisLog(REDIS_WARNING, "load leveldb select db error: %d", rk.slot);
+            r->err = 1;
+            break;
+        }
+        r->records++;
+        if (rk.type == 'f') continue;
+
+        if (!leveldbLoaderIsKey(&loader, &rk)) {
+            if (!skip && leveldbLoadEmitKey(r, &loader) == REDIS_ERR) {
+                r->err = 1;
+                break;
+            }
+            leveldbLoaderStart(&loader, &rk);
+            skip = leveldbFreezedKeyType(rk.dbid, loader.key) ||
+                   leveldbLoadKeyExpired(rk.dbid, loader.key);
+            if (!skip) r->keys++;
+        }
+        if (skip) continue;
+
+        value = (char*) leveldb_iter_value(iterator, &valueLen);
+        leveldbLoaderAdd(&loader, &rk, value, valueLen);
+    }
+    if (!r->err && !skip && leveldbLoadEmitKey(r, &loader) == REDIS_ERR) r->err = 1;
+    if (!r->err && r->batch->count) leveldbLoadEmitBatch(r);
+
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb iterator err: %s", err);
+        leveldb_free(err);
+        r->err = 1;
+    }
+    leveldbLoaderFree(&loader);
+    leveldb_iter_destroy(iterator);
+    leveldb_readoptions_destroy(roptions);
+}
+
+static void *leveldbLoadThread(void *arg) {
+    leveldbLoadRange *r = arg;
+
+    leveldbLoadRangeRecords(r);
+    pthread_mutex_lock(&leveldb_load_mutex);
+    if (r->err) leveldb_load_abort = 1;
+    leveldb_load_running--;
+    pthread_cond_broadcast(&leveldb_load_cond);
+    pthread_mutex_unlock(&leveldb_load_mutex);
+    return NULL;
+}
+
+/* LevelDB default comparator order. */
+int leveldbCompareKeys(const char *a, size_t alen, const char *b, size_t blen) {
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (cmp == 0) return alen < blen ? -1 : (alen > blen);
+    return cmp;
+}
+
+/* Smallest key greater than every key starting with 'prefix', or NULL if
+ * the prefix is all 0xff bytes. */
+static sds leveldbPrefixEnd(sds prefix) {
+    sds end = sdsdup(prefix);
+    int j;
+
+    for (j = sdslen(end)-1; j >= 0; j--) {
+        if ((unsigned char)end[j] != 0xff) {
+            end[j]++;
+            sdsrange(end, 0, j);
+            return end;
+        }
+    }
+    sdsfree(end);
+    return NULL;
+}
+
+static uint64_t leveldbApproximateSize(leveldb_t *db, sds start, sds limit) {
+    static const char maxkey[] = "\xff\xff\xff\xff\xff\xff\xff\xff";
+    const char *starts[1] = { start };
+    const char *limits[1] = { limit ? limit : maxkey };
+    size_t startlens[1] = { sdslen(start) };
+    size_t limitlens[1] = { limit ? sdslen(limit) : sizeof(maxkey)-1 };
+    uint64_t size;
+
+    leveldb_approximate_sizes(db, 1, starts, startlens, limits, limitlens, &size);
+    return size;
+}
+
+/* Add to 'cuts' the prefixes that split the keys under 'prefix' in pieces
+ * of about 'target' bytes, 'acc' is the size accumulated since the last
+ * cut. Only the prefixes bigger than the target are refined, so the number
+ * of size estimations is proportional to the number of threads. */
+static void leveldbLoadSplitPrefix(leveldb_t *db, sds prefix, uint64_t size,
+                                   uint64_t target, uint64_t *acc, list *cuts,
+                                   unsigned long maxcuts)
+{
+    int j;
+
+    if (size <= target || sdslen(prefix) >= LEVELDB_LOAD_SPLIT_DEPTH) {
+        if (*acc >= target && listLength(cuts) < maxcuts) {
+            listAddNodeTail(cuts, sdsdup(prefix));
+            *acc = 0;
+        }
+        *acc += size;
+        return;
+    }
+
+    for (j = 0; j < 256; j++) {
+        char c = j;
+        sds child = sdscatlen(sdsdup(prefix), &c, 1);
+        sds end = leveldbPrefixEnd(child);
+
+        leveldbLoadSplitPrefix(db, child, leveldbApproximateSize(db, child, end),
+                               target, acc, cuts, maxcuts);
+        sdsfree(child);
+        sdsfree(end);
+    }
+}
+
+/* Split the key space of a shard in at most 'parts' ranges. Returns the
+ * number of ranges: range j starts at cuts[j-1] (the first one at the first
+ * record) and ends before cuts[j] (the last one at the last record). */
+static int leveldbLoadSplit(struct leveldb *ldb, leveldb_t *db, int parts, sds **cuts) {
+    sds sizes_prefix[LEVELDB_MAX_SLOTS];
+    uint64_t sizes[LEVELDB_MAX_SLOTS];
+    uint64_t total = 0, acc = 0;
+    list *l = listCreate();
+    listIter li;
+    listNode *ln;
+    int j, count = 0;
+
+    /* Slots in key order, the flushed ones are skipped by the loaders. */
+    for (j = 0; j < LEVELDB_MAX_SLOTS; j++) {
+        char c = j;
+        sds end;
+
+        sizes_prefix[j] = sdsnewlen(&c, 1);
+        sizes[j] = 0;
+        if (ldb->slotdb[j] < 0) continue;
+        end = leveldbPrefixEnd(sizes_prefix[j]);
+        sizes[j] = leveldbApproximateSize(db, sizes_prefix[j], end);
+        total += sizes[j];
+        sdsfree(end);
+    }
+
+    /* Data still in the memtable is not accounted: in this case the db is
+     * small enough for a single loader. */
+    if (parts > 1 && total > 0) {
+        for (j = 0; j < LEVELDB_MAX_SLOTS; j++) {
+            if (ldb->slotdb[j] < 0) continue;
+            leveldbLoadSplitPrefix(db, sizes_prefix[j], sizes[j], total/parts, &acc, l, parts-1);
+        }
+    }
+    for (j = 0; j < LEVELDB_MAX_SLOTS; j++) sdsfree(sizes_prefix[j]);
+
+    /* The first prefix is always reached before any cut. */
+    *cuts = zmalloc(sizeof(sds)*(listLength(l)+1));
+    listRewind(l, &li);
+    while ((ln = listNext(&li)) != NULL) (*cuts)[count++] = listNodeValue(ln);
+    listRelease(l);
+    return count+1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Snapshot resync
+ *
+ * With leveldb-repl-snapshot enabled a full resynchronization doesn't fork a
+ * BGSAVE child. The main thread drains the pending writes and pins a LevelDB
+ * snapshot, then the REDIS_BIO_LEVELDB_SNAPSHOT thread reads the snapshot and
+ * writes a regular RDB file to rdb_filename, sent to the slaves as usual.
+ * The writes performed meanwhile accumulate in the output buffers of the
+ * slaves exactly as they do while a child is saving.
+ *
+ * The thread only sees the snapshot: the slots of the dbs are copied when it
+ * is taken, the generations and the expires are read from the metadata
+ * records of the snapshot. Frozen keys are saved too, as their records are
+ * in LevelDB like the others.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_SNAPSHOT_STOP_CHECK 65536  /* Records between stop checks. */
+
+typedef struct leveldbSnapshotJob {
+    const leveldb_snapshot_t *snapshots[REDIS_MAX_LEVELDB_SHARDS];
+    leveldb_readoptions_t *roptions[REDIS_MAX_LEVELDB_SHARDS];
+    int numshards;
+    int slotdb[256];            /* Slot map when the snapshot was taken. */
+    dict *gens;                 /* [slot][key] -> generation */
+    dict *expires;              /* [slot][key] -> unix time in ms */
+    sds filename;
+    long long now;
+    long long start;
+    long long keys;
+    long long records;
+    int err;
+} leveldbSnapshotJob;
+
+static pthread_mutex_t leveldb_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static leveldbSnapshotJob *leveldb_snapshot_job = NULL; /* Save in progress. */
+static leveldbSnapshotJob *leveldb_snapshot_done = NULL; /* Set by the thread. */
+static volatile int leveldb_snapshot_stop = 0;
+
+static void leveldbFreeSnapshotJob(leveldbSnapshotJob *job) {
+    int shard;
+
+    for (shard = 0; shard < job->numshards; shard++) {
+        leveldb_readoptions_destroy(job->roptions[shard]);
+        leveldb_release_snapshot(server.ldb.shards[shard].db, job->snapshots[shard]);
+    }
+    if (job->gens) dictRelease(job->gens);
+    if (job->expires) dictRelease(job->expires);
+    sdsfree(job->filename);
+    zfree(job);
+}
+
+/* Slot and name of a key, as the generations and expires are indexed. */
+static sds leveldbSnapshotIndexKey(int slot, const char *name, size_t len) {
+    char c = slot;
+    sds key = sdsnewlen(&c, 1);
+
+    return sdscatlen(key, name, len);
+}
+
+/* Read the generations and the expires of a shard of the snapshot. */
+static int leveldbSnapshotLoadShardMeta(leveldbSnapshotJob *job, int shard) {
+    leveldb_iterator_t *iterator = leveldb_create_iterator(server.ldb.shards[shard].db, job->roptions[shard]);
+    sds prefix = leveldbMetaKey(LEVELDB_META_EXPIRE, 0);
+    char *err = NULL;
+
+    for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value = leveldb_iter_value(iterator, &valueLen);
+        const unsigned char *p = (const unsigned char*)data + 3;
+        const unsigned char *end = (const unsigned char*)data + dataLen;
+        const unsigned char *vp = (const unsigned char*)value;
+        uint64_t keylen, *gen;
+        long long *when;
+        dictEntry *de;
+        sds name;
+
+        if (dataLen < 3 || (unsigned char)data[0] != LEVELDB_META_SLOT) break;
+        if (data[1] != LEVELDB_META_EXPIRE && data[1] != LEVELDB_META_KEYGEN) break;
+        if (job->slotdb[(unsigned char)data[2]] < 0) continue;
+
+        if (data[1] == LEVELDB_META_EXPIRE) {
+            size_t hdrlen = 3 + LEVELDB_INT64_LEN;
+
+            if (dataLen < hdrlen) continue;
+            name = leveldbSnapshotIndexKey((unsigned char)data[2], data + hdrlen, dataLen - hdrlen);
+            if ((de = dictFind(job->expires, name)) != NULL) {
+                /* The index is sorted by time: keep the last entry. */
+                when = dictGetVal(de);
+                sdsfree(name);
+            } else {
+                when = zmalloc(sizeof(*when));
+                dictAdd(job->expires, name, when);
+            }
+            *when = leveldbDecodeInt64(data + 3);
+        } else {
+            if (leveldbDecodeVarint(&p, end, &keylen) == REDIS_ERR ||
+                keylen != (size_t)(end - p)) continue;
+            gen = zmalloc(sizeof(*gen));
+            if (leveldbDecodeVarint(&vp, vp + valueLen, gen) == REDIS_ERR) {
+                zfree(gen);
+                continue;
+            }
+            name = leveldbSnapshotIndexKey((unsigned char)data[2], (const char*)p, keylen);
+            if (dictAdd(job->gens, name, gen) != DICT_OK) {
+                sdsfree(name);
+                zfree(gen);
+            }
+        }
+    }
+    leveldb_iter_get_error(iterator, &err);
+    leveldb_iter_destroy(iterator);
+    sdsfree(prefix);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "snapshot leveldb meta iterator err: %s", err);
+        leveldb_free(err);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Read the generations and the expires of the snapshot. */
+static int leveldbSnapshotLoadMeta(leveldbSnapshotJob *job) {
+    int shard;
+
+    job->gens = dictCreate(&generationsDictType, NULL);
+    job->expires = dictCreate(&generationsDictType, NULL);
+    for (shard = 0; shard < job->numshards; shard++) {
+        if (leveldbSnapshotLoadShardMeta(job, shard) == REDIS_ERR) return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static void leveldbSnapshotStartKey(leveldbSnapshotJob *job, leveldbKeyLoader *l, leveldbRecordKey *rk) {
+    leveldbLoaderReset(l);
+    l->dbid = rk->dbid;
+    l->type = rk->type;
+    l->key = sdscpylen(l->key, rk->key, rk->keylen);
+    if (leveldbTypeHasFields(rk->type)) {
+        sds name = leveldbSnapshotIndexKey(rk->slot, rk->key, rk->keylen);
+        dictEntry *de = dictFind(job->gens, name);
+
+        l->gen = de ? *(uint64_t*)dictGetVal(de) : 0;
+        sdsfree(name);
+    } else {
+        l->gen = 0;
+    }
+}
+
+/* Write the collected key, preceded by a SELECTDB if its db changed. */
+static int leveldbSnapshotSaveKey(leveldbSnapshotJob *job, rio *rdb, leveldbKeyLoader *l, int slot, int *dbid) {
+    long long expire = -1;
+    robj keyobj, *val;
+    dictEntry *de;
+    sds name;
+    int retval;
+
+    if (l->type == 0 || l->count == 0) return REDIS_OK;
+    if ((val = leveldbLoaderBuild(l)) == NULL) {
+        redisLog(REDIS_WARNING, "snapshot leveldb corrupted records of key: %s type: %c", l->key, l->type);
+        return REDIS_ERR;
+    }
+    if (*dbid != l->dbid) {
+        if (rdbSaveType(rdb,REDIS_RDB_OPCODE_SELECTDB) == -1 ||
+            rdbSaveLen(rdb,l->dbid) == -1)
+        {
+            decrRefCount(val);
+            return REDIS_ERR;
+        }
+        *dbid = l->dbid;
+    }
+    name = leveldbSnapshotIndexKey(slot, l->key, sdslen(l->key));
+    if ((de = dictFind(job->expires, name)) != NULL) expire = *(long long*)dictGetVal(de);
+    sdsfree(name);
+
+    initStaticStringObject(keyobj, l->key);
+    retval = rdbSaveKeyValuePair(rdb, &keyobj, val, expire, job->now);
+    decrRefCount(val);
+    if (retval == -1) return REDIS_ERR;
+    job->keys += retval;
+    return REDIS_OK;
+}
+
+/* Write the data records of a shard of the snapshot. The records of a key
+ * all live in the same shard, so the keys never straddle two shards. */
+static int leveldbSnapshotSaveShard(leveldbSnapshotJob *job, rio *rdb, int shard, int *dbid) {
+    leveldb_iterator_t *iterator = leveldb_create_iterator(server.ldb.shards[shard].db, job->roptions[shard]);
+    leveldbKeyLoader loader;
+    leveldbRecordKey rk;
+    int slot = -1, retval = REDIS_ERR;
+    char *err = NULL;
+
+    leveldbLoaderInit(&loader);
+    for (leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value;
+
+        if (!(++job->records % LEVELDB_SNAPSHOT_STOP_CHECK) && leveldb_snapshot_stop) goto cleanup;
+        if (leveldbParseRecordKeySlots(data, dataLen, &rk, job->slotdb) == REDIS_ERR &&
+            rk.dbid >= 0)
+        {
+            redisLog(REDIS_WARNING, "snapshot leveldb bad record key, len: %zu", dataLen);
+            goto cleanup;
+        }
+        if (rk.slot == LEVELDB_META_SLOT) break;
+        if (rk.dbid < 0) {
+            /* Records of a flushed slot, not swept yet: skip the slot. */
+            char next = rk.slot + 1;
+
+            leveldb_iter_seek(iterator, &next, 1);
+            if (!leveldb_iter_valid(iterator)) break;
+            leveldb_iter_prev(iterator);
+            continue;
+        }
+        if (rk.type == 'f') continue;
+
+        if (!leveldbLoaderIsKey(&loader, &rk)) {
+            if (leveldbSnapshotSaveKey(job, rdb, &loader, slot, dbid) == REDIS_ERR)
+                goto cleanup;
+            leveldbSnapshotStartKey(job, &loader, &rk);
+            slot = rk.slot;
+        }
+        value = leveldb_iter_value(iterator, &valueLen);
+        leveldbLoaderAdd(&loader, &rk, value, valueLen);
+    }
+    if (leveldbSnapshotSaveKey(job, rdb, &loader, slot, dbid) == REDIS_ERR) goto cleanup;
+
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "snapshot leveldb iterator err: %s", err);
+        leveldb_free(err);
+        goto cleanup;
+    }
+    retval = REDIS_OK;
+
+cleanup:
+    leveldbLoaderFree(&loader);
+    leveldb_iter_destroy(iterator);
+    return retval;
+}
+
+/* Write the data records of the snapshot as an RDB payload. */
+static int leveldbSnapshotSaveRio(leveldbSnapshotJob *job, rio *rdb) {
+    int shard, dbid = -1;
+    char magic[10];
+    uint64_t cksum;
+
+    if (server.rdb_checksum)
+        rdb->update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",REDIS_RDB_VERSION);
+    if (rioWrite(rdb,magic,9) == 0) return REDIS_ERR;
+    for (shard = 0; shard < job->numshards; shard++) {
+        if (leveldbSnapshotSaveShard(job, rdb, shard, &dbid) == REDIS_ERR) return REDIS_ERR;
+    }
+    if (rdbSaveType(rdb,REDIS_RDB_OPCODE_EOF) == -1) return REDIS_ERR;
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* Executed by the REDIS_BIO_LEVELDB_SNAPSHOT thread. */
+void leveldbSnapshotSave(void *arg) {
+    leveldbSnapshotJob *job = arg;
+    char tmpfile[256];
+    FILE *fp = NULL;
+    rio rdb;
+
+    snprintf(tmpfile,sizeof(tmpfile),"temp-leveldb-%d.rdb",(int)getpid());
+    if (leveldbSnapshotLoadMeta(job) == REDIS_ERR) goto werr;
+    if ((fp = fopen(tmpfile,"w")) == NULL) {
+        redisLog(REDIS_WARNING, "Failed opening .rdb for saving: %s", strerror(errno));
+        goto werr;
+    }
+    rioInitWithFile(&rdb,fp);
+    if (leveldbSnapshotSaveRio(job, &rdb) == REDIS_ERR) goto werr;
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) goto werr;
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto werr;
+    }
+    fp = NULL;
+    if (rename(tmpfile,job->filename) == -1) goto werr;
+    goto done;
+
+werr:
+    if (!leveldb_snapshot_stop)
+        redisLog(REDIS_WARNING, "Error saving the leveldb snapshot: %s", strerror(errno));
+    if (fp) fclose(fp);
+    unlink(tmpfile);
+    job->err = 1;
+
+done:
+    pthread_mutex_lock(&leveldb_snapshot_mutex);
+    leveldb_snapshot_done = job;
+    pthread_mutex_unlock(&leveldb_snapshot_mutex);
+}
+
+/* Start saving the dataset to 'filename' from a LevelDB snapshot. Like
+ * rdbSaveBackground() it returns REDIS_ERR if a save is already in
+ * progress. */
+int leveldbSnapshotSaveBackground(char *filename) {
+    leveldbSnapshotJob *job;
+    int shard;
+
+    if (server.rdb_child_pid != -1 || leveldb_snapshot_job != NULL) return REDIS_ERR;
+
+    leveldbCoalesceFlush(&server.ldb);
+    leveldbDrain(&server.ldb);
+    job = zcalloc(sizeof(*job));
+    job->numshards = server.ldb.numshards;
+    for (shard = 0; shard < job->numshards; shard++) {
+        leveldb_t *db = server.ldb.shards[shard].db;
+
+        job->snapshots[shard] = leveldb_create_snapshot(db);
+        job->roptions[shard] = leveldb_readoptions_create();
+        /* A full scan would only evict the useful blocks from the cache. */
+        leveldb_readoptions_set_fill_cache(job->roptions[shard], 0);
+        leveldb_readoptions_set_snapshot(job->roptions[shard], job->snapshots[shard]);
+    }
+    memcpy(job->slotdb, server.ldb.slotdb, sizeof(job->slotdb));
+    job->filename = sdsnew(filename);
+    job->now = mstime();
+    job->start = ustime();
+    leveldb_snapshot_job = job;
+    redisLog(REDIS_NOTICE, "Background saving from the leveldb snapshot started");
+    bioCreateBackgroundJob(REDIS_BIO_LEVELDB_SNAPSHOT, job, NULL, NULL);
+    return REDIS_OK;
+}
+
+int leveldbSnapshotSaveInProgress(void) {
+    return leveldb_snapshot_job != NULL;
+}
+
+/* Hand the saved file to the slaves once the thread is done. */
+void leveldbSnapshotCron(void) {
+    leveldbSnapshotJob *job;
+    int err;
+
+    pthread_mutex_lock(&leveldb_snapshot_mutex);
+    job = leveldb_snapshot_done;
+    leveldb_snapshot_done = NULL;
+    pthread_mutex_unlock(&leveldb_snapshot_mutex);
+    if (job == NULL) return;
+
+    err = job->err;
+    server.leveldb_snapshot_saves++;
+    server.leveldb_snapshot_last_usec = ustime()-job->start;
+    if (!err) {
+        redisLog(REDIS_NOTICE, "Background saving from the leveldb snapshot terminated with success: %lld keys, %lld records, %.3f seconds",
+            job->keys, job->records, (double)server.leveldb_snapshot_last_usec/1000000);
+    }
+    leveldb_snapshot_job = NULL;
+    leveldbFreeSnapshotJob(job);
+    updateSlavesWaitingBgsave(err ? REDIS_ERR : REDIS_OK, REDIS_RDB_CHILD_TYPE_DISK);
+}
+
+/* -----------------------------------------------------------------------------
+ * Full sync ingestion
+ *
+ * rdbLoad() doesn't go through the leveldb* hooks of the commands, so when a
+ * slave loads the RDB of a full resynchronization its LevelDB is rebuilt from
+ * the loaded keys. leveldbIngestBegin() maps every db to a fresh slot, that
+ * is recorded as a slot to sweep before anything is written to it: a crash
+ * during the load restarts with the old dataset, and the partial new one is
+ * swept. Then rdbLoad() passes every key to leveldbIngestKey(), that stages
+ * its records. Every LEVELDB_INGEST_BATCH_BYTES the batch is handed to the
+ * REDIS_BIO_LEVELDB_WRITE thread even with leveldb-async-write off, so that
+ * the LevelDB writes overlap with the decoding of the RDB.
+ *
+ * leveldbIngestEnd() waits for the writer. If the RDB was loaded, a single
+ * metadata write maps the dbs to the new slots and retires the old ones,
+ * otherwise the new slots are retired and the old dataset stays. The log is
+ * synced once: the slave can then restart from LevelDB with the
+ * synchronized dataset.
+ *
+ * When there are not enough free slots for all the dbs the old slots are
+ * retired before the load, as FLUSHALL does.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_INGEST_BATCH_BYTES (4*1024*1024)
+
+static int leveldb_ingesting = 0;
+static long long leveldb_ingest_start;
+static int *leveldb_ingest_oldslots = NULL; /* NULL if retired before the load */
+static dict **leveldb_ingest_generations = NULL;
+static dict **leveldb_ingest_listheads = NULL;
+
+/* Queue the staged records for the writer thread, without sync. */
+static void leveldbIngestFlush(struct leveldb *ldb) {
+    if (ldb->wbops == 0) return;
+    leveldbAsyncEnqueue(ldb, 0);
+    ldb->wbbytes = 0;
+    ldb->wbops = 0;
+    server.leveldb_op_num++;
+}
+
+/* Map every db to a fresh slot, keeping the old slots and the generations
+ * of their keys. Returns REDIS_ERR if there are not enough free slots. */
+static int leveldbIngestMapSlots(struct leveldb *ldb) {
+    int j, slot, free = 0;
+
+    for (slot = 0; slot < LEVELDB_MAX_SLOTS; slot++)
+        if (ldb->slotdb[slot] == LEVELDB_SLOT_FREE) free++;
+    if (free < server.dbnum) {
+        leveldbStartBatchSweeps(ldb);
+        bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_SWEEP, 0);
+        leveldbSweepCron();
+        for (free = 0, slot = 0; slot < LEVELDB_MAX_SLOTS; slot++)
+            if (ldb->slotdb[slot] == LEVELDB_SLOT_FREE) free++;
+        if (free < server.dbnum) return REDIS_ERR;
+    }
+
+    leveldb_ingest_oldslots = zmalloc(sizeof(int)*server.dbnum);
+    leveldb_ingest_generations = zmalloc(sizeof(dict*)*server.dbnum);
+    leveldb_ingest_listheads = zmalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        sds metakey;
+
+        slot = leveldbFreeSlot(ldb);
+        metakey = leveldbMetaKey(LEVELDB_META_SLOTSWEEP, slot);
+        leveldbBatchPut(ldb, metakey, sdslen(metakey), "", 0);
+        sdsfree(metakey);
+
+        leveldb_ingest_oldslots[j] = ldb->dbslot[j];
+        ldb->dbslot[j] = slot;
+        ldb->slotdb[slot] = j;
+        leveldb_ingest_generations[j] = server.db[j].generations;
+        leveldb_ingest_listheads[j] = server.db[j].listheads;
+        server.db[j].generations = dictCreate(&generationsDictType,NULL);
+        server.db[j].listheads = dictCreate(&freezedDictType,NULL);
+    }
+
+    /* The new slots must be known as slots to sweep before their records
+     * reach any shard. */
+    leveldbFlush(ldb);
+    leveldbWaitWriter();
+    if (server.leveldb_fsync != REDIS_LEVELDB_FSYNC_NO) leveldbSyncLog(ldb);
+    return REDIS_OK;
+}
+
+/* Retire the old slots if 'loaded' is set, the new ones otherwise. */
+static void leveldbIngestRetireSlots(struct leveldb *ldb, int loaded) {
+    leveldbSweepJob **jobs = zmalloc(sizeof(leveldbSweepJob*)*server.dbnum);
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        int slot = ldb->dbslot[j], old = leveldb_ingest_oldslots[j];
+        redisDb *db = server.db+j;
+
+        if (loaded) {
+            sds metakey = leveldbMetaKey(LEVELDB_META_DBSLOT, j);
+            char c = slot;
+
+            leveldbBatchPut(ldb, metakey, sdslen(metakey), &c, 1);
+            sdsfree(metakey);
+            metakey = leveldbMetaKey(LEVELDB_META_SLOTSWEEP, slot);
+            leveldbBatchDelete(ldb, metakey, sdslen(metakey));
+            sdsfree(metakey);
+            jobs[j] = leveldbCreateSlotSweep(old);
+            leveldbBatchPut(ldb, jobs[j]->meta, sdslen(jobs[j]->meta), "", 0);
+            ldb->slotdb[old] = LEVELDB_SLOT_SWEEPING;
+            dictRelease(leveldb_ingest_generations[j]);
+            dictRelease(leveldb_ingest_listheads[j]);
+        } else {
+            /* The slot sweep record was written by leveldbIngestMapSlots(). */
+            jobs[j] = leveldbCreateSlotSweep(slot);
+            ldb->dbslot[j] = old;
+            ldb->slotdb[slot] = LEVELDB_SLOT_SWEEPING;
+            dictRelease(db->generations);
+            dictRelease(db->listheads);
+            db->generations = leveldb_ingest_generations[j];
+            db->listheads = leveldb_ingest_listheads[j];
+        }
+    }
+    /* The slots to sweep must not be read from the log again at restart. */
+    leveldbFlush(ldb);
+    leveldbWaitWriter();
+    if (server.leveldb_fsync != REDIS_LEVELDB_FSYNC_NO) leveldbSyncLog(ldb);
+    leveldbStartSweeps(ldb, jobs, server.dbnum);
+    zfree(jobs);
+    zfree(leveldb_ingest_oldslots);
+    zfree(leveldb_ingest_generations);
+    zfree(leveldb_ingest_listheads);
+    leveldb_ingest_oldslots = NULL;
+    leveldb_ingest_generations = NULL;
+    leveldb_ingest_listheads = NULL;
+}
+
+void leveldbIngestBegin(struct leveldb *ldb) {
+    if (server.leveldb_state == REDIS_LEVELDB_OFF) return;
+
+    leveldbCoalesceFlush(ldb);
+    if (leveldbIngestMapSlots(ldb) == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "leveldb has no free slots for the synchronized dataset, dropping the old one first");
+        leveldbFlushall(ldb);
+    }
+    leveldbBeginBatch(ldb);
+    leveldb_ingesting = 1;
+    leveldb_ingest_start = ustime();
+    server.leveldb_ingest_keys = 0;
+}
+
+/* Called by rdbLoad() for every key added to the key space. The expire is
+ * staged by setExpire() as usual. */
+void leveldbIngestKey(int dbid, robj *key, robj *val) {
+    struct leveldb *ldb = &server.ldb;
+
+    if (!leveldb_ingesting) return;
+    leveldbPutKey(dbid, ldb, key, val);
+    server.leveldb_ingest_keys++;
+    if (ldb->wbbytes >= LEVELDB_INGEST_BATCH_BYTES) leveldbIngestFlush(ldb);
+}
+
+/* Called once rdbLoad() returned, 'loaded' is set if it succeeded. */
+void leveldbIngestEnd(struct leveldb *ldb, int loaded) {
+    if (!leveldb_ingesting) return;
+
+    leveldb_ingesting = 0;
+    leveldbIngestFlush(ldb);
+    leveldbEndBatch(ldb);
+    leveldbWaitWriter();
+    if (leveldb_ingest_oldslots)
+        leveldbIngestRetireSlots(ldb, loaded);
+    else if (server.leveldb_fsync != REDIS_LEVELDB_FSYNC_NO)
+        leveldbSyncLog(ldb);
+    server.leveldb_ingest_usec = ustime()-leveldb_ingest_start;
+    redisLog(REDIS_NOTICE, "leveldb ingested %lld keys in %.3f seconds",
+        server.leveldb_ingest_keys, (double)server.leveldb_ingest_usec/1000000);
+}
+
+/* -----------------------------------------------------------------------------
+ * Format migration
+ *
+ * The format 1 records have a lower case type, a single byte key length, and
+ * for hashes, sets and sorted sets an optional ['#'][generation, 8 bytes]
+ * followed by '=' before the field. Sorted set scores are "%.17g" strings
+ * and the metadata records 'g' and 'k' use the same single byte lengths and
+ * 8 bytes generations.
+ *
+ * The format 2 differs only for the strings longer than a page, see
+ * leveldbMigrateStrings().
+ *
+ * leveldbMigrate() rewrites them at startup, before anything else reads the
+ * records: every converted record is written and its old version deleted in
+ * the same batch, so a migration interrupted by a crash resumes where it
+ * stopped. The version record is written last.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_V1_KEYGEN 'g'
+#define LEVELDB_V1_KEYSWEEP 'k'
+#define LEVELDB_V1_GEN_MARK '#'
+#define LEVELDB_V1_GEN_LEN 8
+
+static uint64_t leveldbDecodeGenV1(const char *buf) {
+    uint64_t gen = 0;
+    int j;
+
+    for (j = 0; j < LEVELDB_V1_GEN_LEN; j++) gen = (gen << 8) | (unsigned char)buf[j];
+    return gen;
+}
+
+static int leveldbParseRecordKeyV1(const char *data, size_t len, leveldbRecordKey *rk) {
+    if (len < LEVELDB_KEY_FLAG_SET_KEY) return REDIS_ERR;
+    rk->slot = (unsigned char)data[LEVELDB_KEY_FLAG_DATABASE_ID];
+    rk->dbid = -1;
+    rk->type = data[LEVELDB_KEY_FLAG_TYPE];
+    rk->keylen = (unsigned char)data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
+    rk->key = data + LEVELDB_KEY_FLAG_SET_KEY;
+    if (LEVELDB_KEY_FLAG_SET_KEY + rk->keylen > len) return REDIS_ERR;
+
+    rk->field = NULL;
+    rk->fieldlen = 0;
+    rk->gen = 0;
+    if (leveldbTypeHasFields(rk->type)) {
+        size_t flen = LEVELDB_KEY_FLAG_SET_KEY + rk->keylen;
+
+        if (flen < len && data[flen] == LEVELDB_V1_GEN_MARK) {
+            if (flen + 1 + LEVELDB_V1_GEN_LEN >= len) return REDIS_ERR;
+            rk->gen = leveldbDecodeGenV1(data + flen + 1);
+            flen += 1 + LEVELDB_V1_GEN_LEN;
+        }
+        if (flen >= len || data[flen] != '=') return REDIS_ERR;
+        rk->field = data + flen + 1;
+        rk->fieldlen = len - flen - 1;
+    } else if (len != LEVELDB_KEY_FLAG_SET_KEY + rk->keylen) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Convert a format 1 data record, staging the new record and the deletion
+ * of the old one. */
+static int leveldbMigrateRecord(struct leveldb *ldb, const char *data, size_t len,
+                                const char *value, size_t valuelen)
+{
+    leveldbRecordKey rk;
+    sds name, key, val;
+
+    if (leveldbParseRecordKeyV1(data, len, &rk) == REDIS_ERR) return REDIS_ERR;
+
+    switch(rk.type) {
+    case 'c':
+    case 'h':
+        val = leveldbEncodeValue(value, valuelen);
+        break;
+    case 's':
+        val = sdsempty();
+        break;
+    case 'z': {
+        char buf[128], *eptr;
+        double score;
+
+        if (valuelen == 0 || valuelen >= sizeof(buf)) return REDIS_ERR;
+        memcpy(buf, value, valuelen);
+        buf[valuelen] = '\0';
+        errno = 0;
+        score = strtod(buf, &eptr);
+        if (eptr[0] != '\0' || errno == ERANGE || isnan(score)) return REDIS_ERR;
+        val = sdsnewlen(NULL, LEVELDB_SCORE_LEN);
+        leveldbEncodeScore(val, score);
+        break;
+    }
+    case 'f':
+        val = sdsnewlen(value, valuelen);
+        break;
+    default:
+        return REDIS_ERR;
+    }
+
+    name = sdsnewlen(rk.key, rk.keylen);
+    key = leveldbKeyPrefixGen(rk.slot, rk.type, name, rk.gen);
+    if (rk.field) key = sdscatlen(key, rk.field, rk.fieldlen);
+    leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
+    leveldbBatchDelete(ldb, data, len);
+    sdsfree(name);
+    sdsfree(key);
+    sdsfree(val);
+    return REDIS_OK;
+}
+
+/* Convert a format 1 'g' or 'k' metadata record. The ones of the slots to
+ * sweep are just deleted, the slot sweep only knows the new prefixes. */
+static void leveldbMigrateMeta(struct leveldb *ldb, const char *data, size_t len,
+                               const char *value, size_t valuelen, char *sweeping)
+{
+    int slot = (unsigned char)data[2];
+    size_t keylen;
+    sds name, key = NULL;
+
+    if (data[1] == LEVELDB_V1_KEYGEN) {
+        keylen = len > 3 ? (unsigned char)data[3] : 0;
+        if (len > 3 && len == 4 + keylen && valuelen == LEVELDB_V1_GEN_LEN && !sweeping[slot]) {
+            unsigned char buf[LEVELDB_VARINT_MAX_LEN];
+
+            name = sdsnewlen(data+4, keylen);
+            key = leveldbKeyGenMetaKey(slot, name);
+            leveldbBatchPut(ldb, key, sdslen(key), (char*)buf,
+                            leveldbEncodeVarint(buf, leveldbDecodeGenV1(value)));
+            sdsfree(name);
+        }
+    } else {
+        keylen = len > 4 ? (unsigned char)data[4] : 0;
+        if (len > 4 && len == 5 + keylen + LEVELDB_V1_GEN_LEN && !sweeping[slot]) {
+            name = sdsnewlen(data+5, keylen);
+            key = leveldbKeySweepMetaKey(slot, data[3], name,
+                                         leveldbDecodeGenV1(data+5+keylen));
+            leveldbBatchPut(ldb, key, sdslen(key), "", 0);
+            sdsfree(name);
+        }
+    }
+    if (key == NULL)
+        redisLog(REDIS_WARNING, "migrate leveldb drop metadata record, len: %zu", len);
+    sdsfree(key);
+    leveldbBatchDelete(ldb, data, len);
+}
+
+/* The format 2 stored every string in a single record: the ones longer than
+ * LEVELDB_STRING_PAGE_SIZE are rewritten in pages, the paged record taking
+ * the place of the old one in the same batch. */
+static int leveldbMigrateStrings(struct leveldb *ldb, char *sweeping, long long *migrated) {
+    leveldb_readoptions_t *roptions = leveldb_readoptions_create();
+    leveldb_iterator_t *iterator;
+    leveldbRecordKey rk;
+    char *err = NULL;
+    int slot;
+
+    leveldb_readoptions_set_fill_cache(roptions, 0);
+    iterator = leveldb_create_iterator(ldb->db, roptions);
+    for (slot = 0; slot < LEVELDB_MAX_SLOTS; slot++) {
+        char prefix[LEVELDB_KEY_FLAG_SET_KEY_LEN];
+
+        if (sweeping[slot]) continue;
+        prefix[LEVELDB_KEY_FLAG_DATABASE_ID] = slot;
+        prefix[LEVELDB_KEY_FLAG_TYPE] = 'C';
+        for (leveldb_iter_seek(iterator, prefix, sizeof(prefix));
+             leveldb_iter_valid(iterator);
+             leveldb_iter_next(iterator))
+        {
+            size_t dataLen, valueLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            const char *value;
+            sds name;
+
+            if (dataLen < sizeof(prefix) || memcmp(data, prefix, sizeof(prefix))) break;
+            value = leveldb_iter_value(iterator, &valueLen);
+            if (valueLen <= LEVELDB_STRING_PAGE_SIZE+1 || value[0] != LEVELDB_VALUE_RAW ||
+                leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR || rk.field)
+                continue;
+            name = sdsnewlen(rk.key, rk.keylen);
+            leveldbPutString(ldb, slot, name, value+1, valueLen-1);
+            sdsfree(name);
+            if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
+            if (!(++*migrated % 10000)) {
+                processEventsWhileBlocked();
+                redisLog(REDIS_NOTICE, "migrate leveldb: %lld strings", *migrated);
+            }
+        }
+    }
+
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "migrate leveldb iterator err: %s", err);
+        leveldb_free(err);
+    }
+    leveldb_iter_destroy(iterator);
+    leveldb_readoptions_destroy(roptions);
+    return err ? REDIS_ERR : REDIS_OK;
+}
+
+/* Bring the records to LEVELDB_FORMAT_VERSION. The older formats predate the
+ * shards, and leveldbCheckShards() only accepts them with a single shard, so
+ * the records to migrate are all in the first one. */
+static int leveldbMigrate(struct leveldb *ldb) {
+    char vkey[2] = { (char)LEVELDB_META_SLOT, LEVELDB_META_VERSION };
+    char sweeping[LEVELDB_MAX_SLOTS+1];
+    unsigned char buf[LEVELDB_VARINT_MAX_LEN];
+    leveldb_readoptions_t *roptions;
+    leveldb_iterator_t *iterator;
+    long long migrated = 0, start = ustime();
+    size_t valueLen;
+    char *value, *err = NULL;
+    int success = REDIS_OK;
+    uint64_t version = 1;
+    sds prefix;
+
+    value = leveldb_get(ldb->db, ldb->roptions, vkey, sizeof(vkey), &valueLen, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb version err: %s", err);
+        leveldb_free(err);
+        return REDIS_ERR;
+    }
+    if (value != NULL) {
+        const unsigned char *p = (unsigned char*)value;
+
+        if (leveldbDecodeVarint(&p, p + valueLen, &version) == REDIS_ERR)
+            version = UINT64_MAX;
+        leveldb_free(value);
+        if (version == LEVELDB_FORMAT_VERSION) return REDIS_OK;
+    }
+    if (version != 1 && version != 2) {
+        redisLog(REDIS_WARNING, "leveldb format version %llu is not supported",
+            (unsigned long long)version);
+        return REDIS_ERR;
+    }
+
+    roptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(roptions, 0);
+    iterator = leveldb_create_iterator(ldb->db, roptions);
+
+    /* The records of the slots to sweep are not worth converting. */
+    memset(sweeping, 0, sizeof(sweeping));
+    prefix = leveldbMetaKey(LEVELDB_META_SLOTSWEEP, 0);
+    for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+        size_t dataLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+
+        if (dataLen < 2 || memcmp(data, prefix, 2) != 0) break;
+        if (dataLen == 3) sweeping[(unsigned char)data[2]] = 1;
+    }
+    sdsfree(prefix);
+
+    if (version == 1) {
+        for (leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+            size_t dataLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            int slot = (unsigned char)data[0];
+
+            if (slot == LEVELDB_META_SLOT) {
+                if (dataLen < 3 || (data[1] != LEVELDB_V1_KEYGEN && data[1] != LEVELDB_V1_KEYSWEEP))
+                    continue;
+                value = (char*) leveldb_iter_value(iterator, &valueLen);
+                leveldbMigrateMeta(ldb, data, dataLen, value, valueLen, sweeping);
+            } else if (sweeping[slot]) {
+                char next = slot + 1;
+
+                leveldb_iter_seek(iterator, &next, 1);
+                if (!leveldb_iter_valid(iterator)) break;
+                leveldb_iter_prev(iterator);
+                continue;
+            } else if (dataLen >= 2 && islower(data[LEVELDB_KEY_FLAG_TYPE])) {
+                value = (char*) leveldb_iter_value(iterator, &valueLen);
+                if (leveldbMigrateRecord(ldb, data, dataLen, value, valueLen) == REDIS_ERR) {
+                    redisLog(REDIS_WARNING, "migrate leveldb bad record, len: %zu", dataLen);
+                    success = REDIS_ERR;
+                    break;
+                }
+            } else {
+                continue;
+            }
+
+            if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
+            if (!(++migrated % 1000000)) {
+                processEventsWhileBlocked();
+                redisLog(REDIS_NOTICE, "migrate leveldb: %lld records", migrated);
+            }
+        }
+    }
+
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "migrate leveldb iterator err: %s", err);
+        leveldb_free(err);
+        success = REDIS_ERR;
+    }
+    leveldb_iter_destroy(iterator);
+    leveldb_readoptions_destroy(roptions);
+
+    if (success == REDIS_OK) {
+        leveldbDrain(ldb);
+        success = leveldbMigrateStrings(ldb, sweeping, &migrated);
+    }
+    if (success == REDIS_OK) {
+        leveldbBatchPut(ldb, vkey, sizeof(vkey), (char*)buf,
+                        leveldbEncodeVarint(buf, LEVELDB_FORMAT_VERSION));
+        if (migrated)
+            redisLog(REDIS_NOTICE, "migrate leveldb to format %d: %lld records, %.3f seconds",
+                LEVELDB_FORMAT_VERSION, migrated, (double)(ustime()-start)/1000000);
+    }
+    leveldbDrain(ldb);
+    return success;
+}
+
+/* -----------------------------------------------------------------------------
+ * Lazy startup load
+ *
+ * With leveldb-lazy-load the server accepts commands as soon as the metadata
+ * and the expires index are read. The key space is then loaded by
+ * leveldbLazyLoadCron() on the main thread, in slices of about
+ * LEVELDB_LAZYLOAD_CYCLE_PERC percent of the CPU time, walking iterators
+ * created at startup: they see the records as they were before the first
+ * write, and keep the old tables on disk until the load is done.
+ *
+ * The first time a command names a key, leveldbLazyLoadCommandKeys() loads it
+ * with a point read and marks it as touched: from then on the key space owns
+ * the key, and the background walk drops its records. A flushed db is never
+ * loaded again. The commands that see the whole key space, RDB saves and AOF
+ * rewrites are refused with -LOADING until the load is done.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_LAZYLOAD_CYCLE_PERC 25
+#define LEVELDB_LAZYLOAD_STEP 64     /* Records between time checks. */
+
+typedef struct leveldbLazyLoad {
+    leveldb_readoptions_t *roptions;
+    leveldb_iterator_t *iterators[REDIS_MAX_LEVELDB_SHARDS];
+    int shard;                  /* Shard being walked. */
+    int slotdb[256];            /* Slots of the walked records. */
+    dict **touched;             /* Keys owned by the key space, per db. */
+    int *flushed;               /* Dbs flushed since the start. */
+    leveldbKeyLoader loader;
+    int skip;                   /* Skip the records of the current key. */
+    long long records;
+    long long keys;
+    long long start;
+} leveldbLazyLoad;
+
+static leveldbLazyLoad *leveldb_lazy = NULL;
+
+int leveldbLazyLoading(void) {
+    return leveldb_lazy != NULL;
+}
 
-  char *err = NULL;
-  ldb->db = leveldb_open(ldb->options, path, &err);
+static void leveldbLazyLoadStart(struct leveldb *ldb, long long start) {
+    leveldbLazyLoad *lz = zcalloc(sizeof(*lz));
+    int j;
 
-  procLeveldbError(err, "open leveldb err: %s");
+    /* All the iterators are created at once, before any write. */
+    lz->roptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(lz->roptions, 0);
+    for (j = 0; j < ldb->numshards; j++) {
+        lz->iterators[j] = leveldb_create_iterator(ldb->shards[j].db, lz->roptions);
+        leveldb_iter_seek_to_first(lz->iterators[j]);
+    }
+    memcpy(lz->slotdb, ldb->slotdb, sizeof(lz->slotdb));
+    lz->touched = zmalloc(sizeof(dict*)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++)
+        lz->touched[j] = dictCreate(&freezedDictType, NULL);
+    lz->flushed = zcalloc(sizeof(int)*server.dbnum);
+    leveldbLoaderInit(&lz->loader);
+    lz->start = start;
+    leveldb_lazy = lz;
+}
 
-  ldb->roptions = leveldb_readoptions_create();
-  leveldb_readoptions_set_fill_cache(ldb->roptions, 0);
+static void leveldbLazyLoadFree(void) {
+    leveldbLazyLoad *lz = leveldb_lazy;
+    int j;
 
-  ldb->woptions = leveldb_writeoptions_create();
-  leveldb_writeoptions_set_sync(ldb->woptions, 0);
+    if (lz == NULL) return;
+    for (j = 0; j < REDIS_MAX_LEVELDB_SHARDS; j++)
+        if (lz->iterators[j]) leveldb_iter_destroy(lz->iterators[j]);
+    leveldb_readoptions_destroy(lz->roptions);
+    for (j = 0; j < server.dbnum; j++) dictRelease(lz->touched[j]);
+    zfree(lz->touched);
+    zfree(lz->flushed);
+    leveldbLoaderFree(&lz->loader);
+    zfree(lz);
+    leveldb_lazy = NULL;
+    leveldbFreeLoadExpires();
 }
 
-int addFreezedKey(int dbid, sds key, char keytype) {
-    dictEntry *entry = dictAddRaw(server.db[dbid].freezed,key);
+static void leveldbLazyLoadFinish(void) {
+    leveldbLazyLoad *lz = leveldb_lazy;
+    int old_leveldb_state = server.leveldb_state;
 
-    if (!entry) return REDIS_ERR;
-    dictSetSignedIntegerVal(entry, keytype);
-    return REDIS_OK;
+    server.leveldb_load_records = lz->records;
+    server.leveldb_load_keys = lz->keys;
+    server.leveldb_load_usec = ustime() - lz->start;
+    redisLog(REDIS_NOTICE, "lazy load leveldb done: %lld records, %lld keys, %lld loaded on demand, %.3f seconds",
+        lz->records, lz->keys, server.leveldb_lazy_point_loads,
+        (double)server.leveldb_load_usec/1000000);
+
+    /* The index entries of the loaded keys are already in place. */
+    server.leveldb_state = REDIS_LEVELDB_OFF;
+    leveldbApplyLoadExpires(&server.ldb);
+    server.leveldb_state = old_leveldb_state;
+    leveldbCommit(&server.ldb);
+    leveldbLazyLoadFree();
+    leveldbHotnessLoaded();
 }
 
-int loadFreezedKey(struct leveldb* ldb) {
-    int success = REDIS_OK;
-    int dbid = 0;
-    unsigned long len = 0;
-    char *data = NULL;
-    char *value = NULL;
-    size_t dataLen = 0;
-    size_t valueLen = 0;
-    sds strkey;
-    int retval;
-    leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
-    char tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN];
+/* Give the key its expire from the index and remove it from the index. */
+static void leveldbLazyLoadExpire(int dbid, sds name) {
+    dictEntry *de = dictFind(leveldb_load_expires[dbid], name);
+    int old_leveldb_state = server.leveldb_state;
+    robj keyobj;
+
+    if (de == NULL) return;
+    initStaticStringObject(keyobj, name);
+    server.leveldb_state = REDIS_LEVELDB_OFF;
+    setExpire(server.db+dbid, &keyobj, ((leveldbLoadExpire*)dictGetVal(de))->when);
+    server.leveldb_state = old_leveldb_state;
+    dictDelete(leveldb_load_expires[dbid], name);
+}
 
-    tmp[LEVELDB_KEY_FLAG_TYPE] = 'f';
-    for(dbid = 0; dbid < server.dbnum; dbid++) {
-        tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-        
-        for(leveldb_iter_seek(iterator, tmp, LEVELDB_KEY_FLAG_SET_KEY_LEN); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-            data = (char*) leveldb_iter_key(iterator, &dataLen);
-            if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid || data[LEVELDB_KEY_FLAG_TYPE] != 'f') break;
+/* The records can't be trusted anymore: stop like a failed startup load. */
+static void leveldbLazyLoadFatal(const char *msg) {
+    redisLog(REDIS_WARNING, "Fatal error in the leveldb lazy load: %s. Exiting.", msg);
+    exit(1);
+}
 
-            value = (char*) leveldb_iter_value(iterator, &valueLen);
-            if(valueLen != 1) continue;
-            
-            len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-            strkey = sdsnewlen(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-            retval = addFreezedKey(dbid, strkey, value[0]);
-            redisAssertWithInfo(NULL,NULL,retval == REDIS_OK);
+/* Load the key 'name' of db 'dbid' before a command uses it. */
+static void leveldbLazyLoadKey(int dbid, sds name) {
+    static const char types[] = "chszl";
+    leveldbLazyLoad *lz = leveldb_lazy;
+    leveldbKeyLoader loader;
+    dictEntry *de;
+    const char *t;
+
+    if (lz->flushed[dbid] || dictFind(lz->touched[dbid], name) != NULL) return;
+    dictAdd(lz->touched[dbid], sdsdup(name), NULL);
+    if (dictFind(server.db[dbid].dict, name) != NULL) return;
+
+    /* The key may have been deleted by an expire or an eviction while its
+     * delete was still queued. */
+    leveldbDrain(&server.ldb);
+    leveldbLoaderInit(&loader);
+    if (leveldbFreezedKeyType(dbid, name) == 0) {
+        for (t = types; *t && loader.count == 0; t++) {
+            leveldbLoaderReset(&loader);
+            if (leveldbReadKeyRecords(&server.ldb, dbid, name, *t, &loader) == REDIS_ERR)
+                leveldbLazyLoadFatal("iterator error");
         }
     }
-    
-    char *err = NULL;
-    leveldb_iter_get_error(iterator, &err);
-    if(err != NULL) {
-        redisLog(REDIS_WARNING, "load freezedkey iterator err: %s", err);
-        leveldb_free(err);
-        success = REDIS_ERR;
-        err = NULL;
+
+    if (loader.count) {
+        if (leveldbLoaderInsert(&loader) == REDIS_ERR)
+            leveldbLazyLoadFatal("corrupted records");
+        server.leveldb_lazy_point_loads++;
+        leveldbLazyLoadExpire(dbid, name);
+    } else if ((de = dictFind(leveldb_load_expires[dbid], name)) != NULL) {
+        /* Frozen or missing key: drop its index entry like the startup
+         * load does. */
+        sds metakey = leveldbExpireMetaKey(server.ldb.dbslot[dbid],
+            ((leveldbLoadExpire*)dictGetVal(de))->when, name);
+
+        leveldbBatchDelete(&server.ldb, metakey, sdslen(metakey));
+        leveldbCommit(&server.ldb);
+        sdsfree(metakey);
+        dictDelete(leveldb_load_expires[dbid], name);
     }
+    leveldbLoaderFree(&loader);
+}
 
-    leveldb_iter_destroy(iterator);
-    return success;
+/* Add the collected key to the key space, unless a command owns it. */
+static void leveldbLazyLoadEmit(leveldbLazyLoad *lz) {
+    leveldbKeyLoader *l = &lz->loader;
+
+    if (!lz->skip && l->type != 0 && l->count != 0 &&
+        !lz->flushed[l->dbid] && dictFind(lz->touched[l->dbid], l->key) == NULL)
+    {
+        if (leveldbLoaderInsert(l) == REDIS_ERR)
+            leveldbLazyLoadFatal("corrupted records");
+        lz->keys++;
+        leveldbLazyLoadExpire(l->dbid, l->key);
+    }
+    leveldbLoaderReset(l);
+    lz->skip = 1;
 }
 
-int isKeyFreezed(int dbid, robj *key) {
-    dictEntry *de = dictFind(server.db[dbid].freezed,key->ptr);
-	return de ? 1 : 0;
+/* Walk the records for about 'usec' microseconds. Returns 1 once every
+ * shard was walked. */
+static int leveldbLazyLoadStep(long long usec) {
+    leveldbLazyLoad *lz = leveldb_lazy;
+    long long deadline = ustime() + usec;
+    long long steps = 0;
+
+    while (lz->shard < server.ldb.numshards) {
+        leveldb_iterator_t *iterator = lz->iterators[lz->shard];
+        leveldbRecordKey rk;
+        const char *data, *value;
+        size_t dataLen, valueLen;
+
+        if (!(++steps % LEVELDB_LAZYLOAD_STEP) && ustime() >= deadline) return 0;
+
+        data = leveldb_iter_valid(iterator) ? leveldb_iter_key(iterator, &dataLen) : NULL;
+        if (data == NULL || (unsigned char)data[0] == LEVELDB_META_SLOT) {
+            char *err = NULL;
+
+            leveldb_iter_get_error(iterator, &err);
+            if (err != NULL) {
+                redisLog(REDIS_WARNING, "lazy load leveldb iterator err: %s", err);
+                leveldb_free(err);
+                leveldbLazyLoadFatal("iterator error");
+            }
+            leveldbLazyLoadEmit(lz);
+            leveldb_iter_destroy(iterator);
+            lz->iterators[lz->shard++] = NULL;
+            continue;
+        }
+        if (leveldbParseRecordKeySlots(data, dataLen, &rk, lz->slotdb) == REDIS_ERR &&
+            rk.dbid >= 0)
+        {
+            redisLog(REDIS_WARNING, "lazy load leveldb bad record key, len: %zu", dataLen);
+            leveldbLazyLoadFatal("bad record key");
+        }
+        if (rk.dbid == LEVELDB_SLOT_SWEEPING || (rk.dbid >= 0 && lz->flushed[rk.dbid])) {
+            /* Skip the whole slot, as the startup load does. */
+            char next = rk.slot + 1;
+
+            leveldbLazyLoadEmit(lz);
+            leveldb_iter_seek(iterator, &next, 1);
+            continue;
+        }
+        if (rk.dbid < 0) {
+            redisLog(REDIS_WARNING, "lazy load leveldb select db error: %d", rk.slot);
+            leveldbLazyLoadFatal("bad slot");
+        }
+        lz->records++;
+        if (rk.type != 'f') {
+            if (!leveldbLoaderIsKey(&lz->loader, &rk)) {
+                leveldbLazyLoadEmit(lz);
+                leveldbLoaderStart(&lz->loader, &rk);
+                lz->skip = dictFind(lz->touched[rk.dbid], lz->loader.key) != NULL ||
+                           dictFind(server.db[rk.dbid].dict, lz->loader.key) != NULL ||
+                           leveldbFreezedKeyType(rk.dbid, lz->loader.key) ||
+                           leveldbLoadKeyExpired(rk.dbid, lz->loader.key);
+            }
+            if (!lz->skip) {
+                value = leveldb_iter_value(iterator, &valueLen);
+                leveldbLoaderAdd(&lz->loader, &rk, value, valueLen);
+            }
+        }
+        leveldb_iter_next(iterator);
+    }
+    return 1;
 }
 
-sds createleveldbFreezedKeyHead(int dbid, sds name) {
-  char tmp[LEVELDB_KEY_FLAG_SET_KEY];
+void leveldbLazyLoadCron(void) {
+    if (leveldb_lazy == NULL) return;
+    if (leveldbLazyLoadStep(LEVELDB_LAZYLOAD_CYCLE_PERC*1000000/server.hz/100))
+        leveldbLazyLoadFinish();
+    else if (leveldb_lazy) {
+        server.leveldb_load_records = leveldb_lazy->records;
+        server.leveldb_load_keys = leveldb_lazy->keys;
+    }
+}
+
+/* Called when the db 'dbid' is emptied: its records are never loaded. */
+void leveldbLazyLoadFlushed(int dbid) {
+    leveldbLazyLoad *lz = leveldb_lazy;
+    int j;
+
+    if (lz == NULL) return;
+    lz->flushed[dbid] = 1;
+    dictEmpty(lz->touched[dbid], NULL);
+    dictEmpty(leveldb_load_expires[dbid], NULL);
+    for (j = 0; j < server.dbnum; j++) if (!lz->flushed[j]) return;
+    leveldbLazyLoadFinish();
+}
+
+/* Load the keys of the command before it runs. */
+void leveldbLazyLoadCommandKeys(redisClient *c) {
+    int *keys, numkeys, j;
 
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  tmp[LEVELDB_KEY_FLAG_TYPE] = 'f';
-  tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = sdslen(name);
+    if (leveldb_lazy == NULL) return;
+    keys = getKeysFromCommand(c->cmd, c->argv, c->argc, &numkeys, REDIS_GETKEYS_ALL);
+    for (j = 0; j < numkeys; j++)
+        leveldbLazyLoadKey(c->db->id, c->argv[keys[j]]->ptr);
+    getKeysFreeResult(keys);
 
-  sds key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
+    /* MOVE also names the key in the target db. */
+    if (c->cmd->proc == moveCommand && c->argc == 3) {
+        long long dbid;
 
-  key = sdscatsds(key, name);
-  return key;
+        if (getLongLongFromObject(c->argv[2], &dbid) == REDIS_OK &&
+            dbid >= 0 && dbid < server.dbnum)
+            leveldbLazyLoadKey((int)dbid, c->argv[1]->ptr);
+    }
 }
 
-int freezeKey(redisDb *db, struct leveldb *ldb, robj *key, char keytype) {
-    sds strkey;
-    sds leveldbkey;
-    int retval;
-    char *err = NULL;
-    
-    if (!dbDelete(db, key)) {
-	    return REDIS_ERR;
+/* Return 1 if the command can't run before the load is done, since it sees
+ * the whole key space. */
+int leveldbLazyLoadRefuses(struct redisCommand *cmd, robj **argv, int argc) {
+    int j;
+
+    if (leveldb_lazy == NULL) return 0;
+    if (cmd->proc == keysCommand || cmd->proc == scanCommand ||
+        cmd->proc == randomkeyCommand || cmd->proc == dbsizeCommand) return 1;
+    if (cmd->proc == debugCommand)
+        return argc > 1 && !strcasecmp(argv[1]->ptr, "digest");
+    if (cmd->proc == sortCommand) {
+        for (j = 2; j < argc; j++) {
+            if (!strcasecmp(argv[j]->ptr, "by") || !strcasecmp(argv[j]->ptr, "get"))
+                return 1;
+        }
     }
+    return 0;
+}
 
-    leveldbkey = createleveldbFreezedKeyHead(db->id, key->ptr);
-    leveldb_put(ldb->db, ldb->woptions, leveldbkey, sdslen(leveldbkey), &keytype, 1, &err);
-    if (err != NULL) {
-        redisLog(REDIS_WARNING, "freezekey err: %s", err);
-        leveldb_free(err);
-        sdsfree(leveldbkey);
-        err = NULL;
-        return REDIS_ERR;
+/* -----------------------------------------------------------------------------
+ * Memory budgeted startup load
+ *
+ * With leveldb-load-max-memory set, the keys of the hotness index are loaded
+ * first, the most recently accessed first, with point reads, until the used
+ * memory reaches the budget. Then the records are walked: the keys missing
+ * from the index are loaded while the budget allows, and the others are
+ * frozen, writing their F record and seeking past their records. Volatile
+ * keys are always loaded, since a frozen key has no expire.
+ * -------------------------------------------------------------------------- */
+
+typedef struct leveldbHotKey {
+    sds name;
+    time_t atime;
+    int dbid;
+    char type;
+} leveldbHotKey;
+
+static int leveldbCompareHotKeys(const void *a, const void *b) {
+    time_t ta = ((const leveldbHotKey*)a)->atime;
+    time_t tb = ((const leveldbHotKey*)b)->atime;
+
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+static void leveldbFreeHotKeys(leveldbHotKey *hot, long count) {
+    long j;
+
+    for (j = 0; j < count; j++) sdsfree(hot[j].name);
+    zfree(hot);
+}
+
+/* Read the hotness index of every shard. */
+static int leveldbLoadHotKeys(struct leveldb *ldb, leveldbHotKey **hotp, long *countp) {
+    sds prefix = leveldbMetaKey(LEVELDB_META_ACCESS, 0);
+    leveldbHotKey *hot = NULL;
+    long count = 0, size = 0;
+    int shard, success = REDIS_OK;
+
+    for (shard = 0; shard < ldb->numshards && success == REDIS_OK; shard++) {
+        leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->shards[shard].db, ldb->roptions);
+        char *err = NULL;
+
+        for (leveldb_iter_seek(iterator, prefix, 2); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
+            size_t dataLen, valueLen;
+            const char *data = leveldb_iter_key(iterator, &dataLen);
+            const char *value = leveldb_iter_value(iterator, &valueLen);
+            const unsigned char *p = (const unsigned char*)value + 1;
+            uint64_t atime;
+            int dbid;
+
+            if (dataLen < 2 || (unsigned char)data[0] != LEVELDB_META_SLOT ||
+                data[1] != LEVELDB_META_ACCESS) break;
+            if (dataLen < 3 || valueLen < 2) continue;
+            dbid = ldb->slotdb[(unsigned char)data[2]];
+            if (dbid < 0) continue; /* Swept with the slot. */
+            if (leveldbDecodeVarint(&p, (const unsigned char*)value + valueLen, &atime) == REDIS_ERR)
+                continue;
+
+            if (count == size) {
+                size = size ? size*2 : 1024;
+                hot = zrealloc(hot, sizeof(leveldbHotKey)*size);
+            }
+            hot[count].name = sdsnewlen(data + 3, dataLen - 3);
+            hot[count].atime = atime;
+            hot[count].dbid = dbid;
+            hot[count].type = value[0];
+            count++;
+        }
+
+        leveldb_iter_get_error(iterator, &err);
+        leveldb_iter_destroy(iterator);
+        if (err != NULL) {
+            redisLog(REDIS_WARNING, "load leveldb hotness iterator err: %s", err);
+            leveldb_free(err);
+            success = REDIS_ERR;
+        }
     }
-    server.leveldb_op_num++;
-    sdsfree(leveldbkey);
-    
-    strkey = sdsdup(key->ptr);
-    retval = addFreezedKey(db->id, strkey, keytype);
-    redisAssertWithInfo(NULL,key,retval == REDIS_OK);
-    if(retval != REDIS_OK)
-    {
-        sdsfree(strkey);
+    sdsfree(prefix);
+    if (success == REDIS_ERR) {
+        leveldbFreeHotKeys(hot, count);
         return REDIS_ERR;
     }
-    
+    *hotp = hot;
+    *countp = count;
     return REDIS_OK;
 }
 
-int callCommandForleveldb(struct redisClient *fakeClient, char *data, size_t dataLen, leveldb_iterator_t *iterator) {
-    char *value = NULL;
-    size_t valueLen = 0;
-    int argc;
-    unsigned long len;
-    robj **argv;
-    struct redisCommand *cmd;
-    int tmptype;
-
-    tmptype = data[LEVELDB_KEY_FLAG_TYPE];
-    if(tmptype == 'h'){
-        argc = 4;
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-        argv[0] = createStringObject("hset",4);
-        len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-        argv[1] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-        argv[2] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY+len+1,dataLen-LEVELDB_KEY_FLAG_SET_KEY-len-1);
-        value = (char*) leveldb_iter_value(iterator, &valueLen);
-        argv[3] = createStringObject(value, valueLen);
-    }else if(tmptype == 's'){
-        argc = 3;
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-        argv[0] = createStringObject("sadd",4);
-        len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-        argv[1] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-        argv[2] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY+len+1,dataLen-LEVELDB_KEY_FLAG_SET_KEY-len-1);
-    }else if(tmptype == 'z'){
-        argc = 4;
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-        argv[0] = createStringObject("zadd",4);
-        len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-        argv[1] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-        argv[3] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY+len+1,dataLen-LEVELDB_KEY_FLAG_SET_KEY-len-1);
-        value = (char*) leveldb_iter_value(iterator, &valueLen);
-        argv[2] = createStringObject(value, valueLen);
-    }else if(tmptype == 'c'){
-        argc = 3;
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-        argv[0] = createStringObject("set",3);
-        len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-        argv[1] = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-        value = (char*) leveldb_iter_value(iterator, &valueLen);
-        argv[2] = createStringObject(value, valueLen);
-    }else{
-        redisLog(REDIS_WARNING,"callCommandForLeveldb no found type: %d %d", fakeClient->db->id, tmptype);
-        freeFakeClientArgv(fakeClient);
-        return REDIS_ERR;
-    }
+/* Give the loaded object the access time of the index, as the LRU clock
+ * would have set it. */
+static void leveldbSetAccessTime(robj *o, time_t atime) {
+    time_t oldest = time(NULL) - (time_t)(REDIS_LRU_CLOCK_MAX-1)*REDIS_LRU_CLOCK_RESOLUTION;
 
-    cmd = lookupCommand(argv[0]->ptr);
-    if (!cmd) {
-        redisLog(REDIS_WARNING,"Unknown command '%s' from leveldb", (char*)argv[0]->ptr);
-        exit(1);
-    }
-    cmd->proc(fakeClient);
+    if (atime < oldest) atime = oldest;
+    o->lru = (atime/REDIS_LRU_CLOCK_RESOLUTION) & REDIS_LRU_CLOCK_MAX;
+}
 
-    /* The fake client should not have a reply */
-    redisAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
-    /* Clean up. Command code may have changed argv/argc so we use the
-     * argv/argc of the client instead of the local variables. */
-    freeFakeClientArgv(fakeClient);
-    
-    return REDIS_OK;
+/* Load the indexed keys, hottest first, until the memory used but the
+ * index itself reaches the budget. */
+static int leveldbLoadHotKeysFirst(struct leveldb *ldb, long long *records, long long *keys) {
+    size_t used = zmalloc_used_memory(), indexbytes;
+    leveldbHotKey *hot;
+    leveldbKeyLoader loader;
+    long count, j;
+    int success = REDIS_OK;
+
+    if (leveldbLoadHotKeys(ldb, &hot, &count) == REDIS_ERR) return REDIS_ERR;
+    indexbytes = zmalloc_used_memory() - used;
+    qsort(hot, count, sizeof(leveldbHotKey), leveldbCompareHotKeys);
+    redisLog(REDIS_NOTICE, "load leveldb hotness index: %ld keys", count);
+
+    leveldbLoaderInit(&loader);
+    for (j = 0; j < count; j++) {
+        leveldbHotKey *k = hot+j;
+        dictEntry *de;
+
+        if (zmalloc_used_memory() - indexbytes >= server.leveldb_load_max_memory) break;
+        if (dictFind(server.db[k->dbid].dict, k->name) != NULL ||
+            leveldbFreezedKeyType(k->dbid, k->name) ||
+            leveldbLoadKeyExpired(k->dbid, k->name)) continue;
+
+        leveldbLoaderReset(&loader);
+        if (leveldbReadKeyRecords(ldb, k->dbid, k->name, k->type, &loader) == REDIS_ERR) {
+            success = REDIS_ERR;
+            break;
+        }
+        if (loader.count == 0) {
+            /* The key was deleted or changed type. */
+            sds metakey = leveldbAccessMetaKey(ldb->dbslot[k->dbid], k->name);
+
+            leveldbBatchDelete(ldb, metakey, sdslen(metakey));
+            sdsfree(metakey);
+            if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
+            continue;
+        }
+        *records += loader.count;
+        if (leveldbLoaderInsert(&loader) == REDIS_ERR) {
+            success = REDIS_ERR;
+            break;
+        }
+        if ((de = dictFind(server.db[k->dbid].dict, k->name)) != NULL)
+            leveldbSetAccessTime(dictGetVal(de), k->atime);
+        if (!(++*keys % 100000)) {
+            processEventsWhileBlocked();
+            redisLog(REDIS_NOTICE, "load leveldb: %lld hot keys", *keys);
+        }
+    }
+    leveldbLoaderFree(&loader);
+    leveldbFreeHotKeys(hot, count);
+    leveldbFlush(ldb);
+    return success;
 }
 
-int meltKey(int dbid, struct leveldb *ldb, robj *key, char keytype) {
-    int success = 1;
-    char *data = NULL;
-    size_t dataLen = 0;
-    size_t keylen = sdslen(key->ptr);
-    sds leveldbkey;
-    sds sdskey;
+/* Walk the records of a shard, loading the keys that fit in the budget or
+ * are volatile, and freezing the others. */
+static int leveldbLoadBudgetShard(struct leveldb *ldb, leveldb_t *db, long long *records,
+                                  long long *keys, long long *frozen)
+{
+    leveldb_iterator_t *iterator = leveldb_create_iterator(db, ldb->roptions);
+    leveldbKeyLoader loader;
+    leveldbRecordKey rk;
+    int skip = 1, pending = 0, success = REDIS_OK;
     char *err = NULL;
-    struct redisClient *fakeClient = ldb->fakeClient;
 
-    if(selectDb(fakeClient,dbid) == REDIS_ERR) {
-        redisLog(REDIS_WARNING, "meltKey select db error: %d", dbid);
-        return REDIS_ERR;
-    }
-    
-    leveldbkey = createleveldbFreezedKeyHead(dbid, key->ptr);
-    leveldb_delete(ldb->db, ldb->woptions, leveldbkey, sdslen(leveldbkey), &err);
-    if (err != NULL) {
-        redisLog(REDIS_WARNING, "meltKey leveldb err: %s", err);
-        leveldb_free(err); 
-        sdsfree(leveldbkey);
-        err = NULL;
-        return REDIS_ERR;
-    }
-    sdsfree(leveldbkey);
-    server.leveldb_op_num++;
-    
-    dictDelete(server.db[dbid].freezed,key->ptr);
-
-    char tmp[LEVELDB_KEY_FLAG_SET_KEY];
-    tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-    tmp[LEVELDB_KEY_FLAG_TYPE] = keytype;
-    tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = keylen;
-    sdskey = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
-    sdskey = sdscatsds(sdskey, key->ptr);
-    
-    leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
-    for(leveldb_iter_seek(iterator, sdskey, sdslen(sdskey)); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-        data = (char*) leveldb_iter_key(iterator, &dataLen);
-        if(data[LEVELDB_KEY_FLAG_SET_KEY_LEN] != (char)keylen) break;
-        if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid) break;
-        if(memcmp(key->ptr, data + LEVELDB_KEY_FLAG_SET_KEY, keylen) != 0) break;
-        
-        if (callCommandForleveldb(fakeClient, data, dataLen, iterator) == REDIS_OK) {
-            server.dirty++;
-        } else {
-            success = 0;
+    leveldbLoaderInit(&loader);
+    leveldb_iter_seek_to_first(iterator);
+    while (leveldb_iter_valid(iterator)) {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value;
+
+        if (leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR && rk.dbid >= 0) {
+            redisLog(REDIS_WARNING, "load leveldb bad record key, len: %zu", dataLen);
+            success = REDIS_ERR;
+            break;
+        }
+        if (rk.dbid == LEVELDB_SLOT_SWEEPING) {
+            char next = rk.slot + 1;
+
+            leveldb_iter_seek(iterator, &next, 1);
+            continue;
+        }
+        if (rk.slot == LEVELDB_META_SLOT) break;
+        if (rk.dbid < 0) {
+            redisLog(REDIS_WARNING, "load leveldb select db error: %d", rk.slot);
+            success = REDIS_ERR;
             break;
         }
+        if (!(++*records % 1000000)) {
+            processEventsWhileBlocked();
+            redisLog(REDIS_NOTICE, "load leveldb: %lld records, %lld keys, %lld frozen",
+                *records, *keys, *frozen);
+        }
+        if (rk.type == 'f') {
+            leveldb_iter_next(iterator);
+            continue;
+        }
+
+        if (!leveldbLoaderIsKey(&loader, &rk)) {
+            if (!skip && loader.count) {
+                if (leveldbLoaderInsert(&loader) == REDIS_ERR) {
+                    success = REDIS_ERR;
+                    break;
+                }
+                (*keys)++;
+            }
+            leveldbLoaderStart(&loader, &rk);
+            skip = dictFind(server.db[rk.dbid].dict, loader.key) != NULL ||
+                   leveldbFreezedKeyType(rk.dbid, loader.key) ||
+                   leveldbLoadKeyExpired(rk.dbid, loader.key);
+            pending = !skip;
+        }
+
+        /* Decide on the first record of the live generation. */
+        if (pending && rk.gen == loader.gen) {
+            pending = 0;
+            if (zmalloc_used_memory() >= server.leveldb_load_max_memory &&
+                dictFind(leveldb_load_expires[rk.dbid], loader.key) == NULL)
+            {
+                sds metakey = createleveldbFreezedKeyHead(rk.dbid, loader.key);
+                sds prefix = sdsnewlen(data, rk.key + rk.keylen - data);
+                sds end = leveldbPrefixEnd(prefix);
+
+                leveldbBatchPut(ldb, metakey, sdslen(metakey), &rk.type, 1);
+                if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
+                addFreezedKey(rk.dbid, sdsdup(loader.key), rk.type);
+                (*frozen)++;
+                skip = 1;
+
+                /* The records of the key, of any generation, share the
+                 * prefix, and the slot byte is never 0xff here. */
+                leveldb_iter_seek(iterator, end, sdslen(end));
+                sdsfree(metakey);
+                sdsfree(prefix);
+                sdsfree(end);
+                continue;
+            }
+        }
+        if (!skip) {
+            value = leveldb_iter_value(iterator, &valueLen);
+            leveldbLoaderAdd(&loader, &rk, value, valueLen);
+        }
+        leveldb_iter_next(iterator);
     }
-    
-    sdsfree(sdskey);
-    
+    if (success == REDIS_OK && !skip && loader.count) {
+        if (leveldbLoaderInsert(&loader) == REDIS_ERR) success = REDIS_ERR;
+        else (*keys)++;
+    }
+
     leveldb_iter_get_error(iterator, &err);
-    if(err != NULL) {
-        redisLog(REDIS_WARNING, "meltKey iterator err: %s", err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "load leveldb iterator err: %s", err);
         leveldb_free(err);
-        err = NULL;
+        success = REDIS_ERR;
     }
-
+    leveldbLoaderFree(&loader);
     leveldb_iter_destroy(iterator);
-    if(success == 1) {
-        return REDIS_OK;
+    return success;
+}
+
+static int leveldbLoadBudget(struct leveldb *ldb, long long *records, long long *keys) {
+    long long frozen = 0;
+    int shard;
+
+    redisLog(REDIS_NOTICE, "load leveldb within %llu bytes", server.leveldb_load_max_memory);
+    if (leveldbLoadHotKeysFirst(ldb, records, keys) == REDIS_ERR) return REDIS_ERR;
+    for (shard = 0; shard < ldb->numshards; shard++) {
+        if (leveldbLoadBudgetShard(ldb, ldb->shards[shard].db, records, keys, &frozen) == REDIS_ERR)
+            return REDIS_ERR;
     }
-    return REDIS_ERR;
+    leveldbFlush(ldb);
+    server.leveldb_load_freezes = frozen;
+    redisLog(REDIS_NOTICE, "load leveldb: %lld keys frozen to stay within leveldb-load-max-memory", frozen);
+    return REDIS_OK;
 }
 
 int loadleveldb(char *path) {
   redisLog(REDIS_NOTICE, "load leveldb path: %s", path);
 
-  struct redisClient *fakeClient = createFakeClient();
   int old_leveldb_state = server.leveldb_state;
-  long loops = 0;
+  long long start = ustime();
+  long long records = 0, keys = 0, inserted = 0, progress = 0;
+  int success = 1;
+  int nranges = 0, parts, shard, j;
+  leveldbLoadRange *ranges;
+
+  if (server.dbnum >= LEVELDB_MAX_SLOTS) {
+    redisLog(REDIS_WARNING, "leveldb supports up to %d databases", LEVELDB_MAX_SLOTS-1);
+    return REDIS_ERR;
+  }
 
   server.leveldb_state = REDIS_LEVELDB_OFF;
   initleveldb(&server.ldb, path);
-  server.ldb.fakeClient = fakeClient;
+  for (shard = 0; shard < server.ldb.numshards; shard++) {
+    sds dir = leveldbShardPath(path, shard);
+
+    leveldbBackupCleanStaging(dir);
+    sdsfree(dir);
+  }
+  startLoading(NULL);
   
-  if(loadFreezedKey(&server.ldb) == REDIS_ERR) {
+  if(leveldbCheckShards(&server.ldb) == REDIS_ERR ||
+     leveldbRecoverShards(&server.ldb) == REDIS_ERR ||
+     leveldbMigrate(&server.ldb) == REDIS_ERR ||
+     leveldbLoadMeta(&server.ldb) == REDIS_ERR ||
+     loadFreezedKey(&server.ldb) == REDIS_ERR ||
+     leveldbLoadExpires(&server.ldb) == REDIS_ERR) {
+    leveldbFreeLoadExpires();
+    stopLoading();
     server.leveldb_state = old_leveldb_state;
     return REDIS_ERR;
   }
-  
-  startLoading(NULL);
 
-  int success = 1;
-  int dbid = 0;
-  char *data = NULL;
-  size_t dataLen = 0;
-  int tmpdbid;
-  leveldb_iterator_t *iterator = leveldb_create_iterator(server.ldb.db, server.ldb.roptions);
+  if (server.leveldb_load_max_memory) {
+    if (leveldbLoadBudget(&server.ldb, &records, &keys) == REDIS_ERR) success = 0;
+    goto loaded;
+  }
 
-  for(leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-    unsigned long len;
-    robj *tmpkey;
+  if (server.leveldb_lazy_load) {
+    leveldbLazyLoadStart(&server.ldb, start);
+    redisLog(REDIS_NOTICE, "lazy load leveldb: the key space is loaded in background");
+    stopLoading();
+    server.leveldb_state = old_leveldb_state;
+    return REDIS_OK;
+  }
 
-    if (!(loops++ % 1000000)) {
-      processEventsWhileBlocked();
-      redisLog(REDIS_NOTICE, "load leveldb: %lu", loops);
+  parts = (server.leveldb_load_threads + server.ldb.numshards - 1) / server.ldb.numshards;
+  ranges = zcalloc(sizeof(leveldbLoadRange)*parts*server.ldb.numshards);
+  for (shard = 0; shard < server.ldb.numshards; shard++) {
+    leveldb_t *db = server.ldb.shards[shard].db;
+    sds *cuts;
+    int count = leveldbLoadSplit(&server.ldb, db, parts, &cuts);
+
+    for (j = 0; j < count; j++, nranges++) {
+      ranges[nranges].db = db;
+      ranges[nranges].start = j ? cuts[j-1] : NULL;
+      ranges[nranges].limit = j < count-1 ? cuts[j] : NULL;
+      ranges[nranges].batch = zcalloc(sizeof(leveldbLoadBatch));
     }
-    data = (char*) leveldb_iter_key(iterator, &dataLen);
-    tmpdbid = data[LEVELDB_KEY_FLAG_DATABASE_ID];
-    if(tmpdbid != dbid) {
-      if(selectDb(fakeClient,tmpdbid) == REDIS_OK ){
-        dbid = tmpdbid;
-      }else{
-        redisLog(REDIS_WARNING, "load leveldb select db error: %d", tmpdbid);
-        success = 0;
-        break;
-      }
+    zfree(cuts);
+  }
+  for (j = 0; j < nranges; j++) ranges[j].threaded = nranges > 1;
+
+  if (nranges == 1) {
+    leveldbLoadRangeRecords(ranges);
+  } else {
+    pthread_attr_t attr;
+    pthread_t *threads = zmalloc(sizeof(pthread_t)*nranges);
+    size_t stacksize;
+
+    redisLog(REDIS_NOTICE, "load leveldb with %d threads", nranges);
+
+    /* The loaders look up the frozen keys, the generations and the expires:
+     * the dicts must not be modified by an incremental rehash step while
+     * they run. */
+    for (j = 0; j < server.dbnum; j++) {
+      while (dictIsRehashing(server.db[j].freezed)) dictRehash(server.db[j].freezed, 100);
+      while (dictIsRehashing(server.db[j].generations)) dictRehash(server.db[j].generations, 100);
+      while (dictIsRehashing(leveldb_load_expires[j])) dictRehash(leveldb_load_expires[j], 100);
     }
-    
-    len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-    tmpkey = createStringObject(data+LEVELDB_KEY_FLAG_SET_KEY,len);
-    if(isKeyFreezed(dbid, tmpkey) == 1) {
-      decrRefCount(tmpkey);
-      continue;
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1;
+    while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    leveldb_load_queue = listCreate();
+    leveldb_load_running = nranges;
+    leveldb_load_abort = 0;
+    for (j = 0; j < nranges; j++) {
+      if (pthread_create(&threads[j],&attr,leveldbLoadThread,ranges+j) != 0) {
+        redisLog(REDIS_WARNING,"Fatal: Can't create leveldb loader thread.");
+        exit(1);
+      }
     }
-    decrRefCount(tmpkey);
-    
-    if (callCommandForleveldb(fakeClient, data, dataLen, iterator) == REDIS_ERR) {
-      success = 0;
-      break;
+
+    pthread_mutex_lock(&leveldb_load_mutex);
+    while (leveldb_load_running || listLength(leveldb_load_queue)) {
+      listNode *ln = listFirst(leveldb_load_queue);
+
+      if (ln == NULL) {
+        struct timespec ts;
+        long long deadline = ustime() + 100000;
+
+        ts.tv_sec = deadline / 1000000;
+        ts.tv_nsec = (deadline % 1000000) * 1000;
+        pthread_cond_timedwait(&leveldb_load_cond, &leveldb_load_mutex, &ts);
+        pthread_mutex_unlock(&leveldb_load_mutex);
+        processEventsWhileBlocked();
+        pthread_mutex_lock(&leveldb_load_mutex);
+        continue;
+      }
+
+      leveldbLoadBatch *b = listNodeValue(ln);
+      listDelNode(leveldb_load_queue, ln);
+      pthread_cond_broadcast(&leveldb_load_cond);
+      pthread_mutex_unlock(&leveldb_load_mutex);
+
+      inserted += b->records;
+      leveldbLoadInsertBatch(b);
+      zfree(b);
+      if (inserted - progress >= 1000000) {
+        progress = inserted;
+        processEventsWhileBlocked();
+        redisLog(REDIS_NOTICE, "load leveldb: %lld records", inserted);
+      }
+      pthread_mutex_lock(&leveldb_load_mutex);
     }
+    pthread_mutex_unlock(&leveldb_load_mutex);
+
+    for (j = 0; j < nranges; j++) pthread_join(threads[j], NULL);
+    listRelease(leveldb_load_queue);
+    leveldb_load_queue = NULL;
+    pthread_attr_destroy(&attr);
+    zfree(threads);
+  }
+
+  for (j = 0; j < nranges; j++) {
+    leveldbLoadInsertBatch(ranges[j].batch); /* Left by failed loaders. */
+    zfree(ranges[j].batch);
+    records += ranges[j].records;
+    keys += ranges[j].keys;
+    if (ranges[j].err) success = 0;
+    sdsfree(ranges[j].start);
   }
-  redisLog(REDIS_NOTICE, "load leveldb sum: %lu", loops);
+  zfree(ranges);
+
+loaded:
+  server.leveldb_load_records = records;
+  server.leveldb_load_keys = keys;
+  server.leveldb_load_usec = ustime() - start;
+  redisLog(REDIS_NOTICE, "load leveldb sum: %lld records, %lld keys, %.0f records/sec",
+      records, keys, (double)records*1000000/(server.leveldb_load_usec ? server.leveldb_load_usec : 1));
+
+  if (success) leveldbApplyLoadExpires(&server.ldb);
+  leveldbFreeLoadExpires();
+  leveldbHotnessLoaded();
 
   stopLoading();
   server.leveldb_state = old_leveldb_state;
 
-  char *err = NULL;
-  leveldb_iter_get_error(iterator, &err);
-  if(err != NULL) {
-    redisLog(REDIS_WARNING, "load leveldb iterator err: %s", err);
-    leveldb_free(err);
-    err = NULL;
-  }
-
-  leveldb_iter_destroy(iterator);
   if(success == 1) {
     return REDIS_OK;
   }
@@ -356,24 +4822,36 @@ int loadleveldb(char *path) {
 }
 
 void closeleveldb(struct leveldb *ldb) {
+  int j;
+
+  leveldbLazyLoadFree();
+  leveldbCoalesceFlush(ldb);
+  leveldbDrain(ldb);
+  leveldb_sweep_stop = 1;
+  bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_SWEEP, 0);
+  bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_MELT, 0);
+  bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_FSYNC, 0);
+  leveldb_snapshot_stop = 1;
+  bioWaitPendingJobsLE(REDIS_BIO_LEVELDB_SNAPSHOT, 0);
+  if (leveldb_snapshot_job) leveldbFreeSnapshotJob(leveldb_snapshot_job);
+  if (server.leveldb_fsync != REDIS_LEVELDB_FSYNC_NO) leveldbSyncLog(ldb);
+  zfree(ldb->dbslot);
+  listRelease(ldb->batchsweeps);
   leveldb_writeoptions_destroy(ldb->woptions);
+  leveldb_writeoptions_destroy(ldb->swoptions);
   leveldb_readoptions_destroy(ldb->roptions);
+  leveldb_readoptions_destroy(ldb->proptions);
+  for (j = 0; j < ldb->numshards; j++) {
+    leveldb_writebatch_destroy(ldb->shards[j].wb);
+    leveldb_close(ldb->shards[j].db);
+  }
+  zfree(ldb->shards);
   leveldb_options_destroy(ldb->options);
-  leveldb_close(ldb->db);
-  freeFakeClient(ldb->fakeClient);
+  leveldb_cache_destroy(ldb->cache);
 }
 
 sds createleveldbStringHead(int dbid, sds name) {
-  char tmp[LEVELDB_KEY_FLAG_SET_KEY];
-
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  tmp[LEVELDB_KEY_FLAG_TYPE] = 'c';
-  tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = sdslen(name);
-
-  sds key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
-
-  key = sdscatsds(key, name);
-  return key;
+  return leveldbKeyPrefix(dbid, 'c', name);
 }
 
 void leveldbSet(int dbid, struct leveldb *ldb, robj** argv) {
@@ -385,49 +4863,111 @@ void leveldbSetDirect(int dbid, struct leveldb *ldb, robj *argv1, robj *argv2) {
     return;
   }
 
-  robj *r1 = getDecodedObject(argv1);
-  robj *r2 = getDecodedObject(argv2);
-  sds key = createleveldbStringHead(dbid, r1->ptr);
-  char *err = NULL;
+  robj *r1 = getDecodedObject(argv1);
+
+  if (argv2->encoding == REDIS_ENCODING_INT) {
+    sds key = createleveldbStringHead(dbid, r1->ptr);
+    sds val = leveldbEncodeObjectValue(argv2);
+
+    leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
+    sdsfree(key);
+    sdsfree(val);
+  } else {
+    leveldbPutString(ldb, ldb->dbslot[dbid], r1->ptr, argv2->ptr, sdslen(argv2->ptr));
+  }
+  leveldbCommit(ldb);
+
+  decrRefCount(r1);
+}
+
+/* The new value of a counter (INCR and friends), see leveldbCoalesce(). */
+void leveldbSetCounter(int dbid, struct leveldb *ldb, robj *key, robj *val) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF || leveldbCoalesce(dbid, 'c', key, NULL)) {
+    return;
+  }
+  leveldbSetDirect(dbid, ldb, key, val);
+}
+
+/* SETRANGE, APPEND and SETBIT changed in place 'len' bytes from 'offset' of
+ * the string 'val', that was 'oldlen' bytes long: once the string is stored
+ * in pages only the pages that changed are written. The bytes between the
+ * old end and 'offset' were zero padded, the whole tail is written then. */
+void leveldbSetStringRange(int dbid, struct leveldb *ldb, robj *key, robj *val,
+                           size_t oldlen, size_t offset, size_t len)
+{
+  size_t newlen, end;
+  robj *r1;
+
+  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+    return;
+  }
+  if (leveldbObjectPages(val) == 0 || leveldbStringPages(oldlen) == 0) {
+    leveldbSetDirect(dbid, ldb, key, val);
+    return;
+  }
+
+  newlen = sdslen(val->ptr);
+  end = offset+len;
+  if (newlen > oldlen) {
+    if (offset > oldlen) offset = oldlen;
+    end = newlen;
+  }
+  if (end <= offset) return;
+
+  r1 = getDecodedObject(key);
+  if (newlen != oldlen) {
+    sds headkey = createleveldbStringHead(dbid, r1->ptr);
+    sds headval = leveldbEncodePagedValue(newlen);
+
+    leveldbBatchPut(ldb, headkey, sdslen(headkey), headval, sdslen(headval));
+    sdsfree(headkey);
+    sdsfree(headval);
+  }
+  leveldbPutStringPages(ldb, ldb->dbslot[dbid], r1->ptr, val->ptr, newlen,
+                        offset/LEVELDB_STRING_PAGE_SIZE, (end-1)/LEVELDB_STRING_PAGE_SIZE);
+  leveldbCommit(ldb);
+  decrRefCount(r1);
+}
+
+/* Called by dbOverwrite() before 'old' is replaced by 'val': the pages of a
+ * string the new value does not rewrite are deleted, in the same write as
+ * the new value. The records of a string replaced by another type are all
+ * deleted. */
+void leveldbOverwriteString(int dbid, struct leveldb *ldb, robj *key, robj *old, robj *val) {
+  size_t pages;
+  robj *r1;
 
-  leveldb_put(ldb->db, ldb->woptions, key, sdslen(key), r2->ptr, sdslen(r2->ptr), &err);
-  procLeveldbError(err, "set direct leveldb err: %s");
-  server.leveldb_op_num++;
+  if(server.leveldb_state == REDIS_LEVELDB_OFF || (pages = leveldbObjectPages(old)) == 0) {
+    return;
+  }
+  if (val->type != REDIS_STRING) {
+    leveldbDelString(dbid, ldb, key, old);
+    return;
+  }
 
-  sdsfree(key);
+  r1 = getDecodedObject(key);
+  leveldbDelStringPages(ldb, ldb->dbslot[dbid], r1->ptr, leveldbObjectPages(val), pages);
   decrRefCount(r1);
-  decrRefCount(r2);
 }
 
-void leveldbDelString(int dbid, struct leveldb *ldb, robj* argv) {
+void leveldbDelString(int dbid, struct leveldb *ldb, robj* argv, robj *val) {
   if(server.leveldb_state == REDIS_LEVELDB_OFF) {
     return;
   }
   
   robj *r1 = getDecodedObject(argv);
   sds sdskey = createleveldbStringHead(dbid, r1->ptr);
-  char *err = NULL;
 
-  leveldb_delete(ldb->db, ldb->woptions, sdskey, sdslen(sdskey), &err);
-  procLeveldbError(err, "leveldbDel leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbBatchDelete(ldb, sdskey, sdslen(sdskey));
+  leveldbDelStringPages(ldb, ldb->dbslot[dbid], r1->ptr, 0, leveldbObjectPages(val));
+  leveldbCommit(ldb);
   
   sdsfree(sdskey);
   decrRefCount(r1);
 }
 
 sds createleveldbHashHead(int dbid, sds name) {
-  char tmp[LEVELDB_KEY_FLAG_SET_KEY];
-
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  tmp[LEVELDB_KEY_FLAG_TYPE] = 'h';
-  tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = sdslen(name);
-
-  sds key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
-
-  key = sdscatsds(key, name);
-  key = sdscat(key, "=");
-  return key;
+  return leveldbKeyPrefix(dbid, 'h', name);
 }
 
 void leveldbHset(int dbid, struct leveldb *ldb, robj** argv) {
@@ -435,25 +4975,23 @@ void leveldbHset(int dbid, struct leveldb *ldb, robj** argv) {
 }
 
 void leveldbHsetDirect(int dbid, struct leveldb *ldb, robj *argv1, robj *argv2, robj *argv3) {
-  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF || leveldbCoalesce(dbid, 'h', argv1, argv2)) {
     return;
   }
 
   robj *r1 = getDecodedObject(argv1);
   robj *r2 = getDecodedObject(argv2);
-  robj *r3 = getDecodedObject(argv3);
   sds key = createleveldbHashHead(dbid, r1->ptr);
-  char *err = NULL;
+  sds val = leveldbEncodeObjectValue(argv3);
 
   key = sdscatsds(key, r2->ptr);
-  leveldb_put(ldb->db, ldb->woptions, key, sdslen(key), r3->ptr, sdslen(r3->ptr), &err);
-  procLeveldbError(err, "hset direct leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
+  leveldbCommit(ldb);
 
   sdsfree(key);
+  sdsfree(val);
   decrRefCount(r1);
   decrRefCount(r2);
-  decrRefCount(r3);
 }
 
 void leveldbHmset(int dbid, struct leveldb *ldb, robj** argv, int argc) {
@@ -463,28 +5001,25 @@ void leveldbHmset(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbHashHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
-  robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
+  robj **rs = zmalloc(sizeof(robj*)*(argc - 2)/2);
   size_t klen = sdslen(key);
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i += 2) {
+    sds val = leveldbEncodeObjectValue(argv[i+1]);
+
     rs[j] = getDecodedObject(argv[i]);
-    rs[j+1] = getDecodedObject(argv[i+1]);
     key = sdscatsds(key, rs[j]->ptr);
-    leveldb_writebatch_put(wb, key, sdslen(key), rs[j+1]->ptr, sdslen(rs[j+1]->ptr));
+    leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
     sdsrange(key, 0, klen - 1);
-    j += 2;
+    sdsfree(val);
+    j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "hmset leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
-  for(j = 0; j < argc - 2; j++) {
+  for(j = 0; j < (argc - 2)/2; j++) {
     decrRefCount(rs[j]);
   }
   zfree(rs);
@@ -497,26 +5032,21 @@ void leveldbHdel(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbHashHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
   robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
   size_t klen = sdslen(key);
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i++) {
     rs[j] = getDecodedObject(argv[i]);
     key = sdscatsds(key, rs[j]->ptr);
-    leveldb_writebatch_delete(wb, key, sdslen(key));
+    leveldbBatchDelete(ldb, key, sdslen(key));
     sdsrange(key, 0, klen - 1);
     j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "hdel leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
   for(j = 0; j < argc - 2; j++) {
     decrRefCount(rs[j]);
   }
@@ -530,25 +5060,21 @@ void leveldbHclear(int dbid, struct leveldb *ldb, robj *argv) {
 
   robj *r1 = getDecodedObject(argv);
   sds key = createleveldbHashHead(dbid, r1->ptr);
-  leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+  leveldb_iterator_t *iterator;
   char *data = NULL;
   size_t dataLen = 0;
-  size_t keyLen = sdslen(r1->ptr);
-  int cmp;
   size_t klen = sdslen(key);
   char *err = NULL;
 
+  leveldbDrain(ldb);
+  iterator = leveldb_create_iterator(leveldbKeyDb(ldb, r1->ptr), ldb->roptions);
   for(leveldb_iter_seek(iterator, key, klen); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
     data = (char*) leveldb_iter_key(iterator, &dataLen);
-    size_t len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-    if(len != keyLen) break;
-    if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid) break;
-    cmp = memcmp(r1->ptr, data + LEVELDB_KEY_FLAG_SET_KEY, len);
-    if(cmp != 0) break;
-    leveldb_delete(ldb->db, ldb->woptions, data, dataLen, &err);
-    procLeveldbError(err, "hclear leveldb err: %s");
+    if(dataLen < klen || memcmp(data, key, klen) != 0) break;
+    leveldbBatchDelete(ldb, data, dataLen);
+    if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
   }
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -558,17 +5084,7 @@ void leveldbHclear(int dbid, struct leveldb *ldb, robj *argv) {
 }
 
 sds createleveldbSetHead(int dbid, sds name) {
-  char tmp[LEVELDB_KEY_FLAG_SET_KEY];
-
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  tmp[LEVELDB_KEY_FLAG_TYPE] = 's';
-  tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = sdslen(name);
-
-  sds key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
-
-  key = sdscatsds(key, name);
-  key = sdscat(key, "=");
-  return key;
+  return leveldbKeyPrefix(dbid, 's', name);
 }
 
 void leveldbSadd(int dbid, struct leveldb *ldb, robj** argv, int argc) {
@@ -578,26 +5094,21 @@ void leveldbSadd(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbSetHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
   robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
   size_t klen = sdslen(key);
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i++) {
     rs[j] = getDecodedObject(argv[i]);
     key = sdscatsds(key, rs[j]->ptr);
-    leveldb_writebatch_put(wb, key, sdslen(key), NULL, 0);
+    leveldbBatchPut(ldb, key, sdslen(key), NULL, 0);
     sdsrange(key, 0, klen - 1);
     j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "sadd leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
   for(j = 0; j < argc - 2; j++) {
     decrRefCount(rs[j]);
   }
@@ -611,32 +5122,52 @@ void leveldbSrem(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbSetHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
   robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
   size_t klen = sdslen(key);
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i++ ) {
     rs[j] = getDecodedObject(argv[i]);
     key = sdscatsds(key, rs[j]->ptr);
-    leveldb_writebatch_delete(wb, key, sdslen(key));
+    leveldbBatchDelete(ldb, key, sdslen(key));
     sdsrange(key, 0, klen - 1);
     j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "srem leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
   for(j = 0; j < argc - 2; j++) {
     decrRefCount(rs[j]);
   }
   zfree(rs);
 }
 
+/* Move the record of 'member' from the set 'src' to the set 'dst'. */
+void leveldbSmove(int dbid, struct leveldb *ldb, robj *src, robj *dst, robj *member) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+    return;
+  }
+
+  robj *r1 = getDecodedObject(src);
+  robj *r2 = getDecodedObject(dst);
+  robj *r3 = getDecodedObject(member);
+  sds key = createleveldbSetHead(dbid, r1->ptr);
+
+  key = sdscatsds(key, r3->ptr);
+  leveldbBatchDelete(ldb, key, sdslen(key));
+  sdsfree(key);
+  key = createleveldbSetHead(dbid, r2->ptr);
+  key = sdscatsds(key, r3->ptr);
+  leveldbBatchPut(ldb, key, sdslen(key), NULL, 0);
+  leveldbCommit(ldb);
+
+  sdsfree(key);
+  decrRefCount(r1);
+  decrRefCount(r2);
+  decrRefCount(r3);
+}
+
 void leveldbSclear(int dbid, struct leveldb *ldb, robj* argv) {
   if(server.leveldb_state == REDIS_LEVELDB_OFF) {
     return;
@@ -644,25 +5175,21 @@ void leveldbSclear(int dbid, struct leveldb *ldb, robj* argv) {
 
   robj *r1 = getDecodedObject(argv);
   sds key = createleveldbSetHead(dbid, r1->ptr);
-  leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+  leveldb_iterator_t *iterator;
   char *data = NULL;
   size_t dataLen = 0;
-  size_t keyLen = sdslen(r1->ptr);
-  int cmp;
   size_t klen = sdslen(key);
   char *err = NULL;
 
+  leveldbDrain(ldb);
+  iterator = leveldb_create_iterator(leveldbKeyDb(ldb, r1->ptr), ldb->roptions);
   for(leveldb_iter_seek(iterator, key, klen); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
     data = (char*) leveldb_iter_key(iterator, &dataLen);
-    size_t len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-    if(len != keyLen) break;
-    if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid) break;
-    cmp = memcmp(r1->ptr, data + LEVELDB_KEY_FLAG_SET_KEY, len);
-    if(cmp != 0) break;
-    leveldb_delete(ldb->db, ldb->woptions, data, dataLen, &err);
-    procLeveldbError(err, "sclear leveldb err: %s");
+    if(dataLen < klen || memcmp(data, key, klen) != 0) break;
+    leveldbBatchDelete(ldb, data, dataLen);
+    if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
   }
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -672,17 +5199,7 @@ void leveldbSclear(int dbid, struct leveldb *ldb, robj* argv) {
 }
 
 sds createleveldbSortedSetHead(int dbid, sds name) {
-  char tmp[LEVELDB_KEY_FLAG_SET_KEY];
-
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  tmp[LEVELDB_KEY_FLAG_TYPE] = 'z';
-  tmp[LEVELDB_KEY_FLAG_SET_KEY_LEN] = sdslen(name);
-
-  sds key = sdsnewlen(tmp, LEVELDB_KEY_FLAG_SET_KEY);
-
-  key = sdscatsds(key, name);
-  key = sdscat(key, "=");
-  return key;
+  return leveldbKeyPrefix(dbid, 'z', name);
 }
 
 void leveldbZadd(int dbid, struct leveldb *ldb, robj** argv, int argc) {
@@ -692,35 +5209,34 @@ void leveldbZadd(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
-  robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
+  robj **rs = zmalloc(sizeof(robj*)*(argc - 2)/2);
   size_t klen = sdslen(key);
+  char buf[LEVELDB_SCORE_LEN];
+  double score;
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i += 2) {
-    rs[j] = getDecodedObject(argv[i]);
-    rs[j+1] = getDecodedObject(argv[i+1]);
-    key = sdscatsds(key, rs[j+1]->ptr);
-    leveldb_writebatch_put(wb, key, sdslen(key), rs[j]->ptr, sdslen(rs[j]->ptr));
+    /* The scores were validated by the command already. */
+    getDoubleFromObject(argv[i], &score);
+    leveldbEncodeScore(buf, score);
+    rs[j] = getDecodedObject(argv[i+1]);
+    key = sdscatsds(key, rs[j]->ptr);
+    leveldbBatchPut(ldb, key, sdslen(key), buf, sizeof(buf));
     sdsrange(key, 0, klen - 1);
-    j += 2;
+    j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "zadd leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
-  for(j = 0; j < argc - 2; j++) {
+  for(j = 0; j < (argc - 2)/2; j++) {
     decrRefCount(rs[j]);
   }
   zfree(rs);
 }
 
 void leveldbZaddDirect(int dbid, struct leveldb *ldb, robj* argv1, robj* argv2, double score) {
-  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF || leveldbCoalesce(dbid, 'z', argv1, argv2)) {
     return;
   }
 
@@ -729,13 +5245,11 @@ void leveldbZaddDirect(int dbid, struct leveldb *ldb, robj* argv1, robj* argv2,
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
   key = sdscatsds(key, r2->ptr);
   size_t klen = sdslen(key);
-  char *err = NULL;
-  char buf[128];
-  int len = snprintf(buf,sizeof(buf),"%.17g",score);
+  char buf[LEVELDB_SCORE_LEN];
 
-  leveldb_put(ldb->db, ldb->woptions, key, klen, buf, len, &err);
-  procLeveldbError(err, "zadd direct leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbEncodeScore(buf, score);
+  leveldbBatchPut(ldb, key, klen, buf, sizeof(buf));
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -749,26 +5263,21 @@ void leveldbZrem(int dbid, struct leveldb *ldb, robj** argv, int argc) {
 
   robj *r1 = getDecodedObject(argv[1]);
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
   robj **rs = zmalloc(sizeof(robj*)*(argc - 2));
   size_t klen = sdslen(key);
   int i, j = 0;
-  char *err = NULL;
 
   for (i = 2; i < argc; i++ ) {
     rs[j] = getDecodedObject(argv[i]);
     key = sdscatsds(key, rs[j]->ptr);
-    leveldb_writebatch_delete(wb, key, sdslen(key));
+    leveldbBatchDelete(ldb, key, sdslen(key));
     sdsrange(key, 0, klen - 1);
     j++;
   }
-  leveldb_write(ldb->db, ldb->woptions, wb, &err);
-  procLeveldbError(err, "zrem leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
-  leveldb_writebatch_destroy(wb);
   for(j = 0; j < argc - 2; j++) {
     decrRefCount(rs[j]);
   }
@@ -782,16 +5291,14 @@ void leveldbZremByLongLong(int dbid, struct leveldb *ldb, robj *arg, long long v
 
   robj *r1 = getDecodedObject(arg);
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
-  char *err = NULL;
   char buf[64];
   int len;
 
   len = ll2string(buf,64,vlong);
   key = sdscatlen(key, buf, len);
   //redisLog(REDIS_NOTICE, "leveldbZremByLongLong %s", key);
-  leveldb_delete(ldb->db, ldb->woptions, key, sdslen(key), &err);
-  procLeveldbError(err, "zrem by long long leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbBatchDelete(ldb, key, sdslen(key));
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -804,13 +5311,11 @@ void leveldbZremByCBuffer(int dbid, struct leveldb *ldb, robj *arg, unsigned cha
 
   robj *r1 = getDecodedObject(arg);
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
-  char *err = NULL;
 
   key = sdscatlen(key, vstr, vlen);
   //redisLog(REDIS_NOTICE, "leveldbZremByCBuffer %s", key);
-  leveldb_delete(ldb->db, ldb->woptions, key, sdslen(key), &err);
-  procLeveldbError(err, "zrem by c buffer leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbBatchDelete(ldb, key, sdslen(key));
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -824,13 +5329,11 @@ void leveldbZremByObject(int dbid, struct leveldb *ldb, robj *arg, robj *field)
   robj *r1 = getDecodedObject(arg);
   robj *r2 = getDecodedObject(field);
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
-  char *err = NULL;
 
   key = sdscatsds(key,  r2->ptr);
   //redisLog(REDIS_NOTICE, "leveldbZremByObject %s", key);
-  leveldb_delete(ldb->db, ldb->woptions, key, sdslen(key), &err);
-  procLeveldbError(err, "zrem by object leveldb err: %s");
-  server.leveldb_op_num++;
+  leveldbBatchDelete(ldb, key, sdslen(key));
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -846,23 +5349,18 @@ void leveldbZclear(int dbid, struct leveldb *ldb, robj* argv) {
   sds key = createleveldbSortedSetHead(dbid, r1->ptr);
   char *data = NULL;
   size_t dataLen = 0;
-  size_t keyLen = sdslen(r1->ptr);
-  int cmp;
   size_t klen = sdslen(key);
   char *err = NULL;
 
-  leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+  leveldbDrain(ldb);
+  leveldb_iterator_t *iterator = leveldb_create_iterator(leveldbKeyDb(ldb, r1->ptr), ldb->roptions);
   for(leveldb_iter_seek(iterator, key, klen); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
     data = (char*) leveldb_iter_key(iterator, &dataLen);
-    size_t len = data[LEVELDB_KEY_FLAG_SET_KEY_LEN];
-    if(len != keyLen) break;
-    if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid) break;
-    cmp = memcmp(r1->ptr, data + LEVELDB_KEY_FLAG_SET_KEY, len);
-    if(cmp != 0) break;
-    leveldb_delete(ldb->db, ldb->woptions, data, dataLen, &err);
-    procLeveldbError(err, "zclear leveldb err: %s");
+    if(dataLen < klen || memcmp(data, key, klen) != 0) break;
+    leveldbBatchDelete(ldb, data, dataLen);
+    if (ldb->wbops >= LEVELDB_CLEAR_BATCH_OPS) leveldbFlush(ldb);
   }
-  server.leveldb_op_num++;
+  leveldbCommit(ldb);
 
   sdsfree(key);
   decrRefCount(r1);
@@ -871,130 +5369,591 @@ void leveldbZclear(int dbid, struct leveldb *ldb, robj* argv) {
   leveldb_iter_destroy(iterator);
 }
 
-void leveldbFlushdb(int dbid, struct leveldb* ldb) {
-  char tmp[1];
-  char *err = NULL;
-  char *data = NULL;
-  size_t dataLen = 0;
-  leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+/* -----------------------------------------------------------------------------
+ * Lists
+ *
+ * The elements of a list are stored at consecutive sequence numbers:
+ *
+ * [slot]['L'][keylen][key][generation][sequence, 8 bytes] -> element
+ *
+ * The sequence is big endian with the sign bit flipped, so negative numbers
+ * sort first. Element 'i' is at head+i, and the head of every list is kept
+ * in db->listheads (absent when zero): pushes and pops at both ends stage a
+ * single record. LINSERT and LREM renumber the elements on the shorter side
+ * of the change, LTRIM only deletes the trimmed elements.
+ * -------------------------------------------------------------------------- */
+
+long long leveldbListHead(int dbid, sds key) {
+    dictEntry *de = dictFind(server.db[dbid].listheads, key);
+
+    return de ? dictGetSignedIntegerVal(de) : 0;
+}
 
-  tmp[LEVELDB_KEY_FLAG_DATABASE_ID] = dbid;
-  for(leveldb_iter_seek(iterator, tmp, 1); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-    data = (char*) leveldb_iter_key(iterator, &dataLen);
-    if(data[LEVELDB_KEY_FLAG_DATABASE_ID] != dbid) break;
-    leveldb_delete(ldb->db, ldb->woptions, data, dataLen, &err);
-    procLeveldbError(err, "flushdb leveldb err: %s");
-  }
-  server.leveldb_op_num++;
+void leveldbSetListHead(int dbid, sds key, long long head) {
+    dict *d = server.db[dbid].listheads;
+    dictEntry *de;
 
-  leveldb_iter_get_error(iterator, &err);
-  procLeveldbError(err, "flushdb leveldb iterator err: %s");
-  leveldb_iter_destroy(iterator);
+    if (head == 0) {
+        dictDelete(d, key);
+        return;
+    }
+    if ((de = dictFind(d, key)) == NULL) de = dictAddRaw(d, sdsdup(key));
+    dictSetSignedIntegerVal(de, head);
 }
 
-void leveldbFlushall(struct leveldb* ldb) {
-  char *err = NULL;
-  char *data = NULL;
-  size_t dataLen = 0;
-  leveldb_iterator_t *iterator = leveldb_create_iterator(ldb->db, ldb->roptions);
+static sds leveldbListPut(struct leveldb *ldb, sds key, size_t klen, long long seq, robj *value) {
+    sds val = leveldbEncodeObjectValue(value);
 
-  for(leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-    data = (char*) leveldb_iter_key(iterator, &dataLen);
-    leveldb_delete(ldb->db, ldb->woptions, data, dataLen, &err);
-    procLeveldbError(err, "flushall leveldb err: %s");
-  }
-  server.leveldb_op_num++;
+    key = leveldbCatInt64(key, seq);
+    leveldbBatchPut(ldb, key, sdslen(key), val, sdslen(val));
+    sdsrange(key, 0, klen - 1);
+    sdsfree(val);
+    return key;
+}
 
-  leveldb_iter_get_error(iterator, &err);
-  procLeveldbError(err, "flushall leveldb iterator err: %s");
-  leveldb_iter_destroy(iterator);
+static sds leveldbListDelete(struct leveldb *ldb, sds key, size_t klen, long long seq) {
+    key = leveldbCatInt64(key, seq);
+    leveldbBatchDelete(ldb, key, sdslen(key));
+    sdsrange(key, 0, klen - 1);
+    return key;
 }
 
-void backupleveldb(void *arg) {
-  char *path = (char *)arg;
-  time_t backup_start = time(NULL);
-  leveldb_options_t *options = leveldb_options_create();
-  int success = 0;
+/* Stage the elements [start, stop] of the list at head+index. */
+static sds leveldbListRewrite(struct leveldb *ldb, sds key, size_t klen, robj *list,
+                              long long head, long start, long stop)
+{
+    listTypeIterator *li;
+    listTypeEntry entry;
+    long index = start;
+
+    if (start > stop) return key;
+    li = listTypeInitIterator(list, start, REDIS_TAIL);
+    while (index <= stop && listTypeNext(li, &entry)) {
+        robj *value = listTypeGet(&entry);
+
+        key = leveldbListPut(ldb, key, klen, head+index, value);
+        decrRefCount(value);
+        index++;
+    }
+    listTypeReleaseIterator(li);
+    return key;
+}
 
-  leveldb_options_set_create_if_missing(options, 1);
-  leveldb_options_set_error_if_exists(options, 1);
-  leveldb_options_set_compression(options, 1);
-  leveldb_options_set_write_buffer_size(options, 64 * 1024 * 1024);
+/* 'count' values were pushed at 'where', the list is now 'len' long. */
+void leveldbListPush(int dbid, struct leveldb *ldb, robj *name, robj **values, int count, int where, long len) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
 
-  char *err = NULL;
-  leveldb_t *db = leveldb_open(options, path, &err);
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+    size_t klen = sdslen(key);
+    long long head = leveldbListHead(dbid, r1->ptr);
+    int j;
 
-  if (err != NULL) {
-    redisLog(REDIS_WARNING, "open leveldb err: %s", err);
-    leveldb_free(err); 
-    err = NULL;
-    goto cleanup;
-  }
+    for (j = 0; j < count; j++) {
+        if (where == REDIS_HEAD)
+            key = leveldbListPut(ldb, key, klen, head-1-j, values[j]);
+        else
+            key = leveldbListPut(ldb, key, klen, head+len-count+j, values[j]);
+    }
+    if (where == REDIS_HEAD) leveldbSetListHead(dbid, r1->ptr, head-count);
+    leveldbCommit(ldb);
 
-  char *data = NULL;
-  size_t dataLen = 0;
-  char *value = NULL;
-  size_t valueLen = 0;
-  int i = 0;
-  leveldb_writebatch_t* wb = leveldb_writebatch_create();
-  leveldb_writeoptions_t *woptions = leveldb_writeoptions_create();
-  leveldb_iterator_t *iterator = leveldb_create_iterator(server.ldb.db, server.ldb.roptions);
-
-  leveldb_writeoptions_set_sync(woptions, 0);
-  for(leveldb_iter_seek_to_first(iterator); leveldb_iter_valid(iterator); leveldb_iter_next(iterator)) {
-    data = (char*) leveldb_iter_key(iterator, &dataLen);
-    value = (char*) leveldb_iter_value(iterator, &valueLen);
-    leveldb_writebatch_put(wb, data, dataLen, value, valueLen);
-    i++;
-    if(i == 1000) {
-      i = 0;
-      leveldb_write(db, woptions, wb, &err);
-      if (err != NULL) {
-        redisLog(REDIS_WARNING, "backup write leveldb err: %s", err);
-        leveldb_free(err); 
-        err = NULL;
-        goto closehandler;
-      }
-      leveldb_writebatch_destroy(wb);
-      wb = leveldb_writebatch_create();
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+/* An element was popped from 'where', the list is now 'len' long. */
+void leveldbListPop(int dbid, struct leveldb *ldb, robj *name, int where, long len) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
     }
+
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+    size_t klen = sdslen(key);
+    long long head = leveldbListHead(dbid, r1->ptr);
+
+    if (where == REDIS_HEAD) {
+        key = leveldbListDelete(ldb, key, klen, head);
+        head++;
+    } else {
+        key = leveldbListDelete(ldb, key, klen, head+len);
+    }
+    leveldbSetListHead(dbid, r1->ptr, len ? head : 0);
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+void leveldbListSet(int dbid, struct leveldb *ldb, robj *name, long index, robj *value) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+
+    key = leveldbListPut(ldb, key, sdslen(key), leveldbListHead(dbid, r1->ptr)+index, value);
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+/* A value was inserted at 'index': renumber the shorter side. */
+void leveldbListInsert(int dbid, struct leveldb *ldb, robj *name, robj *list, long index) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+    size_t klen = sdslen(key);
+    long long head = leveldbListHead(dbid, r1->ptr);
+    long len = listTypeLength(list);
+
+    if (index < len - index) {
+        key = leveldbListRewrite(ldb, key, klen, list, head-1, 0, index);
+        leveldbSetListHead(dbid, r1->ptr, head-1);
+    } else {
+        key = leveldbListRewrite(ldb, key, klen, list, head, index, len-1);
+    }
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+/* 'removed' elements were deleted, the first and the last at the indexes
+ * 'first' and 'last' of the list before the removal. */
+void leveldbListRemove(int dbid, struct leveldb *ldb, robj *name, robj *list, long first, long last, long removed) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+    size_t klen = sdslen(key);
+    long long head = leveldbListHead(dbid, r1->ptr);
+    long len = listTypeLength(list), j;
+
+    if (len - first <= last + 1 - removed) {
+        /* Keep the head, move the elements after 'first' backward. */
+        key = leveldbListRewrite(ldb, key, klen, list, head, first, len-1);
+        for (j = len; j < len+removed; j++)
+            key = leveldbListDelete(ldb, key, klen, head+j);
+    } else {
+        /* Keep the tail, move the elements before 'last' forward. */
+        key = leveldbListRewrite(ldb, key, klen, list, head+removed, 0, last-removed);
+        for (j = 0; j < removed; j++)
+            key = leveldbListDelete(ldb, key, klen, head+j);
+        head += removed;
+    }
+    leveldbSetListHead(dbid, r1->ptr, len ? head : 0);
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+/* 'ltrim' elements were removed from the head and 'rtrim' from the tail,
+ * the list is now 'len' long. */
+void leveldbListTrim(int dbid, struct leveldb *ldb, robj *name, long ltrim, long rtrim, long len) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    robj *r1 = getDecodedObject(name);
+    sds key = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+    size_t klen = sdslen(key);
+    long long head = leveldbListHead(dbid, r1->ptr);
+    long j;
+
+    for (j = 0; j < ltrim; j++)
+        key = leveldbListDelete(ldb, key, klen, head+j);
+    for (j = 0; j < rtrim; j++)
+        key = leveldbListDelete(ldb, key, klen, head+ltrim+len+j);
+    leveldbSetListHead(dbid, r1->ptr, len ? head+ltrim : 0);
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+    decrRefCount(r1);
+}
+
+void leveldbFlushdb(int dbid, struct leveldb* ldb) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+    return;
   }
-  leveldb_write(db, woptions, wb, &err);
-  if (err != NULL) {
-    redisLog(REDIS_WARNING, "backup write leveldb err: %s", err);
-    leveldb_free(err); 
-    err = NULL;
-    goto closehandler;
-  }
-  leveldb_writebatch_destroy(wb);
-  leveldb_iter_get_error(iterator, &err);
-  if(err != NULL) {
-    redisLog(REDIS_WARNING, "backup leveldb iterator err: %s", err);
-    leveldb_free(err);
-    err = NULL;
-    goto closehandler;
+
+  leveldbSweepJob *job = leveldbRetireSlot(dbid, ldb);
+
+  leveldbCommit(ldb);
+  leveldbStartSweeps(ldb, &job, 1);
+}
+
+void leveldbFlushall(struct leveldb* ldb) {
+  if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+    return;
   }
-  success = 1;
-closehandler:
-  leveldb_iter_destroy(iterator);
-  leveldb_writeoptions_destroy(woptions);
-  leveldb_close(db);
+
+  leveldbSweepJob **jobs = zmalloc(sizeof(leveldbSweepJob*)*server.dbnum);
+  int j;
+
+  for (j = 0; j < server.dbnum; j++) jobs[j] = leveldbRetireSlot(j, ldb);
+  leveldbCommit(ldb);
+  leveldbStartSweeps(ldb, jobs, server.dbnum);
+  zfree(jobs);
+}
+
+/* -----------------------------------------------------------------------------
+ * Backup
+ *
+ * BACKUP <path> [<previous backup path>] copies the LevelDB files to 'path'.
+ *
+ * The main thread drains the pending writes and hard links the live files
+ * into a staging directory inside the LevelDB directory. No write can happen
+ * meanwhile, so the staged files are a point-in-time image of the database,
+ * and the links keep them around if a compaction deletes them. LevelDB
+ * ignores the staging directory since its name is not a LevelDB file name.
+ *
+ * The background job then copies the staged files to the backup path. Table
+ * files are immutable and their numbers are never reused, so the tables that
+ * a previous backup already contains with the same size are hard linked
+ * from it instead of being copied again.
+ *
+ * With several shards every shard is staged and copied by its own job, into
+ * the same layout as leveldb-path: the jobs are chained and run by the same
+ * background call, and BACKUP.log is only written when all of them
+ * succeeded, the first shard last.
+ * -------------------------------------------------------------------------- */
+
+#define LEVELDB_BACKUP_STAGING_PREFIX "backup-staging-"
+#define LEVELDB_BACKUP_STAGE_RETRIES 10
+#define LEVELDB_BACKUP_IO_BUF (64*1024)
+
+/* LevelDB log format, used by both the MANIFEST and the write ahead log:
+ * blocks of 32k containing records with a 7 bytes header, checksum (4),
+ * length (2) and type (1). A logical record spans one or more fragments. */
+#define LEVELDB_LOG_BLOCK_SIZE 32768
+#define LEVELDB_LOG_HEADER_SIZE 7
+#define LEVELDB_LOG_FULL 1
+#define LEVELDB_LOG_FIRST 2
+#define LEVELDB_LOG_MIDDLE 3
+#define LEVELDB_LOG_LAST 4
+
+typedef struct leveldbBackupFile {
+    sds name;
+    off_t size;                 /* Bytes to copy: logs are still appended. */
+    int table;
+} leveldbBackupFile;
+
+typedef struct leveldbBackupJob {
+    sds dir;                    /* LevelDB directory of the shard. */
+    sds path;
+    sds prev;                   /* Previous backup, NULL for a full backup. */
+    sds staging;
+    sds manifest;               /* MANIFEST file name. */
+    leveldbBackupFile *files;
+    int numfiles;
+    time_t start;
+    uint64_t seq;
+    int linked;
+    int copied;
+    long long bytes;
+    struct leveldbBackupJob *next;  /* Job of the next shard. */
+} leveldbBackupJob;
+
+static int leveldbIsTableFile(const char *name) {
+    size_t len = strlen(name);
+
+    return len > 4 && (!strcmp(name+len-4,".ldb") || !strcmp(name+len-4,".sst"));
+}
+
+static int leveldbIsLogFile(const char *name) {
+    size_t len = strlen(name);
+
+    return len > 4 && !strcmp(name+len-4,".log");
+}
+
+/* Remove a directory and the files it contains. */
+static void leveldbRemoveDir(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *de;
+
+    if (dir == NULL) return;
+    while ((de = readdir(dir)) != NULL) {
+        sds file;
+
+        if (!strcmp(de->d_name,".") || !strcmp(de->d_name,"..")) continue;
+        file = sdscatprintf(sdsempty(),"%s/%s",path,de->d_name);
+        unlink(file);
+        sdsfree(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/* Remove the staging directories left by backups that did not complete. */
+void leveldbBackupCleanStaging(char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *de;
+
+    if (dir == NULL) return;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name,LEVELDB_BACKUP_STAGING_PREFIX,
+                     strlen(LEVELDB_BACKUP_STAGING_PREFIX)))
+        {
+            sds staging = sdscatprintf(sdsempty(),"%s/%s",path,de->d_name);
+
+            redisLog(REDIS_NOTICE, "remove stale leveldb backup staging dir: %s", staging);
+            leveldbRemoveDir(staging);
+            sdsfree(staging);
+        }
+    }
+    closedir(dir);
+}
+
+/* Free the job and the jobs of the next shards. */
+static void leveldbBackupFreeJob(leveldbBackupJob *job) {
+    while (job) {
+        leveldbBackupJob *next = job->next;
+        int j;
+
+        for (j = 0; j < job->numfiles; j++) sdsfree(job->files[j].name);
+        zfree(job->files);
+        sdsfree(job->dir);
+        sdsfree(job->path);
+        sdsfree(job->prev);
+        sdsfree(job->staging);
+        sdsfree(job->manifest);
+        zfree(job);
+        job = next;
+    }
+}
+
+/* Read the MANIFEST name of the LevelDB in 'dir' from CURRENT and its size. */
+static int leveldbCurrentManifest(const char *dir, sds *manifest, off_t *size) {
+    char buf[256];
+    sds file = sdscatprintf(sdsempty(),"%s/CURRENT",dir);
+    FILE *fp = fopen(file,"r");
+    struct stat sb;
+    size_t len;
+
+    sdsfree(file);
+    if (fp == NULL) return REDIS_ERR;
+    len = fread(buf,1,sizeof(buf)-1,fp);
+    fclose(fp);
+    buf[len] = '\0';
+    if (len == 0 || buf[len-1] != '\n') return REDIS_ERR;
+    buf[len-1] = '\0';
+
+    sdsfree(*manifest);
+    *manifest = sdsnew(buf);
+    file = sdscatprintf(sdsempty(),"%s/%s",dir,buf);
+    if (stat(file,&sb) == -1) {
+        sdsfree(file);
+        return REDIS_ERR;
+    }
+    sdsfree(file);
+    *size = sb.st_size;
+    return REDIS_OK;
+}
+
+/* Link the live files into the staging directory. The links are retried
+ * when a compaction edits the MANIFEST in the meantime: otherwise a table
+ * it references may have been deleted before we could link it. */
+static int leveldbBackupStage(leveldbBackupJob *job) {
+    int attempt;
+
+    for (attempt = 0; attempt < LEVELDB_BACKUP_STAGE_RETRIES; attempt++) {
+        sds manifest = NULL;
+        off_t size, newsize;
+        DIR *dir;
+        struct dirent *de;
+        int failed = 0;
+
+        leveldbRemoveDir(job->staging);
+        if (mkdir(job->staging,0755) == -1) {
+            redisLog(REDIS_WARNING, "backup create staging dir err: %s", strerror(errno));
+            return REDIS_ERR;
+        }
+        if (leveldbCurrentManifest(job->dir,&job->manifest,&size) == REDIS_ERR) {
+            redisLog(REDIS_WARNING, "backup can't read the leveldb MANIFEST");
+            return REDIS_ERR;
+        }
+        if ((dir = opendir(job->dir)) == NULL) {
+            redisLog(REDIS_WARNING, "backup open leveldb dir err: %s", strerror(errno));
+            return REDIS_ERR;
+        }
+
+        while (!failed && (de = readdir(dir)) != NULL) {
+            int table = leveldbIsTableFile(de->d_name);
+            int ismanifest = !strcmp(de->d_name,job->manifest);
+            sds src, dst;
+            struct stat sb;
+
+            if (!table && !ismanifest && !leveldbIsLogFile(de->d_name)) continue;
+            src = sdscatprintf(sdsempty(),"%s/%s",job->dir,de->d_name);
+            dst = sdscatprintf(sdsempty(),"%s/%s",job->staging,de->d_name);
+            if (link(src,dst) == -1) {
+                /* Files deleted after readdir() were already obsolete. */
+                if (errno != ENOENT) {
+                    redisLog(REDIS_WARNING, "backup link %s err: %s", src, strerror(errno));
+                    failed = 1;
+                }
+            } else if (stat(dst,&sb) == 0) {
+                job->files = zrealloc(job->files,sizeof(leveldbBackupFile)*(job->numfiles+1));
+                job->files[job->numfiles].name = sdsnew(de->d_name);
+                job->files[job->numfiles].size = ismanifest ? size : sb.st_size;
+                job->files[job->numfiles].table = table;
+                job->numfiles++;
+            }
+            sdsfree(src);
+            sdsfree(dst);
+        }
+        closedir(dir);
+        if (failed) return REDIS_ERR;
+
+        if (leveldbCurrentManifest(job->dir,&manifest,&newsize) == REDIS_OK &&
+            !strcmp(manifest,job->manifest) && newsize == size)
+        {
+            sdsfree(manifest);
+            return REDIS_OK;
+        }
+        sdsfree(manifest);
+        while (job->numfiles) sdsfree(job->files[--job->numfiles].name);
+    }
+    redisLog(REDIS_WARNING, "backup can't stage a stable set of leveldb files");
+    return REDIS_ERR;
+}
+
+/* Copy the first 'size' bytes of 'src' to the new file 'dst'. */
+static int leveldbCopyFile(const char *src, const char *dst, off_t size) {
+    char *buf = zmalloc(LEVELDB_BACKUP_IO_BUF);
+    int in = -1, out = -1, retval = REDIS_ERR;
+
+    if ((in = open(src,O_RDONLY)) == -1) goto cleanup;
+    if ((out = open(dst,O_WRONLY|O_CREAT|O_EXCL,0644)) == -1) goto cleanup;
+    while (size > 0) {
+        size_t chunk = size < LEVELDB_BACKUP_IO_BUF ? (size_t)size : LEVELDB_BACKUP_IO_BUF;
+        ssize_t nread = read(in,buf,chunk);
+
+        if (nread <= 0) goto cleanup;
+        if (write(out,buf,nread) != nread) goto cleanup;
+        size -= nread;
+    }
+    if (fsync(out) == -1) goto cleanup;
+    retval = REDIS_OK;
+
 cleanup:
-  leveldb_options_destroy(options);
-  if( success == 1) {
+    if (retval == REDIS_ERR)
+        redisLog(REDIS_WARNING, "backup copy %s err: %s", src, strerror(errno));
+    if (in != -1) close(in);
+    if (out != -1) close(out);
+    zfree(buf);
+    return retval;
+}
+
+/* Call 'proc' for every logical record of a LevelDB log file. A truncated
+ * tail is ignored, as LevelDB does when recovering. */
+static int leveldbLogForEach(const char *filename, void (*proc)(const unsigned char *rec, size_t len, void *privdata), void *privdata) {
+    unsigned char *block = zmalloc(LEVELDB_LOG_BLOCK_SIZE);
+    sds rec = sdsempty();
+    FILE *fp = fopen(filename,"r");
+    size_t nread;
+
+    if (fp == NULL) {
+        zfree(block);
+        sdsfree(rec);
+        return REDIS_ERR;
+    }
+    while ((nread = fread(block,1,LEVELDB_LOG_BLOCK_SIZE,fp)) > 0) {
+        size_t pos = 0;
+
+        while (pos + LEVELDB_LOG_HEADER_SIZE <= nread) {
+            size_t len = block[pos+4] | (block[pos+5] << 8);
+            int type = block[pos+6];
+            const char *frag = (char*)block + pos + LEVELDB_LOG_HEADER_SIZE;
+
+            if (type == 0 && len == 0) break; /* Zero padding. */
+            if (pos + LEVELDB_LOG_HEADER_SIZE + len > nread) break;
+            if (type == LEVELDB_LOG_FULL || type == LEVELDB_LOG_FIRST) sdsclear(rec);
+            rec = sdscatlen(rec,frag,len);
+            if (type == LEVELDB_LOG_FULL || type == LEVELDB_LOG_LAST)
+                proc((unsigned char*)rec,sdslen(rec),privdata);
+            pos += LEVELDB_LOG_HEADER_SIZE + len;
+        }
+    }
+    fclose(fp);
+    zfree(block);
+    sdsfree(rec);
+    return REDIS_OK;
+}
+
+/* Track the last sequence of a MANIFEST version edit (db/version_edit.cc). */
+static void leveldbManifestSequence(const unsigned char *rec, size_t len, void *privdata) {
+    const unsigned char *p = rec, *end = rec + len;
+    uint64_t *seq = privdata, tag, v;
+
+    while (p < end && leveldbDecodeVarint(&p,end,&tag) == REDIS_OK) {
+        int slices = 0, varints = 0;
+
+        switch(tag) {
+        case 1: slices = 1; break;                  /* Comparator. */
+        case 2: case 3: case 9: varints = 1; break; /* Log and file numbers. */
+        case 4:                                     /* Last sequence. */
+            if (leveldbDecodeVarint(&p,end,&v) == REDIS_ERR) return;
+            if (v > *seq) *seq = v;
+            break;
+        case 5: varints = 1; slices = 1; break;     /* Compact pointer. */
+        case 6: varints = 2; break;                 /* Deleted file. */
+        case 7: varints = 3; slices = 2; break;     /* New file. */
+        default: return;
+        }
+        while (varints--)
+            if (leveldbDecodeVarint(&p,end,&v) == REDIS_ERR) return;
+        while (slices--) {
+            if (leveldbDecodeVarint(&p,end,&v) == REDIS_ERR || v > (uint64_t)(end-p)) return;
+            p += v;
+        }
+    }
+}
+
+/* Track the last sequence of a write batch: 8 bytes sequence and 4 bytes
+ * count, little endian (db/write_batch.cc). */
+static void leveldbLogSequence(const unsigned char *rec, size_t len, void *privdata) {
+    uint64_t *seq = privdata, first = 0;
+    uint32_t count = 0;
+    int j;
+
+    if (len < 12) return;
+    for (j = 7; j >= 0; j--) first = (first << 8) | rec[j];
+    for (j = 11; j >= 8; j--) count = (count << 8) | rec[j];
+    if (count && first + count - 1 > *seq) *seq = first + count - 1;
+}
+
+static void leveldbBackupWriteInfo(leveldbBackupJob *job) {
     time_t backup_end = time(NULL);
     char info[1024];
     char tmpfile[512];
     char backupfile[512];
-    snprintf(tmpfile,512,"%s/temp.log", path);
-    snprintf(backupfile,512,"%s/BACKUP.log", path);
+    snprintf(tmpfile,512,"%s/temp.log", job->path);
+    snprintf(backupfile,512,"%s/BACKUP.log", job->path);
     FILE *fp = fopen(tmpfile,"w");
 
     if (!fp) {
       redisLog(REDIS_WARNING, "Failed opening .log for saving: %s",
           strerror(errno));
     }else{
-      int infolen = snprintf(info, sizeof(info), "BACKUP\n\tSTART:\t%jd\n\tEND:\t\t%jd\n\tCOST:\t\t%jd\nSUCCESS", backup_start, backup_end, backup_end-backup_start);
+      int infolen = snprintf(info, sizeof(info),
+          "BACKUP\n\tSTART:\t%jd\n\tEND:\t\t%jd\n\tCOST:\t\t%jd\n"
+          "\tSEQUENCE:\t%llu\n\tPREVIOUS:\t%s\n\tLINKED:\t\t%d\n"
+          "\tCOPIED:\t\t%d\n\tBYTES:\t\t%lld\nSUCCESS",
+          (intmax_t)job->start, (intmax_t)backup_end, (intmax_t)(backup_end-job->start),
+          (unsigned long long)job->seq, job->prev ? job->prev : "-", job->linked, job->copied, job->bytes);
 
       fwrite(info, infolen, 1, fp);
       fclose(fp);
@@ -1002,10 +5961,100 @@ cleanup:
         redisLog(REDIS_WARNING,"Error moving temp backup file on the final destination: %s", strerror(errno));
       }
       unlink(tmpfile);
-      redisLog(REDIS_NOTICE, "backup leveldb path: %s", path);
+      redisLog(REDIS_NOTICE, "backup leveldb path: %s sequence: %llu linked: %d copied: %d bytes: %lld",
+          job->path, (unsigned long long)job->seq, job->linked, job->copied, job->bytes);
+    }
+}
+
+/* Copy the staged files of a shard to its backup path. */
+static int leveldbBackupCopy(leveldbBackupJob *job) {
+  int j, success = 0;
+  sds src = sdsempty(), dst = sdsempty(), prev = sdsempty();
+  FILE *fp;
+
+  for (j = 0; j < job->numfiles; j++) {
+    leveldbBackupFile *f = job->files+j;
+    struct stat sb;
+
+    src = sdscpy(src, job->staging); src = sdscatprintf(src, "/%s", f->name);
+    dst = sdscpy(dst, job->path); dst = sdscatprintf(dst, "/%s", f->name);
+    if (f->table && job->prev) {
+      prev = sdscpy(prev, job->prev); prev = sdscatprintf(prev, "/%s", f->name);
+      if (stat(prev,&sb) == 0 && sb.st_size == f->size && link(prev,dst) == 0) {
+        job->linked++;
+        continue;
+      }
     }
+    if (leveldbCopyFile(src, dst, f->size) == REDIS_ERR) goto cleanup;
+    job->copied++;
+    job->bytes += f->size;
+
+    if (!strcmp(f->name, job->manifest))
+      leveldbLogForEach(dst, leveldbManifestSequence, &job->seq);
+    else if (!f->table)
+      leveldbLogForEach(dst, leveldbLogSequence, &job->seq);
+  }
+
+  dst = sdscpy(dst, job->path); dst = sdscat(dst, "/CURRENT");
+  if ((fp = fopen(dst,"w")) == NULL || fprintf(fp,"%s\n",job->manifest) < 0 ||
+      fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+  {
+    redisLog(REDIS_WARNING, "backup write CURRENT err: %s", strerror(errno));
+    if (fp) fclose(fp);
+    goto cleanup;
+  }
+  fclose(fp);
+  success = 1;
+
+cleanup:
+  leveldbRemoveDir(job->staging);
+  sdsfree(src);
+  sdsfree(dst);
+  sdsfree(prev);
+  return success ? REDIS_OK : REDIS_ERR;
+}
+
+/* Reverse the order of the chain of jobs. */
+static leveldbBackupJob *leveldbBackupReverse(leveldbBackupJob *job) {
+  leveldbBackupJob *prev = NULL;
+
+  while (job) {
+    leveldbBackupJob *next = job->next;
+
+    job->next = prev;
+    prev = job;
+    job = next;
+  }
+  return prev;
+}
+
+void backupleveldb(void *arg) {
+  leveldbBackupJob *jobs = arg, *job;
+  int success = 1;
+
+  for (job = jobs; job; job = job->next) {
+    if (success && leveldbBackupCopy(job) == REDIS_ERR) success = 0;
+    else if (!success) leveldbRemoveDir(job->staging);
+  }
+  /* The BACKUP.log of the first shard marks the backup as complete. */
+  jobs = leveldbBackupReverse(jobs);
+  if (success) {
+    for (job = jobs; job; job = job->next) leveldbBackupWriteInfo(job);
+  }
+  leveldbBackupFreeJob(jobs);
+}
+
+/* Remove the staging directories and the backup paths of the shards after a
+ * failed stage, the shard directories first. */
+static void leveldbBackupAbort(leveldbBackupJob *jobs) {
+  leveldbBackupJob *job;
+
+  jobs = leveldbBackupReverse(jobs);
+  for (job = jobs; job; job = job->next) {
+    leveldbRemoveDir(job->staging);
+    rmdir(job->path);
   }
-  zfree(path);
+  leveldbBackupFreeJob(jobs);
 }
 
 void backupCommand(redisClient *c) {
@@ -1013,12 +6062,43 @@ void backupCommand(redisClient *c) {
     addReplyError(c,"leveldb off");
     return;
   }
+  if (c->argc > 3) {
+    addReply(c,shared.syntaxerr);
+    return;
+  }
+
+  leveldbBackupJob *jobs = NULL, **tail = &jobs, *job;
+  long long now = ustime();
+  int shard;
+
+  for (shard = 0; shard < server.ldb.numshards; shard++) {
+    job = zcalloc(sizeof(*job));
+    job->dir = leveldbShardPath(server.leveldb_path, shard);
+    job->path = leveldbShardPath(c->argv[1]->ptr, shard);
+    job->prev = c->argc == 3 ? leveldbShardPath(c->argv[2]->ptr, shard) : NULL;
+    job->staging = sdscatprintf(sdsempty(),"%s/" LEVELDB_BACKUP_STAGING_PREFIX "%lld",
+        job->dir, now);
+    job->start = time(NULL);
+    if (mkdir(job->path,0755) == -1) {
+      addReplyErrorFormat(c,"can't create the backup dir: %s", strerror(errno));
+      leveldbBackupFreeJob(job);
+      leveldbBackupAbort(jobs);
+      return;
+    }
+    *tail = job;
+    tail = &job->next;
+  }
 
-  size_t len = sdslen(c->argv[1]->ptr);
-  char *path = zmalloc(len + 1);
-  memcpy(path, c->argv[1]->ptr, len);
-  path[len] = '\0';
-  bioCreateBackgroundJob(REDIS_BIO_LEVELDB_BACKUP,(void*)path,NULL,NULL);
+  leveldbCoalesceFlush(&server.ldb);
+  leveldbDrain(&server.ldb);
+  for (job = jobs; job; job = job->next) {
+    if (leveldbBackupStage(job) == REDIS_ERR) {
+      addReplyError(c,"can't stage the leveldb files, check the log");
+      leveldbBackupAbort(jobs);
+      return;
+    }
+  }
+  bioCreateBackgroundJob(REDIS_BIO_LEVELDB_BACKUP,(void*)jobs,NULL,NULL);
   addReplyStatus(c,"backup leveldb started");
 }
 
@@ -1069,15 +6149,6 @@ void freezeCommand(redisClient *c) {
     addReplyLongLong(c,deleted);
 }
 
-char getFreezedKeyType(int dbid, robj *key) {
-    dictEntry *de = dictFind(server.db[dbid].freezed,key->ptr);
-
-    if (de) {
-        return (char)(dictGetSignedIntegerVal(de));
-    }
-    return 0;
-}
-
 void meltCommand(redisClient *c) {
     if(server.leveldb_state == REDIS_LEVELDB_OFF) {
         addReplyError(c,"leveldb off");
@@ -1086,6 +6157,14 @@ void meltCommand(redisClient *c) {
     
     int success = 0;
     int j;
+
+    /* Resumed once the keys were melted in background. */
+    if (c->bpop.melted != -1) {
+        if (c->bpop.melted)
+            forceCommandPropagation(c,REDIS_PROPAGATE_AOF|REDIS_PROPAGATE_REPL);
+        addReplyLongLong(c,c->bpop.melted);
+        return;
+    }
     
     for (j = 1; j < c->argc; j++) {
         if(isKeyFreezed(c->db->id, c->argv[j]) == 1) {
@@ -1100,48 +6179,798 @@ void meltCommand(redisClient *c) {
     addReplyLongLong(c,success);
 }
 
+/* With the freeze-lru maxmemory policy the keys are frozen behind the back
+ * of the clients, so the frozen keys of a command are melted before it runs.
+ * FREEZE and MELT handle the frozen keys themselves, DEL drops them, and the
+ * point reads are served without melting, see leveldbFreezedValue(). */
+static int leveldbCommandMelts(struct redisCommand *cmd) {
+    return !(cmd->flags & REDIS_CMD_FREEZED_READ) &&
+           cmd->proc != freezeCommand && cmd->proc != meltCommand &&
+           cmd->proc != delCommand;
+}
+
+/* Returns 1 if the command replaces the key at argv[pos], of the record type
+ * 'keytype', without reading it, nor checking if it exists. SET, SETEX,
+ * PSETEX and MSET refuse to replace a key that is not a string. */
+static int leveldbCommandOverwrites(struct redisCommand *cmd, robj **argv, int argc, int pos, char keytype) {
+    int j;
+
+    if (cmd->proc == setCommand) {
+        if (keytype != 'c') return 0;
+        for (j = 3; j < argc; j++) {
+            if (!strcasecmp(argv[j]->ptr,"nx") || !strcasecmp(argv[j]->ptr,"xx"))
+                return 0;
+        }
+        return 1;
+    }
+    if (cmd->proc == restoreCommand) {
+        for (j = 4; j < argc; j++)
+            if (!strcasecmp(argv[j]->ptr,"replace")) return 1;
+        return 0;
+    }
+    if (cmd->proc == setexCommand || cmd->proc == psetexCommand ||
+        cmd->proc == msetCommand) return keytype == 'c';
+    if (cmd->proc == sunionstoreCommand || cmd->proc == sinterstoreCommand ||
+        cmd->proc == sdiffstoreCommand || cmd->proc == zunionstoreCommand ||
+        cmd->proc == zinterstoreCommand) return pos == 1;
+    if (cmd->proc == bitopCommand || cmd->proc == renameCommand) return pos == 2;
+    return 0;
+}
+
+/* Returns 1 if a frozen key of the command can be dropped instead of melted:
+ * every position of the key, keys[j], is replaced by the command. */
+static int leveldbCommandDrops(struct redisCommand *cmd, robj **argv, int argc, int *keys, int numkeys, int j, char keytype) {
+    int k;
+
+    for (k = 0; k < numkeys; k++) {
+        if (k != j && !equalStringObjects(argv[keys[k]], argv[keys[j]])) continue;
+        if (!leveldbCommandOverwrites(cmd, argv, argc, keys[k], keytype)) return 0;
+    }
+    return 1;
+}
+
+/* Called by DEL for a key that is not in memory: with freeze-lru a frozen
+ * key is dropped, as if it was still there. Returns 1 if it was. */
+int leveldbDelFreezedKey(redisClient *c, robj *key) {
+    char keytype;
+
+    if (server.maxmemory_policy != REDIS_MAXMEMORY_FREEZE_LRU ||
+        server.leveldb_state == REDIS_LEVELDB_OFF ||
+        freezedKeysCount(c->db->id) == 0 ||
+        (keytype = getFreezedKeyType(c->db->id, key)) == 0) return 0;
+    leveldbDropFreezedKey(c->db->id, &server.ldb, key, keytype);
+    server.leveldb_lru_drops++;
+    return 1;
+}
+
+void leveldbMeltCommandKeys(redisClient *c) {
+    int *keys, numkeys, j;
+
+    if (server.maxmemory_policy != REDIS_MAXMEMORY_FREEZE_LRU ||
+        server.leveldb_state == REDIS_LEVELDB_OFF ||
+        freezedKeysCount(c->db->id) == 0 ||
+        !leveldbCommandMelts(c->cmd)) return;
+
+    keys = getKeysFromCommand(c->cmd, c->argv, c->argc, &numkeys, REDIS_GETKEYS_ALL);
+    for (j = 0; j < numkeys; j++) {
+        robj *key = c->argv[keys[j]];
+        char keytype = getFreezedKeyType(c->db->id, key);
+
+        if (keytype == 0) continue;
+        if (leveldbCommandDrops(c->cmd, c->argv, c->argc, keys, numkeys, j, keytype)) {
+            leveldbDropFreezedKey(c->db->id, &server.ldb, key, keytype);
+            server.leveldb_lru_drops++;
+        } else if (meltKey(c->db->id, &server.ldb, key, keytype) == REDIS_OK) {
+            server.leveldb_lru_melts++;
+        } else {
+            redisLog(REDIS_WARNING, "melt key:%s of %s failed", (char*)key->ptr, c->cmd->name);
+        }
+    }
+    getKeysFreeResult(keys);
+}
+
+/* -----------------------------------------------------------------------------
+ * Background melt
+ *
+ * Melting a big key scans all its records, so MELT and the transparent melts
+ * of freeze-lru scan the records and build the object in a bio thread. The
+ * client is blocked like in BLPOP, its command parked in c->bpop, and the
+ * command runs once leveldbMeltDone() installed the object in the key space.
+ *
+ * The key stays frozen until then: the commands writing it are refused and
+ * the point reads are served from LevelDB. A melt is cancelled when the key
+ * is melted synchronously or its db is flushed, its object is then dropped.
+ * Clients that can't wait, as the master link and the scripts, still melt
+ * synchronously.
+ * -------------------------------------------------------------------------- */
+
+typedef struct leveldbMeltJob {
+    int dbid;
+    sds key;
+    char keytype;
+    sds prefix;                 /* The records of the key. */
+    uint64_t gen;
+    robj *val;                  /* NULL if the key has no records. */
+    long long listhead;
+    long records;
+    int failed;
+    int cancelled;
+    int lru;                    /* Started by the freeze-lru policy. */
+    list *clients;              /* Clients waiting for the key. */
+    long long start;
+    long long usec;
+} leveldbMeltJob;
+
+static list *leveldb_melt_jobs = NULL;  /* Jobs not installed yet. */
+static pthread_mutex_t leveldb_melt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list *leveldb_melt_done = NULL;  /* Jobs to install in leveldbMeltDone() */
+static int leveldb_melt_pipe[2] = {-1, -1}; /* Wakes up the main thread. */
+
+static void leveldbFreeMeltJob(leveldbMeltJob *job) {
+    sdsfree(job->key);
+    sdsfree(job->prefix);
+    if (job->val) decrRefCount(job->val);
+    listRelease(job->clients);
+    zfree(job);
+}
+
+void leveldbMeltRun(void *arg) {
+    leveldbMeltJob *job = arg;
+    leveldb_iterator_t *iterator = leveldb_create_iterator(leveldbKeyDb(&server.ldb, job->key), server.ldb.roptions);
+    size_t plen = sdslen(job->prefix);
+    leveldbKeyLoader loader;
+    leveldbRecordKey rk;
+    char *err = NULL;
+
+    /* The loader is set up here as leveldbLoaderStart() reads the key space. */
+    leveldbLoaderInit(&loader);
+    loader.dbid = job->dbid;
+    loader.type = job->keytype;
+    loader.key = sdscpy(loader.key, job->key);
+    loader.gen = job->gen;
+    memset(&rk, 0, sizeof(rk));
+    rk.dbid = job->dbid;
+    rk.type = job->keytype;
+    rk.key = job->key;
+    rk.keylen = sdslen(job->key);
+    rk.gen = job->gen;
+
+    for (leveldb_iter_seek(iterator, job->prefix, plen);
+         leveldb_iter_valid(iterator);
+         leveldb_iter_next(iterator))
+    {
+        size_t dataLen, valueLen;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value;
+
+        if (dataLen < plen || memcmp(data, job->prefix, plen)) break;
+        if (leveldbTypeHasFields(job->keytype) || dataLen > plen) {
+            rk.field = data+plen; /* Or the page of a string. */
+            rk.fieldlen = dataLen-plen;
+        } else {
+            rk.field = NULL;
+            rk.fieldlen = 0;
+        }
+        value = leveldb_iter_value(iterator, &valueLen);
+        leveldbLoaderAdd(&loader, &rk, value, valueLen);
+    }
+    leveldb_iter_get_error(iterator, &err);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "melt leveldb iterator err: %s", err);
+        leveldb_free(err);
+        job->failed = 1;
+    }
+    leveldb_iter_destroy(iterator);
+
+    job->records = loader.count;
+    if (!job->failed && loader.count) {
+        job->val = leveldbLoaderBuild(&loader);
+        job->listhead = leveldbLoaderListHead(&loader);
+        if (job->val == NULL) job->failed = 1;
+    }
+    leveldbLoaderFree(&loader);
+    job->usec = ustime()-job->start;
+
+    pthread_mutex_lock(&leveldb_melt_mutex);
+    if (leveldb_melt_done == NULL) leveldb_melt_done = listCreate();
+    listAddNodeTail(leveldb_melt_done, job);
+    pthread_mutex_unlock(&leveldb_melt_mutex);
+    if (write(leveldb_melt_pipe[1], "x", 1) == -1) {
+        /* The pipe is full, the main thread is already woken up. */
+    }
+}
+
+/* Replace the frozen key with the melted object. Returns 1 if the key was
+ * melted. */
+static int leveldbMeltInstall(leveldbMeltJob *job) {
+    redisDb *db = server.db+job->dbid;
+    robj keyobj;
+    sds leveldbkey;
+
+    if (job->cancelled) return 0;
+    dictDelete(db->melting, job->key);
+    if (job->failed ||
+        leveldbFreezedKeyType(job->dbid, job->key) != job->keytype ||
+        dictFind(db->dict, job->key) != NULL)
+    {
+        redisLog(REDIS_WARNING, "melt key:%s failed", job->key);
+        server.leveldb_melt_failures++;
+        return 0;
+    }
+
+    leveldbkey = createleveldbFreezedKeyHead(job->dbid, job->key);
+    leveldbBatchDelete(&server.ldb, leveldbkey, sdslen(leveldbkey));
+    leveldbCommit(&server.ldb);
+    sdsfree(leveldbkey);
+    delFreezedKey(job->dbid, job->key);
+    if (job->val) {
+        initStaticStringObject(keyobj, job->key);
+        dbAdd(db, &keyobj, job->val);
+        job->val = NULL;
+        if (job->keytype == 'l') leveldbSetListHead(job->dbid, job->key, job->listhead);
+    }
+    server.dirty += job->records;
+    server.leveldb_melts++;
+    if (job->lru) server.leveldb_lru_melts++;
+    return 1;
+}
+
+/* Run the parked command of a client whose melts are all done. */
+static void leveldbResumeMelt(redisClient *c) {
+    c->flags &= ~REDIS_BLOCKED;
+    server.bpop_blocked_clients--;
+    c->argv = c->bpop.meltargv;
+    c->argc = c->bpop.meltargc;
+    c->cmd = c->bpop.meltcmd;
+    c->bpop.meltargv = NULL;
+    c->bpop.meltargc = 0;
+    c->bpop.meltcmd = NULL;
+
+    server.current_client = c;
+    call(c,REDIS_CALL_FULL);
+    server.current_client = NULL;
+    c->bpop.melted = -1;
+    if (listLength(server.ready_keys))
+        handleClientsBlockedOnLists();
+    resetClient(c);
+
+    /* Process the commands pipelined meanwhile in beforeSleep(). */
+    c->flags |= REDIS_UNBLOCKED;
+    listAddNodeTail(server.unblocked_clients,c);
+}
+
+static void leveldbMeltDone(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    list *done;
+    listNode *ln, *cn;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&leveldb_melt_mutex);
+    done = leveldb_melt_done;
+    leveldb_melt_done = NULL;
+    pthread_mutex_unlock(&leveldb_melt_mutex);
+    if (done == NULL) return;
+
+    while ((ln = listFirst(done)) != NULL) {
+        leveldbMeltJob *job = listNodeValue(ln);
+        int melted = leveldbMeltInstall(job);
+
+        server.leveldb_melt_usec += job->usec;
+        if (job->usec > server.leveldb_melt_max_usec)
+            server.leveldb_melt_max_usec = job->usec;
+
+        /* A resumed command may free the other clients waiting for the job,
+         * so they are taken one at a time while the job is still listed in
+         * leveldb_melt_jobs for leveldbUnblockMelt(). */
+        while ((cn = listFirst(job->clients)) != NULL) {
+            redisClient *c = listNodeValue(cn);
+
+            listDelNode(job->clients, cn);
+            if (melted && c->bpop.melted != -1) c->bpop.melted++;
+            if (--c->bpop.meltpending == 0) leveldbResumeMelt(c);
+        }
+        listDelNode(leveldb_melt_jobs, listSearchKey(leveldb_melt_jobs, job));
+        listDelNode(done, ln);
+        leveldbFreeMeltJob(job);
+    }
+    listRelease(done);
+    if (listLength(server.ready_keys))
+        handleClientsBlockedOnLists();
+}
+
+static int leveldbMeltInit(void) {
+    if (leveldb_melt_jobs != NULL) return REDIS_OK;
+    if (pipe(leveldb_melt_pipe) == -1) {
+        redisLog(REDIS_WARNING, "Can't create the melt pipe: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    anetNonBlock(NULL, leveldb_melt_pipe[0]);
+    anetNonBlock(NULL, leveldb_melt_pipe[1]);
+    if (aeCreateFileEvent(server.el, leveldb_melt_pipe[0], AE_READABLE,
+        leveldbMeltDone, NULL) == AE_ERR)
+    {
+        redisLog(REDIS_WARNING, "Can't watch the melt pipe");
+        close(leveldb_melt_pipe[0]);
+        close(leveldb_melt_pipe[1]);
+        leveldb_melt_pipe[0] = leveldb_melt_pipe[1] = -1;
+        return REDIS_ERR;
+    }
+    leveldb_melt_jobs = listCreate();
+    return REDIS_OK;
+}
+
+/* Start the background melt of a frozen key, or join the one in progress.
+ * Returns 1 if the client has to wait for it. */
+static int leveldbMeltKeyAsync(redisClient *c, robj *key, int lru) {
+    char keytype = getFreezedKeyType(c->db->id, key);
+    leveldbMeltJob *job;
+    dictEntry *de;
+
+    if (keytype == 0) return 0;
+    if ((de = dictFind(c->db->melting, key->ptr)) != NULL) {
+        job = dictGetVal(de);
+        if (listSearchKey(job->clients, c) != NULL) return 0;
+    } else {
+        if (leveldbMeltInit() == REDIS_ERR) return 0;
+        job = zcalloc(sizeof(*job));
+        job->dbid = c->db->id;
+        job->key = sdsdup(key->ptr);
+        job->keytype = keytype;
+        job->prefix = leveldbKeyPrefix(job->dbid, keytype, job->key);
+        job->gen = leveldbTypeHasFields(keytype) ? leveldbKeyGeneration(job->dbid, job->key) : 0;
+        job->lru = lru;
+        job->clients = listCreate();
+        job->start = ustime();
+        dictAdd(c->db->melting, job->key, job);
+        listAddNodeTail(leveldb_melt_jobs, job);
+
+        /* The thread reads the records, they must be written first. */
+        leveldbDrain(&server.ldb);
+        bioCreateBackgroundJob(REDIS_BIO_LEVELDB_MELT, job, NULL, NULL);
+    }
+    listAddNodeTail(job->clients, c);
+    return 1;
+}
+
+static int leveldbMeltCommandAsync(redisClient *c, struct redisCommand *cmd, robj **argv, int argc) {
+    int *keys, numkeys, j, pending = 0;
+
+    if (!leveldbCommandMelts(cmd)) return 0;
+    keys = getKeysFromCommand(cmd, argv, argc, &numkeys, REDIS_GETKEYS_ALL);
+    for (j = 0; j < numkeys; j++) {
+        char keytype = getFreezedKeyType(c->db->id, argv[keys[j]]);
+
+        /* Left to leveldbMeltCommandKeys() that drops it. */
+        if (keytype == 0 ||
+            leveldbCommandDrops(cmd, argv, argc, keys, numkeys, j, keytype)) continue;
+        pending += leveldbMeltKeyAsync(c, argv[keys[j]], 1);
+    }
+    getKeysFreeResult(keys);
+    return pending;
+}
+
+/* Called by processCommand() before running a command: start the background
+ * melt of the frozen keys of MELT, or with freeze-lru of the frozen keys of
+ * any command (of the queued commands for EXEC), and block the client until
+ * they are melted. Returns 1 if the client is blocked. */
+int leveldbBlockForMelt(redisClient *c) {
+    int pending = 0, j;
+
+    if (server.leveldb_state == REDIS_LEVELDB_OFF ||
+        freezedKeysCount(c->db->id) == 0 ||
+        c->flags & REDIS_MASTER) return 0;
+
+    if (c->cmd->proc == meltCommand) {
+        for (j = 1; j < c->argc; j++)
+            pending += leveldbMeltKeyAsync(c, c->argv[j], 0);
+    } else if (server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU) {
+        if (c->cmd->proc == execCommand) {
+            for (j = 0; j < c->mstate.count; j++) {
+                multiCmd *mc = c->mstate.commands+j;
+
+                pending += leveldbMeltCommandAsync(c, mc->cmd, mc->argv, mc->argc);
+            }
+        } else {
+            pending = leveldbMeltCommandAsync(c, c->cmd, c->argv, c->argc);
+        }
+    }
+    if (pending == 0) return 0;
+
+    /* Park the command: resetClient() must not release its arguments. */
+    c->bpop.meltpending = pending;
+    c->bpop.melted = c->cmd->proc == meltCommand ? 0 : -1;
+    c->bpop.meltargv = c->argv;
+    c->bpop.meltargc = c->argc;
+    c->bpop.meltcmd = c->cmd;
+    c->bpop.timeout = 0;
+    c->argv = NULL;
+    c->argc = 0;
+    c->flags |= REDIS_BLOCKED;
+    server.bpop_blocked_clients++;
+    return 1;
+}
+
+/* Called by freeClient() for a client waiting for background melts. The
+ * melts go on without it. */
+void leveldbUnblockMelt(redisClient *c) {
+    listIter li;
+    listNode *ln;
+    int j;
+
+    listRewind(leveldb_melt_jobs, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        leveldbMeltJob *job = listNodeValue(ln);
+        listNode *cn = listSearchKey(job->clients, c);
+
+        if (cn != NULL) listDelNode(job->clients, cn);
+    }
+    for (j = 0; j < c->bpop.meltargc; j++) decrRefCount(c->bpop.meltargv[j]);
+    zfree(c->bpop.meltargv);
+    c->bpop.meltargv = NULL;
+    c->bpop.meltargc = 0;
+    c->bpop.meltcmd = NULL;
+    c->bpop.meltpending = 0;
+    c->bpop.melted = -1;
+    c->flags &= ~REDIS_BLOCKED;
+    server.bpop_blocked_clients--;
+}
+
+/* Drop the object of the background melt of a key, or of all the keys of
+ * the db if key is NULL. The waiting clients are resumed anyway once the
+ * jobs are done. */
+void leveldbCancelMelts(int dbid, robj *key) {
+    dict *melting = server.db[dbid].melting;
+    dictIterator *di;
+    dictEntry *de;
+
+    if (key != NULL) {
+        if ((de = dictFind(melting, key->ptr)) == NULL) return;
+        ((leveldbMeltJob*)dictGetVal(de))->cancelled = 1;
+        dictDelete(melting, key->ptr);
+        return;
+    }
+    di = dictGetIterator(melting);
+    while ((de = dictNext(di)) != NULL)
+        ((leveldbMeltJob*)dictGetVal(de))->cancelled = 1;
+    dictReleaseIterator(di);
+    dictEmpty(melting, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+ * Frozen key reads
+ *
+ * The point reads of the commands flagged "z" (GET, STRLEN, HGET, HMGET,
+ * HEXISTS, SISMEMBER, ZSCORE) on a frozen key are served by a leveldb_get()
+ * of the single record they need, instead of melting the whole key. These
+ * reads fill the LevelDB block cache (leveldb-cache-size), so the repeated
+ * lookups of a cold key do not go to disk every time.
+ * -------------------------------------------------------------------------- */
+
+/* The raw value of the record of 'field' (NULL for strings) of a frozen key,
+ * NULL if there is no such record. */
+static sds leveldbFreezedGet(int dbid, char type, robj *key, robj *field) {
+    struct leveldb *ldb = &server.ldb;
+    sds k = leveldbKeyPrefix(dbid, type, key->ptr);
+    char *val, *err = NULL;
+    size_t vallen;
+    sds raw = NULL;
+
+    if (field) {
+        robj *decfield = getDecodedObject(field);
+
+        k = sdscatsds(k, decfield->ptr);
+        decrRefCount(decfield);
+    }
+    leveldbDrain(ldb);
+    val = leveldb_get(leveldbKeyDb(ldb, key->ptr), ldb->proptions, k, sdslen(k), &vallen, &err);
+    sdsfree(k);
+    server.leveldb_freezed_reads++;
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "read frozen key:%s err: %s", (char*)key->ptr, err);
+        leveldb_free(err);
+        return NULL;
+    }
+    if (val != NULL) {
+        raw = sdsnewlen(val, vallen);
+        leveldb_free(val);
+    }
+    return raw;
+}
+
+/* The bytes of a frozen string of 'len' bytes stored in pages, NULL if the
+ * pages are not all there. */
+static sds leveldbFreezedPages(int dbid, robj *key, size_t len) {
+    struct leveldb *ldb = &server.ldb;
+    leveldb_iterator_t *iterator = leveldb_create_iterator(leveldbKeyDb(ldb, key->ptr), ldb->proptions);
+    sds prefix = leveldbKeyPrefix(dbid, 'c', key->ptr);
+    sds s = sdsnewlen(NULL, len);
+    size_t plen = sdslen(prefix), done = 0;
+    char *err = NULL;
+
+    for (leveldb_iter_seek(iterator, prefix, plen);
+         leveldb_iter_valid(iterator) && done < len;
+         leveldb_iter_next(iterator))
+    {
+        size_t dataLen, valueLen, count = len-done;
+        const char *data = leveldb_iter_key(iterator, &dataLen);
+        const char *value;
+
+        if (dataLen < plen || memcmp(data, prefix, plen)) break;
+        if (dataLen == plen) continue; /* The paged record. */
+        if (count > LEVELDB_STRING_PAGE_SIZE) count = LEVELDB_STRING_PAGE_SIZE;
+        value = leveldb_iter_value(iterator, &valueLen);
+        if (dataLen != plen+LEVELDB_INT64_LEN || valueLen != count ||
+            leveldbDecodeInt64(data+plen) != (long long)(done/LEVELDB_STRING_PAGE_SIZE)) break;
+        memcpy(s+done, value, count);
+        done += count;
+    }
+    leveldb_iter_get_error(iterator, &err);
+    leveldb_iter_destroy(iterator);
+    sdsfree(prefix);
+    if (err != NULL) {
+        redisLog(REDIS_WARNING, "read frozen key:%s err: %s", (char*)key->ptr, err);
+        leveldb_free(err);
+    }
+    if (done != len) {
+        sdsfree(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* 1 if the key is frozen as 'type', 0 if it is not frozen, -1 after replying
+ * a type error. */
+static int leveldbFreezedCheckType(redisClient *c, robj *key, char type) {
+    char keytype = getFreezedKeyType(c->db->id, key);
+
+    if (keytype == 0) return 0;
+    if (keytype != type) {
+        addReply(c, shared.wrongtypeerr);
+        return -1;
+    }
+    return 1;
+}
+
+/* Read the value of 'field' (NULL for strings) of a key missing from the key
+ * space. Returns 1 with the value in *value if the key is frozen and has such
+ * a field, 0 if not, and -1 after replying a type error. Set members have an
+ * empty value. */
+int leveldbFreezedValue(redisClient *c, robj *key, char type, robj *field, sds *value) {
+    int retval = leveldbFreezedCheckType(c, key, type);
+    size_t len;
+    sds raw;
+
+    if (retval <= 0) return retval;
+    if ((raw = leveldbFreezedGet(c->db->id, type, key, field)) == NULL) return 0;
+    if (type == 's') {
+        *value = raw;
+        return 1;
+    }
+    if (type == 'c' && leveldbDecodePagedValue(raw, sdslen(raw), &len) == REDIS_OK) {
+        *value = leveldbFreezedPages(c->db->id, key, len);
+        retval = *value != NULL;
+    } else {
+        retval = leveldbDecodeValue(raw, sdslen(raw), value) == REDIS_OK;
+    }
+    if (!retval) redisLog(REDIS_WARNING, "read frozen key:%s corrupted value", (char*)key->ptr);
+    sdsfree(raw);
+    return retval;
+}
+
+/* Same as leveldbFreezedValue() for the score of a sorted set member. */
+int leveldbFreezedScore(redisClient *c, robj *key, robj *member, double *score) {
+    int retval = leveldbFreezedCheckType(c, key, 'z');
+    sds raw;
+
+    if (retval <= 0) return retval;
+    if ((raw = leveldbFreezedGet(c->db->id, 'z', key, member)) == NULL) return 0;
+    retval = sdslen(raw) == LEVELDB_SCORE_LEN;
+    if (retval) {
+        *score = leveldbDecodeScore(raw);
+    } else {
+        redisLog(REDIS_WARNING, "read frozen key:%s corrupted score", (char*)key->ptr);
+    }
+    sdsfree(raw);
+    return retval;
+}
+
+typedef struct leveldbFreezedReply {
+    redisClient *c;
+    sds pattern;
+    int allkeys;
+    unsigned long numkeys;
+} leveldbFreezedReply;
+
+static void leveldbFreezedReplyProc(int dbid, const char *name, size_t len, char keytype, void *privdata) {
+    leveldbFreezedReply *r = privdata;
+    REDIS_NOTUSED(dbid);
+
+    if (r->allkeys || stringmatchlen(r->pattern,sdslen(r->pattern),name,len,0)) {
+        addReplyBulkCBuffer(r->c,(char*)name,len);
+        addReplyBulkCBuffer(r->c,&keytype,1);
+        r->numkeys += 2;
+    }
+}
+
+/* FREEZED <pattern> lists the frozen keys and their types from the F records,
+ * as the filter index does not keep the names. */
 void freezedCommand(redisClient *c) {
     if(server.leveldb_state == REDIS_LEVELDB_OFF) {
         addReplyError(c,"leveldb off");
         return;
     }
     
-    dictIterator *di;
-    dictEntry *de;
-    sds pattern = c->argv[1]->ptr;
-    int plen = sdslen(pattern), allkeys;
-    unsigned long numkeys = 0;
+    leveldbFreezedReply r;
     void *replylen = addDeferredMultiBulkLength(c);
 
-    di = dictGetSafeIterator(c->db->freezed);
-    allkeys = (pattern[0] == '*' && pattern[1] == '\0');
-    while((de = dictNext(di)) != NULL) {
-        sds key = dictGetKey(de);
-        char keytype = (char)(dictGetSignedIntegerVal(de));;
-        robj *keyobj;
-        robj *keyval;
-
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
-            keyobj = createStringObject(key,sdslen(key));
-            keyval = createStringObject(&keytype,1);
-            addReplyBulk(c,keyobj);
-            addReplyBulk(c,keyval);
-            numkeys++;
-            numkeys++;
-            decrRefCount(keyobj);
-            decrRefCount(keyval);
+    r.c = c;
+    r.pattern = c->argv[1]->ptr;
+    r.allkeys = (r.pattern[0] == '*' && r.pattern[1] == '\0');
+    r.numkeys = 0;
+    leveldbDrain(&server.ldb);
+    leveldbForEachFreezed(c->db->id, leveldbFreezedReplyProc, &r);
+    setDeferredMultiBulkLength(c,replylen,r.numkeys);
+}
+
+/* FREEZEDSCAN <cursor> [MATCH pattern] [COUNT count] [TYPE type]
+ *
+ * SCAN over the frozen keys, replying with key / type pairs as FREEZED. The
+ * F records are sorted, so the cursor is the hex encoded name of the next
+ * key to visit, "0" to start and at the end of the iteration: the keys that
+ * are frozen during the whole iteration are returned exactly once. At most
+ * COUNT records are visited per call. With several shards their F records
+ * are merged, so the order and the cursor are the same. */
+void freezedscanCommand(redisClient *c) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        addReplyError(c,"leveldb off");
+        return;
+    }
+
+    static const char *hex = "0123456789abcdef";
+    sds cursor = c->argv[1]->ptr, pat = NULL, name, seek, next = NULL;
+    long count = 10, visited = 0;
+    char keytype = 0;
+    leveldb_iterator_t *iterators[REDIS_MAX_LEVELDB_SHARDS];
+    leveldbRecordKey rk;
+    list *keys;
+    listNode *ln;
+    int i, j, shard, cur;
+
+    for (i = 2; i < c->argc; i += 2) {
+        j = c->argc - i;
+        if (!strcasecmp(c->argv[i]->ptr, "count") && j >= 2) {
+            if (getLongFromObjectOrReply(c, c->argv[i+1], &count, NULL) != REDIS_OK)
+                return;
+            if (count < 1) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        } else if (!strcasecmp(c->argv[i]->ptr, "match") && j >= 2) {
+            pat = c->argv[i+1]->ptr;
+            if (pat[0] == '*' && sdslen(pat) == 1) pat = NULL;
+        } else if (!strcasecmp(c->argv[i]->ptr, "type") && j >= 2) {
+            char *t = c->argv[i+1]->ptr;
+
+            if (!strcasecmp(t,"string")) keytype = 'c';
+            else if (!strcasecmp(t,"hash")) keytype = 'h';
+            else if (!strcasecmp(t,"set")) keytype = 's';
+            else if (!strcasecmp(t,"zset")) keytype = 'z';
+            else if (!strcasecmp(t,"list")) keytype = 'l';
+            else {
+                addReplyError(c,"unknown type");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
         }
     }
-    dictReleaseIterator(di);
-    setDeferredMultiBulkLength(c,replylen,numkeys);
+
+    /* The cursor is the name of the next key, the empty name for "0". */
+    name = sdsempty();
+    if (strcmp(cursor,"0")) {
+        int len = sdslen(cursor);
+        const char *hi, *lo;
+        char byte;
+
+        for (j = 0; j < len; j += 2) {
+            if (j+1 == len || !cursor[j] || !cursor[j+1] ||
+                (hi = strchr(hex,tolower(cursor[j]))) == NULL ||
+                (lo = strchr(hex,tolower(cursor[j+1]))) == NULL)
+            {
+                sdsfree(name);
+                addReplyError(c,"invalid cursor");
+                return;
+            }
+            byte = ((hi-hex) << 4) | (lo-hex);
+            name = sdscatlen(name,&byte,1);
+        }
+    }
+    seek = createleveldbFreezedKeyHead(c->db->id, name);
+    sdsfree(name);
+
+    keys = listCreate();
+    leveldbDrain(&server.ldb);
+    for (shard = 0; shard < server.ldb.numshards; shard++) {
+        iterators[shard] = leveldb_create_iterator(server.ldb.shards[shard].db, server.ldb.roptions);
+        leveldb_iter_seek(iterators[shard], seek, sdslen(seek));
+    }
+    for (cur = -1; ; ) {
+        size_t dataLen = 0, valueLen;
+        const char *data = NULL;
+        const char *value;
+
+        /* Advance the shard visited last, then pick the smallest record. */
+        if (cur >= 0) leveldb_iter_next(iterators[cur]);
+        cur = -1;
+        for (shard = 0; shard < server.ldb.numshards; shard++) {
+            size_t len;
+            const char *k;
+
+            if (!leveldb_iter_valid(iterators[shard])) continue;
+            k = leveldb_iter_key(iterators[shard], &len);
+            if (len < LEVELDB_KEY_FLAG_SET_KEY_LEN ||
+                memcmp(k, seek, LEVELDB_KEY_FLAG_SET_KEY_LEN)) continue;
+            if (cur == -1 || leveldbCompareKeys(k, len, data, dataLen) < 0) {
+                cur = shard;
+                data = k;
+                dataLen = len;
+            }
+        }
+        if (cur == -1) break;
+        value = leveldb_iter_value(iterators[cur], &valueLen);
+        if (valueLen != 1 || leveldbParseRecordKey(data, dataLen, &rk) == REDIS_ERR) continue;
+        if (visited++ == count) {
+            next = sdsempty();
+            for (j = 0; j < (int)rk.keylen; j++) {
+                unsigned char byte = rk.key[j];
+
+                next = sdscatlen(next, hex+(byte >> 4), 1);
+                next = sdscatlen(next, hex+(byte & 0xf), 1);
+            }
+            break;
+        }
+        if (keytype && value[0] != keytype) continue;
+        if (pat && !stringmatchlen(pat, sdslen(pat), rk.key, rk.keylen, 0)) continue;
+        listAddNodeTail(keys, createStringObject((char*)rk.key, rk.keylen));
+        listAddNodeTail(keys, createStringObject((char*)value, 1));
+    }
+    for (shard = 0; shard < server.ldb.numshards; shard++)
+        leveldb_iter_destroy(iterators[shard]);
+    sdsfree(seek);
+
+    addReplyMultiBulkLen(c,2);
+    if (next && sdslen(next)) {
+        addReplyBulkCBuffer(c,next,sdslen(next));
+    } else {
+        addReplyBulkCString(c,"0");
+    }
+    sdsfree(next);
+    addReplyMultiBulkLen(c,listLength(keys));
+    while ((ln = listFirst(keys)) != NULL) {
+        addReplyBulk(c,listNodeValue(ln));
+        decrRefCount(listNodeValue(ln));
+        listDelNode(keys,ln);
+    }
+    listRelease(keys);
 }
 
 void leveldbDelHash(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    if (hashTypeLength(objval) > LEVELDB_SWEEP_MIN_ELEMENTS) {
+        leveldbRetireKey(dbid, ldb, 'h', objkey->ptr);
+        return;
+    }
+
     hashTypeIterator *hi;
     sds key = createleveldbHashHead(dbid, objkey->ptr);
-    leveldb_writebatch_t* wb = leveldb_writebatch_create();
     size_t klen = sdslen(key);
-    char *err = NULL;
 
     hi = hashTypeInitIterator(objval);
     while (hashTypeNext(hi) != REDIS_ERR) {
@@ -1153,12 +6982,12 @@ void leveldbDelHash(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
             hashTypeCurrentFromZiplist(hi, REDIS_HASH_KEY, &vstr, &vlen, &vll);
             if (vstr) {
                 key = sdscatlen(key, vstr, vlen);
-                leveldb_writebatch_delete(wb, key, sdslen(key));
+                leveldbBatchDelete(ldb, key, sdslen(key));
                 sdsrange(key, 0, klen - 1);
             } else {
                 sds sdsll = sdsfromlonglong(vll);
                 key = sdscatsds(key, sdsll);
-                leveldb_writebatch_delete(wb, key, sdslen(key));
+                leveldbBatchDelete(ldb, key, sdslen(key));
                 sdsfree(sdsll);
                 sdsrange(key, 0, klen - 1);
             }
@@ -1168,8 +6997,8 @@ void leveldbDelHash(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
 
             hashTypeCurrentFromHashTable(hi, REDIS_HASH_KEY, &value);
             decval = getDecodedObject(value);
-            key = sdscat(key, decval->ptr);
-            leveldb_writebatch_delete(wb, key, sdslen(key));
+            key = sdscatsds(key, decval->ptr);
+            leveldbBatchDelete(ldb, key, sdslen(key));
             sdsrange(key, 0, klen - 1);
             decrRefCount(decval);
         } else {
@@ -1177,57 +7006,66 @@ void leveldbDelHash(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
         }
     }
 
-    leveldb_write(ldb->db, ldb->woptions, wb, &err);
-    procLeveldbError(err, "leveldbDelHash leveldb err: %s");
-    server.leveldb_op_num++;
+    leveldbCommit(ldb);
 
     hashTypeReleaseIterator(hi);
-    leveldb_writebatch_destroy(wb);
     sdsfree(key);
 }
 
 void leveldbDelSet(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    if (setTypeSize(objval) > LEVELDB_SWEEP_MIN_ELEMENTS) {
+        leveldbRetireKey(dbid, ldb, 's', objkey->ptr);
+        return;
+    }
+
     setTypeIterator *si;
     robj *eleobj = NULL;
     int64_t intobj;
     int encoding;
     sds key = createleveldbSetHead(dbid, objkey->ptr);
-    leveldb_writebatch_t* wb = leveldb_writebatch_create();
     size_t klen = sdslen(key);
-    char *err = NULL;
     
     si = setTypeInitIterator(objval);
     while((encoding = setTypeNext(si, &eleobj, &intobj)) != -1) {
         if (encoding == REDIS_ENCODING_HT) {
             robj *decval = getDecodedObject(eleobj);
-            key = sdscat(key, decval->ptr);
-            leveldb_writebatch_delete(wb, key, sdslen(key));
+            key = sdscatsds(key, decval->ptr);
+            leveldbBatchDelete(ldb, key, sdslen(key));
             sdsrange(key, 0, klen - 1);
             decrRefCount(decval);
         } else {
             sds sdsll = sdsfromlonglong((long long)intobj);
             key = sdscatsds(key, sdsll);
-            leveldb_writebatch_delete(wb, key, sdslen(key));
+            leveldbBatchDelete(ldb, key, sdslen(key));
             sdsfree(sdsll);
             sdsrange(key, 0, klen - 1);
         }
     }
     
-    leveldb_write(ldb->db, ldb->woptions, wb, &err);
-    procLeveldbError(err, "leveldbDelSet leveldb err: %s");
-    server.leveldb_op_num++;
+    leveldbCommit(ldb);
     
     setTypeReleaseIterator(si);
-    leveldb_writebatch_destroy(wb);
     sdsfree(key);
 }
 
 void leveldbDelZset(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
     int rangelen = zsetLength(objval);
+
+    if (rangelen > LEVELDB_SWEEP_MIN_ELEMENTS) {
+        leveldbRetireKey(dbid, ldb, 'z', objkey->ptr);
+        return;
+    }
+
     sds key = createleveldbSortedSetHead(dbid, objkey->ptr);
-    leveldb_writebatch_t* wb = leveldb_writebatch_create();
     size_t klen = sdslen(key);
-    char *err = NULL;
 
     if (objval->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = objval->ptr;
@@ -1247,12 +7085,12 @@ void leveldbDelZset(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
             if (vstr == NULL) {
                 sds sdsll = sdsfromlonglong(vlong);
                 key = sdscatsds(key, sdsll);
-                leveldb_writebatch_delete(wb, key, sdslen(key));
+                leveldbBatchDelete(ldb, key, sdslen(key));
                 sdsfree(sdsll);
                 sdsrange(key, 0, klen - 1);
             } else {
                 key = sdscatlen(key, vstr, vlen);
-                leveldb_writebatch_delete(wb, key, sdslen(key));
+                leveldbBatchDelete(ldb, key, sdslen(key));
                 sdsrange(key, 0, klen - 1);
             }
             
@@ -1272,8 +7110,8 @@ void leveldbDelZset(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
             ele = ln->obj;
             
             decval = getDecodedObject(ele);
-            key = sdscat(key, decval->ptr);
-            leveldb_writebatch_delete(wb, key, sdslen(key));
+            key = sdscatsds(key, decval->ptr);
+            leveldbBatchDelete(ldb, key, sdslen(key));
             sdsrange(key, 0, klen - 1);
             decrRefCount(decval);
             ln = ln->level[0].forward;
@@ -1282,10 +7120,162 @@ void leveldbDelZset(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
         redisPanic("leveldbDelZset unknown sorted set encoding");
     }
     
-    leveldb_write(ldb->db, ldb->woptions, wb, &err);
-    procLeveldbError(err, "leveldbDelZset leveldb err: %s");
-    server.leveldb_op_num++;
+    leveldbCommit(ldb);
+
+    sdsfree(key);
+}
+
+void leveldbDelList(int dbid, struct leveldb *ldb, robj* objkey, robj *objval) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    long len = listTypeLength(objval), j;
+    long long head = leveldbListHead(dbid, objkey->ptr);
+
+    leveldbSetListHead(dbid, objkey->ptr, 0);
+    if (len > LEVELDB_SWEEP_MIN_ELEMENTS) {
+        leveldbRetireKey(dbid, ldb, 'l', objkey->ptr);
+        return;
+    }
+
+    sds key = leveldbKeyPrefix(dbid, 'l', objkey->ptr);
+    size_t klen = sdslen(key);
+
+    for (j = 0; j < len; j++)
+        key = leveldbListDelete(ldb, key, klen, head+j);
+    leveldbCommit(ldb);
 
-    leveldb_writebatch_destroy(wb);
     sdsfree(key);
 }
+
+/* Stage every record of 'val' stored at 'key', that holds no records. */
+void leveldbPutKey(int dbid, struct leveldb *ldb, robj *key, robj *val) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    robj *r1 = getDecodedObject(key);
+    sds rkey, rval;
+    size_t klen;
+
+    switch(val->type) {
+    case REDIS_STRING:
+        leveldbSetDirect(dbid, ldb, r1, val);
+        decrRefCount(r1);
+        return;
+    case REDIS_LIST:
+        rkey = leveldbKeyPrefix(dbid, 'l', r1->ptr);
+        klen = sdslen(rkey);
+        rkey = leveldbListRewrite(ldb, rkey, klen, val,
+            leveldbListHead(dbid, r1->ptr), 0, listTypeLength(val)-1);
+        break;
+    case REDIS_SET: {
+        setTypeIterator *si = setTypeInitIterator(val);
+        robj *ele;
+
+        rkey = createleveldbSetHead(dbid, r1->ptr);
+        klen = sdslen(rkey);
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            robj *decval = getDecodedObject(ele);
+
+            rkey = sdscatsds(rkey, decval->ptr);
+            leveldbBatchPut(ldb, rkey, sdslen(rkey), NULL, 0);
+            sdsrange(rkey, 0, klen - 1);
+            decrRefCount(decval);
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+        break;
+    }
+    case REDIS_ZSET: {
+        char buf[LEVELDB_SCORE_LEN];
+
+        rkey = createleveldbSortedSetHead(dbid, r1->ptr);
+        klen = sdslen(rkey);
+        if (val->encoding == REDIS_ENCODING_ZIPLIST) {
+            unsigned char *zl = val->ptr;
+            unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+
+            sptr = eptr ? ziplistNext(zl,eptr) : NULL;
+            while (eptr != NULL) {
+                redisAssertWithInfo(NULL,val,ziplistGet(eptr,&vstr,&vlen,&vlong));
+                if (vstr == NULL) {
+                    sds sdsll = sdsfromlonglong(vlong);
+
+                    rkey = sdscatsds(rkey, sdsll);
+                    sdsfree(sdsll);
+                } else {
+                    rkey = sdscatlen(rkey, vstr, vlen);
+                }
+                leveldbEncodeScore(buf, zzlGetScore(sptr));
+                leveldbBatchPut(ldb, rkey, sdslen(rkey), buf, sizeof(buf));
+                sdsrange(rkey, 0, klen - 1);
+                zzlNext(zl,&eptr,&sptr);
+            }
+        } else if (val->encoding == REDIS_ENCODING_SKIPLIST) {
+            zskiplistNode *ln = ((zset*)val->ptr)->zsl->header->level[0].forward;
+
+            for (; ln != NULL; ln = ln->level[0].forward) {
+                robj *decval = getDecodedObject(ln->obj);
+
+                rkey = sdscatsds(rkey, decval->ptr);
+                leveldbEncodeScore(buf, ln->score);
+                leveldbBatchPut(ldb, rkey, sdslen(rkey), buf, sizeof(buf));
+                sdsrange(rkey, 0, klen - 1);
+                decrRefCount(decval);
+            }
+        } else {
+            redisPanic("leveldbPutKey unknown sorted set encoding");
+        }
+        break;
+    }
+    case REDIS_HASH: {
+        hashTypeIterator *hi = hashTypeInitIterator(val);
+
+        rkey = createleveldbHashHead(dbid, r1->ptr);
+        klen = sdslen(rkey);
+        while (hashTypeNext(hi) != REDIS_ERR) {
+            robj *field = hashTypeCurrentObject(hi, REDIS_HASH_KEY);
+            robj *value = hashTypeCurrentObject(hi, REDIS_HASH_VALUE);
+            robj *decval = getDecodedObject(field);
+
+            rkey = sdscatsds(rkey, decval->ptr);
+            rval = leveldbEncodeObjectValue(value);
+            leveldbBatchPut(ldb, rkey, sdslen(rkey), rval, sdslen(rval));
+            sdsrange(rkey, 0, klen - 1);
+            sdsfree(rval);
+            decrRefCount(decval);
+            decrRefCount(field);
+            decrRefCount(value);
+        }
+        hashTypeReleaseIterator(hi);
+        break;
+    }
+    default:
+        redisPanic("leveldbPutKey unknown type");
+    }
+    leveldbCommit(ldb);
+
+    sdsfree(rkey);
+    decrRefCount(r1);
+}
+
+/* Replace the records of 'key', that held 'old' (NULL if it did not exist),
+ * with those of 'val' (NULL if the key is deleted) in a single write. Used
+ * by the commands storing a computed value, that would otherwise rewrite
+ * the destination member by member. 'old' must leave the key space right
+ * after, see leveldbDelKey(). */
+void leveldbReplaceKey(int dbid, struct leveldb *ldb, robj *key, robj *old, robj *val) {
+    if(server.leveldb_state == REDIS_LEVELDB_OFF) {
+        return;
+    }
+
+    leveldbBeginBatch(ldb);
+    if (old) leveldbDelKey(dbid, ldb, key, old);
+    if (val) leveldbPutKey(dbid, ldb, key, val);
+    leveldbEndBatch(ldb);
+}
@@ -142,6 +142,8 @@ void execCommand(redisClient *c) {
     orig_argc = c->argc;
     orig_cmd = c->cmd;
     addReplyMultiBulkLen(c,c->mstate.count);
+    /* The LevelDB mutations of the transaction are written as one batch. */
+    leveldbBeginBatch(&server.ldb);
     for (j = 0; j < c->mstate.count; j++) {
         c->argc = c->mstate.commands[j].argc;
         c->argv = c->mstate.commands[j].argv;
@@ -163,6 +165,7 @@ void execCommand(redisClient *c) {
         c->mstate.commands[j].argv = c->argv;
         c->mstate.commands[j].cmd = c->cmd;
     }
+    leveldbEndBatch(&server.ldb);
     c->argv = orig_argv;
     c->argc = orig_argc;
     c->cmd = orig_cmd;
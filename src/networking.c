@@ -102,6 +102,11 @@ redisClient *createClient(int fd) {
     c->bpop.keys = dictCreate(&setDictType,NULL);
     c->bpop.timeout = 0;
     c->bpop.target = NULL;
+    c->bpop.meltpending = 0;
+    c->bpop.melted = -1;
+    c->bpop.meltargv = NULL;
+    c->bpop.meltargc = 0;
+    c->bpop.meltcmd = NULL;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&setDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -671,8 +676,12 @@ void freeClient(redisClient *c) {
     c->querybuf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
-    if (c->flags & REDIS_BLOCKED)
-        unblockClientWaitingData(c);
+    if (c->flags & REDIS_BLOCKED) {
+        if (c->bpop.meltpending)
+            leveldbUnblockMelt(c);
+        else
+            unblockClientWaitingData(c);
+    }
     dictRelease(c->bpop.keys);
 
     /* UNWATCH all the keys */
@@ -721,6 +721,12 @@ int rdbSave(char *filename) {
     rio rdb;
     int error;
 
+    /* Only part of the key space is loaded yet. */
+    if (leveldbLazyLoading()) {
+        redisLog(REDIS_WARNING, "Can't save the DB while the leveldb lazy load is in progress");
+        return REDIS_ERR;
+    }
+
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
     if (!fp) {
@@ -764,7 +770,11 @@ int rdbSaveBackground(char *filename) {
     pid_t childpid;
     long long start;
 
-    if (server.rdb_child_pid != -1) return REDIS_ERR;
+    /* The slaves waiting for a snapshot save would get this file instead.
+     * A lazy leveldb load has only part of the key space in memory. */
+    if (server.rdb_child_pid != -1 || leveldbSnapshotSaveInProgress() ||
+        leveldbLazyLoading())
+        return REDIS_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -1207,6 +1217,7 @@ int rdbLoad(char *filename) {
         }
         /* Add the new object in the hash table */
         dbAdd(db,key,val);
+        leveldbIngestKey(db->id,key,val);
 
         /* Set the expire time if needed */
         if (expiretime != -1) setExpire(db,key,expiretime);
@@ -1394,7 +1405,8 @@ int rdbSaveToSlavesSockets(void) {
     long long start;
     int pipefds[2];
 
-    if (server.rdb_child_pid != -1) return REDIS_ERR;
+    if (server.rdb_child_pid != -1 || leveldbSnapshotSaveInProgress())
+        return REDIS_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -1531,7 +1543,7 @@ void saveCommand(redisClient *c) {
 }
 
 void bgsaveCommand(redisClient *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || leveldbSnapshotSaveInProgress()) {
         addReplyError(c,"Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         addReplyError(c,"Can't BGSAVE while AOF log rewriting is in progress");
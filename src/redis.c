@@ -116,15 +116,16 @@ struct redisServer server; /* server global state */
  *    its execution as long as the kernel scheduler is giving us time.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
+ * z: Reads frozen keys straight from LevelDB, without melting them.
  */
 struct redisCommand redisCommandTable[] = {
-    {"get",getCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"get",getCommand,2,"rFz",0,NULL,1,1,1,0,0},
     {"set",setCommand,-3,"wm",0,NULL,1,1,1,0,0},
     {"setnx",setnxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"setex",setexCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"psetex",psetexCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"append",appendCommand,3,"wm",0,NULL,1,1,1,0,0},
-    {"strlen",strlenCommand,2,"rF",0,NULL,1,1,1,0,0},
+    {"strlen",strlenCommand,2,"rFz",0,NULL,1,1,1,0,0},
     {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"exists",existsCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"setbit",setbitCommand,4,"wm",0,NULL,1,1,1,0,0},
@@ -155,7 +156,7 @@ struct redisCommand redisCommandTable[] = {
     {"sadd",saddCommand,-3,"wmF",0,NULL,1,1,1,0,0},
     {"srem",sremCommand,-3,"wF",0,NULL,1,1,1,0,0},
     {"smove",smoveCommand,4,"wF",0,NULL,1,2,1,0,0},
-    {"sismember",sismemberCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"sismember",sismemberCommand,3,"rFz",0,NULL,1,1,1,0,0},
     {"scard",scardCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"spop",spopCommand,2,"wRsF",0,NULL,1,1,1,0,0},
     {"srandmember",srandmemberCommand,-2,"rR",0,NULL,1,1,1,0,0},
@@ -184,15 +185,15 @@ struct redisCommand redisCommandTable[] = {
     {"zlexcount",zlexcountCommand,4,"rF",0,NULL,1,1,1,0,0},
     {"zrevrange",zrevrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zcard",zcardCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"zscore",zscoreCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"zscore",zscoreCommand,3,"rFz",0,NULL,1,1,1,0,0},
     {"zrank",zrankCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"zrevrank",zrevrankCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"zscan",zscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
     {"hset",hsetCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hsetnx",hsetnxCommand,4,"wmF",0,NULL,1,1,1,0,0},
-    {"hget",hgetCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"hget",hgetCommand,3,"rFz",0,NULL,1,1,1,0,0},
     {"hmset",hmsetCommand,-4,"wm",0,NULL,1,1,1,0,0},
-    {"hmget",hmgetCommand,-3,"r",0,NULL,1,1,1,0,0},
+    {"hmget",hmgetCommand,-3,"rz",0,NULL,1,1,1,0,0},
     {"hincrby",hincrbyCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hincrbyfloat",hincrbyfloatCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hdel",hdelCommand,-3,"wF",0,NULL,1,1,1,0,0},
@@ -200,7 +201,7 @@ struct redisCommand redisCommandTable[] = {
     {"hkeys",hkeysCommand,2,"rS",0,NULL,1,1,1,0,0},
     {"hvals",hvalsCommand,2,"rS",0,NULL,1,1,1,0,0},
     {"hgetall",hgetallCommand,2,"r",0,NULL,1,1,1,0,0},
-    {"hexists",hexistsCommand,3,"rF",0,NULL,1,1,1,0,0},
+    {"hexists",hexistsCommand,3,"rFz",0,NULL,1,1,1,0,0},
     {"hscan",hscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
     {"incrby",incrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"decrby",decrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
@@ -278,7 +279,8 @@ struct redisCommand redisCommandTable[] = {
     {"freeze",freezeCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"melt",meltCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"freezed",freezedCommand,2,"rS",0,NULL,0,0,0,0,0},
-    {"backup",backupCommand,2,"ar",0,NULL,0,0,0,0,0}
+    {"freezedscan",freezedscanCommand,-2,"rR",0,NULL,0,0,0,0,0},
+    {"backup",backupCommand,-2,"ar",0,NULL,0,0,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -505,7 +507,8 @@ unsigned int dictEncObjHash(const void *key) {
     }
 }
 
-/* Freezed key hash table */
+/* Freezed key hash table, also used by db->listheads and the coalesced
+ * LevelDB writes: sds keys, integer values. */
 dictType freezedDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -515,6 +518,16 @@ dictType freezedDictType = {
     NULL                        /* val destructor */
 };
 
+/* Db->generations dict: sds keys, zmalloc()ed values. */
+dictType generationsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictVanillaFree             /* val destructor */
+};
+
 /* Sets type hash table */
 dictType setDictType = {
     dictEncObjHash,            /* hash function */
@@ -555,7 +568,7 @@ dictType shaScriptObjectDictType = {
     dictRedisObjectDestructor   /* val destructor */
 };
 
-/* Db->expires */
+/* Db->expires and db->melting */
 dictType keyptrDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
@@ -688,6 +701,7 @@ int activeExpireCycleTryExpire(redisDb *db, struct dictEntry *de, long long now)
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj);
+        leveldbDelKey(db->id,&server.ldb,keyobj,dictFetchValue(db->dict,key));
         dbDelete(db,keyobj);
         notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
             "expired",keyobj,db->id);
@@ -956,8 +970,11 @@ void clientsCron(void) {
 void databasesCron(void) {
     /* Expire keys by random sampling. Not required for slaves
      * as master will synthesize DELs for us. */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL) {
+        leveldbBeginBatch(&server.ldb);
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
+        leveldbEndBatch(&server.ldb);
+    }
 
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
@@ -1105,6 +1122,34 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Release what the LevelDB background sweeps reclaimed. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbSweepCron();
+
+    /* Send the RDB saved from a LevelDB snapshot to the waiting slaves. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbSnapshotCron();
+
+    /* Free a slice of the big collections deleted in LevelDB mode. */
+    leveldbLazyFreeCron();
+
+    /* Load a slice of the key space with leveldb-lazy-load. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbLazyLoadCron();
+
+    /* Index the access times of the keys with leveldb-hotness-period. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbHotnessCron();
+
+    /* Forget the frozen key changes applied by the LevelDB writer threads. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) leveldbFreezedCron();
+
+    /* Sync the LevelDB log with leveldb-fsync everysec. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF) {
+        run_with_period(1000) leveldbFsyncCron();
+    }
+
+    /* Write the counters coalesced during the last leveldb-coalesce-ms. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF && server.leveldb_coalesce_ms) {
+        run_with_period(server.leveldb_coalesce_ms) leveldbCoalesceFlush(&server.ldb);
+    }
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
@@ -1135,7 +1180,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             }
             updateDictResizePolicy();
         }
-    } else {
+    } else if (!leveldbLazyLoading()) {
         /* If there is not a background saving/rewrite in progress check if
          * we have to save/rewrite now */
          for (j = 0; j < server.saveparamslen; j++) {
@@ -1214,8 +1259,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL) {
+        leveldbBeginBatch(&server.ldb);
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
+        leveldbEndBatch(&server.ldb);
+    }
 
     /* Try to process pending commands for clients that were just unblocked. */
     while (listLength(server.unblocked_clients)) {
@@ -1233,6 +1281,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         }
     }
 
+    /* Write the LevelDB mutations of this event loop iteration, before the
+     * replies are sent to the clients. */
+    if (server.leveldb_state != REDIS_LEVELDB_OFF)
+        leveldbFlush(&server.ldb);
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 }
@@ -1349,6 +1402,7 @@ void initServerConfig(void) {
     server.maxidletime = REDIS_MAXIDLETIME;
     server.tcpkeepalive = REDIS_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
+    server.leveldb_debug_crash_shards = -1;
     server.client_max_querybuf_len = REDIS_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
@@ -1479,6 +1533,40 @@ void initServerConfig(void) {
     server.leveldb_state = REDIS_LEVELDB_OFF;
     server.leveldb_path = NULL;
     server.leveldb_op_num = 0;
+    server.leveldb_async = REDIS_DEFAULT_LEVELDB_ASYNC;
+    server.leveldb_async_max_bytes = REDIS_DEFAULT_LEVELDB_ASYNC_MAX_BYTES;
+    server.leveldb_async_stalls = 0;
+    server.leveldb_group_commit = REDIS_DEFAULT_LEVELDB_GROUP_COMMIT;
+    server.leveldb_load_keys = 0;
+    server.leveldb_load_records = 0;
+    server.leveldb_load_usec = 0;
+    server.leveldb_load_threads = REDIS_DEFAULT_LEVELDB_LOAD_THREADS;
+    server.leveldb_lazy_load = REDIS_DEFAULT_LEVELDB_LAZY_LOAD;
+    server.leveldb_lazy_point_loads = 0;
+    server.leveldb_load_max_memory = REDIS_DEFAULT_LEVELDB_LOAD_MAX_MEMORY;
+    server.leveldb_load_freezes = 0;
+    server.leveldb_hotness_period = REDIS_DEFAULT_LEVELDB_HOTNESS_PERIOD;
+    server.leveldb_hotness_writes = 0;
+    server.leveldb_shards = REDIS_DEFAULT_LEVELDB_SHARDS;
+    server.leveldb_lru_freezes = 0;
+    server.leveldb_lru_melts = 0;
+    server.leveldb_lru_drops = 0;
+    server.leveldb_freezed_reads = 0;
+    server.leveldb_melts = 0;
+    server.leveldb_melt_failures = 0;
+    server.leveldb_melt_usec = 0;
+    server.leveldb_melt_max_usec = 0;
+    server.leveldb_cache_size = REDIS_DEFAULT_LEVELDB_CACHE_SIZE;
+    server.leveldb_freezed_index = REDIS_DEFAULT_LEVELDB_FREEZED_INDEX;
+    server.leveldb_coalesce_ms = REDIS_DEFAULT_LEVELDB_COALESCE_MS;
+    server.leveldb_coalesced = 0;
+    server.leveldb_fsync = REDIS_DEFAULT_LEVELDB_FSYNC;
+    server.leveldb_fsync_op_num = 0;
+    server.leveldb_repl_snapshot = REDIS_DEFAULT_LEVELDB_REPL_SNAPSHOT;
+    server.leveldb_snapshot_saves = 0;
+    server.leveldb_snapshot_last_usec = 0;
+    server.leveldb_ingest_keys = 0;
+    server.leveldb_ingest_usec = 0;
 }
 
 /* This function will try to raise the max number of open files accordingly to
@@ -1732,6 +1820,9 @@ void initServer(void) {
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].freezed = dictCreate(&freezedDictType,NULL);
+        server.db[j].generations = dictCreate(&generationsDictType,NULL);
+        server.db[j].listheads = dictCreate(&freezedDictType,NULL);
+        server.db[j].melting = dictCreate(&keyptrDictType,NULL);
     }
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
@@ -1832,6 +1923,7 @@ void populateCommandTable(void) {
             case 't': c->flags |= REDIS_CMD_STALE; break;
             case 'M': c->flags |= REDIS_CMD_SKIP_MONITOR; break;
             case 'F': c->flags |= REDIS_CMD_FAST; break;
+            case 'z': c->flags |= REDIS_CMD_FREEZED_READ; break;
             default: redisPanic("Unsupported command flag"); break;
             }
             f++;
@@ -1970,6 +2062,12 @@ void call(redisClient *c, int flags) {
         replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
     }
 
+    /* Load the keys of the command not yet read by leveldb-lazy-load. */
+    leveldbLazyLoadCommandKeys(c);
+
+    /* Bring back the keys frozen by the freeze-lru policy. */
+    leveldbMeltCommandKeys(c);
+
     /* Call the command. */
     c->flags &= ~(REDIS_FORCE_AOF|REDIS_FORCE_REPL);
     redisOpArrayInit(&server.also_propagate);
@@ -2171,6 +2269,13 @@ int processCommand(redisClient *c) {
         return REDIS_OK;
     }
 
+    /* Commands seeing the whole key space wait for the leveldb lazy load. */
+    if (leveldbLazyLoadRefuses(c->cmd, c->argv, c->argc)) {
+        flagTransaction(c);
+        addReply(c, shared.loadingerr);
+        return REDIS_OK;
+    }
+
     /* Lua script too slow? Only allow a limited number of commands. */
     if (server.lua_timedout &&
           c->cmd->proc != authCommand &&
@@ -2195,6 +2300,8 @@ int processCommand(redisClient *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        /* Wait for the frozen keys of the command melted in background. */
+        if (leveldbBlockForMelt(c)) return REDIS_OK;
         call(c,REDIS_CALL_FULL);
         if (listLength(server.ready_keys))
             handleClientsBlockedOnLists();
@@ -2220,6 +2327,7 @@ void closeListeningSockets(int unlink_unix_socket) {
 int prepareForShutdown(int flags) {
     int save = flags & REDIS_SHUTDOWN_SAVE;
     int nosave = flags & REDIS_SHUTDOWN_NOSAVE;
+    int lazyload = leveldbLazyLoading();
 
     redisLog(REDIS_WARNING,"User requested shutdown...");
     /* Kill the saving child if there is a background saving in progress.
@@ -2249,7 +2357,10 @@ int prepareForShutdown(int flags) {
         aof_fsync(server.aof_fd);
     }
     if(server.leveldb_state != REDIS_LEVELDB_OFF) closeleveldb(&server.ldb);
-    if ((server.saveparamslen > 0 && !nosave) || save) {
+    if (lazyload && ((server.saveparamslen > 0 && !nosave) || save)) {
+        /* Only part of the key space is in memory, LevelDB has it all. */
+        redisLog(REDIS_WARNING,"Skipping the final RDB snapshot: the leveldb lazy load is in progress.");
+    } else if ((server.saveparamslen > 0 && !nosave) || save) {
         redisLog(REDIS_NOTICE,"Saving the final RDB snapshot before exiting.");
         /* Snapshotting. Perform a SYNC SAVE and exit */
         if (rdbSave(server.rdb_filename) != REDIS_OK) {
@@ -2902,24 +3013,102 @@ sds genRedisInfoString(char *section) {
       if (sections++) info = sdscat(info,"\r\n");
       info = sdscatprintf(info, "# leveldb\r\n");
       if(server.leveldb_state != REDIS_LEVELDB_OFF) {
+        unsigned long long async_batches, async_bytes;
+        unsigned long long lazyfree_elements, lazyfree_bytes;
+        unsigned long lazyfree_objects;
+        long long async_lag;
+
+        leveldbAsyncStats(&async_batches,&async_bytes,&async_lag);
+        leveldbLazyFreeStats(&lazyfree_objects,&lazyfree_elements,&lazyfree_bytes);
         info = sdscatprintf(info, "leveldb op num=%lld\r\n", server.leveldb_op_num);
+        info = sdscatprintf(info,
+            "leveldb_group_commit:%d\r\n"
+            "leveldb_async_write:%d\r\n"
+            "leveldb_fsync:%s\r\n"
+            "leveldb_async_queue_batches:%llu\r\n"
+            "leveldb_async_queue_bytes:%llu\r\n"
+            "leveldb_async_lag_ms:%lld\r\n"
+            "leveldb_async_stalls:%lld\r\n"
+            "leveldb_load_keys:%lld\r\n"
+            "leveldb_load_records:%lld\r\n"
+            "leveldb_load_seconds:%.3f\r\n"
+            "leveldb_load_records_per_sec:%lld\r\n"
+            "leveldb_lazy_loading:%d\r\n"
+            "leveldb_lazy_point_loads:%lld\r\n"
+            "leveldb_load_frozen_keys:%lld\r\n"
+            "leveldb_hotness_writes:%lld\r\n"
+            "leveldb_sweeps_pending:%llu\r\n"
+            "leveldb_lru_freezes:%lld\r\n"
+            "leveldb_lru_melts:%lld\r\n"
+            "leveldb_lru_drops:%lld\r\n"
+            "leveldb_freezed_reads:%lld\r\n"
+            "leveldb_melts_in_flight:%llu\r\n"
+            "leveldb_melts:%lld\r\n"
+            "leveldb_melt_failures:%lld\r\n"
+            "leveldb_melt_avg_ms:%.3f\r\n"
+            "leveldb_melt_max_ms:%.3f\r\n"
+            "leveldb_freezed_filter_bytes:%zu\r\n"
+            "leveldb_coalesce_pending:%lu\r\n"
+            "leveldb_coalesced_writes:%lld\r\n"
+            "leveldb_lazyfree_pending_objects:%lu\r\n"
+            "leveldb_lazyfree_pending_elements:%llu\r\n"
+            "leveldb_lazyfree_pending_bytes:%llu\r\n"
+            "leveldb_repl_snapshot:%d\r\n"
+            "leveldb_snapshot_save_in_progress:%d\r\n"
+            "leveldb_snapshot_saves:%lld\r\n"
+            "leveldb_snapshot_last_save_seconds:%.3f\r\n"
+            "leveldb_sync_ingest_keys:%lld\r\n"
+            "leveldb_sync_ingest_seconds:%.3f\r\n",
+            server.leveldb_group_commit,
+            server.leveldb_async,
+            server.leveldb_fsync == REDIS_LEVELDB_FSYNC_ALWAYS ? "always" :
+            server.leveldb_fsync == REDIS_LEVELDB_FSYNC_EVERYSEC ? "everysec" : "no",
+            async_batches,
+            async_bytes,
+            async_lag,
+            server.leveldb_async_stalls,
+            server.leveldb_load_keys,
+            server.leveldb_load_records,
+            (double)server.leveldb_load_usec/1000000,
+            server.leveldb_load_usec ?
+                server.leveldb_load_records*1000000/server.leveldb_load_usec : 0,
+            leveldbLazyLoading(),
+            server.leveldb_lazy_point_loads,
+            server.leveldb_load_freezes,
+            server.leveldb_hotness_writes,
+            bioPendingJobsOfType(REDIS_BIO_LEVELDB_SWEEP),
+            server.leveldb_lru_freezes,
+            server.leveldb_lru_melts,
+            server.leveldb_lru_drops,
+            server.leveldb_freezed_reads,
+            bioPendingJobsOfType(REDIS_BIO_LEVELDB_MELT),
+            server.leveldb_melts,
+            server.leveldb_melt_failures,
+            server.leveldb_melts+server.leveldb_melt_failures ?
+                (double)server.leveldb_melt_usec/1000/
+                (server.leveldb_melts+server.leveldb_melt_failures) : 0,
+            (double)server.leveldb_melt_max_usec/1000,
+            leveldbFreezedFilterBytes(),
+            leveldbCoalescePending(),
+            server.leveldb_coalesced,
+            lazyfree_objects,
+            lazyfree_elements,
+            lazyfree_bytes,
+            server.leveldb_repl_snapshot,
+            leveldbSnapshotSaveInProgress(),
+            server.leveldb_snapshot_saves,
+            (double)server.leveldb_snapshot_last_usec/1000000,
+            server.leveldb_ingest_keys,
+            (double)server.leveldb_ingest_usec/1000000);
         for (j = 0; j < server.dbnum; j++) {
             long long keys;
 
-            keys = dictSize(server.db[j].freezed);
+            keys = freezedKeysCount(j);
             if (keys) {
                 info = sdscatprintf(info, "db%d:freezed=%lld\r\n", j, keys);
             }
         }
-        char *ss = leveldb_property_value(server.ldb.db, "leveldb.stats");
-        info = sdscat(info,ss);
-        leveldb_free(ss);
-        ss = NULL;
-        info = sdscat(info,"\r\n");
-        ss = leveldb_property_value(server.ldb.db, "leveldb.sstables");
-        info = sdscat(info,ss);
-        leveldb_free(ss);
-        ss = NULL;
+        info = leveldbCatShardsInfo(info);
       }
     }
     return info;
@@ -2997,6 +3186,9 @@ int freeMemoryIfNeeded(void) {
 
     if (server.maxmemory_policy == REDIS_MAXMEMORY_NO_EVICTION)
         return REDIS_ERR; /* We need to free memory, but policy forbids. */
+    if (server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU &&
+        server.leveldb_state == REDIS_LEVELDB_OFF)
+        return REDIS_ERR; /* Nowhere to freeze the keys. */
 
     /* Compute how much memory we need to free. */
     mem_tofree = mem_used - server.maxmemory;
@@ -3013,7 +3205,8 @@ int freeMemoryIfNeeded(void) {
             dict *dict;
 
             if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM)
+                server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM ||
+                server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU)
             {
                 dict = server.db[j].dict;
             } else {
@@ -3029,9 +3222,10 @@ int freeMemoryIfNeeded(void) {
                 bestkey = dictGetKey(de);
             }
 
-            /* volatile-lru and allkeys-lru policy */
+            /* volatile-lru, allkeys-lru and freeze-lru policy */
             else if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
+                server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU ||
+                server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU)
             {
                 for (k = 0; k < server.maxmemory_samples; k++) {
                     sds thiskey;
@@ -3040,6 +3234,11 @@ int freeMemoryIfNeeded(void) {
 
                     de = dictGetRandomKey(dict);
                     thiskey = dictGetKey(de);
+                    /* A frozen key would lose its expire: volatile keys
+                     * are left in memory to expire. */
+                    if (server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU &&
+                        dictSize(db->expires) &&
+                        dictFind(db->expires, thiskey)) continue;
                     /* When policy is volatile-lru we need an additional lookup
                      * to locate the real key, as dict is set to db->expires. */
                     if (server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
@@ -3074,8 +3273,27 @@ int freeMemoryIfNeeded(void) {
                 }
             }
 
+            /* Freeze the selected key: its records are in LevelDB already,
+             * only the memory is released. */
+            if (bestkey &&
+                server.maxmemory_policy == REDIS_MAXMEMORY_FREEZE_LRU)
+            {
+                long long delta;
+                robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
+                char type = leveldbObjectType(dictFetchValue(db->dict,bestkey));
+
+                delta = (long long) zmalloc_used_memory();
+                if (freezeKey(db,&server.ldb,keyobj,type) == REDIS_OK) {
+                    delta -= (long long) zmalloc_used_memory();
+                    mem_freed += delta;
+                    server.leveldb_lru_freezes++;
+                    keys_freed++;
+                }
+                decrRefCount(keyobj);
+            }
+
             /* Finally remove the selected key. */
-            if (bestkey) {
+            else if (bestkey) {
                 long long delta;
 
                 robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
@@ -134,6 +134,21 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_BINDADDR_MAX 16
 #define REDIS_MIN_RESERVED_FDS 32
 #define REDIS_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
+#define REDIS_DEFAULT_LEVELDB_ASYNC 0
+#define REDIS_DEFAULT_LEVELDB_GROUP_COMMIT 1
+#define REDIS_DEFAULT_LEVELDB_ASYNC_MAX_BYTES (64*1024*1024) /* 64mb */
+#define REDIS_DEFAULT_LEVELDB_LOAD_THREADS 4
+#define REDIS_MAX_LEVELDB_LOAD_THREADS 64
+#define REDIS_DEFAULT_LEVELDB_LAZY_LOAD 0
+#define REDIS_DEFAULT_LEVELDB_LOAD_MAX_MEMORY 0
+#define REDIS_DEFAULT_LEVELDB_HOTNESS_PERIOD 0
+#define REDIS_DEFAULT_LEVELDB_CACHE_SIZE (8*1024*1024) /* 8mb */
+#define REDIS_DEFAULT_LEVELDB_FREEZED_INDEX REDIS_LEVELDB_FREEZED_DICT
+#define REDIS_DEFAULT_LEVELDB_COALESCE_MS 0
+#define REDIS_DEFAULT_LEVELDB_FSYNC REDIS_LEVELDB_FSYNC_NO
+#define REDIS_DEFAULT_LEVELDB_REPL_SNAPSHOT 0
+#define REDIS_DEFAULT_LEVELDB_SHARDS 1
+#define REDIS_MAX_LEVELDB_SHARDS 8  /* One writer per shard, see bio.h */
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -180,6 +195,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_CMD_SKIP_MONITOR 2048         /* "M" flag */
 #define REDIS_CMD_ASKING 4096               /* "k" flag */
 #define REDIS_CMD_FAST 8192                 /* "F" flag */
+#define REDIS_CMD_FREEZED_READ 16384        /* "z" flag */
 
 /* Object types */
 #define REDIS_STRING 0
@@ -236,6 +252,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_LEVELDB_OFF 0             /* LEVELDB is off */
 #define REDIS_LEVELDB_ON 1              /* LEVELDB is on */
 
+/* leveldb frozen key indexes, see leveldb-freezed-index */
+#define REDIS_LEVELDB_FREEZED_DICT 0    /* db->freezed dict */
+#define REDIS_LEVELDB_FREEZED_FILTER 1  /* Bloom filter and F records */
+
+/* leveldb durability, see leveldb-fsync */
+#define REDIS_LEVELDB_FSYNC_NO 0        /* Left to the OS */
+#define REDIS_LEVELDB_FSYNC_EVERYSEC 1  /* Synced empty write every second */
+#define REDIS_LEVELDB_FSYNC_ALWAYS 2    /* Every written batch is synced */
+
 /* Client flags */
 #define REDIS_SLAVE (1<<0)   /* This client is a slave server */
 #define REDIS_MASTER (1<<1)  /* This client is a master server */
@@ -343,6 +368,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_MAXMEMORY_ALLKEYS_LRU 3
 #define REDIS_MAXMEMORY_ALLKEYS_RANDOM 4
 #define REDIS_MAXMEMORY_NO_EVICTION 5
+#define REDIS_MAXMEMORY_FREEZE_LRU 6    /* Freeze to LevelDB, see leveldb.c */
 #define REDIS_DEFAULT_MAXMEMORY_POLICY REDIS_MAXMEMORY_VOLATILE_LRU
 
 /* Scripting */
@@ -439,6 +465,9 @@ typedef struct redisDb {
     int id;
     long long avg_ttl;          /* Average TTL, just for stats */
     dict *freezed;              /* The keyspace for freezed key for this db */
+    dict *generations;          /* LevelDB generation of deleted big keys */
+    dict *listheads;            /* LevelDB sequence of the head of the lists */
+    dict *melting;              /* Frozen keys melted in background */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -462,6 +491,13 @@ typedef struct blockingState {
                              * is > timeout then the operation timed out. */
     robj *target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
+
+    /* MELT and the commands waiting for frozen keys melted in background. */
+    int meltpending;        /* Melts the client is waiting for. */
+    int melted;             /* Keys melted for MELT, -1 for other commands. */
+    robj **meltargv;        /* The command to run once the keys are melted. */
+    int meltargc;
+    struct redisCommand *meltcmd;
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -602,14 +638,66 @@ typedef struct redisOpArray {
     int numops;
 } redisOpArray;
 
-struct leveldb {
+/* One of the LevelDB instances the key space is split into, see
+ * leveldb-shards. */
+typedef struct leveldbShard {
   leveldb_t *db;
+  leveldb_writebatch_t *wb;   /* Mutations of the shard staged in the batch */
+  size_t wbbytes;
+  long wbops;
+} leveldbShard;
+
+struct leveldb {
+  leveldb_t *db;              /* First shard, holding the global metadata */
+  leveldbShard *shards;
+  int numshards;
   leveldb_options_t *options;
   leveldb_readoptions_t *roptions;
+  leveldb_readoptions_t *proptions; /* Point reads, filling the block cache */
+  leveldb_cache_t *cache;
   leveldb_writeoptions_t *woptions;
-  struct redisClient *fakeClient;
+  leveldb_writeoptions_t *swoptions; /* Synced writes, see leveldb-fsync */
+  size_t wbbytes;             /* Key and value bytes staged in all shards */
+  long wbops;                 /* Number of puts/deletes staged in all shards */
+  int batchdepth;             /* Open leveldbBeginBatch() calls */
+  int batchfreezed;           /* LEVELDB_BATCH_* changes to the frozen keys */
+  int batchatomic;            /* A leveldbBeginBatch() batch is staged */
+  list *batchsweeps;          /* Sweeps started once the batch is written */
+  int *dbslot;                /* Key prefix (slot) of every db */
+  int slotdb[256];            /* Db of every slot, or a LEVELDB_SLOT_* state */
 };
 
+/* A data record key split in its parts, see leveldbParseRecordKey(). */
+typedef struct leveldbRecordKey {
+  int slot;
+  int dbid;                   /* Db mapped to the slot, negative if none */
+  char type;
+  const char *key;
+  size_t keylen;
+  const char *field;          /* NULL for strings, or the page of a string */
+  size_t fieldlen;
+  uint64_t gen;               /* Generation of the key, see leveldbKeyPrefix() */
+} leveldbRecordKey;
+
+typedef struct leveldbLoaderEntry {
+  sds field;
+  sds value;
+  double score;
+} leveldbLoaderEntry;
+
+/* Collects the records of a single key to build its value at once. */
+typedef struct leveldbKeyLoader {
+  int dbid;
+  char type;                  /* Record type, 0 when empty */
+  sds key;
+  uint64_t gen;               /* Records of other generations are skipped */
+  leveldbLoaderEntry *entries;
+  long count;
+  long size;
+  int corrupted;              /* A record could not be decoded */
+  size_t pagedlen;            /* Length of a string stored in pages, or 0 */
+} leveldbKeyLoader;
+
 /*-----------------------------------------------------------------------------
  * Global server state
  *----------------------------------------------------------------------------*/
@@ -697,6 +785,8 @@ struct redisServer {
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
+    int leveldb_debug_crash_shards; /* Exit after writing that many shards of
+                                       a batch, see DEBUG leveldb-crash-after-shards */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int daemonize;                  /* True if running as a daemon */
@@ -856,6 +946,40 @@ struct redisServer {
     char *leveldb_path; 
     struct leveldb ldb;
     long long leveldb_op_num;
+    int leveldb_async;          /* Write LevelDB batches from a bio thread. */
+    unsigned long long leveldb_async_max_bytes; /* Async queue size limit. */
+    long long leveldb_async_stalls; /* Writes delayed by a full async queue. */
+    int leveldb_group_commit;   /* Write once per event loop iteration. */
+    long long leveldb_load_keys;    /* Keys loaded at startup. */
+    long long leveldb_load_records; /* Records read at startup. */
+    long long leveldb_load_usec;    /* Time spent loading at startup. */
+    int leveldb_load_threads;       /* Threads used to load at startup. */
+    int leveldb_lazy_load;          /* Load the key space after startup. */
+    long long leveldb_lazy_point_loads; /* Keys loaded early by a command. */
+    unsigned long long leveldb_load_max_memory; /* Startup load budget, 0 = all. */
+    long long leveldb_load_freezes; /* Keys frozen by the startup budget. */
+    long long leveldb_hotness_period; /* Seconds between access time walks. */
+    long long leveldb_hotness_writes; /* Access times written to the index. */
+    long long leveldb_lru_freezes;  /* Keys frozen by freeze-lru. */
+    long long leveldb_lru_melts;    /* Frozen keys melted by a command. */
+    long long leveldb_lru_drops;    /* Frozen keys replaced by a command. */
+    long long leveldb_freezed_reads; /* Records read for frozen keys. */
+    long long leveldb_melts;        /* Keys melted in background. */
+    long long leveldb_melt_failures; /* Background melts that failed. */
+    long long leveldb_melt_usec;    /* Time spent by the background melts. */
+    long long leveldb_melt_max_usec; /* Slowest background melt. */
+    unsigned long long leveldb_cache_size; /* LevelDB block cache size. */
+    int leveldb_freezed_index;  /* REDIS_LEVELDB_FREEZED_* */
+    long long leveldb_coalesce_ms;  /* Counters write interval, 0 = off. */
+    long long leveldb_coalesced;    /* Counter writes absorbed by coalescing. */
+    int leveldb_fsync;              /* REDIS_LEVELDB_FSYNC_* */
+    long long leveldb_fsync_op_num; /* leveldb_op_num of the last everysec sync. */
+    int leveldb_repl_snapshot;      /* Full resyncs saved from a snapshot. */
+    long long leveldb_snapshot_saves; /* Saves from a snapshot completed. */
+    long long leveldb_snapshot_last_usec; /* Duration of the last one. */
+    long long leveldb_ingest_keys;  /* Keys written by the last full sync. */
+    long long leveldb_ingest_usec;  /* Time spent writing them. */
+    int leveldb_shards;             /* LevelDB instances of the key space. */
 };
 
 typedef struct pubsubPattern {
@@ -946,6 +1070,7 @@ typedef struct {
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
 extern dictType freezedDictType;
+extern dictType generationsDictType;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType dbDictType;
@@ -962,6 +1087,7 @@ extern dictType replScriptCacheDictType;
 long long ustime(void);
 long long mstime(void);
 void getRandomHexChars(char *p, unsigned int len);
+uint64_t MurmurHash64A(const void *key, int len, unsigned int seed);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
@@ -1079,6 +1205,7 @@ robj *createZsetZiplistObject(void);
 int getLongFromObjectOrReply(redisClient *c, robj *o, long *target, const char *msg);
 int checkType(redisClient *c, robj *o, int type);
 int getLongLongFromObjectOrReply(redisClient *c, robj *o, long long *target, const char *msg);
+int getDoubleFromObject(robj *o, double *target);
 int getDoubleFromObjectOrReply(redisClient *c, robj *o, double *target, const char *msg);
 int getLongLongFromObject(robj *o, long long *target);
 int getLongDoubleFromObject(robj *o, long double *target);
@@ -1152,6 +1279,7 @@ typedef struct {
 
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
+void zslFreeNode(zskiplistNode *node);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
 unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score);
 int zslDelete(zskiplist *zsl, double score, robj *obj);
@@ -1159,6 +1287,7 @@ zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
+unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score);
 unsigned int zsetLength(robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
 
@@ -1456,11 +1585,66 @@ void backupCommand(redisClient *c);
 void freezeCommand(redisClient *c);
 void meltCommand(redisClient *c);
 void freezedCommand(redisClient *c);
+void freezedscanCommand(redisClient *c);
 
 int loadleveldb(char *path);
 void closeleveldb(struct leveldb *ldb);
 void backupleveldb(void *arg);
+void leveldbBackupCleanStaging(char *path);
 int isKeyFreezed(int dbid, robj *key);
+int freezeKey(redisDb *db, struct leveldb *ldb, robj *key, char keytype);
+char getFreezedKeyType(int dbid, robj *key);
+void emptyFreezedKeys(int dbid);
+unsigned long freezedKeysCount(int dbid);
+size_t leveldbFreezedFilterBytes(void);
+void leveldbFreezedCron(void);
+int leveldbDelFreezedKey(redisClient *c, robj *key);
+void leveldbBatchPut(struct leveldb *ldb, const char *key, size_t keylen, const char *val, size_t vallen);
+void leveldbBatchDelete(struct leveldb *ldb, const char *key, size_t keylen);
+void leveldbCommit(struct leveldb *ldb);
+void leveldbFlush(struct leveldb *ldb);
+void leveldbDrain(struct leveldb *ldb);
+void leveldbCoalesceFlush(struct leveldb *ldb);
+unsigned long leveldbCoalescePending(void);
+void leveldbBeginBatch(struct leveldb *ldb);
+void leveldbEndBatch(struct leveldb *ldb);
+void leveldbAsyncWriteJob(void *arg);
+void leveldbFsyncJob(void *arg);
+void leveldbFsyncCron(void);
+void leveldbSnapshotSave(void *arg);
+int leveldbSnapshotSaveBackground(char *filename);
+int leveldbSnapshotSaveInProgress(void);
+void leveldbSnapshotCron(void);
+void leveldbIngestBegin(struct leveldb *ldb);
+void leveldbIngestKey(int dbid, robj *key, robj *val);
+void leveldbIngestEnd(struct leveldb *ldb, int loaded);
+void leveldbAsyncStats(unsigned long long *batches, unsigned long long *bytes, long long *lag);
+int leveldbKeyShard(struct leveldb *ldb, const char *name, size_t len);
+leveldb_t *leveldbKeyDb(struct leveldb *ldb, sds name);
+sds leveldbShardPath(const char *path, int shard);
+sds leveldbCatShardsInfo(sds info);
+int leveldbParseRecordKey(const char *data, size_t len, leveldbRecordKey *rk);
+void leveldbLoaderInit(leveldbKeyLoader *l);
+void leveldbLoaderReset(leveldbKeyLoader *l);
+void leveldbLoaderFree(leveldbKeyLoader *l);
+int leveldbLoaderIsKey(leveldbKeyLoader *l, leveldbRecordKey *rk);
+void leveldbLoaderStart(leveldbKeyLoader *l, leveldbRecordKey *rk);
+void leveldbLoaderAdd(leveldbKeyLoader *l, leveldbRecordKey *rk, const char *value, size_t valuelen);
+robj *leveldbLoaderBuild(leveldbKeyLoader *l);
+int leveldbCompareKeys(const char *a, size_t alen, const char *b, size_t blen);
+sds leveldbKeyPrefix(int dbid, char type, sds name);
+uint64_t leveldbKeyGeneration(int dbid, sds key);
+void leveldbSweep(void *arg);
+void leveldbSweepCron(void);
+int leveldbLazyFree(robj *val);
+void leveldbLazyFreeCron(void);
+void leveldbLazyFreeStats(unsigned long *objects, unsigned long long *elements, unsigned long long *bytes);
+void leveldbHotnessCron(void);
+int leveldbLazyLoading(void);
+void leveldbLazyLoadCron(void);
+void leveldbLazyLoadFlushed(int dbid);
+void leveldbLazyLoadCommandKeys(redisClient *c);
+int leveldbLazyLoadRefuses(struct redisCommand *cmd, robj **argv, int argc);
 
 void leveldbHset(int dbid, struct leveldb *ldb, robj** argv);
 void leveldbHsetDirect(int dbid, struct leveldb *ldb, robj *argv1, robj *argv2, robj *argv3);
@@ -1470,6 +1654,7 @@ void leveldbHclear(int dbid, struct leveldb *ldb, robj* argv);
 void leveldbSadd(int dbid, struct leveldb *ldb, robj** argv, int argc);
 void leveldbSrem(int dbid, struct leveldb *ldb, robj** argv, int argc);
 void leveldbSclear(int dbid, struct leveldb *ldb, robj* argv);
+void leveldbSmove(int dbid, struct leveldb *ldb, robj *src, robj *dst, robj *member);
 void leveldbZaddDirect(int dbid, struct leveldb *ldb, robj *argv1, robj *argv2, double score);
 void leveldbZadd(int dbid, struct leveldb *ldb, robj** argv, int argc);
 void leveldbZrem(int dbid, struct leveldb *ldb, robj** argv, int argc);
@@ -1477,14 +1662,39 @@ void leveldbZremByLongLong(int dbid, struct leveldb *ldb, robj *arg, long long v
 void leveldbZremByCBuffer(int dbid, struct leveldb *ldb, robj *arg, unsigned char *vstr, unsigned int vlen);
 void leveldbZremByObject(int dbid, struct leveldb *ldb, robj *arg, robj *field);
 void leveldbZclear(int dbid, struct leveldb *ldb, robj* argv);
+long long leveldbListHead(int dbid, sds key);
+void leveldbSetListHead(int dbid, sds key, long long head);
+void leveldbListPush(int dbid, struct leveldb *ldb, robj *name, robj **values, int count, int where, long len);
+void leveldbListPop(int dbid, struct leveldb *ldb, robj *name, int where, long len);
+void leveldbListSet(int dbid, struct leveldb *ldb, robj *name, long index, robj *value);
+void leveldbListInsert(int dbid, struct leveldb *ldb, robj *name, robj *list, long index);
+void leveldbListRemove(int dbid, struct leveldb *ldb, robj *name, robj *list, long first, long last, long removed);
+void leveldbListTrim(int dbid, struct leveldb *ldb, robj *name, long ltrim, long rtrim, long len);
 void leveldbFlushdb(int dbid, struct leveldb* ldb);
 void leveldbFlushall(struct leveldb* ldb);
 void leveldbDelHash(int dbid, struct leveldb *ldb, robj* objkey, robj *objval);
 void leveldbDelSet(int dbid, struct leveldb *ldb, robj* objkey, robj *objval);
 void leveldbDelZset(int dbid, struct leveldb *ldb, robj* objkey, robj *objval);
+void leveldbDelList(int dbid, struct leveldb *ldb, robj* objkey, robj *objval);
 void leveldbSet(int dbid, struct leveldb *ldb, robj** argv);
 void leveldbSetDirect(int dbid, struct leveldb *ldb, robj *argv1, robj *argv2);
-void leveldbDelString(int dbid, struct leveldb *ldb, robj* argv);
+void leveldbSetCounter(int dbid, struct leveldb *ldb, robj *key, robj *val);
+void leveldbSetStringRange(int dbid, struct leveldb *ldb, robj *key, robj *val, size_t oldlen, size_t offset, size_t len);
+void leveldbOverwriteString(int dbid, struct leveldb *ldb, robj *key, robj *old, robj *val);
+void leveldbDelString(int dbid, struct leveldb *ldb, robj* argv, robj *val);
+void leveldbDelKey(int dbid, struct leveldb *ldb, robj *key, robj *val);
+void leveldbPutKey(int dbid, struct leveldb *ldb, robj *key, robj *val);
+void leveldbReplaceKey(int dbid, struct leveldb *ldb, robj *key, robj *old, robj *val);
+char leveldbObjectType(robj *o);
+void leveldbMeltCommandKeys(redisClient *c);
+void leveldbMeltRun(void *arg);
+int leveldbBlockForMelt(redisClient *c);
+void leveldbUnblockMelt(redisClient *c);
+void leveldbCancelMelts(int dbid, robj *key);
+int leveldbFreezedValue(redisClient *c, robj *key, char type, robj *field, sds *value);
+int leveldbFreezedScore(redisClient *c, robj *key, robj *member, double *score);
+void leveldbSetExpire(int dbid, struct leveldb *ldb, robj *key, robj *val, long long old, long long when);
+void leveldbDelExpire(int dbid, struct leveldb *ldb, robj *key, long long when);
 
 #if defined(__GNUC__)
 void *calloc(size_t count, size_t size) __attribute__ ((deprecated));
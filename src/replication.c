@@ -437,18 +437,28 @@ need_full_resync:
     return REDIS_ERR;
 }
 
+/* With leveldb-repl-snapshot the full resyncs are served from a LevelDB
+ * snapshot saved by a thread instead of a forked child, see leveldb.c. */
+static int replicationUseLeveldbSnapshot(void) {
+    return server.leveldb_state == REDIS_LEVELDB_ON && server.leveldb_repl_snapshot;
+}
+
 /* Start a BGSAVE for replication goals, which is, selecting the disk or
  * socket target depending on the configuration, and making sure that
  * the script cache is flushed before to start.
  *
  * Returns REDIS_OK on success or REDIS_ERR otherwise. */
 int startBgsaveForReplication(void) {
+    int snapshot = replicationUseLeveldbSnapshot();
     int retval;
 
     redisLog(REDIS_NOTICE,"Starting BGSAVE for SYNC with target: %s",
+        snapshot ? "disk from leveldb snapshot" :
         server.repl_diskless_sync ? "slaves sockets" : "disk");
 
-    if (server.repl_diskless_sync)
+    if (snapshot)
+        retval = leveldbSnapshotSaveBackground(server.rdb_filename);
+    else if (server.repl_diskless_sync)
         retval = rdbSaveToSlavesSockets();
     else
         retval = rdbSaveBackground(server.rdb_filename);
@@ -517,8 +527,9 @@ void syncCommand(redisClient *c) {
 
     /* Here we need to check if there is a background saving operation
      * in progress, or if it is required to start one */
-    if (server.rdb_child_pid != -1 &&
-        server.rdb_child_type == REDIS_RDB_CHILD_TYPE_DISK)
+    if ((server.rdb_child_pid != -1 &&
+         server.rdb_child_type == REDIS_RDB_CHILD_TYPE_DISK) ||
+        leveldbSnapshotSaveInProgress())
     {
         /* Ok a background save is in progress. Let's check if it is a good
          * one for replication, i.e. if there is another slave that is
@@ -553,7 +564,7 @@ void syncCommand(redisClient *c) {
         c->replstate = REDIS_REPL_WAIT_BGSAVE_START;
         redisLog(REDIS_NOTICE,"Waiting for next BGSAVE for SYNC");
     } else {
-        if (server.repl_diskless_sync) {
+        if (server.repl_diskless_sync && !replicationUseLeveldbSnapshot()) {
             /* Diskless replication RDB child is created inside
              * replicationCron() since we want to delay its start a
              * few seconds to wait for more slaves to arrive. */
@@ -855,6 +866,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
     char buf[4096];
     ssize_t nread, readlen;
     off_t left;
+    int loaded;
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(privdata);
     REDIS_NOTUSED(mask);
@@ -1004,7 +1016,11 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
          * time for non blocking loading. */
         aeDeleteFileEvent(server.el,server.repl_transfer_s,AE_READABLE);
         redisLog(REDIS_NOTICE, "MASTER <-> SLAVE sync: Loading DB in memory");
-        if (rdbLoad(server.rdb_filename) != REDIS_OK) {
+        /* Rebuild LevelDB from the loaded keys, see leveldbIngestKey(). */
+        leveldbIngestBegin(&server.ldb);
+        loaded = rdbLoad(server.rdb_filename);
+        leveldbIngestEnd(&server.ldb, loaded == REDIS_OK);
+        if (loaded != REDIS_OK) {
             redisLog(REDIS_WARNING,"Failed trying to load the MASTER synchronization DB from disk");
             replicationAbortSyncTransfer();
             return;
@@ -1896,7 +1912,9 @@ void replicationCron(void) {
      * This code is also useful to trigger a BGSAVE if the diskless
      * replication was turned off with CONFIG SET, while there were already
      * slaves in WAIT_BGSAVE_START state. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        !leveldbSnapshotSaveInProgress())
+    {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         listNode *ln;
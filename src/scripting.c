@@ -298,6 +298,12 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         goto cleanup;
     }
 
+    /* Commands seeing the whole key space wait for the leveldb lazy load. */
+    if (leveldbLazyLoadRefuses(cmd, argv, argc)) {
+        luaPushError(lua, shared.loadingerr->ptr);
+        goto cleanup;
+    }
+
     /* Write commands are forbidden against read-only slaves, or if a
      * command marked as non-deterministic was already called in the context
      * of this script. */
@@ -984,8 +990,11 @@ void evalGenericCommand(redisClient *c, int evalsha) {
 
     /* At this point whether this script was never seen before or if it was
      * already defined, we can call it. We have zero arguments and expect
-     * a single return value. */
+     * a single return value. The LevelDB mutations of the script are
+     * written as one batch. */
+    leveldbBeginBatch(&server.ldb);
     err = lua_pcall(lua,0,1,-2);
+    leveldbEndBatch(&server.ldb);
 
     /* Perform some cleanup that we need to do both on error and success. */
     if (delhook) lua_sethook(lua,luaMaskCountHook,0,0); /* Disable hook */
@@ -519,6 +519,8 @@ void sortCommand(redisClient *c) {
                 }
             }
         }
+        leveldbReplaceKey(c->db->id,&server.ldb,storekey,
+            lookupKeyWrite(c->db,storekey), outputlen ? sobj : NULL);
         if (outputlen) {
             setKey(c->db,storekey,sobj);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"sortstore",storekey,
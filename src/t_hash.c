@@ -554,9 +554,9 @@ void hincrbyCommand(redisClient *c) {
 
     hashTypeTryObjectEncoding(o,&c->argv[2],NULL);
     hashTypeSet(o,c->argv[2],new);
-    decrRefCount(new);
     addReplyLongLong(c,value);
     leveldbHsetDirect(c->db->id,&server.ldb,c->argv[1],c->argv[2],new);
+    decrRefCount(new);
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hincrby",c->argv[1],c->db->id);
     server.dirty++;
@@ -640,9 +640,17 @@ static void addHashFieldToReply(redisClient *c, robj *o, robj *field) {
 
 void hgetCommand(redisClient *c) {
     robj *o;
+    sds val;
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
-        checkType(c,o,REDIS_HASH)) return;
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        switch(leveldbFreezedValue(c,c->argv[1],'h',c->argv[2],&val)) {
+        case -1: break;
+        case 0: addReply(c,shared.nullbulk); break;
+        default: addReplyBulkCBuffer(c,val,sdslen(val)); sdsfree(val); break;
+        }
+        return;
+    }
+    if (checkType(c,o,REDIS_HASH)) return;
 
     addHashFieldToReply(c, o, c->argv[2]);
 }
@@ -650,6 +658,7 @@ void hgetCommand(redisClient *c) {
 void hmgetCommand(redisClient *c) {
     robj *o;
     int i;
+    char keytype;
 
     /* Don't abort when the key cannot be found. Non-existing keys are empty
      * hashes, where HMGET should respond with a series of null bulks. */
@@ -659,6 +668,26 @@ void hmgetCommand(redisClient *c) {
         return;
     }
 
+    /* A frozen hash is read field by field from LevelDB. */
+    if (o == NULL && (keytype = getFreezedKeyType(c->db->id, c->argv[1]))) {
+        if (keytype != 'h') {
+            addReply(c, shared.wrongtypeerr);
+            return;
+        }
+        addReplyMultiBulkLen(c, c->argc-2);
+        for (i = 2; i < c->argc; i++) {
+            sds val;
+
+            if (leveldbFreezedValue(c, c->argv[1], 'h', c->argv[i], &val) == 1) {
+                addReplyBulkCBuffer(c, val, sdslen(val));
+                sdsfree(val);
+            } else {
+                addReply(c, shared.nullbulk);
+            }
+        }
+        return;
+    }
+
     addReplyMultiBulkLen(c, c->argc-2);
     for (i = 2; i < c->argc; i++) {
         addHashFieldToReply(c, o, c->argv[i]);
@@ -771,8 +800,17 @@ void hgetallCommand(redisClient *c) {
 
 void hexistsCommand(redisClient *c) {
     robj *o;
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,REDIS_HASH)) return;
+    sds val;
+
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        switch(leveldbFreezedValue(c,c->argv[1],'h',c->argv[2],&val)) {
+        case -1: break;
+        case 0: addReply(c,shared.czero); break;
+        default: addReply(c,shared.cone); sdsfree(val); break;
+        }
+        return;
+    }
+    if (checkType(c,o,REDIS_HASH)) return;
 
     addReply(c, hashTypeExists(o,c->argv[2]) ? shared.cone : shared.czero);
 }
@@ -300,6 +300,10 @@ void pushGenericCommand(redisClient *c, int where) {
         addReply(c,shared.wrongtypeerr);
         return;
     }
+    if (!lobj && isKeyFreezed(c->db->id, c->argv[1]) == 1) {
+        addReply(c,shared.keyfreezederr);
+        return;
+    }
 
     for (j = 2; j < c->argc; j++) {
         c->argv[j] = tryObjectEncoding(c->argv[j]);
@@ -316,6 +320,7 @@ void pushGenericCommand(redisClient *c, int where) {
 
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(REDIS_NOTIFY_LIST,event,c->argv[1],c->db->id);
+        leveldbListPush(c->db->id,&server.ldb,c->argv[1],c->argv+2,pushed,where,listTypeLength(lobj));
     }
     server.dirty += pushed;
 }
@@ -333,6 +338,12 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
     listTypeIterator *iter;
     listTypeEntry entry;
     int inserted = 0;
+    long index = 0;
+
+    if(isKeyFreezed(c->db->id, c->argv[1]) == 1) {
+        addReply(c,shared.keyfreezederr);
+        return;
+    }
 
     if ((subject = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,subject,REDIS_LIST)) return;
@@ -353,6 +364,7 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
                 inserted = 1;
                 break;
             }
+            index++;
         }
         listTypeReleaseIterator(iter);
 
@@ -365,6 +377,8 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"linsert",
                                 c->argv[1],c->db->id);
             server.dirty++;
+            leveldbListInsert(c->db->id,&server.ldb,c->argv[1],subject,
+                              (where == REDIS_TAIL) ? index+1 : index);
         } else {
             /* Notify client of a failed insert */
             addReply(c,shared.cnegone);
@@ -377,6 +391,7 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(REDIS_NOTIFY_LIST,event,c->argv[1],c->db->id);
         server.dirty++;
+        leveldbListPush(c->db->id,&server.ldb,c->argv[1],&val,1,where,listTypeLength(subject));
     }
 
     addReplyLongLong(c,listTypeLength(subject));
@@ -449,6 +464,11 @@ void lindexCommand(redisClient *c) {
 }
 
 void lsetCommand(redisClient *c) {
+    if(isKeyFreezed(c->db->id, c->argv[1]) == 1) {
+        addReply(c,shared.keyfreezederr);
+        return;
+    }
+
     robj *o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr);
     if (o == NULL || checkType(c,o,REDIS_LIST)) return;
     long index;
@@ -472,6 +492,8 @@ void lsetCommand(redisClient *c) {
             signalModifiedKey(c->db,c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"lset",c->argv[1],c->db->id);
             server.dirty++;
+            leveldbListSet(c->db->id,&server.ldb,c->argv[1],
+                index < 0 ? (long)listTypeLength(o)+index : index,c->argv[3]);
         }
     } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
         listNode *ln = listIndex(o->ptr,index);
@@ -485,6 +507,8 @@ void lsetCommand(redisClient *c) {
             signalModifiedKey(c->db,c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"lset",c->argv[1],c->db->id);
             server.dirty++;
+            leveldbListSet(c->db->id,&server.ldb,c->argv[1],
+                index < 0 ? (long)listTypeLength(o)+index : index,value);
         }
     } else {
         redisPanic("Unknown list encoding");
@@ -503,6 +527,7 @@ void popGenericCommand(redisClient *c, int where) {
 
         addReplyBulk(c,value);
         decrRefCount(value);
+        leveldbListPop(c->db->id,&server.ldb,c->argv[1],where,listTypeLength(o));
         notifyKeyspaceEvent(REDIS_NOTIFY_LIST,event,c->argv[1],c->db->id);
         if (listTypeLength(o) == 0) {
             notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",
@@ -629,6 +654,7 @@ void ltrimCommand(redisClient *c) {
         redisPanic("Unknown list encoding");
     }
 
+    leveldbListTrim(c->db->id,&server.ldb,c->argv[1],ltrim,rtrim,listTypeLength(o));
     notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"ltrim",c->argv[1],c->db->id);
     if (listTypeLength(o) == 0) {
         dbDelete(c->db,c->argv[1]);
@@ -644,6 +670,8 @@ void lremCommand(redisClient *c) {
     obj = c->argv[3] = tryObjectEncoding(c->argv[3]);
     long toremove;
     long removed = 0;
+    long llen, pos = 0, index, first = -1, last = -1;
+    int fromtail = 0;
     listTypeEntry entry;
 
     if ((getLongFromObjectOrReply(c, c->argv[2], &toremove, NULL) != REDIS_OK))
@@ -657,8 +685,10 @@ void lremCommand(redisClient *c) {
         obj = getDecodedObject(obj);
 
     listTypeIterator *li;
+    llen = listTypeLength(subject);
     if (toremove < 0) {
         toremove = -toremove;
+        fromtail = 1;
         li = listTypeInitIterator(subject,-1,REDIS_HEAD);
     } else {
         li = listTypeInitIterator(subject,0,REDIS_TAIL);
@@ -666,11 +696,16 @@ void lremCommand(redisClient *c) {
 
     while (listTypeNext(li,&entry)) {
         if (listTypeEqual(&entry,obj)) {
+            /* Track the removed range for the LevelDB renumbering. */
+            index = fromtail ? llen-1-pos : pos;
+            if (first == -1 || index < first) first = index;
+            if (index > last) last = index;
             listTypeDelete(&entry);
             server.dirty++;
             removed++;
             if (toremove && removed == toremove) break;
         }
+        pos++;
     }
     listTypeReleaseIterator(li);
 
@@ -678,6 +713,8 @@ void lremCommand(redisClient *c) {
     if (subject->encoding == REDIS_ENCODING_ZIPLIST)
         decrRefCount(obj);
 
+    if (removed)
+        leveldbListRemove(c->db->id,&server.ldb,c->argv[1],subject,first,last,removed);
     if (listTypeLength(subject) == 0) dbDelete(c->db,c->argv[1]);
     addReplyLongLong(c,removed);
     if (removed) signalModifiedKey(c->db,c->argv[1]);
@@ -707,6 +744,7 @@ void rpoplpushHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj *value
     }
     signalModifiedKey(c->db,dstkey);
     listTypePush(dstobj,value,REDIS_HEAD);
+    leveldbListPush(c->db->id,&server.ldb,dstkey,&value,1,REDIS_HEAD,listTypeLength(dstobj));
     notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"lpush",dstkey,c->db->id);
     /* Always send the pushed value to the client. */
     addReplyBulk(c,value);
@@ -714,6 +752,11 @@ void rpoplpushHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj *value
 
 void rpoplpushCommand(redisClient *c) {
     robj *sobj, *value;
+    if(isKeyFreezed(c->db->id, c->argv[1]) == 1 ||
+       (lookupKeyWrite(c->db,c->argv[2]) == NULL && isKeyFreezed(c->db->id, c->argv[2]) == 1)) {
+        addReply(c,shared.keyfreezederr);
+        return;
+    }
     if ((sobj = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,sobj,REDIS_LIST)) return;
 
@@ -727,6 +770,7 @@ void rpoplpushCommand(redisClient *c) {
 
         if (dobj && checkType(c,dobj,REDIS_LIST)) return;
         value = listTypePop(sobj,REDIS_TAIL);
+        leveldbListPop(c->db->id,&server.ldb,touchedkey,REDIS_TAIL,listTypeLength(sobj));
         /* We saved touched key, and protect it, since rpoplpushHandlePush
          * may change the client command argument vector (it does not
          * currently). */
@@ -890,7 +934,7 @@ void signalListAsReady(redisDb *db, robj *key) {
  * REDIS_ERR is returned to signal the caller that the list POP operation
  * should be undone as the client was not served: This only happens for
  * BRPOPLPUSH that fails to push the value to the destination key as it is
- * of the wrong type. */
+ * of the wrong type or frozen. */
 int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey, redisDb *db, robj *value, int where)
 {
     robj *argv[3];
@@ -912,6 +956,11 @@ int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey, red
         /* BRPOPLPUSH */
         robj *dstobj =
             lookupKeyWrite(receiver->db,dstkey);
+        if (!dstobj && isKeyFreezed(receiver->db->id,dstkey) == 1) {
+            /* BRPOPLPUSH failed because the destination is frozen. */
+            addReply(receiver,shared.keyfreezederr);
+            return REDIS_ERR;
+        }
         if (!(dstobj &&
              checkType(receiver,dstobj,REDIS_LIST)))
         {
@@ -993,6 +1042,8 @@ void handleClientsBlockedOnLists(void) {
                         robj *value = listTypePop(o,where);
 
                         if (value) {
+                            leveldbListPop(rl->db->id,&server.ldb,rl->key,
+                                           where,listTypeLength(o));
                             /* Protect receiver->bpop.target, that will be
                              * freed by the next unblockClientWaitingData()
                              * call. */
@@ -1006,6 +1057,8 @@ void handleClientsBlockedOnLists(void) {
                                 /* If we failed serving the client we need
                                  * to also undo the POP operation. */
                                     listTypePush(o,value,where);
+                                    leveldbListPush(rl->db->id,&server.ldb,
+                                        rl->key,&value,1,where,listTypeLength(o));
                             }
 
                             if (dstkey) decrRefCount(dstkey);
@@ -1069,6 +1122,7 @@ void blockingPopGenericCommand(redisClient *c, int where) {
                     char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
                     robj *value = listTypePop(o,where);
                     redisAssert(value != NULL);
+                    leveldbListPop(c->db->id,&server.ldb,c->argv[j],where,listTypeLength(o));
 
                     addReplyMultiBulkLen(c,2);
                     addReplyBulk(c,c->argv[j]);
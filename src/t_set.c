@@ -357,14 +357,23 @@ void smoveCommand(redisClient *c) {
         server.dirty++;
         notifyKeyspaceEvent(REDIS_NOTIFY_SET,"sadd",c->argv[2],c->db->id);
     }
+    leveldbSmove(c->db->id,&server.ldb,c->argv[1],c->argv[2],ele);
     addReply(c,shared.cone);
 }
 
 void sismemberCommand(redisClient *c) {
     robj *set;
+    sds val;
 
-    if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,set,REDIS_SET)) return;
+    if ((set = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        switch(leveldbFreezedValue(c,c->argv[1],'s',c->argv[2],&val)) {
+        case -1: break;
+        case 0: addReply(c,shared.czero); break;
+        default: addReply(c,shared.cone); sdsfree(val); break;
+        }
+        return;
+    }
+    if (checkType(c,set,REDIS_SET)) return;
 
     c->argv[2] = tryObjectEncoding(c->argv[2]);
     if (setTypeIsMember(set,c->argv[2]))
@@ -405,6 +414,7 @@ void spopCommand(redisClient *c) {
     rewriteClientCommandVector(c,3,aux,c->argv[1],ele);
     decrRefCount(ele);
     decrRefCount(aux);
+    leveldbSrem(c->db->id,&server.ldb,c->argv,c->argc);
 
     addReplyBulk(c,ele);
     if (setTypeSize(set) == 0) {
@@ -613,6 +623,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
         if (!setobj) {
             zfree(sets);
             if (dstkey) {
+                leveldbDelKey(c->db->id,&server.ldb,dstkey,
+                    lookupKeyWrite(c->db,dstkey));
                 if (dbDelete(c->db,dstkey)) {
                     signalModifiedKey(c->db,dstkey);
                     server.dirty++;
@@ -711,7 +723,12 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
-        int deleted = dbDelete(c->db,dstkey);
+        int deleted;
+
+        leveldbReplaceKey(c->db->id,&server.ldb,dstkey,
+            lookupKeyWrite(c->db,dstkey),
+            setTypeSize(dstset) > 0 ? dstset : NULL);
+        deleted = dbDelete(c->db,dstkey);
         if (setTypeSize(dstset) > 0) {
             dbAdd(c->db,dstkey,dstset);
             addReplyLongLong(c,setTypeSize(dstset));
@@ -882,7 +899,12 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
     } else {
         /* If we have a target key where to store the resulting set
          * create this key with the result set inside */
-        int deleted = dbDelete(c->db,dstkey);
+        int deleted;
+
+        leveldbReplaceKey(c->db->id,&server.ldb,dstkey,
+            lookupKeyWrite(c->db,dstkey),
+            setTypeSize(dstset) > 0 ? dstset : NULL);
+        deleted = dbDelete(c->db,dstkey);
         if (setTypeSize(dstset) > 0) {
             dbAdd(c->db,dstkey,dstset);
             addReplyLongLong(c,setTypeSize(dstset));
@@ -159,9 +159,16 @@ void psetexCommand(redisClient *c) {
 
 int getGenericCommand(redisClient *c) {
     robj *o;
+    sds val;
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL)
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        switch(leveldbFreezedValue(c,c->argv[1],'c',NULL,&val)) {
+        case -1: return REDIS_ERR;
+        case 0: addReply(c,shared.nullbulk); break;
+        default: addReplyBulkCBuffer(c,val,sdslen(val)); sdsfree(val); break;
+        }
         return REDIS_OK;
+    }
 
     if (o->type != REDIS_STRING) {
         addReply(c,shared.wrongtypeerr);
@@ -246,13 +253,15 @@ void setrangeCommand(redisClient *c) {
     }
 
     if (sdslen(value) > 0) {
+        size_t oldlen = sdslen(o->ptr);
+
         o->ptr = sdsgrowzero(o->ptr,offset+sdslen(value));
         memcpy((char*)o->ptr+offset,value,sdslen(value));
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(REDIS_NOTIFY_STRING,
             "setrange",c->argv[1],c->db->id);
         server.dirty++;
-        leveldbSetDirect(c->db->id, &server.ldb, c->argv[1], o);
+        leveldbSetStringRange(c->db->id, &server.ldb, c->argv[1], o, oldlen, offset, sdslen(value));
     }
     addReplyLongLong(c,sdslen(o->ptr));
 }
@@ -398,7 +407,7 @@ void incrDecrCommand(redisClient *c, long long incr) {
     addReply(c,shared.colon);
     addReply(c,new);
     addReply(c,shared.crlf);
-    leveldbSetDirect(c->db->id, &server.ldb, c->argv[1], new);
+    leveldbSetCounter(c->db->id, &server.ldb, c->argv[1], new);
 }
 
 void incrCommand(redisClient *c) {
@@ -452,7 +461,7 @@ void incrbyfloatCommand(redisClient *c) {
     notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"incrbyfloat",c->argv[1],c->db->id);
     server.dirty++;
     addReplyBulk(c,new);
-    leveldbSetDirect(c->db->id, &server.ldb, c->argv[1], new);
+    leveldbSetCounter(c->db->id, &server.ldb, c->argv[1], new);
 
     /* Always replicate INCRBYFLOAT as a SET command with the final value
      * in order to make sure that differences in float precision or formatting
@@ -464,7 +473,7 @@ void incrbyfloatCommand(redisClient *c) {
 }
 
 void appendCommand(redisClient *c) {
-    size_t totlen;
+    size_t totlen, oldlen;
     robj *o, *append;
     
     if(isKeyFreezed(c->db->id, c->argv[1]) == 1) {
@@ -493,9 +502,10 @@ void appendCommand(redisClient *c) {
 
         /* Append the value */
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+        oldlen = sdslen(o->ptr);
         o->ptr = sdscatlen(o->ptr,append->ptr,sdslen(append->ptr));
         totlen = sdslen(o->ptr);
-        leveldbSetDirect(c->db->id, &server.ldb, c->argv[1], o);
+        leveldbSetStringRange(c->db->id, &server.ldb, c->argv[1], o, oldlen, oldlen, sdslen(append->ptr));
     }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"append",c->argv[1],c->db->id);
@@ -505,7 +515,16 @@ void appendCommand(redisClient *c) {
 
 void strlenCommand(redisClient *c) {
     robj *o;
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,REDIS_STRING)) return;
+    sds val;
+
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        switch(leveldbFreezedValue(c,c->argv[1],'c',NULL,&val)) {
+        case -1: break;
+        case 0: addReply(c,shared.czero); break;
+        default: addReplyLongLong(c,sdslen(val)); sdsfree(val); break;
+        }
+        return;
+    }
+    if (checkType(c,o,REDIS_STRING)) return;
     addReplyLongLong(c,stringObjectLen(o));
 }
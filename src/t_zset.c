@@ -2103,6 +2103,9 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
         redisPanic("Unknown operator");
     }
 
+    leveldbReplaceKey(c->db->id,&server.ldb,dstkey,
+        lookupKeyWrite(c->db,dstkey),
+        dstzset->zsl->length ? dstobj : NULL);
     if (dbDelete(c->db,dstkey)) {
         signalModifiedKey(c->db,dstkey);
         touched = 1;
@@ -2799,8 +2802,15 @@ void zscoreCommand(redisClient *c) {
     robj *zobj;
     double score;
 
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.nullbulk)) == NULL ||
-        checkType(c,zobj,REDIS_ZSET)) return;
+    if ((zobj = lookupKeyRead(c->db,key)) == NULL) {
+        switch(leveldbFreezedScore(c,key,c->argv[2],&score)) {
+        case -1: break;
+        case 0: addReply(c,shared.nullbulk); break;
+        default: addReplyDouble(c,score); break;
+        }
+        return;
+    }
+    if (checkType(c,zobj,REDIS_ZSET)) return;
 
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         if (zzlFind(zobj->ptr,c->argv[2],&score) != NULL)
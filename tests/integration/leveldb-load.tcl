@@ -0,0 +1,67 @@
+proc wait_leveldb_lazy_load {} {
+    wait_for_condition 100 100 {
+        [s leveldb_lazy_loading] == 0
+    } else {
+        fail "Lazy load not completed"
+    }
+}
+
+set server_path [tmpdir "server.leveldb-lazy-load"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB lazy load - write a dataset} {
+        r eval {
+            for i = 1, 100000 do
+                redis.call('set', 'key:' .. i, i)
+            end
+        } 0
+        createComplexDataset r 1000
+        set digest [r debug digest]
+        r dbsize
+    } {*}
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-lazy-load yes]] {
+    test {LevelDB lazy load - keys served before the load is completed} {
+        list [r get key:100000] [r incr key:99999] [r get key:1]
+    } {100000 100000 1}
+
+    test {LevelDB lazy load - dataset complete once loaded} {
+        wait_leveldb_lazy_load
+        assert_equal 100000 [r get key:99999]
+        r decr key:99999
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-load-budget"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB budget load - write a dataset bigger than the budget} {
+        for {set j 0} {$j < 20000} {incr j} {
+            r set key:$j [string repeat x 100]
+        }
+        r hmset hash a 1 b 2
+        r setex volatile 1000 v
+        set budget [expr {[s used_memory]/2}]
+        set digest [r debug digest]
+        r dbsize
+    } {20002}
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-load-max-memory $budget]] {
+    test {LevelDB budget load - the keys over the budget are frozen} {
+        assert {[s leveldb_load_frozen_keys] > 0}
+        assert {[r dbsize] < 20002}
+        assert {[s used_memory] < $budget*3/2}
+        list [r exists volatile] [r ttl volatile] [r get key:0] [r hget hash b]
+    } {1 * xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx 2}
+
+    test {LevelDB budget load - frozen keys melted back into the dataset} {
+        set keys {}
+        foreach {key type} [r freezed *] {lappend keys $key}
+        assert_equal [s leveldb_load_frozen_keys] [llength $keys]
+        r melt {*}$keys
+        list [r dbsize] [r debug digest]
+    } [list 20002 $digest]
+}
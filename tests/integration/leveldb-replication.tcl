@@ -0,0 +1,67 @@
+proc wait_leveldb_sync {slave} {
+    wait_for_condition 100 100 {
+        [status $slave master_link_status] eq {up}
+    } else {
+        fail "Slave not synced with the master"
+    }
+}
+
+start_server {tags {"repl"} overrides {leveldb yes leveldb-path leveldb leveldb-repl-snapshot yes}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    createComplexDataset $master 10000
+    for {set j 0} {$j < 1000} {incr j} {$master zadd bigzset $j m$j}
+
+    start_server {overrides {leveldb yes leveldb-path leveldb}} {
+        set slave [srv 0 client]
+        set slave_path [lindex [$slave config get dir] 1]
+
+        test {LevelDB replication - full resync served from a snapshot} {
+            $slave slaveof $master_host $master_port
+            wait_leveldb_sync $slave
+            assert {[status $master leveldb_snapshot_saves] >= 1}
+            assert_equal -1 [status $master rdb_last_bgsave_time_sec]
+            assert {[status $slave leveldb_sync_ingest_keys] > 0}
+            assert_equal [$master debug digest] [$slave debug digest]
+        }
+
+        test {LevelDB replication - slave follows the writes after the sync} {
+            createComplexDataset $master 1000
+            $master set last v
+            wait_for_condition 50 100 {
+                [$slave get last] eq {v}
+            } else {
+                fail "Write did not reach the slave"
+            }
+            assert_equal [$master debug digest] [$slave debug digest]
+        }
+
+        test {LevelDB replication - second full sync replaces the slave dataset} {
+            set fullsyncs [status $master sync_full]
+            $slave slaveof no one
+            $slave set slaveonly v
+            $master del bigzset
+            $slave slaveof $master_host $master_port
+            wait_leveldb_sync $slave
+            assert_equal [expr {$fullsyncs+1}] [status $master sync_full]
+            wait_for_condition 50 100 {
+                [$master debug digest] eq [$slave debug digest]
+            } else {
+                fail "Slave dataset differs from the master"
+            }
+            $slave exists slaveonly
+        } {0}
+
+        test {LevelDB replication - stop the slave} {
+            $slave slaveof no one
+            $slave debug digest
+        } [$master debug digest]
+    }
+
+    start_server [list overrides [list dir $slave_path leveldb yes leveldb-path leveldb]] {
+        test {LevelDB replication - ingested dataset reloaded at restart} {
+            list [r exists slaveonly] [r exists bigzset] [r debug digest]
+        } [list 0 0 [$master debug digest]]
+    }
+}
@@ -0,0 +1,63 @@
+set server_path [tmpdir "server.leveldb-shards"]
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-shards 4]] {
+    test {LevelDB shards - MULTI/EXEC spanning the shards is interrupted by a crash} {
+        for {set j 0} {$j < 20} {incr j} {
+            r set key:$j old
+        }
+        r debug leveldb-crash-after-shards 2
+        r multi
+        for {set j 0} {$j < 20} {incr j} {
+            r set key:$j new
+        }
+        r hset hash field 1
+        r del key:0
+        catch {r exec}
+        set pid [srv 0 pid]
+        set retry 50
+        while {[incr retry -1] && [is_alive [list pid $pid]]} {
+            after 100
+        }
+        is_alive [list pid $pid]
+    } {0}
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-shards 4]] {
+    test {LevelDB shards - the interrupted MULTI/EXEC is completed at restart} {
+        set values {}
+        for {set j 1} {$j < 20} {incr j} {
+            lappend values [r get key:$j]
+        }
+        list [r exists key:0] [lsort -unique $values] [r hget hash field]
+    } {0 new 1}
+}
+
+set server_path [tmpdir "server.leveldb-shards-dataset"]
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-shards 4]] {
+    test {LevelDB shards - write a dataset across the shards} {
+        createComplexDataset r 10000
+        for {set j 0} {$j < 1000} {incr j} {r sadd bigset $j}
+        r del bigset
+        set digest [r debug digest]
+        assert {$digest ne {0000000000000000000000000000000000000000}}
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-shards 4]] {
+    test {LevelDB shards - dataset reloaded from the shards at restart} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set srv [start_server [list overrides [leveldb_overrides $server_path leveldb-shards 2]]]
+test {LevelDB shards - refused with a different number of shards} {
+    wait_for_condition 50 100 {
+        ![is_alive $srv]
+    } else {
+        fail "Server started with a different number of shards"
+    }
+    set pattern "*leveldb was created with 4 shards, leveldb-shards is 2*"
+    assert_match $pattern [exec cat [dict get $srv stdout]]
+}
+kill_server $srv
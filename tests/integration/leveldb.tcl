@@ -0,0 +1,397 @@
+# Every test starts a server with LevelDB on, restarts it on the same
+# directory and checks the dataset loaded back from LevelDB.
+
+set server_path [tmpdir "server.leveldb-async"]
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-async-write yes leveldb-group-commit yes]] {
+    test {LevelDB async writes - write a dataset through the writer thread} {
+        createComplexDataset r 10000
+        set digest [r debug digest]
+        assert {$digest ne {0000000000000000000000000000000000000000}}
+        assert_match {*leveldb_async_write:1*} [r info leveldb]
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB async writes - dataset reloaded at restart} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-encodings"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB load - write every type in every encoding} {
+        r set intstr 12345
+        r set rawstr [string repeat x 100]
+        r rpush smalllist a 1 b
+        for {set j 0} {$j < 1000} {incr j} {r rpush biglist $j}
+        r sadd intset 1 2 3
+        r sadd smallset a b c
+        for {set j 0} {$j < 1000} {incr j} {r sadd bigset $j}
+        r zadd smallzset 1 a 2 b
+        for {set j 0} {$j < 1000} {incr j} {r zadd bigzset $j m$j}
+        r hmset smallhash a 1 b 2
+        for {set j 0} {$j < 1000} {incr j} {r hset bighash f$j $j}
+        r hset smallhash n -9223372036854775484
+        assert_equal -9223372036854775485 [r hincrby smallhash n -1]
+        assert_equal 1000000 [r hincrby bighash f0 1000000]
+        createComplexDataset r 1000
+        set digest [r debug digest]
+        assert {$digest ne {0000000000000000000000000000000000000000}}
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB load - every type reloaded at restart} {
+        assert_equal $digest [r debug digest]
+        r hmget smallhash n
+    } {-9223372036854775485}
+
+    test {LevelDB load - values reloaded with the encoding of their size} {
+        assert_encoding int intstr
+        assert_encoding raw rawstr
+        assert_encoding ziplist smalllist
+        assert_encoding linkedlist biglist
+        assert_encoding intset intset
+        assert_encoding hashtable smallset
+        assert_encoding hashtable bigset
+        assert_encoding ziplist smallzset
+        assert_encoding skiplist bigzset
+        assert_encoding ziplist smallhash
+        assert_encoding hashtable bighash
+    }
+}
+
+# The assets were written by the servers of the previous record formats:
+# format 1 has lower case record types and single byte key lengths, format
+# 2 stores the long strings in a single record.
+set server_path [tmpdir "server.leveldb-v1"]
+exec cp -r tests/assets/leveldb-v1 $server_path/leveldb
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB migration - format 1 dataset loaded} {
+        assert_equal 5dae925c09232f965b6fd53b4d2f6cdd20236a03 [r debug digest]
+        r select 0
+        assert_equal {12345 {hello world}} [r mget intstr rawstr]
+        assert_equal {1 two} [r hmget hash a b]
+        assert_equal {1 2} [r hmget bighash x y]
+        assert_equal 2 [r hlen bighash]
+        assert_equal {b -2 a 1.5 c inf} [r zrange zset 0 -1 withscores]
+        assert_equal {1 2 3} [lsort [r smembers intset]]
+        r select 9
+        assert_equal value [r get db9]
+        assert_equal {m1 m2} [lsort [r smembers db9set]]
+    }
+
+    test {LevelDB migration - format 1 dataset written back as format 3} {
+        r select 9
+        assert_equal 1 [r sadd db9set m3]
+        r select 0
+        assert_equal 1 [r hset bighash z 3]
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB migration - migrated dataset reloaded at restart} {
+        r select 0
+        assert_equal {1 2 3} [r hmget bighash x y z]
+        assert_equal {1 two} [r hmget hash a b]
+        assert_equal {b -2 a 1.5 c inf} [r zrange zset 0 -1 withscores]
+        r select 9
+        assert_equal {m1 m2 m3} [lsort [r smembers db9set]]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-v2"]
+exec cp -r tests/assets/leveldb-v2 $server_path/leveldb
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB migration - format 2 long string moved to pages} {
+        assert_equal 860f5129bf57f979e2866b96034871eec3b38132 [r debug digest]
+        r select 0
+        assert {[r get bigstr] eq [string repeat x 6000]}
+        r setrange bigstr 5000 y
+        assert_equal 6000 [r strlen bigstr]
+    }
+
+    test {LevelDB migration - format 2 lists, expires and frozen keys loaded} {
+        r select 0
+        assert_equal {head a 1 b} [r lrange list 0 -1]
+        assert {abs([r ttl expiring] + [clock seconds] - 4000000000) <= 1}
+        assert_equal {frozen c} [r freezed frozen]
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB migration - paged string reloaded at restart} {
+        r select 0
+        assert {[r get bigstr] eq "[string repeat x 5000]y[string repeat x 999]"}
+        assert_equal v [r get frozen]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-lists"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB lists - pushes and pops at both ends} {
+        for {set j 0} {$j < 100} {incr j} {
+            r lpush mylist l$j
+            r rpush mylist r$j
+        }
+        for {set j 0} {$j < 30} {incr j} {
+            r lpop mylist
+            r rpop mylist
+        }
+        r lpush mylist head
+        r rpush mylist tail
+        r llen mylist
+    } {142}
+
+    test {LevelDB lists - commands rewriting the middle of the list} {
+        r linsert mylist before l50 before50
+        r linsert mylist after r50 after50
+        r lset mylist 1 newfirst
+        r lrem mylist 0 l40
+        r rpush other x y z
+        r rpoplpush other mylist
+        r ltrim other 0 0
+        r rpush emptied a
+        r lpop emptied
+        set mylist [r lrange mylist 0 -1]
+        r exists emptied
+    } {0}
+
+    test {LevelDB lists - popped list pushed again from an empty head} {
+        r rpush refilled 1 2 3
+        while {[r rpop refilled] ne {}} {}
+        r rpush refilled a b
+        r lpush refilled c
+        r lrange refilled 0 -1
+    } {c a b}
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB lists - lists reloaded at restart} {
+        assert_equal $mylist [r lrange mylist 0 -1]
+        assert_equal x [r lrange other 0 -1]
+        assert_equal {c a b} [r lrange refilled 0 -1]
+        assert_equal 0 [r exists emptied]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-expires"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB expires - set the expires of every type} {
+        r setex str 1000 v
+        r rpush list a
+        r expire list 1000
+        r sadd set a
+        r pexpireat set [expr {[clock milliseconds] + 1000000}]
+        r hset hash f v
+        r expire hash 1000
+        r zadd zset 1 a
+        r expire zset 1000
+        r set persisted v
+        r expire persisted 1000
+        r persist persisted
+        r set overwritten v
+        r expire overwritten 1000
+        r set overwritten v2
+        r set short v
+        r pexpire short 500
+        r ttl str
+    } {1000}
+}
+
+after 1000
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB expires - expires reloaded at restart} {
+        foreach key {str list set hash zset} {
+            set ttl [r ttl $key]
+            assert {$ttl > 990 && $ttl <= 1000}
+        }
+        assert_equal -1 [r ttl persisted]
+        assert_equal -1 [r ttl overwritten]
+        assert_equal v2 [r get overwritten]
+    }
+
+    test {LevelDB expires - keys expired while down not loaded} {
+        assert_equal 7 [r dbsize]
+        assert_equal 0 [r exists short]
+    }
+}
+
+set server_path [tmpdir "server.leveldb-batches"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB batches - MULTI/EXEC written as one batch} {
+        r multi
+        r set a 1
+        r incr a
+        r rpush list x y
+        r hset hash f v
+        r del nokey
+        r exec
+    } {OK 2 2 1 0}
+
+    test {LevelDB batches - discarded MULTI not written} {
+        r multi
+        r set discarded v
+        r discard
+        catch {
+            r multi
+            r set aborted v
+            r nosuchcommand
+        }
+        catch {r exec}
+        list [r exists discarded] [r exists aborted]
+    } {0 0}
+
+    test {LevelDB batches - scripts written as one batch} {
+        r eval {
+            redis.call('sadd', KEYS[1], 'a', 'b')
+            redis.call('zadd', KEYS[2], 1, 'a')
+            return redis.call('incrby', KEYS[3], 10)
+        } 3 set zset counter
+    } {10}
+
+    test {LevelDB batches - writes of a failing script kept} {
+        catch {
+            r eval {
+                redis.call('set', KEYS[1], 'before')
+                redis.call('lpush', KEYS[2], 'x')
+            } 2 partial hash
+        } e
+        list [string match {*WRONGTYPE*} $e] [r get partial]
+    } {1 before}
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB batches - transactions and scripts reloaded at restart} {
+        list [r get a] [r lrange list 0 -1] [r hget hash f] \
+            [lsort [r smembers set]] [r zscore zset a] [r get counter] \
+            [r get partial] [r exists discarded] [r exists aborted]
+    } {2 {x y} v {a b} 1 10 before 0 0}
+}
+
+set server_path [tmpdir "server.leveldb-coalesce"]
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-coalesce-ms 100 databases 254]] {
+    test {LevelDB coalescing - counters updated between two flushes} {
+        for {set j 0} {$j < 100} {incr j} {
+            r incr counter
+            r hincrby hash f 1
+            r hincrbyfloat hash g 0.5
+            r zincrby zset 1 m
+        }
+        r hincrby hash "" 1
+        r zincrby zset 2 ""
+        assert {[s leveldb_coalesced_writes] > 0}
+        list [r get counter] [r hmget hash f g ""] [r zscore zset ""]
+    } {100 {100 50 1} 2}
+
+    test {LevelDB coalescing - dirty records flushed by serverCron} {
+        r select 253
+        r incr counter
+        r hincrby hash "" 2
+        r select 9
+        wait_for_condition 50 100 {
+            [s leveldb_coalesce_pending] == 0
+        } else {
+            fail "Coalesced counters not flushed"
+        }
+        r hincrby hash "" 1
+        r zincrby zset 1 ""
+        set digest [r debug digest]
+        r ping
+    } {PONG}
+}
+
+start_server [list overrides [leveldb_overrides $server_path databases 254]] {
+    test {LevelDB coalescing - counters reloaded at restart} {
+        assert_equal $digest [r debug digest]
+        r select 253
+        list [r get counter] [r hget hash ""]
+    } {1 2}
+}
+
+set server_path [tmpdir "server.leveldb-lazyfree"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB lazy free - deleted collections queued with their size} {
+        for {set j 0} {$j < 5000} {incr j} {
+            r sadd set m$j
+            r zadd zset $j m$j
+        }
+        r set kept v
+        r multi
+        r del set zset
+        r info leveldb
+        set info [lindex [r exec] 1]
+        regexp {leveldb_lazyfree_pending_objects:(\d+)} $info _ objects
+        regexp {leveldb_lazyfree_pending_elements:(\d+)} $info _ elements
+        regexp {leveldb_lazyfree_pending_bytes:(\d+)} $info _ bytes
+        assert {$bytes > $elements*40}
+        list $objects $elements
+    } {2 10000}
+
+    test {LevelDB lazy free - pending counters drained by serverCron} {
+        wait_for_condition 50 100 {
+            [s leveldb_lazyfree_pending_objects] == 0
+        } else {
+            fail "Deleted collections not freed"
+        }
+        list [s leveldb_lazyfree_pending_elements] [s leveldb_lazyfree_pending_bytes] \
+            [r exists set] [r exists zset]
+    } {0 0 0 0}
+}
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB lazy free - deleted collections not reloaded at restart} {
+        list [r exists set] [r exists zset] [r get kept]
+    } {0 0 v}
+}
+
+proc wait_leveldb_backup {path} {
+    wait_for_condition 100 100 {
+        [file exists $path/BACKUP.log]
+    } else {
+        fail "Backup not completed"
+    }
+}
+
+set server_path [tmpdir "server.leveldb-backup"]
+
+start_server [list overrides [leveldb_overrides $server_path]] {
+    test {LevelDB backup - full backup} {
+        createComplexDataset r 10000
+        set full_digest [r debug digest]
+        assert_equal {backup leveldb started} [r backup full]
+        wait_leveldb_backup $server_path/full
+        assert_match {*PREVIOUS:*-*SUCCESS} [exec cat $server_path/full/BACKUP.log]
+    }
+
+    test {LevelDB backup - incremental backup from the previous one} {
+        createComplexDataset r 1000
+        r set afterfull v
+        set incr_digest [r debug digest]
+        assert_equal {backup leveldb started} [r backup incr full]
+        wait_leveldb_backup $server_path/incr
+        assert_match {*PREVIOUS:*full*SUCCESS} [exec cat $server_path/incr/BACKUP.log]
+    }
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-path full]] {
+    test {LevelDB backup - full backup restored} {
+        list [r debug digest] [r exists afterfull]
+    } [list $full_digest 0]
+}
+
+start_server [list overrides [leveldb_overrides $server_path leveldb-path incr]] {
+    test {LevelDB backup - incremental backup restored} {
+        list [r debug digest] [r get afterfull]
+    } [list $incr_digest v]
+}
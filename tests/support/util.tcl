@@ -369,3 +369,9 @@ proc start_write_load {host port seconds} {
 proc stop_write_load {handle} {
     catch {exec /bin/kill -9 $handle}
 }
+
+# Overrides of a server with LevelDB on in the specified directory, so that
+# a server started again on it loads the same dataset.
+proc leveldb_overrides {path args} {
+    concat [list dir $path leveldb yes leveldb-path leveldb] $args
+}
@@ -37,10 +37,15 @@ set ::all_tests {
     integration/aof
     integration/rdb
     integration/convert-zipmap-hash-on-load
+    integration/leveldb
+    integration/leveldb-shards
+    integration/leveldb-replication
+    integration/leveldb-load
     unit/pubsub
     unit/slowlog
     unit/scripting
     unit/maxmemory
+    unit/leveldb-freeze
     unit/introspection
     unit/limits
     unit/obuf-limits
@@ -0,0 +1,164 @@
+proc frozen_keys {} {
+    set keys {}
+    foreach {key type} [r freezed *] {lappend keys $key}
+    lsort $keys
+}
+
+# Walk FREEZEDSCAN to the end, returns the keys found.
+proc freezedscan_keys {args} {
+    set cursor 0
+    set keys {}
+    while 1 {
+        lassign [r freezedscan $cursor {*}$args] cursor batch
+        foreach {key type} $batch {lappend keys $key}
+        if {$cursor eq {0}} break
+    }
+    lsort $keys
+}
+
+foreach index {dict filter} {
+    start_server [list tags {"leveldb"} overrides [list leveldb yes leveldb-path leveldb leveldb-freezed-index $index]] {
+        set server_path [lindex [r config get dir] 1]
+
+        test "FREEZE moves the keys out of memory ($index index)" {
+            r set str v
+            r hmset hash a 1 b 2
+            r sadd set a b c
+            for {set j 0} {$j < 1000} {incr j} {r zadd zset $j m$j}
+            set digest [r debug digest]
+            assert_equal 4 [r freeze str hash set zset nokey]
+            list [r dbsize] [r exists zset] [frozen_keys]
+        } {0 0 {hash set str zset}}
+
+        test "MELT blocks the client until the key is back ($index index)" {
+            set rd [redis_deferring_client]
+            $rd melt zset
+            assert_equal PONG [r ping]
+            assert_equal 1 [$rd read]
+            $rd close
+            list [r zcard zset] [r zscore zset m500]
+        } {1000 500}
+
+        test "MELT of a key that is not frozen ($index index)" {
+            r melt zset nokey
+        } {0}
+
+        test "FREEZEDSCAN returns every frozen key once ($index index)" {
+            set strs {}
+            set hashes {}
+            set sets {}
+            for {set j 0} {$j < 50} {incr j} {
+                r set scan:str:$j v
+                lappend strs scan:str:$j
+            }
+            for {set j 0} {$j < 20} {incr j} {
+                r hset scan:hash:$j a 1
+                lappend hashes scan:hash:$j
+            }
+            for {set j 0} {$j < 10} {incr j} {
+                r sadd scan:set:$j a
+                lappend sets scan:set:$j
+            }
+            assert_equal 80 [r freeze {*}$strs {*}$hashes {*}$sets]
+            assert_equal [frozen_keys] [freezedscan_keys count 7]
+            assert_equal [lsort [concat $strs $hashes $sets]] [freezedscan_keys count 3 match scan:*]
+            assert_equal [lsort $hashes] [freezedscan_keys count 5 match scan:hash:*]
+            assert_equal [lsort $sets] [freezedscan_keys count 4 match scan:* type set]
+            assert_equal [lsort $strs] [freezedscan_keys match scan:* type string]
+            assert_error {*invalid cursor*} {r freezedscan xyz}
+            assert_error {*invalid cursor*} {r freezedscan 616}
+            r melt {*}$strs {*}$hashes {*}$sets
+            r del {*}$strs {*}$hashes {*}$sets
+        } {80}
+
+        test "Point reads served from the frozen keys ($index index)" {
+            list [r get str] [r hmget hash a b] [r sismember set c] [frozen_keys]
+        } {v {1 2} 1 {hash set str}}
+
+        test "Commands melt the frozen keys they access with freeze-lru ($index index)" {
+            r config set maxmemory-policy freeze-lru
+            assert_equal 1 [r append str {}]
+            assert_equal {a 1 b 2} [r hgetall hash]
+            assert_equal {a b c} [lsort [r smembers set]]
+            assert_equal 3 [s leveldb_lru_melts]
+            assert_equal $digest [r debug digest]
+            assert_equal {} [frozen_keys]
+            r config set maxmemory-policy noeviction
+            r freeze str hash
+        } {2}
+    }
+
+    start_server [list tags {"leveldb"} overrides [list dir $server_path leveldb yes leveldb-path leveldb leveldb-freezed-index $index]] {
+        test "Frozen keys reloaded frozen at restart ($index index)" {
+            list [frozen_keys] [r exists str] [r zcard zset]
+        } {{hash str} 0 1000}
+
+        test "Frozen keys melted after a restart ($index index)" {
+            list [r melt str hash] [frozen_keys] [r debug digest]
+        } [list 2 {} $digest]
+    }
+
+    start_server [list tags {"leveldb"} overrides [list leveldb yes leveldb-path leveldb leveldb-freezed-index $index maxmemory-policy freeze-lru]] {
+        test "freeze-lru freezes keys instead of evicting them over maxmemory ($index index)" {
+            r config set maxmemory [expr {[s used_memory]+100*1024}]
+            for {set j 0} {$j < 1000} {incr j} {
+                r hmset hash:$j a [string repeat x 100] b $j
+            }
+            assert {[s leveldb_lru_freezes] > 0}
+            assert {[r dbsize] < 1000}
+            assert {[s used_memory] < [lindex [r config get maxmemory] 1]+4096}
+        }
+
+        test "freeze-lru melts the frozen keys the commands access ($index index)" {
+            r config set maxmemory 0
+            set melts [s leveldb_lru_melts]
+            for {set j 0} {$j < 1000} {incr j} {
+                assert_equal $j [dict get [r hgetall hash:$j] b]
+            }
+            assert {[s leveldb_lru_melts] > $melts}
+            r dbsize
+        } {1000}
+
+        test "freeze-lru drops the frozen keys a command overwrites ($index index)" {
+            r set str v
+            r freeze str hash:0
+            set drops [s leveldb_lru_drops]
+            r set str v2
+            r sunionstore hash:0 nokey
+            list [r get str] [r exists hash:0] [r freezed *] \
+                [expr {[s leveldb_lru_drops]-$drops}]
+        } {v2 0 {} 2}
+
+        test "freeze-lru melts a frozen key SET can't overwrite ($index index)" {
+            r freeze hash:1
+            catch {r set hash:1 v} e
+            list [string match WRONGTYPE* $e] [r hget hash:1 b] [r freezed *]
+        } {1 1 {}}
+
+        test "List writes refused on a list frozen by freeze-lru ($index index)" {
+            r flushall
+            r rpush list a b c
+            r rpush other x
+            r config set maxmemory 1
+            r config set maxmemory 0
+            r config set maxmemory-policy noeviction
+            assert_equal {list l other l} [lsort -stride 2 [r freezed *]]
+            r melt other
+            foreach cmd {
+                {lpush list z} {rpush list z} {lpushx list z} {rpushx list z}
+                {linsert list before a z} {lset list 0 z}
+                {rpoplpush list other} {rpoplpush other list}
+            } {
+                assert_error WKEYFREEZED* {r {*}$cmd}
+            }
+            set rd [redis_deferring_client]
+            $rd brpoplpush blocked list 0
+            after 100
+            r rpush blocked y
+            assert_error WKEYFREEZED* {$rd read}
+            $rd close
+            list [r exists list] [r lrange other 0 -1] [r lrange blocked 0 -1] \
+                [r melt list] [r lrange list 0 -1]
+        } {0 x y 1 {a b c}}
+    }
+}